@@ -0,0 +1,308 @@
+// Micro-benchmarks for the CPU lighting kernels in include/lighting.h, using
+// Google Benchmark.
+//
+// The Blinn-Phong model of the Homework 3 shaders is measured one vector at
+// a time with the exact pow() (Reference), as a scalar loop over
+// structure-of-arrays batches (Scalar) and with AVX2 (AVX2, skipped on CPUs
+// without it). pow() itself is measured the same three ways. Batches run
+// over 1K to 1M vectors.
+//
+// Counters: "time/op" is the time per lit vector (or per pow) and "FLOPS"
+// counts the multiplies and adds of one lit vector, pow excluded.
+
+#include <benchmark/benchmark.h>
+
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include "Angel.h"
+#include "lighting.h"
+
+//----------------------------------------------------------------------------
+//
+//  Inputs
+//
+
+const size_t MinBatch = 1 << 10;
+const size_t MaxBatch = 1 << 20;
+
+// Multiplies and adds per lit vector: four normalizes, two dots, three
+// color channels
+const double LightingFlops = 4 * 9 + 3 + 2 * 5 + 2 + 3 * 4;
+
+// Normals, light and eye vectors as structure-of-arrays, plus room for the
+// colors
+struct LightingInputs
+{
+    std::vector<float> data[12];
+
+    Vec3SoA N, L, E, color;
+
+    explicit LightingInputs(size_t count, unsigned seed = 1)
+    {
+        std::mt19937 random(seed);
+        std::uniform_real_distribution<GLfloat> uniform(-1.0, 1.0);
+
+        for (int i = 0; i < 12; i++)
+        {
+            data[i].resize(count);
+
+            for (float &value : data[i])
+            {
+                value = uniform(random);
+            }
+        }
+
+        // Keep most light vectors on the lit side of the normal
+        for (size_t i = 0; i < count; i++)
+        {
+            data[3][i] += data[0][i];
+            data[4][i] += data[1][i];
+            data[5][i] += data[2][i];
+        }
+
+        N = {&data[0][0], &data[1][0], &data[2][0]};
+        L = {&data[3][0], &data[4][0], &data[5][0]};
+        E = {&data[6][0], &data[7][0], &data[8][0]};
+        color = {&data[9][0], &data[10][0], &data[11][0]};
+    }
+};
+
+// Material and light of the homework's default plastic ball
+LightingModel plasticModel()
+{
+    LightingModel model;
+    model.ambientProduct = vec4(0.0, 0.0, 0.0, 1.0);
+    model.diffuseProduct = vec4(0.5, 0.5, 0.0, 1.0);
+    model.specularProduct = vec4(0.6, 0.6, 0.5, 1.0);
+    model.shininess = 32.0;
+    return model;
+}
+
+void setCounters(benchmark::State &state, double opsPerIteration, double flopsPerOp)
+{
+    double ops = double(state.iterations()) * opsPerIteration;
+
+    state.counters["time/op"] = benchmark::Counter(ops, benchmark::Counter::kIsRate | benchmark::Counter::kInvert);
+
+    if (flopsPerOp > 0)
+    {
+        state.counters["FLOPS"] = benchmark::Counter(ops * flopsPerOp, benchmark::Counter::kIsRate);
+    }
+}
+
+//----------------------------------------------------------------------------
+//
+//  Implementations under test
+//
+
+struct Reference
+{
+    static bool isSupported() { return true; }
+
+    static void light(const LightingInputs &in, size_t count, const LightingModel &model)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            vec4 color = blinnPhong(vec3(in.N.x[i], in.N.y[i], in.N.z[i]),
+                                    vec3(in.L.x[i], in.L.y[i], in.L.z[i]),
+                                    vec3(in.E.x[i], in.E.y[i], in.E.z[i]), model);
+
+            in.color.x[i] = color.x;
+            in.color.y[i] = color.y;
+            in.color.z[i] = color.z;
+        }
+    }
+
+    static void pow(const float *x, float y, float *out, size_t count)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            out[i] = std::pow(x[i], y);
+        }
+    }
+};
+
+struct Scalar
+{
+    static bool isSupported() { return true; }
+
+    static void light(const LightingInputs &in, size_t count, const LightingModel &model)
+    {
+        lightBatchScalar(in.N, in.L, in.E, count, model, in.color);
+    }
+
+    static void pow(const float *x, float y, float *out, size_t count)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            out[i] = fastPow(x[i], y);
+        }
+    }
+};
+
+#ifdef ANGEL_LIGHTING_AVX2
+
+struct AVX2
+{
+    static bool isSupported() { return hasLightingAVX2(); }
+
+    static void light(const LightingInputs &in, size_t count, const LightingModel &model)
+    {
+        lightBatchAVX2(in.N, in.L, in.E, count, model, in.color);
+    }
+
+    __attribute__((target("avx2,fma"))) static void pow(const float *x, float y, float *out, size_t count)
+    {
+        __m256 exponent = _mm256_set1_ps(y);
+
+        for (size_t i = 0; i + 8 <= count; i += 8)
+        {
+            _mm256_storeu_ps(out + i, fastPowAVX2(_mm256_loadu_ps(x + i), exponent));
+        }
+    }
+};
+
+#endif // ANGEL_LIGHTING_AVX2
+
+//----------------------------------------------------------------------------
+
+template <typename Impl>
+void BM_LightingBatch(benchmark::State &state)
+{
+    if (!Impl::isSupported())
+    {
+        state.SkipWithError("not supported by this CPU");
+        return;
+    }
+
+    size_t count = state.range(0);
+    LightingInputs in(count);
+    LightingModel model = plasticModel();
+
+    for (auto _ : state)
+    {
+        Impl::light(in, count, model);
+        benchmark::ClobberMemory();
+    }
+
+    setCounters(state, count, LightingFlops);
+}
+
+template <typename Impl>
+void BM_PowBatch(benchmark::State &state)
+{
+    if (!Impl::isSupported())
+    {
+        state.SkipWithError("not supported by this CPU");
+        return;
+    }
+
+    size_t count = state.range(0);
+    std::vector<float> x(count), out(count);
+
+    std::mt19937 random(1);
+    std::uniform_real_distribution<GLfloat> uniform(0.0, 1.0);
+
+    for (float &value : x)
+    {
+        value = uniform(random);
+    }
+
+    for (auto _ : state)
+    {
+        Impl::pow(&x[0], 32.0, &out[0], count);
+        benchmark::ClobberMemory();
+    }
+
+    setCounters(state, count, 0);
+}
+
+#define BENCHMARK_BATCH(name, Impl) \
+    BENCHMARK_TEMPLATE(name, Impl)->RangeMultiplier(32)->Range(MinBatch, MaxBatch)
+
+#ifdef ANGEL_LIGHTING_AVX2
+#define BENCHMARK_BATCH_IMPLEMENTATIONS(name) \
+    BENCHMARK_BATCH(name, Reference);         \
+    BENCHMARK_BATCH(name, Scalar);            \
+    BENCHMARK_BATCH(name, AVX2);
+#else
+#define BENCHMARK_BATCH_IMPLEMENTATIONS(name) \
+    BENCHMARK_BATCH(name, Reference);         \
+    BENCHMARK_BATCH(name, Scalar);
+#endif
+
+BENCHMARK_BATCH_IMPLEMENTATIONS(BM_LightingBatch)
+BENCHMARK_BATCH_IMPLEMENTATIONS(BM_PowBatch)
+
+//----------------------------------------------------------------------------
+
+// Largest difference of a channel from the exact shader model, which must
+// stay well below one 8-bit color step
+template <typename Impl>
+float maxLightingError()
+{
+    const size_t count = 4096;
+
+    LightingInputs reference(count, 7), in(count, 7);
+    LightingModel model = plasticModel();
+
+    Reference::light(reference, count, model);
+    Impl::light(in, count, model);
+
+    float error = 0.0;
+
+    for (int c = 9; c < 12; c++)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            error = std::max(error, std::fabs(in.data[c][i] - reference.data[c][i]));
+        }
+    }
+
+    return error;
+}
+
+bool checkImplementations()
+{
+    const float MaxError = 1e-3;
+
+    float scalarError = maxLightingError<Scalar>();
+    std::printf("Scalar lighting: max error %g\n", scalarError);
+
+    bool isOk = scalarError < MaxError;
+
+#ifdef ANGEL_LIGHTING_AVX2
+    if (AVX2::isSupported())
+    {
+        float avx2Error = maxLightingError<AVX2>();
+        std::printf("AVX2 lighting:   max error %g\n", avx2Error);
+
+        isOk = isOk && avx2Error < MaxError;
+    }
+#endif
+
+    return isOk;
+}
+
+int main(int argc, char **argv)
+{
+    if (!checkImplementations())
+    {
+        std::fprintf(stderr, "Lighting kernels differ from the reference\n");
+        return 1;
+    }
+
+    benchmark::Initialize(&argc, argv);
+
+    if (benchmark::ReportUnrecognizedArguments(argc, argv))
+    {
+        return 1;
+    }
+
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+
+    return 0;
+}
@@ -0,0 +1,575 @@
+// Micro-benchmarks for the vector and matrix classes in include/vec.h and
+// include/mat.h, using Google Benchmark.
+//
+// Every operation is measured through the library (Scalar) and, where the
+// compiler targets SSE, through a hand-vectorized version of the same
+// computation (SSE), so a change to the math library can be compared
+// against both. Batch variants run over 1K to 1M elements.
+//
+// Counters: "time/op" is the time per operation (one matrix product, one
+// normalize, ...) and "FLOPS" counts the multiplies and adds each
+// operation needs; both are printed with SI prefixes (ns, G/s).
+
+#include <benchmark/benchmark.h>
+
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include "Angel.h"
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+//----------------------------------------------------------------------------
+//
+//  Implementations under test
+//
+
+struct Scalar
+{
+    static void multiply(const mat4 &a, const mat4 &b, mat4 &c)
+    {
+        c = a * b;
+    }
+
+    static void multiply(const mat4 &m, const vec4 *in, vec4 *out, size_t count)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            out[i] = m * in[i];
+        }
+    }
+
+    static void transpose(const mat4 &a, mat4 &t)
+    {
+        t = Angel::transpose(a);
+    }
+
+    static void normalize(const vec4 &v, vec4 &n)
+    {
+        n = Angel::normalize(v);
+    }
+
+    static void cross(const vec4 &a, const vec4 &b, vec4 &c)
+    {
+        c = vec4(Angel::cross(a, b), 0.0);
+    }
+};
+
+#ifdef __SSE__
+
+// mat4 and vec4 are plain arrays of floats, rows first
+struct SSE
+{
+    static void multiply(const mat4 &a, const mat4 &b, mat4 &c)
+    {
+        const GLfloat *A = &a[0].x;
+        const GLfloat *B = &b[0].x;
+        GLfloat *C = &c[0].x;
+
+        __m128 b0 = _mm_loadu_ps(B);
+        __m128 b1 = _mm_loadu_ps(B + 4);
+        __m128 b2 = _mm_loadu_ps(B + 8);
+        __m128 b3 = _mm_loadu_ps(B + 12);
+
+        // Row i of c is the rows of b weighted by row i of a
+        for (int i = 0; i < 4; i++)
+        {
+            __m128 row = _mm_mul_ps(_mm_set1_ps(A[4 * i]), b0);
+            row = _mm_add_ps(row, _mm_mul_ps(_mm_set1_ps(A[4 * i + 1]), b1));
+            row = _mm_add_ps(row, _mm_mul_ps(_mm_set1_ps(A[4 * i + 2]), b2));
+            row = _mm_add_ps(row, _mm_mul_ps(_mm_set1_ps(A[4 * i + 3]), b3));
+            _mm_storeu_ps(C + 4 * i, row);
+        }
+    }
+
+    // Transposed once, the columns are weighted by the vector components
+    static void multiply(const mat4 &m, const vec4 *in, vec4 *out, size_t count)
+    {
+        const GLfloat *M = &m[0].x;
+
+        __m128 c0 = _mm_loadu_ps(M);
+        __m128 c1 = _mm_loadu_ps(M + 4);
+        __m128 c2 = _mm_loadu_ps(M + 8);
+        __m128 c3 = _mm_loadu_ps(M + 12);
+        _MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+
+        for (size_t i = 0; i < count; i++)
+        {
+            __m128 v = _mm_loadu_ps(&in[i].x);
+
+            __m128 r = _mm_mul_ps(c0, _mm_shuffle_ps(v, v, _MM_SHUFFLE(0, 0, 0, 0)));
+            r = _mm_add_ps(r, _mm_mul_ps(c1, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 1, 1, 1))));
+            r = _mm_add_ps(r, _mm_mul_ps(c2, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 2, 2, 2))));
+            r = _mm_add_ps(r, _mm_mul_ps(c3, _mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 3, 3, 3))));
+
+            _mm_storeu_ps(&out[i].x, r);
+        }
+    }
+
+    static void transpose(const mat4 &a, mat4 &t)
+    {
+        const GLfloat *A = &a[0].x;
+        GLfloat *T = &t[0].x;
+
+        __m128 r0 = _mm_loadu_ps(A);
+        __m128 r1 = _mm_loadu_ps(A + 4);
+        __m128 r2 = _mm_loadu_ps(A + 8);
+        __m128 r3 = _mm_loadu_ps(A + 12);
+        _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+
+        _mm_storeu_ps(T, r0);
+        _mm_storeu_ps(T + 4, r1);
+        _mm_storeu_ps(T + 8, r2);
+        _mm_storeu_ps(T + 12, r3);
+    }
+
+    static void normalize(const vec4 &v, vec4 &n)
+    {
+        __m128 x = _mm_loadu_ps(&v.x);
+
+        // Horizontal sum of the squares, in every lane
+        __m128 squares = _mm_mul_ps(x, x);
+        __m128 sum = _mm_add_ps(squares, _mm_shuffle_ps(squares, squares, _MM_SHUFFLE(2, 3, 0, 1)));
+        sum = _mm_add_ps(sum, _mm_shuffle_ps(sum, sum, _MM_SHUFFLE(1, 0, 3, 2)));
+
+        // Same rounding as vec4::operator/: multiply by the reciprocal
+        __m128 scale = _mm_div_ps(_mm_set1_ps(1.0f), _mm_sqrt_ps(sum));
+        _mm_storeu_ps(&n.x, _mm_mul_ps(x, scale));
+    }
+
+    static void cross(const vec4 &a, const vec4 &b, vec4 &c)
+    {
+        __m128 u = _mm_loadu_ps(&a.x);
+        __m128 v = _mm_loadu_ps(&b.x);
+
+        // (y, z, x) and (z, x, y) of both; w ends up as w * w - w * w = 0
+        __m128 uYZX = _mm_shuffle_ps(u, u, _MM_SHUFFLE(3, 0, 2, 1));
+        __m128 vZXY = _mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 1, 0, 2));
+        __m128 uZXY = _mm_shuffle_ps(u, u, _MM_SHUFFLE(3, 1, 0, 2));
+        __m128 vYZX = _mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 0, 2, 1));
+
+        _mm_storeu_ps(&c.x, _mm_sub_ps(_mm_mul_ps(uYZX, vZXY), _mm_mul_ps(uZXY, vYZX)));
+    }
+};
+
+#endif // __SSE__
+
+//----------------------------------------------------------------------------
+//
+//  Inputs
+//
+
+const size_t MinBatch = 1 << 10;
+const size_t MaxBatch = 1 << 20;
+
+std::vector<vec4> randomVectors(size_t count, unsigned seed)
+{
+    std::mt19937 random(seed);
+    std::uniform_real_distribution<GLfloat> uniform(-1.0, 1.0);
+
+    std::vector<vec4> vectors(count);
+
+    for (vec4 &v : vectors)
+    {
+        v = vec4(uniform(random), uniform(random), uniform(random), uniform(random));
+    }
+
+    return vectors;
+}
+
+std::vector<mat4> randomMatrices(size_t count, unsigned seed)
+{
+    std::vector<vec4> rows = randomVectors(4 * count, seed);
+    std::vector<mat4> matrices(count);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        matrices[i] = mat4(rows[4 * i], rows[4 * i + 1], rows[4 * i + 2], rows[4 * i + 3]);
+    }
+
+    return matrices;
+}
+
+void setCounters(benchmark::State &state, double opsPerIteration, double flopsPerOp)
+{
+    double ops = double(state.iterations()) * opsPerIteration;
+
+    state.counters["time/op"] = benchmark::Counter(ops, benchmark::Counter::kIsRate | benchmark::Counter::kInvert);
+
+    if (flopsPerOp > 0)
+    {
+        state.counters["FLOPS"] = benchmark::Counter(ops * flopsPerOp, benchmark::Counter::kIsRate);
+    }
+}
+
+// Multiplies and adds per operation
+const double Mat4MulMat4Flops = 64 + 48;
+const double Mat4MulVec4Flops = 16 + 12;
+const double NormalizeFlops = 4 + 3 + 1 + 1 + 4; // squares, sum, sqrt, reciprocal, scale
+const double CrossFlops = 6 + 3;
+
+//----------------------------------------------------------------------------
+//
+//  Single operations
+//
+
+template <typename Impl>
+void BM_Mat4MulMat4(benchmark::State &state)
+{
+    std::vector<mat4> m = randomMatrices(2, 1);
+    mat4 c;
+
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(&m[0]);
+        Impl::multiply(m[0], m[1], c);
+        benchmark::DoNotOptimize(&c);
+    }
+
+    setCounters(state, 1, Mat4MulMat4Flops);
+}
+
+template <typename Impl>
+void BM_Mat4MulVec4(benchmark::State &state)
+{
+    mat4 m = randomMatrices(1, 1)[0];
+    vec4 v = randomVectors(1, 2)[0];
+    vec4 r;
+
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(&m);
+        benchmark::DoNotOptimize(&v);
+        Impl::multiply(m, &v, &r, 1);
+        benchmark::DoNotOptimize(&r);
+    }
+
+    setCounters(state, 1, Mat4MulVec4Flops);
+}
+
+template <typename Impl>
+void BM_Transpose(benchmark::State &state)
+{
+    mat4 m = randomMatrices(1, 1)[0];
+    mat4 t;
+
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(&m);
+        Impl::transpose(m, t);
+        benchmark::DoNotOptimize(&t);
+    }
+
+    setCounters(state, 1, 0);
+}
+
+template <typename Impl>
+void BM_Normalize(benchmark::State &state)
+{
+    vec4 v = randomVectors(1, 1)[0];
+    vec4 n;
+
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(&v);
+        Impl::normalize(v, n);
+        benchmark::DoNotOptimize(&n);
+    }
+
+    setCounters(state, 1, NormalizeFlops);
+}
+
+template <typename Impl>
+void BM_Cross(benchmark::State &state)
+{
+    std::vector<vec4> v = randomVectors(2, 1);
+    vec4 c;
+
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(&v[0]);
+        Impl::cross(v[0], v[1], c);
+        benchmark::DoNotOptimize(&c);
+    }
+
+    setCounters(state, 1, CrossFlops);
+}
+
+//----------------------------------------------------------------------------
+//
+//  Batches, as when transforming a mesh or a set of instances
+//
+
+template <typename Impl>
+void BM_Mat4MulMat4Batch(benchmark::State &state)
+{
+    size_t count = state.range(0);
+    std::vector<mat4> a = randomMatrices(count, 1);
+    std::vector<mat4> b = randomMatrices(count, 2);
+    std::vector<mat4> c(count);
+
+    for (auto _ : state)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            Impl::multiply(a[i], b[i], c[i]);
+        }
+
+        benchmark::ClobberMemory();
+    }
+
+    setCounters(state, count, Mat4MulMat4Flops);
+}
+
+template <typename Impl>
+void BM_Mat4MulVec4Batch(benchmark::State &state)
+{
+    size_t count = state.range(0);
+    mat4 m = randomMatrices(1, 1)[0];
+    std::vector<vec4> in = randomVectors(count, 2);
+    std::vector<vec4> out(count);
+
+    for (auto _ : state)
+    {
+        Impl::multiply(m, &in[0], &out[0], count);
+        benchmark::ClobberMemory();
+    }
+
+    setCounters(state, count, Mat4MulVec4Flops);
+}
+
+template <typename Impl>
+void BM_TransposeBatch(benchmark::State &state)
+{
+    size_t count = state.range(0);
+    std::vector<mat4> in = randomMatrices(count, 1);
+    std::vector<mat4> out(count);
+
+    for (auto _ : state)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            Impl::transpose(in[i], out[i]);
+        }
+
+        benchmark::ClobberMemory();
+    }
+
+    setCounters(state, count, 0);
+}
+
+template <typename Impl>
+void BM_NormalizeBatch(benchmark::State &state)
+{
+    size_t count = state.range(0);
+    std::vector<vec4> in = randomVectors(count, 1);
+    std::vector<vec4> out(count);
+
+    for (auto _ : state)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            Impl::normalize(in[i], out[i]);
+        }
+
+        benchmark::ClobberMemory();
+    }
+
+    setCounters(state, count, NormalizeFlops);
+}
+
+template <typename Impl>
+void BM_CrossBatch(benchmark::State &state)
+{
+    size_t count = state.range(0);
+    std::vector<vec4> a = randomVectors(count, 1);
+    std::vector<vec4> b = randomVectors(count, 2);
+    std::vector<vec4> c(count);
+
+    for (auto _ : state)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            Impl::cross(a[i], b[i], c[i]);
+        }
+
+        benchmark::ClobberMemory();
+    }
+
+    setCounters(state, count, CrossFlops);
+}
+
+//----------------------------------------------------------------------------
+//
+//  Matrix construction (library only)
+//
+
+void BM_LookAt(benchmark::State &state)
+{
+    vec4 eye(1.0, 2.0, 3.0, 1.0), at(0.0, 0.0, 0.0, 1.0), up(0.0, 1.0, 0.0, 0.0);
+
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(&eye);
+        mat4 m = LookAt(eye, at, up);
+        benchmark::DoNotOptimize(&m);
+    }
+
+    setCounters(state, 1, 0);
+}
+
+void BM_Perspective(benchmark::State &state)
+{
+    GLfloat fovy = 45.0;
+
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(&fovy);
+        mat4 m = Perspective(fovy, 1.0, 0.5, 5.0);
+        benchmark::DoNotOptimize(&m);
+    }
+
+    setCounters(state, 1, 0);
+}
+
+template <mat4 (*Rotate)(const GLfloat)>
+void BM_Rotate(benchmark::State &state)
+{
+    GLfloat theta = 30.0;
+
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(&theta);
+        mat4 m = Rotate(theta);
+        benchmark::DoNotOptimize(&m);
+    }
+
+    setCounters(state, 1, 0);
+}
+
+//----------------------------------------------------------------------------
+
+#define BENCHMARK_BATCH(name, Impl) \
+    BENCHMARK_TEMPLATE(name, Impl)->RangeMultiplier(32)->Range(MinBatch, MaxBatch)
+
+#ifdef __SSE__
+#define BENCHMARK_IMPLEMENTATIONS(name) \
+    BENCHMARK_TEMPLATE(name, Scalar);   \
+    BENCHMARK_TEMPLATE(name, SSE);
+#define BENCHMARK_BATCH_IMPLEMENTATIONS(name) \
+    BENCHMARK_BATCH(name, Scalar);            \
+    BENCHMARK_BATCH(name, SSE);
+#else
+#define BENCHMARK_IMPLEMENTATIONS(name) BENCHMARK_TEMPLATE(name, Scalar);
+#define BENCHMARK_BATCH_IMPLEMENTATIONS(name) BENCHMARK_BATCH(name, Scalar);
+#endif
+
+BENCHMARK_IMPLEMENTATIONS(BM_Mat4MulMat4)
+BENCHMARK_IMPLEMENTATIONS(BM_Mat4MulVec4)
+BENCHMARK_IMPLEMENTATIONS(BM_Transpose)
+BENCHMARK_IMPLEMENTATIONS(BM_Normalize)
+BENCHMARK_IMPLEMENTATIONS(BM_Cross)
+
+BENCHMARK_BATCH_IMPLEMENTATIONS(BM_Mat4MulMat4Batch)
+BENCHMARK_BATCH_IMPLEMENTATIONS(BM_Mat4MulVec4Batch)
+BENCHMARK_BATCH_IMPLEMENTATIONS(BM_TransposeBatch)
+BENCHMARK_BATCH_IMPLEMENTATIONS(BM_NormalizeBatch)
+BENCHMARK_BATCH_IMPLEMENTATIONS(BM_CrossBatch)
+
+BENCHMARK(BM_LookAt);
+BENCHMARK(BM_Perspective);
+BENCHMARK_TEMPLATE(BM_Rotate, RotateX);
+BENCHMARK_TEMPLATE(BM_Rotate, RotateY);
+BENCHMARK_TEMPLATE(BM_Rotate, RotateZ);
+
+//----------------------------------------------------------------------------
+
+#ifdef __SSE__
+
+bool isClose(const vec4 &a, const vec4 &b)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        if (std::fabs(a[i] - b[i]) > 1e-5f * (1.0f + std::fabs(a[i])))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Numbers are only comparable if both versions compute the same thing
+bool checkImplementations()
+{
+    std::vector<mat4> a = randomMatrices(64, 3);
+    std::vector<mat4> b = randomMatrices(64, 4);
+    std::vector<vec4> v = randomVectors(64, 5);
+    std::vector<vec4> w = randomVectors(64, 6);
+
+    bool isOk = true;
+
+    for (int i = 0; i < 64; i++)
+    {
+        mat4 scalarMat, sseMat;
+        vec4 scalarVec, sseVec;
+
+        Scalar::multiply(a[i], b[i], scalarMat);
+        SSE::multiply(a[i], b[i], sseMat);
+
+        for (int row = 0; row < 4; row++)
+        {
+            isOk = isOk && isClose(scalarMat[row], sseMat[row]);
+        }
+
+        Scalar::transpose(a[i], scalarMat);
+        SSE::transpose(a[i], sseMat);
+
+        for (int row = 0; row < 4; row++)
+        {
+            isOk = isOk && isClose(scalarMat[row], sseMat[row]);
+        }
+
+        Scalar::multiply(a[i], &v[i], &scalarVec, 1);
+        SSE::multiply(a[i], &v[i], &sseVec, 1);
+        isOk = isOk && isClose(scalarVec, sseVec);
+
+        Scalar::normalize(v[i], scalarVec);
+        SSE::normalize(v[i], sseVec);
+        isOk = isOk && isClose(scalarVec, sseVec);
+
+        Scalar::cross(v[i], w[i], scalarVec);
+        SSE::cross(v[i], w[i], sseVec);
+        isOk = isOk && isClose(scalarVec, sseVec);
+    }
+
+    return isOk;
+}
+
+#endif // __SSE__
+
+int main(int argc, char **argv)
+{
+#ifdef __SSE__
+    if (!checkImplementations())
+    {
+        std::fprintf(stderr, "Scalar and SSE results differ\n");
+        return 1;
+    }
+#endif
+
+    benchmark::Initialize(&argc, argv);
+
+    if (benchmark::ReportUnrecognizedArguments(argc, argv))
+    {
+        return 1;
+    }
+
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+
+    return 0;
+}
@@ -1,6 +1,8 @@
 
 #include "Angel.h"
 
+#include <cstring>
+
 namespace Angel {
 
 // Create a NULL-terminated string by reading the provided file
@@ -27,8 +29,10 @@ readShaderSource(const char* shaderFile)
 
 // Create a GLSL program object from vertex and fragment shader files
 GLuint
-InitShader(const char* vShaderFile, const char* fShaderFile)
+InitShader(const char* vShaderFile, const char* fShaderFile, const char* fDefines)
 {
+    PROFILE_FUNCTION();
+
     struct Shader {
 	const char*  filename;
 	GLenum       type;
@@ -48,8 +52,20 @@ InitShader(const char* vShaderFile, const char* fShaderFile)
 	    exit( EXIT_FAILURE );
 	}
 
+	// Defines have to follow the #version line
+	const char* defines = ( s.type == GL_FRAGMENT_SHADER && fDefines ) ? fDefines : "";
+	const char* body = s.source;
+
+	if ( strncmp( body, "#version", 8 ) == 0 ) {
+	    body = strchr( body, '\n' );
+	    body = body ? body + 1 : s.source + strlen( s.source );
+	}
+
+	const GLchar* sources[3] = { s.source, defines, body };
+	GLint lengths[3] = { GLint( body - s.source ), -1, -1 };
+
 	GLuint shader = glCreateShader( s.type );
-	glShaderSource( shader, 1, (const GLchar**) &s.source, NULL );
+	glShaderSource( shader, 3, sources, lengths );
 	glCompileShader( shader );
 
 	GLint  compiled;
@@ -0,0 +1,8 @@
+varying vec2 texCoord;
+uniform sampler2D image;
+
+void
+main()
+{
+    gl_FragColor = texture2D( image, texCoord );
+}
@@ -2,85 +2,499 @@
 // Generated using randomly selected vertices and bisection
 
 #include "Angel.h"
+#include "chaosgame.h"
+#include "chunkqueue.h"
+#include "density.h"
+#include "framebench.h"
+#include "headless.h"
+#include "ringbuffer.h"
 
-const int NumPoints = 500000;
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <thread>
+
+// Can be changed with --points and --seed
+size_t NumPoints = 500000;
+uint64_t Seed = 1;
+
+// Points are generated and uploaded in chunks of one chaos-game block
+const size_t ChunkSize = ChaosGame::BlockSize;
+
+// Chunks in flight between the generator threads and the renderer,
+//   and slots of the GPU ring buffer they are copied into
+const int NumChunks = 16;
+const int NumRingSlots = 4;
+
+// Stop uploading (or splatting) for this frame once this much time has passed
+const double FrameBudget = 0.010;
+
+// Consecutive blocks splatted by one slice per pass
+const size_t BlocksPerSlice = 4;
+
+// Draw the points as GL_POINTS, or count them per pixel on the CPU and
+//   draw the resulting density image ('d' or --density)
+bool isDensityMode = false;
+
+// Specifiy the vertices for a triangle
+std::vector<vec2> vertices = {
+    vec2( -1.0, -1.0 ), vec2( 0.0, 1.0 ), vec2( 1.0, -1.0 )
+};
+
+ChaosGame *game;
+
+ChunkQueue<vec2> chunks;
+std::vector<std::thread> generators;
+std::atomic<size_t> nextChunk;
+
+MappedRingBuffer ring;
+
+// Points are accumulated in an offscreen framebuffer, so each frame only
+//   draws the chunks that arrived since the last one
+GLuint framebuffer, colorbuffer;
+int width, height;
+
+size_t numDrawnPoints;
+std::chrono::steady_clock::time_point streamStart;
+
+GLuint pointProgram, pointVao;
+
+// Density image and the full-screen quad it is drawn on
+DensityImage density;
+size_t numSplattedBlocks;
+std::chrono::steady_clock::time_point splatStart;
+
+GLuint quadProgram, quadVao, quadBuffer, quadTexture;
+
+const vec4 Background = vec4( 1.0, 1.0, 1.0, 1.0 );
+const vec4 Ink = vec4( 1.0, 0.0, 0.0, 1.0 );
 
 //----------------------------------------------------------------------------
 
 void
-init( void )
+generatePoints( void )
 {
-    vec2 points[NumPoints];
+    size_t numChunks = game->numBlocks( NumPoints );
 
-    // Specifiy the vertices for a triangle
-    vec2 vertices[3] = {
-        vec2( -1.0, -1.0 ), vec2( 0.0, 1.0 ), vec2( 1.0, -1.0 )
-    };
+    for ( ;; ) {
+        ChunkQueue<vec2>::Chunk *chunk = chunks.acquire();
+
+        if ( !chunk ) {
+            return;
+        }
 
-    // Select an arbitrary initial point inside of the triangle
-    points[0] = vec2( 0.25, 0.50 );
+        size_t index = nextChunk++;
 
-    // compute and store N-1 new points
-    for ( int i = 1; i < NumPoints; ++i ) {
-        int j = rand() % 3;   // pick a vertex at random
+        if ( index >= numChunks ) {
+            chunks.recycle( chunk );
+            return;
+        }
 
-        // Compute the point halfway between the selected vertex
-        //   and the previous point
-        points[i] = ( points[i - 1] + vertices[j] ) / 2.0;
+        chunk->index = index;
+        chunk->count = std::min( ChunkSize, NumPoints - index * ChunkSize );
+
+        PROFILE_ZONE( "generateBlock" );
+        game->generateBlock( index, &chunk->data[0], chunk->count );
+
+        chunks.push( chunk );
+    }
+}
+
+void
+stopStreaming( void )
+{
+    chunks.close();
+
+    for ( std::thread &generator : generators ) {
+        generator.join();
     }
 
+    generators.clear();
+}
+
+// (Re)start generating from the first point
+void
+startStreaming( void )
+{
+    stopStreaming();
+
+    chunks.init( NumChunks, ChunkSize );
+    nextChunk = 0;
+    numDrawnPoints = 0;
+    streamStart = std::chrono::steady_clock::now();
+
+    // Leave one core for the render thread
+    unsigned numThreads = std::max( 2u, std::thread::hardware_concurrency() ) - 1;
+
+    for ( unsigned i = 0; i < numThreads; ++i ) {
+        generators.emplace_back( generatePoints );
+    }
+}
+
+//----------------------------------------------------------------------------
+
+void
+init( void )
+{
+    PROFILE_FUNCTION();
+
+    game = new ChaosGame( vertices, Seed );
+
     // Create a vertex array object
-    GLuint vao[1];
-    glGenVertexArrays( 1, vao );
-    glBindVertexArray( vao[0] );
-    
+    glGenVertexArrays( 1, &pointVao );
+    glBindVertexArray( pointVao );
+
 
-    // Create and initialize a buffer object
-    GLuint buffer;
-    glGenBuffers( 1, &buffer );
-    glBindBuffer( GL_ARRAY_BUFFER, buffer );
-    glBufferData( GL_ARRAY_BUFFER, sizeof(points), points, GL_STATIC_DRAW );
+    // Create a ring of buffer slots the chunks are streamed through
+    ring.init( GL_ARRAY_BUFFER, ChunkSize * sizeof(vec2), NumRingSlots );
 
     // Load shaders and use the resulting shader program
-    GLuint program = InitShader( "vshader.glsl", "fshader.glsl" );
-    glUseProgram( program );
+    pointProgram = InitShader( "vshader.glsl", "fshader.glsl" );
+    glUseProgram( pointProgram );
 
     // Initialize the vertex position attribute from the vertex shader
-    GLuint loc = glGetAttribLocation( program, "vPosition" );
+    GLuint loc = glGetAttribLocation( pointProgram, "vPosition" );
     glEnableVertexAttribArray( loc );
     glVertexAttribPointer( loc, 2, GL_FLOAT, GL_FALSE, 0,
                            BUFFER_OFFSET(0) );
 
+    // Full-screen quad for the density image
+    vec2 corners[4] = {
+        vec2( -1.0, -1.0 ), vec2( 1.0, -1.0 ), vec2( -1.0, 1.0 ), vec2( 1.0, 1.0 )
+    };
+
+    glGenVertexArrays( 1, &quadVao );
+    glBindVertexArray( quadVao );
+
+    glGenBuffers( 1, &quadBuffer );
+    glBindBuffer( GL_ARRAY_BUFFER, quadBuffer );
+    glBufferData( GL_ARRAY_BUFFER, sizeof(corners), corners, GL_STATIC_DRAW );
+
+    quadProgram = InitShader( "vquad.glsl", "fquad.glsl" );
+    glUseProgram( quadProgram );
+
+    loc = glGetAttribLocation( quadProgram, "vPosition" );
+    glEnableVertexAttribArray( loc );
+    glVertexAttribPointer( loc, 2, GL_FLOAT, GL_FALSE, 0,
+                           BUFFER_OFFSET(0) );
+
+    glUniform1i( glGetUniformLocation( quadProgram, "image" ), 0 );
+
+    glGenTextures( 1, &quadTexture );
+    glBindTexture( GL_TEXTURE_2D, quadTexture );
+    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST );
+    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
+
+    glGenFramebuffers( 1, &framebuffer );
+    glGenRenderbuffers( 1, &colorbuffer );
+
     glClearColor( 1.0, 1.0, 1.0, 1.0 ); // white background
 }
 
 //----------------------------------------------------------------------------
 
+void
+displayPoints( void )
+{
+    PROFILE_FUNCTION();
+
+    glUseProgram( pointProgram );
+    glBindVertexArray( pointVao );
+
+    glBindFramebuffer( GL_FRAMEBUFFER, framebuffer );
+
+    std::chrono::steady_clock::time_point frameStart = std::chrono::steady_clock::now();
+    ChunkQueue<vec2>::Chunk *chunk;
+
+    // Copy finished chunks into the ring and draw them on top of the
+    //   points already there
+    while ( std::chrono::duration<double>( std::chrono::steady_clock::now() - frameStart ).count() < FrameBudget &&
+            ( chunk = chunks.pop() ) ) {
+        GLintptr offset;
+        void *data = ring.beginWrite( offset );
+        memcpy( data, &chunk->data[0], chunk->count * sizeof(vec2) );
+        ring.endWrite();
+
+        glDrawArrays( GL_POINTS, offset / sizeof(vec2), chunk->count );
+        ring.fence();
+
+        numDrawnPoints += chunk->count;
+        chunks.recycle( chunk );
+
+        if ( numDrawnPoints == NumPoints ) {
+            double seconds = std::chrono::duration<double>( std::chrono::steady_clock::now() - streamStart ).count();
+
+            std::cout << "Streamed " << NumPoints << " points in " << seconds << " s ("
+                      << generators.size() << " generator threads, seed " << Seed << ")" << std::endl;
+        }
+    }
+
+    glBindFramebuffer( GL_READ_FRAMEBUFFER, framebuffer );
+    glBindFramebuffer( GL_DRAW_FRAMEBUFFER, windowFramebuffer() );
+    glBlitFramebuffer( 0, 0, width, height, 0, 0, width, height,
+                       GL_COLOR_BUFFER_BIT, GL_NEAREST );
+    glBindFramebuffer( GL_FRAMEBUFFER, windowFramebuffer() );
+}
+
+// Splat the next few blocks into the per-slice histograms
+void
+splatPoints( void )
+{
+    PROFILE_FUNCTION();
+
+    size_t numBlocks = game->numBlocks( NumPoints );
+    size_t numSlices = density.numSlices();
+
+    size_t first = numSplattedBlocks;
+    size_t last = std::min( numBlocks, first + BlocksPerSlice * numSlices );
+
+    // Slice s takes the s-th run of BlocksPerSlice blocks into its own
+    //   histogram, so the slices need no locking, and walks one stream
+    //   through the run instead of looking up each block's
+    parallelFor( numSlices, 1, [&]( size_t begin, size_t end ) {
+        for ( size_t slice = begin; slice < end; ++slice ) {
+            size_t runBegin = std::min( last, first + slice * BlocksPerSlice );
+            size_t runEnd = std::min( last, runBegin + BlocksPerSlice );
+
+            if ( runBegin == runEnd ) {
+                continue;
+            }
+
+            Xoshiro256 rng = game->stream( runBegin );
+
+            for ( size_t block = runBegin; block < runEnd; ++block ) {
+                size_t count = std::min( ChunkSize, NumPoints - block * ChunkSize );
+
+                game->visitStream( rng, count, [&]( const vec2 &p ) {
+                    density.splat( slice, p );
+                } );
+
+                rng.jump();
+            }
+        }
+    } );
+
+    density.addPointCount( std::min( NumPoints, last * ChunkSize ) - first * ChunkSize );
+    numSplattedBlocks = last;
+}
+
+void
+displayDensity( void )
+{
+    PROFILE_FUNCTION();
+
+    std::chrono::steady_clock::time_point frameStart = std::chrono::steady_clock::now();
+    size_t numBlocks = game->numBlocks( NumPoints );
+    bool isUpdated = numSplattedBlocks == 0;
+
+    while ( numSplattedBlocks < numBlocks &&
+            std::chrono::duration<double>( std::chrono::steady_clock::now() - frameStart ).count() < FrameBudget ) {
+        splatPoints();
+        isUpdated = true;
+
+        if ( numSplattedBlocks == numBlocks ) {
+            double seconds = std::chrono::duration<double>( std::chrono::steady_clock::now() - splatStart ).count();
+
+            std::cout << "Splatted " << NumPoints << " points in " << seconds << " s ("
+                      << ThreadPool::global().size() << " threads, seed " << Seed << ")" << std::endl;
+        }
+    }
+
+    glBindTexture( GL_TEXTURE_2D, quadTexture );
+
+    // Merge and tone-map only when new points came in
+    if ( isUpdated ) {
+        const std::vector<GLubyte> &pixels = density.resolve( Background, Ink );
+        glTexSubImage2D( GL_TEXTURE_2D, 0, 0, 0, width, height,
+                         GL_RGBA, GL_UNSIGNED_BYTE, &pixels[0] );
+    }
+
+    // Draw cost no longer depends on the number of points
+    glUseProgram( quadProgram );
+    glBindVertexArray( quadVao );
+    glDrawArrays( GL_TRIANGLE_STRIP, 0, 4 );
+}
+
 void
 display( void )
 {
-    glClear( GL_COLOR_BUFFER_BIT );     // clear the window
-    glDrawArrays( GL_POINTS, 0, NumPoints );    // draw the points
+    PROFILE_FUNCTION();
+
+    if ( isDensityMode ) {
+        displayDensity();
+    }
+    else {
+        displayPoints();
+    }
+
     glFlush();
 }
 
 //----------------------------------------------------------------------------
 
+void
+idle( void )
+{
+    PROFILE_FUNCTION();
+
+    bool isDone = isDensityMode ? numSplattedBlocks == game->numBlocks( NumPoints )
+                                : numDrawnPoints == NumPoints;
+
+    if ( !isDone ) {
+        postRedisplay();
+    }
+}
+
+//----------------------------------------------------------------------------
+
+void
+reshape( int w, int h )
+{
+    PROFILE_FUNCTION();
+
+    width = w;
+    height = h;
+
+    glViewport( 0, 0, w, h );
+
+    // The accumulated points are lost with the old size, so start over
+    glBindRenderbuffer( GL_RENDERBUFFER, colorbuffer );
+    glRenderbufferStorage( GL_RENDERBUFFER, GL_RGBA8, w, h );
+
+    glBindFramebuffer( GL_FRAMEBUFFER, framebuffer );
+    glFramebufferRenderbuffer( GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                               GL_RENDERBUFFER, colorbuffer );
+    glClear( GL_COLOR_BUFFER_BIT );
+    glBindFramebuffer( GL_FRAMEBUFFER, windowFramebuffer() );
+
+    startStreaming();
+
+    // Density image at window resolution, one histogram per pool thread
+    density.resize( w, h, ThreadPool::global().size() );
+    numSplattedBlocks = 0;
+    splatStart = std::chrono::steady_clock::now();
+
+    glBindTexture( GL_TEXTURE_2D, quadTexture );
+    glTexImage2D( GL_TEXTURE_2D, 0, GL_RGBA8, w, h, 0,
+                  GL_RGBA, GL_UNSIGNED_BYTE, NULL );
+}
+
+//----------------------------------------------------------------------------
+
 void
 keyboard( unsigned char key, int x, int y )
 {
+    PROFILE_FUNCTION();
+
     switch ( key ) {
     case 033:
         exit( EXIT_SUCCESS );
         break;
+    case 'd':
+    case 'D':
+        isDensityMode = !isDensityMode;
+        postRedisplay();
+        break;
     }
 }
 
 //----------------------------------------------------------------------------
 
+//----------------------------------------------------------------------------
+
+// Stream the points in both modes offscreen for numFrames frames each
+//   and write the frame-time statistics to outputPath
+int
+runFrameBenchmark( int numFrames, const std::string &outputPath,
+                   const char *baselinePath )
+{
+    FrameBenchmark benchmark( "sierpinski", numFrames );
+
+    // Every scene starts from an empty image
+    isDensityMode = false;
+    reshape( width, height );
+    benchmark.runScene( "sierpinski_points", "points", display, idle );
+
+    isDensityMode = true;
+    reshape( width, height );
+    benchmark.runScene( "sierpinski_density", "triangles", display, idle );
+
+    if ( baselinePath && !benchmark.compare( baselinePath ) ) {
+        std::cerr << "Could not read baseline " << baselinePath << std::endl;
+    }
+
+    if ( !benchmark.writeJSON( outputPath, width, height ) ) {
+        std::cerr << "Could not write " << outputPath << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
+
 int
 main( int argc, char **argv )
 {
+    // CPU zones are only recorded when built with -DANGEL_PROFILE
+    PROFILE_TRACE_AT_EXIT( "sierpinski_trace.json" );
+
+    // Render this many frames offscreen and exit, instead of opening a window
+    int headlessFrames = 0;
+    const char *headlessOutput = NULL;
+
+    // Time a fixed set of scenes offscreen instead (--benchmark N)
+    int benchmarkFrames = 0;
+    std::string benchmarkOutput = "sierpinski_benchmark.json";
+    const char *benchmarkBaseline = NULL;
+
+    for ( int i = 1; i < argc; ++i ) {
+        if ( strcmp( argv[i], "--points" ) == 0 && i + 1 < argc ) {
+            NumPoints = std::max( 1ll, atoll( argv[++i] ) );
+        }
+        else if ( strcmp( argv[i], "--seed" ) == 0 && i + 1 < argc ) {
+            Seed = strtoull( argv[++i], NULL, 10 );
+        }
+        else if ( strcmp( argv[i], "--density" ) == 0 ) {
+            isDensityMode = true;
+        }
+        else if ( strcmp( argv[i], "--headless" ) == 0 && i + 1 < argc ) {
+            headlessFrames = std::max( 1, atoi( argv[++i] ) );
+        }
+        else if ( strcmp( argv[i], "--headless-output" ) == 0 && i + 1 < argc ) {
+            headlessOutput = argv[++i];
+        }
+        else if ( strcmp( argv[i], "--benchmark" ) == 0 && i + 1 < argc ) {
+            benchmarkFrames = std::max( 1, atoi( argv[++i] ) );
+        }
+        else if ( strcmp( argv[i], "--benchmark-output" ) == 0 && i + 1 < argc ) {
+            benchmarkOutput = argv[++i];
+        }
+        else if ( strcmp( argv[i], "--benchmark-baseline" ) == 0 && i + 1 < argc ) {
+            benchmarkBaseline = argv[++i];
+        }
+    }
+
+    if ( headlessFrames > 0 || benchmarkFrames > 0 ) {
+        if ( !HeadlessRenderer::get().init( 512, 512 ) ) {
+            return 1;
+        }
+
+        init();
+        atexit( stopStreaming );
+
+        reshape( 512, 512 );
+
+        if ( benchmarkFrames > 0 ) {
+            return runFrameBenchmark( benchmarkFrames, benchmarkOutput, benchmarkBaseline );
+        }
+        HeadlessRenderer::get().run( headlessFrames, display, idle );
+
+        if ( headlessOutput && !HeadlessRenderer::get().savePPM( headlessOutput ) ) {
+            std::cerr << "Could not write " << headlessOutput << std::endl;
+        }
+
+        return 0;
+    }
+
     glutInit( &argc, argv );
     glutInitDisplayMode( GLUT_RGBA );
     glutInitWindowSize( 512, 512 );
@@ -92,7 +506,12 @@ main( int argc, char **argv )
 
     init();
 
+    // Generator threads must be joined before the program goes away
+    atexit( stopStreaming );
+
     glutDisplayFunc( display );
+    glutReshapeFunc( reshape );
+    glutIdleFunc( idle );
     glutKeyboardFunc( keyboard );
 
     glutMainLoop();
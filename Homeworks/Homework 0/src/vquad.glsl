@@ -0,0 +1,9 @@
+attribute vec4 vPosition;
+varying vec2 texCoord;
+
+void
+main()
+{
+    texCoord = vPosition.xy * 0.5 + 0.5;
+    gl_Position = vPosition;
+}
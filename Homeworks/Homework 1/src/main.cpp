@@ -1,9 +1,15 @@
 #include "Angel.h"
+#include "physics.h"
+#include "eventlog.h"
+#include "headless.h"
+#include "glstate.h"
+#include "dynamicbuffer.h"
 
 #include <iostream>
 #include <fstream>
 #include <vector>
 #include <string>
+#include <cstring>
 
 const std::string PRINT_DELIMITER = "------------------------------------------------------";
 
@@ -15,6 +21,14 @@ const GLfloat INITIAL_HORIZONTAL_SPEED = 0.01;
 const GLfloat INITIAL_VERTICAL_SPEED = -0.015;
 const GLfloat INITIAL_Z_SPEED = -0.01;
 
+// The speeds above are per frame at this rate; the simulation works in seconds
+const GLfloat REFERENCE_FRAME_RATE = 60.0;
+const GLfloat PHYSICS_TIME_STEP = 1.0 / 120.0;
+
+// Used when gravity is toggled on
+const vec3 GRAVITY = vec3(0.0, -2.0, 0.0);
+const GLfloat RESTITUTION = 0.85;
+
 const GLfloat SCALE_FACTOR = 0.20;
 const GLfloat BALL_RADIUS = SCALE_FACTOR;
 const GLfloat FOV = 90.0;
@@ -25,15 +39,40 @@ const GLfloat zFar = 5.0;
 // Need to do this so Bunny faces the camera
 const GLfloat BUNNY_X_ROTATION_ANGLE = -90.0;
 
+// Interpolated ball position for the current frame
 vec3 displacement = TOP_LEFT_FRONT_CORNER;
 
-GLfloat curHorizontalSpeed = INITIAL_HORIZONTAL_SPEED;
-GLfloat curVerticalSpeed = INITIAL_VERTICAL_SPEED;
-GLfloat curZSpeed = INITIAL_Z_SPEED;
+// Ball simulation, stepped at a fixed rate on its own thread
+BallPhysics physics;
+
+// Events that can be recorded with --record and replayed with --replay
+enum LoggedEvent
+{
+    KEY_EVENT = 1,
+    MOUSE_EVENT,
+    RESHAPE_EVENT,
+    CHECKPOINT_EVENT
+};
+
+// Simulation steps between recorded checkpoints of the ball state
+const unsigned long long CHECKPOINT_INTERVAL = 120;
+
+EventLog eventLog;
+
+unsigned long long nextCheckpoint = 0;
+
+// While recording, physics is stepped from idle() so every event lands on a known step
+BallPhysics::Clock::time_point lastUpdate;
+
+// False while replaying without a window; GL calls are skipped then
+bool hasGLContext = true;
 
 // Bool for toggling between 2D and 3D
 bool is3D = true;
 
+// Bool for toggling gravity (and energy loss on bounces)
+bool isGravityOn = false;
+
 // Boundaries for the room
 GLfloat leftWallBoundary = -1.0;
 GLfloat rightWallBoundary = 1.0;
@@ -92,6 +131,11 @@ DrawColor curDrawColor = COLORFUL;
 // Allocate space for NUM_SHAPES VAOs and 1 more for the room / walls
 GLuint vao[NUM_SHAPES + 1];
 
+GLuint program;
+
+// Walls and ball, sorted and issued through the GL state cache
+DrawList drawList;
+
 // Model-view and projection matrices uniform location
 GLuint ModelView, Projection;
 
@@ -102,6 +146,9 @@ namespace cubeContext
 {
     GLuint buffer;
 
+    // Vertex colors, rewritten in mapped memory by the 'C' key
+    DynamicAttribute dynamicColors;
+
     const int NumVertices = 36;
 
     point4 points[NumVertices];
@@ -163,6 +210,9 @@ namespace wallsContext
 {
     GLuint buffer;
 
+    // Vertex positions, replaced when the window is reshaped
+    DynamicAttribute dynamicPoints;
+
     // A room is implemented as a cube with the front face missing
     // Hence, there will be 36 - 6 = 30 vertices
     const int NumVertices = 30;
@@ -240,6 +290,9 @@ namespace sphereContext
 {
     GLuint buffer;
 
+    // Vertex colors, rewritten in mapped memory by the 'C' key
+    DynamicAttribute dynamicColors;
+
     // Approximate a sphere using recursive subdivision
 
     const int NumTimesToSubdivide = 5;
@@ -304,6 +357,8 @@ namespace sphereContext
 
     void tetrahedron(int count)
     {
+        PROFILE_FUNCTION();
+
         point4 v[4] = {
             vec4(0.0, 0.0, 1.0, 1.0),
             vec4(0.0, 0.942809, -0.333333, 1.0),
@@ -321,6 +376,9 @@ namespace bunnyContext
 {
     GLuint buffer;
 
+    // Vertex colors, rewritten in mapped memory by the 'C' key
+    DynamicAttribute dynamicColors;
+
     int NumVertices;
 
     std::vector<point4> points;
@@ -344,6 +402,8 @@ namespace bunnyContext
 
 void loadModel(std::string path, std::vector<point4> *points)
 {
+    PROFILE_FUNCTION();
+
     std::string line;
     std::ifstream modelFile(path);
 
@@ -410,6 +470,27 @@ void loadModel(std::string path, std::vector<point4> *points)
     }
 }
 
+BallState initialBallState()
+{
+    BallState state;
+    state.position = TOP_LEFT_FRONT_CORNER;
+    state.velocity = vec3(INITIAL_HORIZONTAL_SPEED, INITIAL_VERTICAL_SPEED, is3D ? INITIAL_Z_SPEED : 0.0) * REFERENCE_FRAME_RATE;
+    return state;
+}
+
+PhysicsParams currentPhysicsParams()
+{
+    PhysicsParams params;
+    params.timeStep = PHYSICS_TIME_STEP;
+    params.gravity = isGravityOn ? GRAVITY : vec3(0.0);
+    params.restitution = isGravityOn ? RESTITUTION : 1.0;
+    params.radius = BALL_RADIUS;
+    params.minBounds = vec3(leftWallBoundary, bottomWallBoundary, backWallBoundary);
+    params.maxBounds = vec3(rightWallBoundary, topWallBoundary, frontWallBoundary);
+    params.bounceZ = is3D;
+    return params;
+}
+
 // For setting the projection matrix when toggling between 2D and 3D
 void setProjectionMatrix()
 {
@@ -431,7 +512,7 @@ void setProjectionMatrix()
                                            : Ortho(-1.0 * aspect, 1.0 * aspect, -1.0, 1.0, zNear, zFar);
     }
 
-    glUniformMatrix4fv(Projection, 1, GL_TRUE, projection);
+    GLStateCache::get().uniformMatrix4fv(Projection, projection);
 }
 
 void toggleColor(point4 colors[], int numVertices)
@@ -452,16 +533,26 @@ void toggleColor(point4 colors[], int numVertices)
     }
 }
 
+// Writes the next colors of a shape straight into its next color buffer
+// region, without waiting for the GPU to finish drawing the current one
+void toggleColor(DynamicAttribute &colors, int numVertices)
+{
+    toggleColor(static_cast<point4 *>(colors.beginUpdate(numVertices * sizeof(point4))), numVertices);
+    colors.endUpdate();
+}
+
 // OpenGL initialization
 void init()
 {
+    PROFILE_FUNCTION();
+
     cubeContext::colorcube();
     sphereContext::tetrahedron(sphereContext::NumTimesToSubdivide);
     bunnyContext::initBunny();
     wallsContext::colorcube();
 
     // Load shaders and use the resulting shader program
-    GLuint program = InitShader("vshader.glsl", "fshader.glsl");
+    program = InitShader("vshader.glsl", "fshader.glsl");
 
     GLuint vPosition = glGetAttribLocation(program, "vPosition");
     GLuint vColor = glGetAttribLocation(program, "vColor");
@@ -484,12 +575,12 @@ void init()
 
     glGenBuffers(1, &cubeContext::buffer);
     glBindBuffer(GL_ARRAY_BUFFER, cubeContext::buffer);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(cubeContext::points) + sizeof(cubeContext::colors), NULL, GL_STATIC_DRAW);
-    glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(cubeContext::points), cubeContext::points);
-    glBufferSubData(GL_ARRAY_BUFFER, sizeof(cubeContext::points), sizeof(cubeContext::colors), cubeContext::colors);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(cubeContext::points), cubeContext::points, GL_STATIC_DRAW);
 
     glVertexAttribPointer(vPosition, 4, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0));
-    glVertexAttribPointer(vColor, 4, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(sizeof(cubeContext::points)));
+
+    cubeContext::dynamicColors.init(vao[0], vColor, 4, GL_FLOAT, sizeof(cubeContext::colors));
+    cubeContext::dynamicColors.update(cubeContext::colors, sizeof(cubeContext::colors));
 
     // Initialization for SPHERE
     glBindVertexArray(vao[1]);
@@ -499,12 +590,12 @@ void init()
 
     glGenBuffers(1, &sphereContext::buffer);
     glBindBuffer(GL_ARRAY_BUFFER, sphereContext::buffer);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(sphereContext::points) + sizeof(sphereContext::colors), NULL, GL_STATIC_DRAW);
-    glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(sphereContext::points), sphereContext::points);
-    glBufferSubData(GL_ARRAY_BUFFER, sizeof(sphereContext::points), sizeof(sphereContext::colors), sphereContext::colors);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(sphereContext::points), sphereContext::points, GL_STATIC_DRAW);
 
     glVertexAttribPointer(vPosition, 4, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0));
-    glVertexAttribPointer(vColor, 4, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(sizeof(sphereContext::points)));
+
+    sphereContext::dynamicColors.init(vao[1], vColor, 4, GL_FLOAT, sizeof(sphereContext::colors));
+    sphereContext::dynamicColors.update(sphereContext::colors, sizeof(sphereContext::colors));
 
     // Initialization for BUNNY
     glBindVertexArray(vao[2]);
@@ -514,12 +605,12 @@ void init()
 
     glGenBuffers(1, &bunnyContext::buffer);
     glBindBuffer(GL_ARRAY_BUFFER, bunnyContext::buffer);
-    glBufferData(GL_ARRAY_BUFFER, bunnyContext::points.size() * sizeof(point4) + bunnyContext::colors.size() * sizeof(point4), NULL, GL_STATIC_DRAW);
-    glBufferSubData(GL_ARRAY_BUFFER, 0, bunnyContext::points.size() * sizeof(point4), &bunnyContext::points[0]);
-    glBufferSubData(GL_ARRAY_BUFFER, bunnyContext::points.size() * sizeof(point4), bunnyContext::colors.size() * sizeof(point4), &bunnyContext::colors[0]);
+    glBufferData(GL_ARRAY_BUFFER, bunnyContext::points.size() * sizeof(point4), &bunnyContext::points[0], GL_STATIC_DRAW);
 
     glVertexAttribPointer(vPosition, 4, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0));
-    glVertexAttribPointer(vColor, 4, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(bunnyContext::points.size() * sizeof(point4)));
+
+    bunnyContext::dynamicColors.init(vao[2], vColor, 4, GL_FLOAT, bunnyContext::colors.size() * sizeof(color4));
+    bunnyContext::dynamicColors.update(&bunnyContext::colors[0], bunnyContext::colors.size() * sizeof(color4));
 
     // Initialization for WALLS / ROOM
     glBindVertexArray(vao[3]);
@@ -529,15 +620,18 @@ void init()
 
     glGenBuffers(1, &wallsContext::buffer);
     glBindBuffer(GL_ARRAY_BUFFER, wallsContext::buffer);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(wallsContext::points) + sizeof(wallsContext::colors), NULL, GL_STATIC_DRAW);
-    glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(wallsContext::points), wallsContext::points);
-    glBufferSubData(GL_ARRAY_BUFFER, sizeof(wallsContext::points), sizeof(wallsContext::colors), wallsContext::colors);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(wallsContext::colors), wallsContext::colors, GL_STATIC_DRAW);
 
-    glVertexAttribPointer(vPosition, 4, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0));
-    glVertexAttribPointer(vColor, 4, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(sizeof(wallsContext::points)));
+    glVertexAttribPointer(vColor, 4, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0));
+
+    wallsContext::dynamicPoints.init(vao[3], vPosition, 4, GL_FLOAT, sizeof(wallsContext::points));
+    wallsContext::dynamicPoints.update(wallsContext::points, sizeof(wallsContext::points));
+
+    // The binds above bypassed the cache
+    GLStateCache::get().invalidate();
 
     // Set current program object
-    glUseProgram(program);
+    GLStateCache::get().useProgram(program);
 
     // Enable hiddden surface removal
     glEnable(GL_DEPTH_TEST);
@@ -550,6 +644,8 @@ void init()
 
 void display(void)
 {
+    PROFILE_FUNCTION();
+
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
     // Render the walls first, then the objects
@@ -557,45 +653,39 @@ void display(void)
     // Scaling should only apply to objects (so (1.0, 1.0, 1.0) is used for the scale matrix)
     mat4 model_view = Translate(vec3(0.0, 0.0, -2.0)) * Scale(1.0, 1.0, 1.0);
 
+    drawList.clear();
+
     // Draw room
-    glBindVertexArray(vao[3]);
-    glBindBuffer(GL_ARRAY_BUFFER, wallsContext::buffer);
-    glUniformMatrix4fv(ModelView, 1, GL_TRUE, model_view);
-    glDrawArrays(GL_TRIANGLES, 0, wallsContext::NumVertices);
+    drawList.add(program, vao[3], GL_TRIANGLES, 0, wallsContext::NumVertices);
+    drawList.uniformMatrix4fv(ModelView, model_view);
 
     // Use different matrices for objects other than the room
     model_view = (Translate(displacement) * Scale(SCALE_FACTOR, SCALE_FACTOR, SCALE_FACTOR));
 
-    glUniformMatrix4fv(ModelView, 1, GL_TRUE, model_view);
-
     switch (curBallShape)
     {
     case CUBE:
-        glBindVertexArray(vao[0]);
-        glBindBuffer(GL_ARRAY_BUFFER, cubeContext::buffer);
-        glDrawArrays(GL_TRIANGLES, 0, cubeContext::NumVertices);
+        drawList.add(program, vao[0], GL_TRIANGLES, 0, cubeContext::NumVertices);
         break;
     case SPHERE:
-        glBindVertexArray(vao[1]);
-        glBindBuffer(GL_ARRAY_BUFFER, sphereContext::buffer);
-        glDrawArrays(GL_TRIANGLES, 0, sphereContext::NumVertices);
+        drawList.add(program, vao[1], GL_TRIANGLES, 0, sphereContext::NumVertices);
         break;
     case BUNNY:
-        glBindVertexArray(vao[2]);
-        glBindBuffer(GL_ARRAY_BUFFER, bunnyContext::buffer);
-
         // Modify and send new ModelView matrix for Bunny
         // Rotate in X-direction
         // Need to do this so BUnny faces camera
         model_view = model_view * RotateX(BUNNY_X_ROTATION_ANGLE);
-        glUniformMatrix4fv(ModelView, 1, GL_TRUE, model_view);
 
-        glDrawArrays(GL_TRIANGLES, 0, bunnyContext::NumVertices);
+        drawList.add(program, vao[2], GL_TRIANGLES, 0, bunnyContext::NumVertices);
         break;
     }
 
+    drawList.uniformMatrix4fv(ModelView, model_view);
+
+    drawList.execute();
+
     glFlush();
-    glutSwapBuffers();
+    swapBuffers();
 }
 
 //---------------------------------------------------------------------
@@ -603,9 +693,12 @@ void display(void)
 // reshape
 //
 
-void reshape(int w, int h)
+void applyReshape(int w, int h)
 {
-    glViewport(0, 0, w, h);
+    if (hasGLContext)
+    {
+        glViewport(0, 0, w, h);
+    }
 
     curWidth = w;
     curHeight = h;
@@ -634,79 +727,72 @@ void reshape(int w, int h)
     // Need to update wall vertices on reshape since room will be scaled
     wallsContext::colorcube();
 
-    // Bind wall buffer send updated vertex data
-    glBindVertexArray(vao[3]);
-    glBindBuffer(GL_ARRAY_BUFFER, wallsContext::buffer);
-    glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(wallsContext::points), wallsContext::points);
+    // Ball bounces off the new walls from the next step on
+    physics.setParams(currentPhysicsParams());
+
+    if (hasGLContext)
+    {
+        // Send the updated vertex data to the next wall buffer region
+        wallsContext::dynamicPoints.update(wallsContext::points, sizeof(wallsContext::points));
 
-    // Projection matrix may need to be updated
-    setProjectionMatrix();
+        // Projection matrix may need to be updated
+        setProjectionMatrix();
+    }
+}
+
+void reshape(int w, int h)
+{
+    PROFILE_FUNCTION();
+
+    eventLog.record(physics.stepCount(), RESHAPE_EVENT, w, h);
+
+    applyReshape(w, h);
 }
 
 //----------------------------------------------------------------------------
 
-void idle(void)
+unsigned simulationChecksum()
 {
-    // Ball should bounce off boundaries
-    if (displacement.x + curHorizontalSpeed <= leftWallBoundary + BALL_RADIUS)
-    {
-        displacement.x = leftWallBoundary + BALL_RADIUS;
-        curHorizontalSpeed = -curHorizontalSpeed;
-    }
-    else if (displacement.x + curHorizontalSpeed >= rightWallBoundary - BALL_RADIUS)
-    {
+    return hashBytes(&physics.state(), sizeof(BallState));
+}
 
-        displacement.x = rightWallBoundary - BALL_RADIUS;
-        curHorizontalSpeed = -curHorizontalSpeed;
-    }
+void idle(void)
+{
+    PROFILE_FUNCTION();
 
-    if (displacement.y + curVerticalSpeed <= bottomWallBoundary + BALL_RADIUS)
-    {
-        displacement.y = bottomWallBoundary + BALL_RADIUS;
-        curVerticalSpeed = -curVerticalSpeed;
-    }
-    else if (displacement.y + curVerticalSpeed >= topWallBoundary - BALL_RADIUS)
+    if (eventLog.isRecording())
     {
-        displacement.y = topWallBoundary - BALL_RADIUS;
-        curVerticalSpeed = -curVerticalSpeed;
-    }
+        BallPhysics::Clock::time_point now = BallPhysics::Clock::now();
+        physics.advance(std::chrono::duration<double>(now - lastUpdate).count());
+        lastUpdate = now;
 
-    // Make ball bounce off front / back walls only if 3D is toggled
-    if (is3D)
-    {
-        if (displacement.z + curZSpeed <= backWallBoundary + BALL_RADIUS)
-        {
-            displacement.z = backWallBoundary + BALL_RADIUS;
-            curZSpeed = -curZSpeed;
-        }
-        else if (displacement.z + curZSpeed >= frontWallBoundary - BALL_RADIUS)
+        eventLog.markStep(physics.stepCount());
+
+        if (physics.stepCount() >= nextCheckpoint)
         {
-            displacement.z = frontWallBoundary - BALL_RADIUS;
-            curZSpeed = -curZSpeed;
+            eventLog.record(physics.stepCount(), CHECKPOINT_EVENT, simulationChecksum());
+            nextCheckpoint = physics.stepCount() + CHECKPOINT_INTERVAL;
         }
     }
 
-    displacement += vec3(curHorizontalSpeed, curVerticalSpeed, curZSpeed);
+    // The ball is simulated on its own thread; just pick up where it is
+    displacement = physics.renderPosition();
 
-    glutPostRedisplay();
+    postRedisplay();
 }
 
 //----------------------------------------------------------------------------
 
-void keyboard(unsigned char key, int x, int y)
+void applyKey(unsigned char key)
 {
     // Toggle draw mode (SOLID or WIREFRAME)
     if (key == 'D' | key == 'd')
     {
         curDrawMode = DrawMode((curDrawMode + 1) % NUM_DRAW_MODES);
 
-        if (curDrawMode == SOLID)
-        {
-            glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-        }
-        else if (curDrawMode == WIREFRAME)
+        if (hasGLContext)
         {
-            glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+            GLStateCache::get().polygonMode(curDrawMode == SOLID ? GL_FILL : GL_LINE);
         }
     }
 
@@ -714,39 +800,49 @@ void keyboard(unsigned char key, int x, int y)
     // Reset ball speed
     if (key == 'I' | key == 'i')
     {
-        displacement = TOP_LEFT_FRONT_CORNER;
-        curHorizontalSpeed = INITIAL_HORIZONTAL_SPEED;
-        curVerticalSpeed = INITIAL_VERTICAL_SPEED;
-        curZSpeed = INITIAL_Z_SPEED;
+        physics.setState(initialBallState());
     }
 
     // Toggle between 2D and 3D
     if (key == 'V' | key == 'v')
     {
         is3D = !is3D;
-        curZSpeed = is3D ? INITIAL_Z_SPEED : 0;
 
-        setProjectionMatrix();
+        BallState state = physics.snapshot().current;
+        state.velocity.z = is3D ? INITIAL_Z_SPEED * REFERENCE_FRAME_RATE : 0.0;
+
+        physics.setParams(currentPhysicsParams());
+        physics.setState(state);
+
+        if (hasGLContext)
+        {
+            setProjectionMatrix();
+        }
+    }
+
+    // Toggle gravity
+    if (key == 'G' || key == 'g')
+    {
+        isGravityOn = !isGravityOn;
+        physics.setParams(currentPhysicsParams());
     }
 
     // Toggle between colors
-    if (key == 'C' | key == 'c')
+    // Colors only affect drawing, nothing to do without a GL context
+    if ((key == 'C' || key == 'c') && hasGLContext)
     {
         switch (curBallShape)
         {
         case SPHERE:
-            toggleColor(sphereContext::colors, sphereContext::NumVertices);
-            glBufferSubData(GL_ARRAY_BUFFER, sizeof(sphereContext::points), sizeof(sphereContext::colors), sphereContext::colors);
+            toggleColor(sphereContext::dynamicColors, sphereContext::NumVertices);
             break;
 
         case CUBE:
-            toggleColor(cubeContext::colors, cubeContext::NumVertices);
-            glBufferSubData(GL_ARRAY_BUFFER, sizeof(cubeContext::points), sizeof(cubeContext::colors), cubeContext::colors);
+            toggleColor(cubeContext::dynamicColors, cubeContext::NumVertices);
             break;
 
         case BUNNY:
-            toggleColor(bunnyContext::colors.data(), bunnyContext::NumVertices);
-            glBufferSubData(GL_ARRAY_BUFFER, bunnyContext::points.size() * sizeof(point4), bunnyContext::colors.size() * sizeof(point4), &bunnyContext::colors[0]);
+            toggleColor(bunnyContext::dynamicColors, bunnyContext::NumVertices);
             break;
         }
     }
@@ -760,21 +856,31 @@ void keyboard(unsigned char key, int x, int y)
         std::cout << "Press C => Toggle between colors" << std::endl;
         std::cout << "Press I => Reset ball to initial position" << std::endl;
         std::cout << "Press V => Toggle between 2D and 3D" << std::endl;
+        std::cout << "Press G => Toggle gravity" << std::endl;
         std::cout << "Press Q => Quit the program" << std::endl;
         std::cout << "Left-mouse click => Toggle between ball shapes" << std::endl;
         std::cout << PRINT_DELIMITER << std::endl;
     }
+}
+
+void keyboard(unsigned char key, int x, int y)
+{
+    PROFILE_FUNCTION();
 
     // Quit the program
     if (key == 'Q' | key == 'q')
     {
         exit(0);
     }
+
+    eventLog.record(physics.stepCount(), KEY_EVENT, key);
+
+    applyKey(key);
 }
 
 //----------------------------------------------------------------------------
 
-void mouse(int button, int state, int x, int y)
+void applyMouse(int button, int state)
 {
     // Toggle betwene shapes on left-mouse click
     if (state == GLUT_DOWN)
@@ -782,49 +888,186 @@ void mouse(int button, int state, int x, int y)
         switch (button)
         {
         case GLUT_LEFT_BUTTON:
+            // display() binds whatever the new shape needs
             curBallShape = BallShape((curBallShape + 1) % NUM_SHAPES);
+            break;
+        }
+    }
+}
 
-            if (curBallShape == CUBE)
-            {
-                glBindVertexArray(vao[0]);
-                glBindBuffer(GL_ARRAY_BUFFER, cubeContext::buffer);
-            }
-            else if (curBallShape == SPHERE)
-            {
-                glBindVertexArray(vao[1]);
-                glBindBuffer(GL_ARRAY_BUFFER, sphereContext::buffer);
-            }
-            else if (curBallShape == BUNNY)
+void mouse(int button, int state, int x, int y)
+{
+    PROFILE_FUNCTION();
+
+    eventLog.record(physics.stepCount(), MOUSE_EVENT, button, state);
+
+    applyMouse(button, state);
+}
+
+//----------------------------------------------------------------------------
+
+// Feed a recorded run back through the same handlers, without a window and
+// as fast as possible, and check the ball ends up where it did when recorded
+int replay(const std::string &path)
+{
+    if (!eventLog.load(path, "bouncing_ball"))
+    {
+        std::cerr << "Could not read event log " << path << std::endl;
+        return 1;
+    }
+
+    hasGLContext = false;
+
+    physics.init(currentPhysicsParams(), initialBallState());
+
+    int numCheckpoints = 0;
+    int numMismatches = 0;
+
+    BallPhysics::Clock::time_point start = BallPhysics::Clock::now();
+
+    for (;;)
+    {
+        LogEvent event;
+
+        while (eventLog.next(physics.stepCount(), event))
+        {
+            switch (event.type)
             {
-                glBindVertexArray(vao[2]);
-                glBindBuffer(GL_ARRAY_BUFFER, bunnyContext::buffer);
+            case KEY_EVENT:
+                applyKey(event.args[0]);
+                break;
+            case MOUSE_EVENT:
+                applyMouse(event.args[0], event.args[1]);
+                break;
+            case RESHAPE_EVENT:
+                applyReshape(event.args[0], event.args[1]);
+                break;
+            case CHECKPOINT_EVENT:
+                numCheckpoints++;
+
+                if (simulationChecksum() != static_cast<unsigned>(event.args[0]))
+                {
+                    if (numMismatches == 0)
+                    {
+                        std::cout << "Replay diverged from the recording at step " << event.step << std::endl;
+                    }
+
+                    numMismatches++;
+                }
+                break;
             }
+        }
 
+        if (physics.stepCount() >= eventLog.endStep())
+        {
             break;
         }
+
+        physics.step();
     }
+
+    double seconds = std::chrono::duration<double>(BallPhysics::Clock::now() - start).count();
+
+    std::cout << PRINT_DELIMITER << std::endl;
+    std::cout << "Replayed " << physics.stepCount() << " steps and " << eventLog.numEvents() << " events in "
+              << seconds << " s (" << physics.stepCount() / seconds << " steps/sec)" << std::endl;
+    std::cout << numCheckpoints - numMismatches << " of " << numCheckpoints << " checkpoints matched" << std::endl;
+    std::cout << PRINT_DELIMITER << std::endl;
+
+    return numMismatches == 0 ? 0 : 1;
 }
 
 //----------------------------------------------------------------------------
 
 int main(int argc, char **argv)
 {
-    glutInit(&argc, argv);
-    glutInitDisplayMode(GLUT_RGBA | GLUT_DOUBLE | GLUT_DEPTH);
-    glutInitWindowSize(1024, 1024);
-    glutInitWindowPosition(50, 50);
-    glutCreateWindow("Bouncing Ball");
+    // CPU zones are only recorded when built with -DANGEL_PROFILE
+    PROFILE_TRACE_AT_EXIT("bouncing_ball_trace.json");
+
+    std::string recordPath;
+
+    // Render this many frames offscreen and exit, instead of opening a window
+    int headlessFrames = 0;
+    const char *headlessOutput = NULL;
+
+    for (int i = 1; i + 1 < argc; i++)
+    {
+        if (strcmp(argv[i], "--record") == 0)
+        {
+            recordPath = argv[++i];
+        }
+        else if (strcmp(argv[i], "--replay") == 0)
+        {
+            return replay(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--headless") == 0)
+        {
+            headlessFrames = std::max(1, atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--headless-output") == 0)
+        {
+            headlessOutput = argv[++i];
+        }
+    }
 
-    glewExperimental = GL_TRUE;
-    glewInit();
+    if (headlessFrames > 0)
+    {
+        if (!HeadlessRenderer::get().init(1024, 1024))
+        {
+            return 1;
+        }
+    }
+    else
+    {
+        glutInit(&argc, argv);
+        glutInitDisplayMode(GLUT_RGBA | GLUT_DOUBLE | GLUT_DEPTH);
+        glutInitWindowSize(1024, 1024);
+        glutInitWindowPosition(50, 50);
+        glutCreateWindow("Bouncing Ball");
+
+        glewExperimental = GL_TRUE;
+        glewInit();
+    }
 
     init();
 
-    glutDisplayFunc(display);
-    glutReshapeFunc(reshape);
-    glutIdleFunc(idle);
-    glutMouseFunc(mouse);
-    glutKeyboardFunc(keyboard);
+    if (headlessFrames == 0)
+    {
+        glutDisplayFunc(display);
+        glutReshapeFunc(reshape);
+        glutIdleFunc(idle);
+        glutMouseFunc(mouse);
+        glutKeyboardFunc(keyboard);
+    }
+
+    physics.init(currentPhysicsParams(), initialBallState());
+
+    if (recordPath.empty())
+    {
+        physics.start();
+    }
+    else if (eventLog.startRecording(recordPath, "bouncing_ball"))
+    {
+        lastUpdate = BallPhysics::Clock::now();
+    }
+    else
+    {
+        std::cerr << "Could not write event log " << recordPath << std::endl;
+        physics.start();
+    }
+
+    if (headlessFrames > 0)
+    {
+        reshape(1024, 1024);
+        HeadlessRenderer::get().run(headlessFrames, display, idle);
+
+        if (headlessOutput && !HeadlessRenderer::get().savePPM(headlessOutput))
+        {
+            std::cerr << "Could not write " << headlessOutput << std::endl;
+        }
+
+        return 0;
+    }
 
     glutMainLoop();
     return 0;
@@ -3,8 +3,18 @@
 #include <set>
 #include <string>
 #include <random>
+#include <chrono>
+#include <cstring>
 
 #include "Angel.h"
+#include "trackball.h"
+#include "eventlog.h"
+#include "headless.h"
+#include "framebench.h"
+#include "gputimer.h"
+#include "rasterizer.h"
+#include "glstate.h"
+#include "culling.h"
 
 typedef vec4 color4;
 typedef vec4 point4;
@@ -39,15 +49,8 @@ vec4 at;
 
 mat4 globalModelView;
 
-float angle = 0.0;
-float axis[3];
-
-bool trackballMove = false;
-
-float lastPos[3] = {0.0, 0.0, 0.0};
-
-int curX, curY;
-int startX, startY;
+// Camera orientation, accumulated as a quaternion so it stays a pure rotation
+Trackball trackball;
 
 int curWidth;
 int curHeight;
@@ -100,6 +103,42 @@ GLuint ModelView, Projection;
 
 bool isPickingOn = false;
 
+// Events that can be recorded with --record and replayed with --replay
+enum LoggedEvent
+{
+    MOUSE_EVENT = 1,
+    MOTION_EVENT,
+    RESHAPE_EVENT,
+    FACE_ROTATION_EVENT,
+    RANDOM_ROTATIONS_EVENT,
+    CHECKPOINT_EVENT
+};
+
+// Timer ticks between recorded checkpoints of the cube state
+const unsigned long long CHECKPOINT_INTERVAL = 64;
+
+EventLog eventLog;
+
+// Timer ticks so far, events are recorded against this
+unsigned long long numTicks = 0;
+
+unsigned long long nextCheckpoint = 0;
+
+// False while replaying without a window; GL calls are skipped then
+bool hasGLContext = true;
+
+// GPU time per render pass, enabled with --gpu-timers / --gpu-timers-csv
+GPUTimer gpuTimer;
+
+// Frames between printed GPU pass averages
+const int GPU_TIMER_PRINT_INTERVAL = 120;
+
+// Cubes culled and drawn per frame, printed with --culling-stats
+CullingStats cullingStats;
+
+// Frames between printed culling averages
+const int CULLING_STATS_PRINT_INTERVAL = 120;
+
 //----------------------------------------------------------------------------
 
 namespace RubicsCubeContext
@@ -107,13 +146,33 @@ namespace RubicsCubeContext
     const int NUM_VERTICES_PER_CUBE = 36;
     const int NUM_VERTICES_PER_FACE = 6;
 
+    // Layer turns all pivot on the centre cube, so the others hide it
+    // whichever way the cube is turned
+    const int CENTRE_CUBE = NUM_CUBES / 2;
+
     // Contains a set of cube indices for each afce
     std::vector<std::set<int>> face_to_cube_set;
 
     GLuint vertex_buffers[NUM_CUBES];
     GLuint vaos[NUM_CUBES];
+
+    // One draw per cubie, rebuilt every frame
+    DrawList drawList;
     mat4 model_view_matrices[NUM_CUBES];
 
+    // Bounding sphere of each cube in model coordinates; all cubes are the
+    // same size
+    vec4 bounding_centres[NUM_CUBES];
+    GLfloat bounding_radius;
+
+    // Cubes outside the view are not drawn, unless --no-culling
+    bool isFrustumCullingOn = true;
+    ViewFrustum frustum;
+
+    // Settled orientation of each cube and the orientation it is turning towards
+    quat orientations[NUM_CUBES];
+    quat target_orientations[NUM_CUBES];
+
     std::vector<point4> points[NUM_CUBES];
     std::vector<color4> colors[NUM_CUBES];
 
@@ -184,6 +243,9 @@ namespace RubicsCubeContext
             GLfloat start_z_coord = START_COORD + z_idx * CUBE_DEPTH + z_idx * BORDER_WIDTH;
             GLfloat end_z_coord = start_z_coord + CUBE_DEPTH;
 
+            bounding_centres[cube_idx] = point4(0.5 * (start_x_coord + end_x_coord), 0.5 * (start_y_coord + end_y_coord),
+                                                0.5 * (start_z_coord + end_z_coord), 1.0);
+
             point4 base_vertices[8] = {
                 point4(start_x_coord, start_y_coord, end_z_coord, 1.0),
                 point4(start_x_coord, end_y_coord, end_z_coord, 1.0),
@@ -248,26 +310,42 @@ namespace RubicsCubeContext
             quad(5, 4, 0, 1, cube_idx, 5, color_front, base_vertices);
         }
 
-        for (size_t i = 0; i < NUM_CUBES; i++)
+        bounding_radius = 0.5 * sqrt(CUBE_WIDTH * CUBE_WIDTH + CUBE_HEIGHT * CUBE_HEIGHT + CUBE_DEPTH * CUBE_DEPTH);
+
+        for (size_t i = 0; i < NUM_CUBES && hasGLContext; i++)
         {
             GLuint cur_buffer = vertex_buffers[i];
 
-            glBindVertexArray(vaos[i]);
-            glBindBuffer(GL_ARRAY_BUFFER, cur_buffer);
+            GLStateCache::get().bindVertexArray(vaos[i]);
+            GLStateCache::get().bindBuffer(GL_ARRAY_BUFFER, cur_buffer);
 
             glBufferData(GL_ARRAY_BUFFER, points[i].size() * sizeof(point4) + colors[i].size() * sizeof(point4), NULL, GL_STATIC_DRAW);
             glBufferSubData(GL_ARRAY_BUFFER, 0, points[i].size() * sizeof(point4), &points[i][0]);
             glBufferSubData(GL_ARRAY_BUFFER, points[i].size() * sizeof(point4), colors[i].size() * sizeof(point4), &colors[i][0]);
+
+            // Attribute arrays are part of the VAO, so they are set up once
+            GLuint vPosition = glGetAttribLocation(PROGRAM, "vPosition");
+            glEnableVertexAttribArray(vPosition);
+            glVertexAttribPointer(vPosition, 4, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0));
+
+            GLuint vColor = glGetAttribLocation(PROGRAM, "vColor");
+            glEnableVertexAttribArray(vColor);
+            glVertexAttribPointer(vColor, 4, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(points[i].size() * sizeof(point4)));
         }
     }
 
     void init()
     {
-        glGenBuffers(NUM_CUBES, vertex_buffers);
-        glGenVertexArrays(NUM_CUBES, vaos);
+        if (hasGLContext)
+        {
+            glGenBuffers(NUM_CUBES, vertex_buffers);
+            glGenVertexArrays(NUM_CUBES, vaos);
+        }
 
         for (size_t i = 0; i < NUM_CUBES; i++)
         {
+            orientations[i] = quat();
+            target_orientations[i] = quat();
             model_view_matrices[i] = mat4();
         }
 
@@ -276,25 +354,53 @@ namespace RubicsCubeContext
 
     void render()
     {
+        mat4 new_model_views[NUM_CUBES];
+        GLfloat eye_x[NUM_CUBES], eye_y[NUM_CUBES], eye_z[NUM_CUBES];
+        uint8_t is_visible[NUM_CUBES];
+
         for (size_t i = 0; i < NUM_CUBES; i++)
         {
-            glBindVertexArray(vaos[i]);
-            glBindBuffer(GL_ARRAY_BUFFER, vertex_buffers[i]);
+            new_model_views[i] = !isPickingOn ? globalModelView * model_view_matrices[i] : globalModelView;
 
-            GLuint vPosition = glGetAttribLocation(PROGRAM, "vPosition");
-            glEnableVertexAttribArray(vPosition);
-            glVertexAttribPointer(vPosition, 4, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0));
+            vec4 centre = new_model_views[i] * bounding_centres[i];
+            eye_x[i] = centre.x, eye_y[i] = centre.y, eye_z[i] = centre.z;
+        }
 
-            GLuint vColor = glGetAttribLocation(PROGRAM, "vColor");
-            glEnableVertexAttribArray(vColor);
-            glVertexAttribPointer(vColor, 4, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(points[i].size() * sizeof(point4)));
+        // Cube rotations leave the bounding radius as it is
+        size_t num_visible = NUM_CUBES;
+
+        if (isFrustumCullingOn)
+        {
+            num_visible = frustum.cullSpheres(eye_x, eye_y, eye_z, bounding_radius, NUM_CUBES, is_visible);
+        }
+        else
+        {
+            std::fill(is_visible, is_visible + NUM_CUBES, 1);
+        }
 
-            mat4 new_model_view = !isPickingOn ? globalModelView * model_view_matrices[i] : globalModelView;
+        size_t num_occluded = is_visible[CENTRE_CUBE];
+        is_visible[CENTRE_CUBE] = 0;
 
-            glUniformMatrix4fv(ModelView, 1, GL_TRUE, new_model_view);
+        if (!isPickingOn)
+        {
+            cullingStats.addObjects(NUM_CUBES);
+            cullingStats.addFrustumCulled(NUM_CUBES - num_visible);
+            cullingStats.addOccluded(num_occluded);
+            cullingStats.addDrawn(num_visible - num_occluded);
+        }
 
-            glDrawArrays(GL_TRIANGLES, 0, NUM_VERTICES_PER_CUBE);
+        drawList.clear();
+
+        for (size_t i = 0; i < NUM_CUBES; i++)
+        {
+            if (is_visible[i])
+            {
+                drawList.add(PROGRAM, vaos[i], GL_TRIANGLES, 0, NUM_VERTICES_PER_CUBE);
+                drawList.uniformMatrix4fv(ModelView, new_model_views[i]);
+            }
         }
+
+        drawList.execute();
     }
 
     void quad(int a, int b, int c, int d,
@@ -333,68 +439,32 @@ namespace RubicsCubeContext
 
 //----------------------------------------------------------------------------
 
-float radians(float degrees)
-{
-    return degrees * M_PI / 180.0;
-}
-
-mat4 rotate(float angle, vec3 axis)
-{
-    vec3 v = normalize(axis);
-
-    float x = v[0];
-    float y = v[1];
-    float z = v[2];
-
-    float c = cos(radians(angle));
-    float omc = 1.0 - c;
-    float s = sin(radians(angle));
-
-    mat4 result = mat4(
-        vec4(x * x * omc + c, x * y * omc - z * s, x * z * omc + y * s, 0.0),
-        vec4(x * y * omc + z * s, y * y * omc + c, y * z * omc - x * s, 0.0),
-        vec4(x * z * omc - y * s, y * z * omc + x * s, z * z * omc + c, 0.0),
-        vec4());
-
-    return result;
-}
-
-void set_trackball_vector(int x, int y, float v[3])
+// Axis that a face turns about
+vec3 faceRotationAxis(FacePosition face)
 {
-    float d;
-    float a;
-
-    v[0] = (2.0 * x - curWidth) / curWidth;
-    v[1] = (curHeight - 2.0F * y) / curHeight;
-
-    d = sqrt(v[0] * v[0] + v[1] * v[1]);
-
-    v[2] = cos((M_PI / 2.0) * ((d < 1.0) ? d : 1.0));
-
-    a = 1.0 / sqrt(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
-
-    v[0] *= a;
-    v[1] *= a;
-    v[2] *= a;
+    switch (face)
+    {
+    case LEFT:
+    case RIGHT:
+        return vec3(0.0, 0.0, 1.0);
+    case BOTTOM:
+    case TOP:
+        return vec3(0.0, 1.0, 0.0);
+    default:
+        return vec3(1.0, 0.0, 0.0);
+    }
 }
 
-void startMotion(int x, int y)
+// Sign of the angle about faceRotationAxis for a clockwise turn of the face
+GLfloat faceClockwiseSign(FacePosition face)
 {
-    startX = x;
-    startY = y;
-
-    curX = x;
-    curY = y;
-
-    set_trackball_vector(x, y, lastPos);
-
-    trackballMove = true;
+    return (face == FRONT || face == LEFT || face == TOP) ? 1.0 : -1.0;
 }
 
-void stopMotion(int x, int y)
+char faceRotationKey(FacePosition face)
 {
-    trackballMove = false;
-    angle = 0.0;
+    const char KEYS[NUM_POSITIONS] = {'L', 'R', 'D', 'U', 'B', 'F'};
+    return KEYS[static_cast<int>(face)];
 }
 
 //----------------------------------------------------------------------------
@@ -431,14 +501,23 @@ void initRotation(char rotationKey)
 
     rotateFaceClockwise = rotateClockwise;
     isFaceRotating = true;
+
+    // Every cube of the face ends up a quarter turn from where it is now
+    GLfloat quarterTurn = (rotateFaceClockwise ? 90.0 : -90.0) * faceClockwiseSign(faceToRotate);
+    quat turn = AxisAngle(quarterTurn, faceRotationAxis(faceToRotate));
+
+    for (int cubeIdx : RubicsCubeContext::face_to_cube_set[static_cast<int>(faceToRotate)])
+    {
+        RubicsCubeContext::target_orientations[cubeIdx] = normalize(turn * RubicsCubeContext::orientations[cubeIdx]);
+    }
 }
 
-std::string generateRandomRotationString(int length)
+// The same seed always gives the same string
+std::string generateRandomRotationString(int length, unsigned seed)
 {
     const std::string CHARACTERS = "UuDdFfBbRrLl";
 
-    std::random_device random_device;
-    std::mt19937 generator(random_device());
+    std::mt19937 generator(seed);
     std::uniform_int_distribution<> distribution(0, CHARACTERS.size() - 1);
 
     std::string random_string;
@@ -459,6 +538,8 @@ std::string generateRandomRotationString(int length)
 // 'F' => Front face, 'B' => Back Face
 void updateFaceIndices(char rotationKey)
 {
+    PROFILE_FUNCTION();
+
     bool rotateClockwise = rotateFaceClockwise;
     rotationKey = toupper(rotationKey);
 
@@ -644,8 +725,10 @@ void updateFaceIndices(char rotationKey)
 // OpenGL initialization
 void init()
 {
+    PROFILE_FUNCTION();
+
     PROGRAM = InitShader("vshader.glsl", "fshader.glsl");
-    glUseProgram(PROGRAM);
+    GLStateCache::get().useProgram(PROGRAM);
 
     RubicsCubeContext::init();
 
@@ -656,7 +739,10 @@ void init()
     // Set projection matrix
     mat4 projection;
     projection = Perspective(FOV, 1.0, zNear, zFar);
-    glUniformMatrix4fv(Projection, 1, GL_TRUE, projection);
+    GLStateCache::get().uniformMatrix4fv(Projection, projection);
+
+    // Cubes are tested in eye coordinates
+    RubicsCubeContext::frustum.set(projection);
 
     at = vec4(0.0, 0.0, 0.0, 1.0);
     eye = camera_pos;
@@ -672,79 +758,58 @@ void init()
 
 //----------------------------------------------------------------------------
 
-void timer(int value)
+// Advance the face rotation and the trackball by one timer tick
+void tick()
 {
-    if (isFaceRotating)
+    numTicks++;
+
+    // Applying the spin per tick rather than per frame keeps the trackball
+    // speed independent of the frame rate
+    if (trackball.update())
     {
-        char rotationKey;
+        // Rotate the initial camera frame by the accumulated orientation
+        // rather than re-rotating the previous frame
+        const quat &orientation = trackball.orientation();
 
-        if (faceToRotate == FRONT)
-        {
-            rotationKey = 'F';
+        eye = rotate(orientation, camera_pos);
+        up = rotate(orientation, vec4(0.0, 1.0, 0.0, 1.0));
+        at = rotate(orientation, vec4(0.0, 0.0, 0.0, 1.0));
 
-            for (int cubeIdx : RubicsCubeContext::face_to_cube_set[static_cast<int>(FRONT)])
-            {
-                RubicsCubeContext::model_view_matrices[cubeIdx] = RotateX(rotateFaceClockwise ? faceRotationIncrement : -faceRotationIncrement) * RubicsCubeContext::model_view_matrices[cubeIdx];
-            }
+        globalModelView = LookAt(eye, at, up);
 
-            faceRotationAngle += rotateFaceClockwise ? faceRotationIncrement : -faceRotationIncrement;
-        }
-        else if (faceToRotate == BACK)
+        if (hasGLContext)
         {
-            rotationKey = 'B';
-
-            for (int cubeIdx : RubicsCubeContext::face_to_cube_set[static_cast<int>(BACK)])
-            {
-                RubicsCubeContext::model_view_matrices[cubeIdx] = RotateX(rotateFaceClockwise ? -faceRotationIncrement : faceRotationIncrement) * RubicsCubeContext::model_view_matrices[cubeIdx];
-            }
-            faceRotationAngle += rotateFaceClockwise ? -faceRotationIncrement : faceRotationIncrement;
+            postRedisplay();
         }
-        else if (faceToRotate == RIGHT)
-        {
-            rotationKey = 'R';
-
-            for (int cubeIdx : RubicsCubeContext::face_to_cube_set[static_cast<int>(RIGHT)])
-            {
-                RubicsCubeContext::model_view_matrices[cubeIdx] = RotateZ(rotateFaceClockwise ? -faceRotationIncrement : faceRotationIncrement) * RubicsCubeContext::model_view_matrices[cubeIdx];
-            }
+    }
 
-            faceRotationAngle += rotateFaceClockwise ? -faceRotationIncrement : faceRotationIncrement;
-        }
-        else if (faceToRotate == LEFT)
-        {
-            rotationKey = 'L';
+    if (isFaceRotating)
+    {
+        char rotationKey = faceRotationKey(faceToRotate);
 
-            for (int cubeIdx : RubicsCubeContext::face_to_cube_set[static_cast<int>(LEFT)])
-            {
-                RubicsCubeContext::model_view_matrices[cubeIdx] = RotateZ(rotateFaceClockwise ? faceRotationIncrement : -faceRotationIncrement) * RubicsCubeContext::model_view_matrices[cubeIdx];
-            }
+        faceRotationAngle += faceRotationIncrement;
 
-            faceRotationAngle += rotateFaceClockwise ? faceRotationIncrement : -faceRotationIncrement;
-        }
-        else if (faceToRotate == TOP)
-        {
-            rotationKey = 'U';
+        bool isDone = faceRotationAngle >= 90.0;
 
-            for (int cubeIdx : RubicsCubeContext::face_to_cube_set[static_cast<int>(TOP)])
-            {
-                RubicsCubeContext::model_view_matrices[cubeIdx] = RotateY(rotateFaceClockwise ? faceRotationIncrement : -faceRotationIncrement) * RubicsCubeContext::model_view_matrices[cubeIdx];
-            }
+        // Interpolate between the settled and target orientations instead of
+        // accumulating small rotation matrices, so no error builds up per step
+        GLfloat t = isDone ? 1.0 : faceRotationAngle / 90.0;
 
-            faceRotationAngle += rotateFaceClockwise ? faceRotationIncrement : -faceRotationIncrement;
-        }
-        else if (faceToRotate == BOTTOM)
+        for (int cubeIdx : RubicsCubeContext::face_to_cube_set[static_cast<int>(faceToRotate)])
         {
-            rotationKey = 'D';
+            quat orientation = slerp(RubicsCubeContext::orientations[cubeIdx],
+                                     RubicsCubeContext::target_orientations[cubeIdx], t);
 
-            for (int cubeIdx : RubicsCubeContext::face_to_cube_set[static_cast<int>(BOTTOM)])
+            if (isDone)
             {
-                RubicsCubeContext::model_view_matrices[cubeIdx] = RotateY(rotateFaceClockwise ? -faceRotationIncrement : faceRotationIncrement) * RubicsCubeContext::model_view_matrices[cubeIdx];
+                orientation = RubicsCubeContext::target_orientations[cubeIdx];
+                RubicsCubeContext::orientations[cubeIdx] = orientation;
             }
 
-            faceRotationAngle += rotateFaceClockwise ? -faceRotationIncrement : faceRotationIncrement;
+            RubicsCubeContext::model_view_matrices[cubeIdx] = Rotate(orientation);
         }
 
-        if (abs(faceRotationAngle) >= 90.0)
+        if (isDone)
         {
             updateFaceIndices(rotationKey);
 
@@ -764,44 +829,93 @@ void timer(int value)
             }
         }
 
-        glutPostRedisplay();
+        if (hasGLContext)
+        {
+            postRedisplay();
+        }
+    }
+}
+
+unsigned simulationChecksum()
+{
+    unsigned hash = hashBytes(&trackball.orientation(), sizeof(quat));
+    hash = hashBytes(RubicsCubeContext::orientations, sizeof(RubicsCubeContext::orientations), hash);
+    return hashBytes(&faceRotationAngle, sizeof(faceRotationAngle), hash);
+}
+
+void timer(int value)
+{
+    PROFILE_FUNCTION();
+
+    tick();
+
+    if (eventLog.isRecording())
+    {
+        eventLog.markStep(numTicks);
+
+        if (numTicks >= nextCheckpoint)
+        {
+            eventLog.record(numTicks, CHECKPOINT_EVENT, simulationChecksum());
+            nextCheckpoint = numTicks + CHECKPOINT_INTERVAL;
+        }
     }
 
     glutTimerFunc(15, timer, 0);
 }
 
+// Without a window there are no timer callbacks: one tick per frame
+void headlessIdle()
+{
+    tick();
+}
+
 //----------------------------------------------------------------------------
 
 void display(void)
 {
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    PROFILE_FUNCTION();
 
-    if (trackballMove && (axis[0] || axis[1] || axis[2]))
     {
-        mat4 rotationMatrix = rotate(angle, vec3(axis[0], axis[1], axis[2]));
+        GPUTimerScope scope(gpuTimer, "cube");
 
-        eye = rotationMatrix * eye;
-        up = rotationMatrix * up;
-        at = rotationMatrix * at;
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-        globalModelView = LookAt(eye, at, up);
+        RubicsCubeContext::render();
     }
 
-    RubicsCubeContext::render();
+    swapBuffers();
+    gpuTimer.endFrame();
 
-    glutSwapBuffers();
+    cullingStats.endFrame();
 }
 //----------------------------------------------------------------------------
 
+void rotateFace(char rotationKey)
+{
+    rotationString = rotationKey;
+
+    initRotation(rotationKey);
+}
+
+void randomRotations(unsigned seed)
+{
+    rotationString = generateRandomRotationString(NUM_RANDOM_ROTATIONS, seed);
+
+    initRotation(rotationString[0]);
+}
+
 void keyboard(unsigned char key, int x, int y)
 {
+    PROFILE_FUNCTION();
+
     if ((key == 'R' || key == 'r') && !isFaceRotating)
     {
-        std::string rotation_string = generateRandomRotationString(NUM_RANDOM_ROTATIONS);
+        std::random_device random_device;
+        unsigned seed = random_device();
 
-        rotationString = rotation_string;
+        eventLog.record(numTicks, RANDOM_ROTATIONS_EVENT, seed);
 
-        initRotation(rotationString[0]);
+        randomRotations(seed);
     }
     else if (key == 'H' | key == 'h')
     {
@@ -819,27 +933,35 @@ void keyboard(unsigned char key, int x, int y)
 
 void mouse(int button, int state, int x, int y)
 {
+    PROFILE_FUNCTION();
+
     bool activeShift = (glutGetModifiers() & GLUT_ACTIVE_SHIFT);
 
     if (button == GLUT_LEFT_BUTTON)
     {
+        eventLog.record(numTicks, MOUSE_EVENT, state, x, y);
+
         switch (state)
         {
         case GLUT_DOWN:
-            startMotion(x, y);
+            trackball.start(x, y);
             break;
         case GLUT_UP:
-            stopMotion(x, y);
+            trackball.stop();
             break;
         }
     }
     else if (state == GLUT_DOWN && button == GLUT_RIGHT_BUTTON && !isFaceRotating)
     {
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
         isPickingOn = true;
 
-        RubicsCubeContext::render();
+        {
+            GPUTimerScope scope(gpuTimer, "picking");
+
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+            RubicsCubeContext::render();
+        }
 
         glFlush();
 
@@ -848,7 +970,7 @@ void mouse(int button, int state, int x, int y)
         unsigned char pixel[4];
         glReadPixels(x, y, 1, 1, GL_RGB, GL_UNSIGNED_BYTE, pixel);
 
-        char rotationKey;
+        char rotationKey = 0;
 
         // White => Top Face is clicked
         if (pixel[0] == 255 && pixel[1] == 255 && pixel[2] == 255)
@@ -880,14 +1002,21 @@ void mouse(int button, int state, int x, int y)
             rotationKey = 'R';
         }
 
+        isPickingOn = false;
+
+        // Clicked outside the cube
+        if (!rotationKey)
+        {
+            return;
+        }
+
         // If Shift is active, rotate counter-clock wise
         rotationKey = activeShift ? tolower(rotationKey) : rotationKey;
 
-        rotationString = rotationKey;
+        // Picking needs the rendered image, so log which face was picked
+        eventLog.record(numTicks, FACE_ROTATION_EVENT, rotationKey);
 
-        isPickingOn = false;
-
-        initRotation(rotationKey);
+        rotateFace(rotationKey);
     }
 }
 
@@ -895,60 +1024,365 @@ void mouse(int button, int state, int x, int y)
 
 void mouseMotion(int x, int y)
 {
-    float curPos[3];
+    PROFILE_FUNCTION();
+
+    eventLog.record(numTicks, MOTION_EVENT, x, y);
+
+    trackball.motion(x, y);
+
+    postRedisplay();
+}
+
+//----------------------------------------------------------------------------
+
+void applyReshape(int w, int h)
+{
+    curWidth = w;
+    curHeight = h;
+
+    trackball.resize(w, h);
+
+    if (hasGLContext)
+    {
+        glViewport(0, 0, w, h);
+    }
+}
+
+void reshape(int w, int h)
+{
+    PROFILE_FUNCTION();
 
-    float dx;
-    float dy;
-    float dz;
+    eventLog.record(numTicks, RESHAPE_EVENT, w, h);
 
-    set_trackball_vector(x, y, curPos);
+    applyReshape(w, h);
+}
+
+//----------------------------------------------------------------------------
+
+// Feed a recorded run back through the same handlers, without a window and
+// as fast as possible, and check the cube ends up as it did when recorded
+int replay(const std::string &path)
+{
+    if (!eventLog.load(path, "rubics_cube"))
+    {
+        std::cerr << "Could not read event log " << path << std::endl;
+        return 1;
+    }
+
+    hasGLContext = false;
+
+    RubicsCubeContext::init();
 
-    if (trackballMove)
+    at = vec4(0.0, 0.0, 0.0, 1.0);
+    eye = camera_pos;
+    up = vec4(0.0, 1.0, 0.0, 1.0);
+
+    globalModelView = LookAt(eye, at, up);
+
+    int numCheckpoints = 0;
+    int numMismatches = 0;
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    for (;;)
     {
-        dx = curPos[0] - lastPos[0];
-        dy = curPos[1] - lastPos[1];
-        dz = curPos[2] - lastPos[2];
+        LogEvent event;
 
-        if (dx || dy || dz)
+        while (eventLog.next(numTicks, event))
         {
-            angle = 90.0 * sqrt(dx * dx + dy * dy + dz * dz);
-            axis[0] = lastPos[1] * curPos[2] - lastPos[2] * curPos[1];
-            axis[1] = lastPos[2] * curPos[0] - lastPos[0] * curPos[2];
-            axis[2] = lastPos[0] * curPos[1] - lastPos[1] * curPos[0];
+            switch (event.type)
+            {
+            case MOUSE_EVENT:
+                if (event.args[0] == GLUT_DOWN)
+                {
+                    trackball.start(event.args[1], event.args[2]);
+                }
+                else
+                {
+                    trackball.stop();
+                }
+                break;
+            case MOTION_EVENT:
+                trackball.motion(event.args[0], event.args[1]);
+                break;
+            case RESHAPE_EVENT:
+                applyReshape(event.args[0], event.args[1]);
+                break;
+            case FACE_ROTATION_EVENT:
+                rotateFace(event.args[0]);
+                break;
+            case RANDOM_ROTATIONS_EVENT:
+                randomRotations(event.args[0]);
+                break;
+            case CHECKPOINT_EVENT:
+                numCheckpoints++;
+
+                if (simulationChecksum() != static_cast<unsigned>(event.args[0]))
+                {
+                    if (numMismatches == 0)
+                    {
+                        std::cout << "Replay diverged from the recording at tick " << event.step << std::endl;
+                    }
+
+                    numMismatches++;
+                }
+                break;
+            }
+        }
 
-            lastPos[0] = curPos[0];
-            lastPos[1] = curPos[1];
-            lastPos[2] = curPos[2];
+        if (numTicks >= eventLog.endStep())
+        {
+            break;
         }
+
+        tick();
     }
 
-    glutPostRedisplay();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::cout << PRINT_DELIMITER << std::endl;
+    std::cout << "Replayed " << numTicks << " ticks and " << eventLog.numEvents() << " events in "
+              << seconds << " s (" << numTicks / seconds << " ticks/sec)" << std::endl;
+    std::cout << numCheckpoints - numMismatches << " of " << numCheckpoints << " checkpoints matched" << std::endl;
+    std::cout << PRINT_DELIMITER << std::endl;
+
+    return numMismatches == 0 ? 0 : 1;
 }
 
 //----------------------------------------------------------------------------
 
-void reshape(int w, int h)
+//----------------------------------------------------------------------------
+
+// Keeps a face turning for the whole benchmark scene
+void benchmarkRotatingIdle()
 {
-    curWidth = w;
-    curHeight = h;
+    static unsigned seed = 1;
 
-    glViewport(0, 0, w, h);
+    tick();
+
+    if (!isFaceRotating)
+    {
+        randomRotations(seed++);
+    }
 }
 
-//----------------------------------------------------------------------------
+// Draw the cube at rest and mid-rotation offscreen for numFrames frames
+// and write the frame-time statistics to outputPath
+int runFrameBenchmark(int numFrames, const std::string &outputPath, const char *baselinePath)
+{
+    FrameBenchmark benchmark("rubics_cube", numFrames);
+
+    std::cout << PRINT_DELIMITER << std::endl;
+
+    benchmark.runScene("cube_static", "triangles", display, headlessIdle);
+    benchmark.runScene("cube_rotating", "triangles", display, benchmarkRotatingIdle);
+
+    std::cout << PRINT_DELIMITER << std::endl;
+
+    if (baselinePath && !benchmark.compare(baselinePath))
+    {
+        std::cerr << "Could not read baseline " << baselinePath << std::endl;
+    }
+
+    if (!benchmark.writeJSON(outputPath, 1024, 1024))
+    {
+        std::cerr << "Could not write " << outputPath << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
+
+// Turn the cube through random rotations on the CPU for numFrames frames,
+// one timer tick per frame, without any GL context; the last frame goes to
+// outputPath when given
+int runSoftwareRenderer(int numFrames, const char *outputPath)
+{
+    hasGLContext = false;
+
+    RubicsCubeContext::init();
+
+    at = vec4(0.0, 0.0, 0.0, 1.0);
+    eye = camera_pos;
+    up = vec4(0.0, 1.0, 0.0, 1.0);
+
+    globalModelView = LookAt(eye, at, up);
+
+    applyReshape(1024, 1024);
+
+    SoftwareRasterizer rasterizer(curWidth, curHeight);
+    rasterizer.state.projection = Perspective(FOV, 1.0, zNear, zFar);
+
+    std::vector<double> times;
+
+    for (int frame = 0; frame < numFrames; frame++)
+    {
+        benchmarkRotatingIdle();
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+        rasterizer.clear(color4(0.0, 0.0, 0.0, 1.0));
+
+        for (size_t i = 0; i < NUM_CUBES; i++)
+        {
+            SoftwareVertexArrays cube(&RubicsCubeContext::points[i][0]);
+            cube.colors = &RubicsCubeContext::colors[i][0];
+
+            rasterizer.state.modelView = globalModelView * RubicsCubeContext::model_view_matrices[i];
+            rasterizer.drawArrays(GL_TRIANGLES, cube, 0, RubicsCubeContext::NUM_VERTICES_PER_CUBE);
+        }
+
+        times.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+
+    FrameTimes frameTimes(times);
+
+    std::cout << PRINT_DELIMITER << std::endl;
+    std::printf("cube_rotating            p50 %8.3f p99 %8.3f max %8.3f ms (%.1f fps)\n",
+                frameTimes.p50, frameTimes.p99, frameTimes.max, 1000.0 / frameTimes.mean);
+    std::cout << PRINT_DELIMITER << std::endl;
+
+    if (outputPath && !rasterizer.savePPM(outputPath))
+    {
+        std::cerr << "Could not write " << outputPath << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
 
 int main(int argc, char **argv)
 {
-    glutInit(&argc, argv);
-    glutInitDisplayMode(GLUT_RGBA | GLUT_DOUBLE | GLUT_DEPTH);
-    glutInitWindowSize(1024, 1024);
-    glutInitWindowPosition(50, 50);
-    glutCreateWindow("Rubic's Cube");
+    // CPU zones are only recorded when built with -DANGEL_PROFILE
+    PROFILE_TRACE_AT_EXIT("rubics_cube_trace.json");
+
+    // Render this many frames offscreen and exit, instead of opening a window
+    int headlessFrames = 0;
+    const char *headlessOutput = NULL;
 
-    glewInit();
+    // Time a fixed set of scenes offscreen instead (--benchmark N)
+    int benchmarkFrames = 0;
+    std::string benchmarkOutput = "rubics_cube_benchmark.json";
+    const char *benchmarkBaseline = NULL;
+
+    bool isGPUTimerOn = false;
+    const char *gpuTimerCSV = NULL;
+
+    // Render on the CPU without any GL context (--software N)
+    int softwareFrames = 0;
+    const char *softwareOutput = NULL;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--record") == 0 && i + 1 < argc)
+        {
+            if (!eventLog.startRecording(argv[++i], "rubics_cube"))
+            {
+                std::cerr << "Could not write event log " << argv[i] << std::endl;
+            }
+        }
+        else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc)
+        {
+            return replay(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--headless") == 0 && i + 1 < argc)
+        {
+            headlessFrames = std::max(1, atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--headless-output") == 0 && i + 1 < argc)
+        {
+            headlessOutput = argv[++i];
+        }
+        else if (strcmp(argv[i], "--benchmark") == 0 && i + 1 < argc)
+        {
+            benchmarkFrames = std::max(1, atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--benchmark-output") == 0 && i + 1 < argc)
+        {
+            benchmarkOutput = argv[++i];
+        }
+        else if (strcmp(argv[i], "--benchmark-baseline") == 0 && i + 1 < argc)
+        {
+            benchmarkBaseline = argv[++i];
+        }
+        else if (strcmp(argv[i], "--gpu-timers") == 0)
+        {
+            isGPUTimerOn = true;
+        }
+        else if (strcmp(argv[i], "--gpu-timers-csv") == 0 && i + 1 < argc)
+        {
+            isGPUTimerOn = true;
+            gpuTimerCSV = argv[++i];
+        }
+        else if (strcmp(argv[i], "--no-culling") == 0)
+        {
+            RubicsCubeContext::isFrustumCullingOn = false;
+        }
+        else if (strcmp(argv[i], "--culling-stats") == 0)
+        {
+            cullingStats.enable(CULLING_STATS_PRINT_INTERVAL);
+        }
+        else if (strcmp(argv[i], "--software") == 0 && i + 1 < argc)
+        {
+            softwareFrames = std::max(1, atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--software-output") == 0 && i + 1 < argc)
+        {
+            softwareOutput = argv[++i];
+        }
+    }
+
+    if (softwareFrames > 0)
+    {
+        return runSoftwareRenderer(softwareFrames, softwareOutput);
+    }
+
+    bool isHeadless = headlessFrames > 0 || benchmarkFrames > 0;
+
+    if (isHeadless)
+    {
+        if (!HeadlessRenderer::get().init(1024, 1024))
+        {
+            return 1;
+        }
+    }
+    else
+    {
+        glutInit(&argc, argv);
+        glutInitDisplayMode(GLUT_RGBA | GLUT_DOUBLE | GLUT_DEPTH);
+        glutInitWindowSize(1024, 1024);
+        glutInitWindowPosition(50, 50);
+        glutCreateWindow("Rubic's Cube");
+
+        glewInit();
+    }
 
     init();
 
+    if (isGPUTimerOn && !gpuTimer.enable(GPU_TIMER_PRINT_INTERVAL, gpuTimerCSV))
+    {
+        std::cerr << "Could not write " << gpuTimerCSV << std::endl;
+    }
+
+    if (isHeadless)
+    {
+        reshape(1024, 1024);
+
+        if (benchmarkFrames > 0)
+        {
+            return runFrameBenchmark(benchmarkFrames, benchmarkOutput, benchmarkBaseline);
+        }
+
+        HeadlessRenderer::get().run(headlessFrames, display, headlessIdle);
+
+        if (headlessOutput && !HeadlessRenderer::get().savePPM(headlessOutput))
+        {
+            std::cerr << "Could not write " << headlessOutput << std::endl;
+        }
+
+        return 0;
+    }
+
     glutDisplayFunc(display);
     glutKeyboardFunc(keyboard);
     glutMouseFunc(mouse);
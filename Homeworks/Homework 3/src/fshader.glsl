@@ -1,5 +1,9 @@
 #version 410
 
+#ifdef GL_ARB_conservative_depth
+#extension GL_ARB_conservative_depth : enable
+#endif
+
 // per-fragment interpolated values from the vertex shader
 in vec3 fN;
 in vec3 fL;
@@ -8,10 +12,42 @@ in vec3 fV;
 in vec2 texCoord2D;
 in float texCoord1D;
 
-uniform sampler2D texMap2D;
-uniform sampler1D texMap1D;
+// Textures of all materials, one layer each
+uniform sampler2DArray TextureLayers;
+uniform int TextureLayer;
+
+// A texture streamed in tiles (texturestream.h): the resident tiles and,
+// per mip level, the pool layer of each tile or -1
+uniform sampler2DArray StreamPool;
+uniform isamplerBuffer StreamPageTable;
+uniform ivec2 StreamBaseSize;
+uniform int StreamTileSize;
+uniform int StreamNumLevels;
+uniform int StreamLevelOffsets[16];
+
+// Texels around each tile in the pool, TextureStreamer::Border
+const int STREAM_BORDER = 1;
 
 in vec4 color;
+in vec4 shadowCoord;
+
+// Compiled with SPHERE_IMPOSTOR defined into a program of its own for the
+// quads the vertex shader draws for spheres to be ray traced in. Only that
+// program writes gl_FragDepth, so meshes keep early depth testing.
+#ifdef SPHERE_IMPOSTOR
+in vec3 impostorPosition;
+flat in vec4 impostorSphere;
+#endif
+
+uniform mat4 ModelView;
+uniform mat4 Projection;
+uniform mat4 ShadowMatrix;
+uniform vec4 LightPosition;
+
+// Point the 1D texture coordinate measures the distance from, as on the mesh
+const vec3 TEXTURE_1D_PLANE = vec3(1.0, 1.0, 1.0);
+
+const float PI = 3.14159265358979;
 
 uniform vec4 AmbientProduct;
 uniform vec4 DiffuseProduct;
@@ -20,39 +56,254 @@ uniform float Shininess;
 
 uniform int ShadeMode;
 
+// Point lights binned into view-space clusters (clusteredlights.h)
+uniform usamplerBuffer ClusterTexture;
+uniform usamplerBuffer LightIndexTexture;
+uniform samplerBuffer PointLightTexture;
+
+uniform int NumPointLights;
+uniform ivec3 ClusterGrid;
+uniform vec4 ClusterParams;
+
+// Depth of the ball as seen from the light
+uniform sampler2DShadow ShadowMap;
+uniform int ShadowsOn;
+
+// Light left in shadow by the shaders without separate lighting terms
+const float SHADOW_DARKNESS = 0.5;
+
 out vec4 fragColor;
 
-void main()
+// Impostors only ever move the depth of their quad towards the eye, which
+// keeps early depth testing where this can be declared
+#if defined(SPHERE_IMPOSTOR) && defined(GL_ARB_conservative_depth)
+layout(depth_less) out float gl_FragDepth;
+#endif
+
+// Fraction of the light reaching this fragment, from 3x3 PCF taps (each
+// filtered 2x2 by the hardware comparison)
+float shadow(vec4 shadowCoord)
+{
+     vec3 coord = shadowCoord.xyz / shadowCoord.w;
+
+     if (ShadowsOn == 0 || any(lessThan(coord, vec3(0.0))) || any(greaterThan(coord, vec3(1.0))))
+     {
+          return 1.0;
+     }
+
+     // The shadow pass offsets the map's depths by their slope, so the
+     // comparison needs no bias of its own
+     vec2 texel = 1.0 / vec2(textureSize(ShadowMap, 0));
+     float lit = 0.0;
+
+     for (int x = -1; x <= 1; x++)
+     {
+          for (int y = -1; y <= 1; y++)
+          {
+               lit += texture(ShadowMap, vec3(coord.xy + vec2(x, y) * texel, coord.z));
+          }
+     }
+
+     return lit / 9.0;
+}
+
+// Diffuse and specular light of the point lights in this fragment's cluster,
+// fading out smoothly at each light's radius
+vec3 pointLights(vec3 N, vec3 V, vec3 pos)
+{
+     ivec3 cell = ivec3(gl_FragCoord.xy * ClusterParams.xy,
+                        log(max(-pos.z, 1e-4)) * ClusterParams.z + ClusterParams.w);
+     cell = clamp(cell, ivec3(0), ClusterGrid - 1);
+
+     uvec2 range = texelFetch(ClusterTexture, (cell.z * ClusterGrid.y + cell.y) * ClusterGrid.x + cell.x).xy;
+
+     vec3 result = vec3(0.0);
+
+     for (uint i = 0u; i < range.y; i++)
+     {
+          int light = int(texelFetch(LightIndexTexture, int(range.x + i)).r);
+
+          vec4 positionRadius = texelFetch(PointLightTexture, 2 * light);
+          vec3 color = texelFetch(PointLightTexture, 2 * light + 1).rgb;
+
+          vec3 L = positionRadius.xyz - pos;
+          float falloff = max(1.0 - dot(L, L) / (positionRadius.w * positionRadius.w), 0.0);
+
+          L = normalize(L);
+
+          float Kd = max(dot(L, N), 0.0);
+          float Ks = (Kd > 0.0) ? pow(max(dot(N, normalize(L + V)), 0.0), Shininess) : 0.0;
+
+          result += falloff * falloff * color * (Kd * DiffuseProduct.rgb + Ks * SpecularProduct.rgb);
+     }
+
+     return result;
+}
+
+// Screen-space derivatives of texture coordinates whose u wraps around the
+// sphere: u is also differentiated shifted by half a turn to see no jump at
+// the seam
+void wrappedGradients(vec2 uv, out vec2 dx, out vec2 dy)
+{
+     dx = dFdx(uv);
+     dy = dFdy(uv);
+
+     float dxSeam = dFdx(fract(uv.x + 0.5)), dySeam = dFdy(fract(uv.x + 0.5));
+
+     if (abs(dxSeam) < abs(dx.x)) dx.x = dxSeam;
+     if (abs(dySeam) < abs(dy.x)) dy.x = dySeam;
+}
+
+// Finest resident level at least as coarse as the footprint of the
+// fragment needs; black until the coarsest tile has arrived
+vec4 streamedTexture(vec2 uv)
+{
+     vec2 size = vec2(StreamBaseSize);
+     vec2 dx, dy;
+     wrappedGradients(uv, dx, dy);
+
+     dx *= size;
+     dy *= size;
+
+     float lod = 0.5 * log2(max(max(dot(dx, dx), dot(dy, dy)), 1.0));
+     vec2 wrapped = vec2(fract(uv.x), clamp(uv.y, 0.0, 1.0));
+
+     for (int level = int(lod); level < StreamNumLevels; level++)
+     {
+          ivec2 levelSize = max(StreamBaseSize >> level, ivec2(1));
+          vec2 p = min(wrapped * vec2(levelSize), vec2(levelSize) - 0.5);
+          ivec2 tile = ivec2(p) / StreamTileSize;
+          int tilesX = (levelSize.x + StreamTileSize - 1) / StreamTileSize;
+          int layer = texelFetch(StreamPageTable, StreamLevelOffsets[level] + tile.y * tilesX + tile.x).r;
+
+          if (layer >= 0)
+          {
+               vec2 local = p - vec2(tile * StreamTileSize) + float(STREAM_BORDER);
+               return texture(StreamPool, vec3(local / float(StreamTileSize + 2 * STREAM_BORDER), layer));
+          }
+     }
+
+     return vec4(0.0, 0.0, 0.0, 1.0);
+}
+
+// Blinn-Phong light from direction L, only ambient where unlit
+vec4 blinnPhong(vec3 N, vec3 V, vec3 L, float lit)
 {
+     vec3 H = normalize(L + V);
+     vec4 ambient = AmbientProduct;
+
+     float Kd = max(dot(L, N), 0.0);
+     vec4 diffuse = Kd * DiffuseProduct;
+
+     float Ks = pow(max(dot(N, H), 0.0), Shininess);
+     vec4 specular = Ks * SpecularProduct;
+
+     // discard the specular highlight if the light's behind the vertex
+     if (dot(L, N) < 0.0)
+          specular = vec4(0.0, 0.0, 0.0, 1.0);
+
+     return ambient + lit * (diffuse + specular);
+}
+
+// Color of a surface point from what the vertex shader passes on, or the
+// ray tracer finds
+vec4 shade(vec3 normal, vec3 toEye, vec3 toLight, vec4 vertexColor, vec2 uv, float u1D, vec4 shadowPosition)
+{
+     vec4 result = vec4(0.0, 0.0, 0.0, 1.0);
+
      // Phong
      if (ShadeMode == 2)
      {
           // Normalize the input lighting vectors
-          vec3 N = normalize(fN);
-          vec3 V = normalize(fV);
-          vec3 L = normalize(fL);
-          vec3 H = normalize(L + V);
-          vec4 ambient = AmbientProduct;
-
-          float Kd = max(dot(L, N), 0.0);
-          vec4 diffuse = Kd * DiffuseProduct;
+          vec3 N = normalize(normal);
+          vec3 V = normalize(toEye);
 
-          float Ks = pow(max(dot(N, H), 0.0), Shininess);
-          vec4 specular = Ks * SpecularProduct;
+          result = blinnPhong(N, V, normalize(toLight), shadow(shadowPosition));
 
-          // discard the specular highlight if the light's behind the vertex
-          if (dot(L, N) < 0.0)
-               specular = vec4(0.0, 0.0, 0.0, 1.0);
+          if (NumPointLights > 0)
+          {
+               // toEye points from the fragment to the eye at the origin
+               result.rgb += pointLights(N, V, -toEye);
+          }
 
-          fragColor = ambient + diffuse + specular;
-          fragColor.a = 1.0;
+          result.a = 1.0;
      }
      else if (ShadeMode == 0 || ShadeMode == 1)
      {
-          fragColor = color;
+          result = vertexColor;
+          result.rgb *= mix(SHADOW_DARKNESS, 1.0, shadow(shadowPosition));
      } else if (ShadeMode == 3) {
-          fragColor = texture2D(texMap2D, texCoord2D);
+          vec2 dx, dy;
+          wrappedGradients(uv, dx, dy);
+          result = textureGrad(TextureLayers, vec3(uv, TextureLayer), dx, dy);
      } else if (ShadeMode == 4) {
-          fragColor = texture1D(texMap1D, texCoord1D);
+          result = texture(TextureLayers, vec3(u1D, 0.5, TextureLayer));
+     } else if (ShadeMode == 5) {
+          result = streamedTexture(uv);
+     }
+
+     return result;
+}
+
+#ifdef SPHERE_IMPOSTOR
+
+// The ray through this fragment hits the sphere of the impostor quad in
+// front; everything the mesh would interpolate comes from the exact point
+// and normal, and the depth is that of the point
+void traceImpostor()
+{
+     vec3 center = impostorSphere.xyz;
+     float radius = impostorSphere.w;
+
+     // Rays leave the eye, or run along -z under orthographic projection
+     bool isOrthographic = Projection[3][3] != 0.0;
+     vec3 origin = isOrthographic ? impostorPosition : vec3(0.0);
+     vec3 direction = isOrthographic ? vec3(0.0, 0.0, -1.0) : normalize(impostorPosition);
+
+     vec3 fromCenter = origin - center;
+     float b = dot(fromCenter, direction);
+     float discriminant = b * b - dot(fromCenter, fromCenter) + radius * radius;
+
+     if (discriminant < 0.0)
+     {
+          discard;
+     }
+
+     vec3 pos = origin + (-b - sqrt(discriminant)) * direction;
+     vec3 N = (pos - center) / radius;
+
+     // The unit sphere point of the mesh; ModelView only rotates and
+     // scales it uniformly
+     vec3 point = normalize(transpose(mat3(ModelView)) * N);
+     vec2 uv = vec2(0.5 + atan(point.z, point.x) / (2.0 * PI), 0.5 - asin(clamp(point.y, -1.0, 1.0)) / PI);
+
+     vec3 toLight = (LightPosition.w != 0.0) ? LightPosition.xyz - pos : LightPosition.xyz;
+     vec4 vertexColor = color;
+
+     // Gouraud as the vertex shader lights it, at every fragment
+     if (ShadeMode == 1)
+     {
+          vertexColor = blinnPhong(N, normalize(-pos), normalize((ModelView * LightPosition).xyz - pos), 1.0);
+          vertexColor.a = 1.0;
      }
-}    
\ No newline at end of file
+
+     fragColor = shade(N, -pos, toLight, vertexColor, uv, length(TEXTURE_1D_PLANE - point),
+                       ShadowMatrix * vec4(pos, 1.0));
+
+     vec4 clip = Projection * vec4(pos, 1.0);
+     gl_FragDepth = 0.5 * (gl_DepthRange.diff * clip.z / clip.w + gl_DepthRange.near + gl_DepthRange.far);
+}
+
+void main()
+{
+     traceImpostor();
+}
+
+#else
+
+void main()
+{
+     fragColor = shade(fN, fV, fL, color, texCoord2D, texCoord1D, shadowCoord);
+}
+
+#endif
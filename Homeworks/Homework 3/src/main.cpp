@@ -1,9 +1,28 @@
 #include "Angel.h"
+#include "physics.h"
+#include "particles.h"
+#include "eventlog.h"
+#include "headless.h"
+#include "framebench.h"
+#include "gputimer.h"
+#include "rasterizer.h"
+#include "lighting.h"
+#include "clusteredlights.h"
+#include "glstate.h"
+#include "renderqueue.h"
+#include "culling.h"
+#include "dynamicbuffer.h"
+#include "vertexformat.h"
+#include "proctexture.h"
+#include "texturestream.h"
 
 #include <iostream>
 #include <fstream>
 #include <vector>
 #include <string>
+#include <cstring>
+#include <cstdlib>
+#include <random>
 
 const std::string PRINT_DELIMITER = "------------------------------------------------------";
 
@@ -16,6 +35,14 @@ const GLfloat INITIAL_HORIZONTAL_SPEED = 0.01;
 const GLfloat INITIAL_VERTICAL_SPEED = -0.015;
 const GLfloat INITIAL_Z_SPEED = -0.01;
 
+// The speeds above are per frame at this rate; the simulation works in seconds
+const GLfloat REFERENCE_FRAME_RATE = 60.0;
+const GLfloat PHYSICS_TIME_STEP = 1.0 / 120.0;
+
+// Used when gravity is toggled on
+const vec3 GRAVITY = vec3(0.0, -2.0, 0.0);
+const GLfloat RESTITUTION = 0.85;
+
 const point4 INITIAL_LIGHT_DIRECTION = vec4(1.0, 1.0, 0.0, 0.0);
 
 const GLfloat SCALE_FACTOR = 0.20;
@@ -30,15 +57,65 @@ const vec3 TEXTURE_1D_PLANE = vec3(1.0, 1.0, 1.0);
 // Need to do this so Bunny faces the camera
 const GLfloat BUNNY_X_ROTATION_ANGLE = -90.0;
 
+// Interpolated ball position for the current frame
 vec3 displacement = TOP_LEFT_FRONT_CORNER;
 
-GLfloat curHorizontalSpeed = INITIAL_HORIZONTAL_SPEED;
-GLfloat curVerticalSpeed = INITIAL_VERTICAL_SPEED;
-GLfloat curZSpeed = INITIAL_Z_SPEED;
+// Ball simulation, stepped at a fixed rate on its own thread
+BallPhysics physics;
+
+// Events that can be recorded with --record and replayed with --replay
+enum LoggedEvent
+{
+    KEY_EVENT = 1,
+    MOUSE_EVENT,
+    RESHAPE_EVENT,
+    MENU_EVENT,
+    BALL_COUNT_EVENT,
+    CHECKPOINT_EVENT
+};
+
+// Simulation steps between recorded checkpoints of the ball state
+const unsigned long long CHECKPOINT_INTERVAL = 120;
+
+EventLog eventLog;
+
+unsigned long long nextCheckpoint = 0;
+
+// While recording, physics is stepped from idle() so every event lands on a known step
+BallPhysics::Clock::time_point lastUpdate;
+
+// False while replaying without a window; GL calls are skipped then
+bool hasGLContext = true;
+
+// GPU time per render pass, enabled with --gpu-timers / --gpu-timers-csv
+GPUTimer gpuTimer;
+
+// Frames between printed GPU pass averages
+const int GPU_TIMER_PRINT_INTERVAL = 120;
+
+// Objects culled and drawn per frame, printed with --culling-stats
+CullingStats cullingStats;
+
+// Frames between printed culling averages
+const int CULLING_STATS_PRINT_INTERVAL = 120;
+
+// Ball meshes in half-float and 10-bit vertex formats, enabled with
+// --packed-vertices
+bool isVertexPackingOn = false;
+
+// --sphere-impostors, toggled with R: spheres are ray traced on one quad
+// each instead of drawn as meshes
+bool isSphereImpostorOn = false;
+
+// --stream-stats
+const int STREAM_STATS_PRINT_INTERVAL = 120;
 
 // Bool for toggling between 2D and 3D
 bool is3D = true;
 
+// Bool for toggling gravity (and energy loss on bounces)
+bool isGravityOn = false;
+
 // Boundaries for the room
 GLfloat leftWallBoundary = -1.0;
 GLfloat rightWallBoundary = 1.0;
@@ -53,6 +130,10 @@ int curHeight;
 int window;
 GLuint PROGRAM;
 
+// The same shaders with SPHERE_IMPOSTOR defined, for the impostor quads
+// alone, as only they write depth from the fragment shader
+GLuint IMPOSTOR_PROGRAM;
+
 color4 VERTEX_COLORS[8] = {
     color4(0.0, 0.0, 0.0, 1.0), // black
     color4(1.0, 0.0, 0.0, 1.0), // red
@@ -91,7 +172,10 @@ enum ShadingMode
     GOURAUD,
     PHONG,
     TEXTURE_2D,
-    TEXTURE_1D
+    TEXTURE_1D,
+
+    // TEXTURE_2D from the tiles of a TextureStreamer
+    STREAMED_TEXTURE
 };
 
 enum MaterialType
@@ -116,6 +200,34 @@ enum DisplayMode
     WIREFRAME
 };
 
+// Meshes and materials the render queue refers to; the meshes up to
+// PARTICLES_MESH follow the order of vao[]
+enum MeshID
+{
+    SPHERE_MESH,
+    BUNNY_MESH,
+    WALLS_MESH,
+    PARTICLES_MESH,
+
+    // Four vertex quads the sphere meshes are ray traced on instead
+    SPHERE_IMPOSTOR_MESH,
+    PARTICLES_IMPOSTOR_MESH,
+
+    NUM_MESHES
+};
+
+enum MaterialID
+{
+    PLAIN_MATERIAL,
+    BASKETBALL_MATERIAL,
+    EARTH_MATERIAL,
+    CHECKERS_MATERIAL,
+    NOISE_MATERIAL,
+    GRADIENT_MATERIAL,
+    STRIPES_MATERIAL,
+    NUM_MATERIALS
+};
+
 BallShape curBallShape = SPHERE;
 DrawColor curDrawColor = COLORFUL;
 ShadingMode curShadeMode = GOURAUD;
@@ -130,12 +242,16 @@ GLuint vao[NUM_SHAPES + 1];
 GLuint ModelView, Projection;
 
 GLuint shadingModeLoc;
-GLuint texMap2DLoc;
-GLuint texMap1DLoc;
+GLuint instanceScaleLoc;
+GLuint sphereImpostorLoc;
+GLuint textureLayersLoc;
+GLuint textureLayerLoc;
 
 mat4 model_view;
 
 void loadModel(std::string path, std::vector<point4> &points, std::vector<vec3> &normals);
+mat4 projectionMatrix();
+void setProjectionMatrix();
 void loadPPM(std::string path, std::vector<GLubyte> &image, int &texHeight, int &texWidth);
 
 // Put object-specific data in namespaces
@@ -143,6 +259,9 @@ namespace wallsContext
 {
     GLuint buffer;
 
+    // Vertex positions, replaced when the window is reshaped
+    DynamicAttribute dynamicPoints;
+
     // A room is implemented as a cube with the front face missing
     // Hence, there will be 36 - 6 = 30 vertices
     const int NumVertices = 30;
@@ -232,11 +351,32 @@ namespace sphereContext
     vec2 texCoords[NumVertices];
     float texCoords1D[NumVertices];
 
-    GLuint sphereTextures[3];
+    // Textures of all materials, one layer each
+    const int TextureLayerSize = 512;
+    TextureArray textures(TextureLayerSize, TextureLayerSize);
+
+    // Layers drawn in TEXTURE_2D mode: basketball, earth, checkers, noise
+    // and gradient, in the order of their materials; earth is streamed
+    // instead and has none
+    const int NumTextures2D = 5;
+    int textureLayers2D[NumTextures2D];
+
+    // Layer drawn in TEXTURE_1D mode
+    int stripeLayer;
+
+    // Entry of textureLayers2D drawn in TEXTURE_2D mode
+    int curTexture2D = 0;
 
+    // Streamed in tiles as the sphere needs them (--earth-texture,
+    // --texture-budget)
     std::string earthTexPath = "earth.ppm";
-    int earthTexHeight, earthTexWidth;
-    std::vector<GLubyte> earthTexImg;
+    const int EarthTileSize = 128;
+    size_t earthTextureBudget = 64 * 1024 * 1024;
+    TextureStreamer earthStream;
+
+    // Tile pool and page table of earthStream
+    const GLuint EarthPoolUnit = 1;
+    const GLuint EarthPageTableUnit = 6;
 
     std::string basketballTexPath = "basketball.ppm";
     int basketballTexHeight, basketballTexWidth;
@@ -247,18 +387,15 @@ namespace sphereContext
 
     GLubyte stripeImage[3 * stripeImageWidth];
 
+    // Red for the first stripeWidth + 1 texels, green for the rest
+    const TexturePattern stripePattern = TexturePattern::stripes(vec3(1.0, 0.0, 0.0), vec3(0.0, 1.0, 0.0), 1,
+                                                                 (stripeWidth + 1.0) / stripeImageWidth);
+
     int Index = 0;
 
     void loadStripeImage()
     {
-        int j;
-
-        for (j = 0; j < stripeImageWidth; j++)
-        {
-            stripeImage[3 * j] = (j <= stripeWidth) ? 255 : 0;
-            stripeImage[3 * j + 1] = (j > stripeWidth) ? 255 : 0;
-            stripeImage[3 * j + 2] = 0;
-        }
+        generateTexture(stripePattern, stripeImageWidth, 1, stripeImage);
     }
 
     void triangle(const point4 &a, const point4 &b, const point4 &c)
@@ -316,8 +453,10 @@ namespace sphereContext
         return t;
     }
 
+    // emit(a, b, c) is called for every triangle of the subdivided sphere
+    template <typename Emit>
     void divide_triangle(const point4 &a, const point4 &b,
-                         const point4 &c, int count)
+                         const point4 &c, int count, Emit emit)
     {
         if (count > 0)
         {
@@ -325,81 +464,72 @@ namespace sphereContext
             point4 v2 = unit(a + c);
             point4 v3 = unit(b + c);
 
-            divide_triangle(a, v1, v2, count - 1);
-            divide_triangle(c, v2, v3, count - 1);
-            divide_triangle(b, v3, v1, count - 1);
-            divide_triangle(v1, v3, v2, count - 1);
+            divide_triangle(a, v1, v2, count - 1, emit);
+            divide_triangle(c, v2, v3, count - 1, emit);
+            divide_triangle(b, v3, v1, count - 1, emit);
+            divide_triangle(v1, v3, v2, count - 1, emit);
         }
         else
         {
-            triangle(a, b, c);
+            emit(a, b, c);
         }
     }
 
-    void tetrahedron(int count)
+    template <typename Emit>
+    void tetrahedron(int count, Emit emit)
     {
+        PROFILE_FUNCTION();
+
         point4 v[4] = {
             vec4(0.0, 0.0, 1.0, 1.0),
             vec4(0.0, 0.942809, -0.333333, 1.0),
             vec4(-0.816497, -0.471405, -0.333333, 1.0),
             vec4(0.816497, -0.471405, -0.333333, 1.0)};
 
-        divide_triangle(v[0], v[1], v[2], count);
-        divide_triangle(v[3], v[2], v[1], count);
-        divide_triangle(v[0], v[3], v[1], count);
-        divide_triangle(v[0], v[2], v[3], count);
+        divide_triangle(v[0], v[1], v[2], count, emit);
+        divide_triangle(v[3], v[2], v[1], count, emit);
+        divide_triangle(v[0], v[3], v[1], count, emit);
+        divide_triangle(v[0], v[2], v[3], count, emit);
     }
 
-    void initTextures()
+    void loadTextureImages()
     {
-        loadPPM(earthTexPath, earthTexImg, earthTexHeight, earthTexWidth);
         loadPPM(basketballTexPath, basketballTexImg, basketballTexHeight, basketballTexWidth);
         loadStripeImage();
+    }
+
+    void initTextures()
+    {
+        loadTextureImages();
 
-        glGenTextures(3, sphereTextures);
+        textureLayers2D[0] = textures.addImage(basketballTexImg.empty() ? NULL : &basketballTexImg[0],
+                                               basketballTexWidth, basketballTexHeight);
+        textureLayers2D[1] = -1;
 
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, sphereTextures[0]);
-        glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-        glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_NEAREST);
-        glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, basketballTexWidth, basketballTexHeight, 0,
-                     GL_RGB, GL_UNSIGNED_BYTE, basketballTexImg.data());
-        glGenerateMipmap(GL_TEXTURE_2D);
-
-        glUniform1i(texMap2DLoc, 0);
+        // Procedural patterns need no image files
+        textureLayers2D[2] = textures.addPattern(TexturePattern::checkers(vec3(0.95, 0.95, 0.95), vec3(0.1, 0.1, 0.1), 8, 4));
+        textureLayers2D[3] = textures.addPattern(TexturePattern::noise(vec3(0.1, 0.25, 0.6), vec3(0.95, 0.95, 1.0), 4, 2, 510));
+        textureLayers2D[4] = textures.addPattern(TexturePattern::gradient(vec3(1.0, 0.85, 0.1), vec3(0.8, 0.1, 0.4)));
 
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, sphereTextures[1]);
-        glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-        glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_NEAREST);
-        glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, earthTexWidth, earthTexHeight, 0,
-                     GL_RGB, GL_UNSIGNED_BYTE, earthTexImg.data());
-        glGenerateMipmap(GL_TEXTURE_2D);
-        glUniform1i(texMap2DLoc, 0);
-
-        glActiveTexture(GL_TEXTURE1);
-        glBindTexture(GL_TEXTURE_1D, sphereTextures[2]);
-        glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-
-        glTexImage1D(GL_TEXTURE_1D, 0, GL_RGB, stripeImageWidth, 0,
-                     GL_RGB, GL_UNSIGNED_BYTE, stripeImage);
-
-        glUniform1i(texMap1DLoc, 1);
+        // The 1D texture coordinate is looked up along the middle row
+        stripeLayer = textures.addPattern(stripePattern);
+
+        textures.upload(0);
+        glUniform1i(textureLayersLoc, 0);
+
+        // Without the image the earth is drawn black
+        if (!earthStream.open(earthTexPath, EarthTileSize))
+        {
+            std::cerr << "Unable to stream " << earthTexPath << std::endl;
+        }
+
+        earthStream.initGL(PROGRAM, EarthPoolUnit, EarthPageTableUnit, earthTextureBudget);
     }
 
     void initSphere()
     {
 
-        tetrahedron(NumTimesToSubdivide);
+        tetrahedron(NumTimesToSubdivide, triangle);
     }
 
 }
@@ -415,11 +545,19 @@ namespace bunnyContext
 
     std::string modelPath = "bunny.off";
 
+    // Radius of a sphere around the model origin holding every vertex
+    GLfloat boundingRadius = 0.0;
+
     void initBunny()
     {
         loadModel("bunny.off", points, normals);
 
         NumVertices = points.size();
+
+        for (const point4 &p : points)
+        {
+            boundingRadius = std::max(boundingRadius, length(vec3(p.x, p.y, p.z)));
+        }
         // colors.resize(NumVertices);
 
         // for (int colorIdx = 0; colorIdx < NumVertices; colorIdx++)
@@ -429,6 +567,271 @@ namespace bunnyContext
     }
 }
 
+// Many balls colliding with each other, drawn with one instanced call
+namespace particlesContext
+{
+    GLuint vao;
+    GLuint meshBuffer;
+
+    // Ball centres of the visible balls, rewritten every frame
+    DynamicAttribute instanceOffsets;
+
+    // Instanced balls use a coarser version of the sphere mesh
+    const int NumTimesToSubdivide = 3;
+
+    std::vector<point4> points;
+    std::vector<vec3> normals;
+
+    int NumVertices;
+
+    // Number of balls, can be set with --balls
+    size_t NumBalls = 1000;
+
+    bool isActive = false;
+
+    ParticleSystem particles;
+
+    BallPhysics::Clock::time_point lastUpdate;
+
+    void initMesh()
+    {
+        sphereContext::tetrahedron(NumTimesToSubdivide, [](const point4 &a, const point4 &b, const point4 &c)
+                                   {
+            vec3 normal = normalize(cross(b - a, c - b));
+
+            points.push_back(a);
+            points.push_back(b);
+            points.push_back(c);
+
+            normals.push_back(normal);
+            normals.push_back(normal);
+            normals.push_back(normal); });
+
+        NumVertices = points.size();
+    }
+
+    // Balls per culling and packing task
+    const size_t PackGrain = 16384;
+
+    // Whether each ball is in view, and how many are per task
+    std::vector<uint8_t> isVisible;
+    std::vector<size_t> numVisible;
+
+    // Ball centres as of now, packed for upload; without a frustum every
+    // ball is packed, with one only those in view. Returns the number of
+    // balls culled.
+    size_t packOffsets(std::vector<vec3> &offsets, const ViewFrustum *frustum)
+    {
+        size_t count = particles.size();
+        size_t numTasks = (count + PackGrain - 1) / PackGrain;
+
+        isVisible.resize(count);
+        numVisible.resize(numTasks + 1);
+
+        GLfloat radius = particles.params().radius;
+
+        parallelFor(numTasks, 1, [&](size_t begin, size_t end)
+                    {
+            for (size_t task = begin; task < end; task++)
+            {
+                size_t first = task * PackGrain;
+                size_t n = std::min(PackGrain, count - first);
+
+                if (frustum)
+                {
+                    numVisible[task] = frustum->cullSpheres(&particles.px[first], &particles.py[first], &particles.pz[first],
+                                                            radius, n, &isVisible[first]);
+                }
+                else
+                {
+                    std::fill(isVisible.begin() + first, isVisible.begin() + first + n, 1);
+                    numVisible[task] = n;
+                }
+            } });
+
+        // Each task's first slot in offsets
+        size_t total = 0;
+
+        for (size_t task = 0; task < numTasks; task++)
+        {
+            size_t n = numVisible[task];
+            numVisible[task] = total;
+            total += n;
+        }
+
+        offsets.resize(total);
+
+        parallelFor(numTasks, 1, [&](size_t begin, size_t end)
+                    {
+            for (size_t task = begin; task < end; task++)
+            {
+                size_t next = numVisible[task];
+                size_t last = std::min((task + 1) * PackGrain, count);
+
+                for (size_t i = task * PackGrain; i < last; i++)
+                {
+                    if (isVisible[i])
+                    {
+                        offsets[next++] = vec3(particles.px[i], particles.py[i], particles.pz[i]);
+                    }
+                }
+            } });
+
+        return count - total;
+    }
+
+    void uploadOffsets(const std::vector<vec3> &offsets)
+    {
+        instanceOffsets.update(offsets.data(), offsets.size() * sizeof(vec3));
+    }
+}
+
+// Coloured point lights drifting through the room, added to Phong shading
+// (--lights N)
+namespace pointLightsContext
+{
+    size_t NumLights = 0;
+
+    const GLfloat LightRadius = 0.4;
+
+    ClusteredLights lights;
+
+    // Each light swings around its own centre
+    std::vector<vec3> centres;
+    std::vector<vec3> amplitudes;
+    std::vector<vec3> frequencies;
+    std::vector<vec3> phases;
+
+    BallPhysics::Clock::time_point startTime;
+
+    void init()
+    {
+        std::mt19937 random(1);
+        std::uniform_real_distribution<GLfloat> uniform(0.0, 1.0);
+
+        vec3 minBounds(leftWallBoundary, bottomWallBoundary, backWallBoundary);
+        vec3 maxBounds(rightWallBoundary, topWallBoundary, frontWallBoundary);
+
+        for (size_t i = 0; i < NumLights; i++)
+        {
+            vec3 t(uniform(random), uniform(random), uniform(random));
+            vec3 centre = minBounds + t * (maxBounds - minBounds);
+
+            vec3 color(uniform(random), uniform(random), uniform(random));
+            color /= std::max(std::max(color.x, color.y), std::max(color.z, 0.01f));
+
+            centres.push_back(centre);
+            amplitudes.push_back(0.3 * vec3(uniform(random), uniform(random), uniform(random)));
+            frequencies.push_back(vec3(0.5) + 1.5 * vec3(uniform(random), uniform(random), uniform(random)));
+            phases.push_back(2.0 * M_PI * vec3(uniform(random), uniform(random), uniform(random)));
+
+            lights.add(centre, LightRadius, color);
+        }
+
+        lights.setDepthRange(zNear, zFar);
+
+        startTime = BallPhysics::Clock::now();
+    }
+
+    // Moves the lights, bins them for the current projection and hands
+    // them to the shaders
+    void update()
+    {
+        PROFILE_FUNCTION();
+
+        GLfloat seconds = std::chrono::duration<double>(BallPhysics::Clock::now() - startTime).count();
+
+        for (size_t i = 0; i < lights.size(); i++)
+        {
+            lights.px[i] = centres[i].x + amplitudes[i].x * std::sin(frequencies[i].x * seconds + phases[i].x);
+            lights.py[i] = centres[i].y + amplitudes[i].y * std::sin(frequencies[i].y * seconds + phases[i].y);
+            lights.pz[i] = centres[i].z + amplitudes[i].z * std::sin(frequencies[i].z * seconds + phases[i].z);
+        }
+
+        // Room coordinates are eye coordinates
+        lights.build(mat4(), projectionMatrix(), curWidth, curHeight);
+
+        // Units 0 and 1 hold the 2D and 1D textures
+        lights.upload(PROGRAM, 2);
+    }
+}
+
+// Gouraud lighting of the ball evaluated once on the CPU and drawn as vertex
+// colors, for as long as the light and material stay the same
+namespace lightBakeContext
+{
+    // Can be turned off with --no-light-bake
+    bool isEnabled = true;
+
+    // Baked colors, bound to vColor in the sphere and bunny VAOs
+    GLuint buffers[NUM_SHAPES];
+
+    // Whether buffers[shape] holds the current lighting
+    bool isValid[NUM_SHAPES] = {false, false};
+
+    std::vector<color4> colors;
+
+    void invalidate()
+    {
+        std::fill(isValid, isValid + NUM_SHAPES, false);
+    }
+
+    // A light moving with the object has to be lit per frame
+    bool isActive()
+    {
+        return isEnabled && curShadeMode == GOURAUD && curLightMovementMode == FIXED;
+    }
+
+    // The ball is baked as lit in the middle of the room; the shading then
+    // stays put on the ball as it moves
+    mat4 modelView(BallShape shape)
+    {
+        vec3 centre(0.0, 0.0, 0.5 * (backWallBoundary + frontWallBoundary));
+        mat4 result = Translate(centre) * Scale(SCALE_FACTOR, SCALE_FACTOR, SCALE_FACTOR);
+
+        return (shape == BUNNY) ? result * RotateX(BUNNY_X_ROTATION_ANGLE) : result;
+    }
+
+    void allocate(int numVertices[NUM_SHAPES])
+    {
+        glGenBuffers(NUM_SHAPES, buffers);
+
+        for (int shape = 0; shape < NUM_SHAPES; shape++)
+        {
+            glBindBuffer(GL_ARRAY_BUFFER, buffers[shape]);
+            glBufferData(GL_ARRAY_BUFFER, numVertices[shape] * sizeof(color4), NULL, GL_STATIC_DRAW);
+        }
+    }
+
+    // Lights every vertex of the shape in parallel and uploads the colors,
+    // unless they are still valid
+    void update(BallShape shape, const LightingModel &model, const vec4 &lightPosition)
+    {
+        if (isValid[shape])
+        {
+            return;
+        }
+
+        PROFILE_FUNCTION();
+
+        const point4 *points = (shape == SPHERE) ? sphereContext::points : &bunnyContext::points[0];
+        const vec3 *normals = (shape == SPHERE) ? sphereContext::normals : &bunnyContext::normals[0];
+        size_t numVertices = (shape == SPHERE) ? sphereContext::NumVertices : bunnyContext::NumVertices;
+
+        colors.resize(numVertices);
+
+        mat4 bakeModelView = modelView(shape);
+
+        parallelFor(numVertices, 4096, [&](size_t begin, size_t end)
+                    { lightVertices(points + begin, normals + begin, end - begin, bakeModelView, lightPosition, model, &colors[begin]); });
+
+        GLStateCache::get().bindBuffer(GL_ARRAY_BUFFER, buffers[shape]);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, numVertices * sizeof(color4), &colors[0]);
+
+        isValid[shape] = true;
+    }
+}
+
 namespace MaterialInfo
 {
     color4 material_ambient;
@@ -478,6 +881,8 @@ namespace MaterialInfo
             material_specular = color4(0.04, 0.7, 0.7, 1.0);
             material_shininess = 10.0;
         }
+
+        lightBakeContext::invalidate();
     }
 }
 
@@ -497,11 +902,15 @@ namespace LightInfo
     bool isDiffuseOn = true;
     bool isSpecularOn = true;
 
+    color4 ambientProduct() { return isAmbientOn ? light_ambient * MaterialInfo::material_ambient : 0.0; }
+    color4 diffuseProduct() { return isDiffuseOn ? light_diffuse * MaterialInfo::material_diffuse : 0.0; }
+    color4 specularProduct() { return isSpecularOn ? light_specular * MaterialInfo::material_specular : 0.0; }
+
     void updateLightingComponents()
     {
-        color4 ambient_product = isAmbientOn ? light_ambient * MaterialInfo::material_ambient : 0.0;
-        color4 diffuse_product = isDiffuseOn ? light_diffuse * MaterialInfo::material_diffuse : 0.0;
-        color4 specular_product = isSpecularOn ? light_specular * MaterialInfo::material_specular : 0.0;
+        color4 ambient_product = ambientProduct();
+        color4 diffuse_product = diffuseProduct();
+        color4 specular_product = specularProduct();
 
         glUniform4fv(glGetUniformLocation(PROGRAM, "AmbientProduct"),
                      1, ambient_product);
@@ -515,11 +924,213 @@ namespace LightInfo
 
         glUniform1f(glGetUniformLocation(PROGRAM, "Shininess"),
                     MaterialInfo::material_shininess);
+
+        lightBakeContext::invalidate();
+    }
+}
+
+// Shadow of the ball on the room and itself, from the light the ball is
+// shaded with
+namespace shadowContext
+{
+    // Can be turned off with --no-shadows
+    bool isEnabled = true;
+
+    const int MapSize = 1024;
+
+    // After the 2D / 1D textures and the point light buffer textures
+    const int TextureUnit = 5;
+
+    GLuint framebuffer;
+    GLuint depthTexture;
+
+    GLuint shadowMatrixLoc;
+    GLuint shadowsOnLoc;
+
+    // Everything the shadow map depends on, as of the last shadow pass
+    struct Key
+    {
+        mat4 objectModelView;
+        vec4 light;
+        vec4 room;
+        int shape;
+    };
+
+    Key lastKey;
+    bool isValid = false;
+
+    // Shadow passes rendered and skipped so far
+    unsigned long long numRendered = 0;
+    unsigned long long numSkipped = 0;
+
+    void init()
+    {
+        glGenTextures(1, &depthTexture);
+        glActiveTexture(GL_TEXTURE0 + TextureUnit);
+        glBindTexture(GL_TEXTURE_2D, depthTexture);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, MapSize, MapSize, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+
+        // Linear filtering of a compared depth texture gives 2x2 PCF per tap
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+        glActiveTexture(GL_TEXTURE0);
+
+        glGenFramebuffers(1, &framebuffer);
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depthTexture, 0);
+        glDrawBuffer(GL_NONE);
+        glReadBuffer(GL_NONE);
+        glBindFramebuffer(GL_FRAMEBUFFER, windowFramebuffer());
+
+        glUniform1i(glGetUniformLocation(PROGRAM, "ShadowMap"), TextureUnit);
+
+        shadowMatrixLoc = glGetUniformLocation(PROGRAM, "ShadowMatrix");
+        shadowsOnLoc = glGetUniformLocation(PROGRAM, "ShadowsOn");
+    }
+
+    // Depth bias of the shadow pass, in slopes and depth units, so a
+    // surface does not shadow itself where the map samples it
+    const GLfloat OffsetFactor = 2.0;
+    const GLfloat OffsetUnits = 4.0;
+
+    // The light as the shaders see it on the ball, in eye coordinates.
+    // Phong takes LightPosition as it is; Gouraud lights from the point
+    // ModelView * LightPosition, and the baked colors from that point as
+    // it was when the ball sat where it is baked.
+    vec4 ballLight(ShadingMode shadeMode, bool isBaked, BallShape shape, const mat4 &objectModelView)
+    {
+        vec4 light = LightInfo::light_direction;
+
+        if (shadeMode == PHONG)
+        {
+            return light;
+        }
+
+        if (isBaked)
+        {
+            mat4 bakeModelView = lightBakeContext::modelView(shape);
+            vec4 moved = objectModelView * vec4(0.0, 0.0, 0.0, 1.0) - bakeModelView * vec4(0.0, 0.0, 0.0, 1.0);
+            vec4 point = bakeModelView * light + moved;
+
+            return vec4(point.x, point.y, point.z, 1.0);
+        }
+
+        vec4 point = objectModelView * light;
+
+        return vec4(point.x, point.y, point.z, 1.0);
+    }
+
+    // A directional light sees the whole room orthographically, so the map
+    // stays put while the ball moves. A point light sees the ball through
+    // the narrowest frustum around it, out to the far side of the room:
+    // nothing outside that cone is in the ball's shadow.
+    mat4 lightViewProjection(const vec4 &light, const vec3 &ballCentre, GLfloat ballRadius)
+    {
+        vec3 minBounds(leftWallBoundary, bottomWallBoundary, backWallBoundary);
+        vec3 maxBounds(rightWallBoundary, topWallBoundary, frontWallBoundary);
+
+        vec3 centre = 0.5 * (minBounds + maxBounds);
+        GLfloat radius = 0.5 * length(maxBounds - minBounds);
+
+        if (light.w == 0.0)
+        {
+            vec3 direction = normalize(vec3(light.x, light.y, light.z));
+
+            // Any up vector not parallel to the light
+            vec4 up = (std::fabs(direction.y) < 0.99) ? vec4(0.0, 1.0, 0.0, 0.0) : vec4(1.0, 0.0, 0.0, 0.0);
+
+            mat4 view = LookAt(vec4(centre + radius * direction, 1.0), vec4(centre, 1.0), up);
+
+            return Ortho(-radius, radius, -radius, radius, 0.0, 2.0 * radius) * view;
+        }
+
+        vec3 position(light.x, light.y, light.z);
+        vec3 toBall = ballCentre - position;
+        GLfloat distance = length(toBall);
+        vec3 direction = toBall / distance;
+
+        vec4 up = (std::fabs(direction.y) < 0.99) ? vec4(0.0, 1.0, 0.0, 0.0) : vec4(1.0, 0.0, 0.0, 0.0);
+        mat4 view = LookAt(vec4(position, 1.0), vec4(ballCentre, 1.0), up);
+
+        // Half the angle the ball spans, short of a light inside it
+        GLfloat halfAngle = std::asin(std::min(ballRadius / distance, GLfloat(0.95)));
+        GLfloat zNearLight = std::max(distance - ballRadius, GLfloat(0.01));
+        GLfloat zFarLight = length(centre - position) + radius;
+
+        return Perspective(2.0 * halfAngle * 180.0 / M_PI, 1.0, zNearLight, zFarLight) * view;
+    }
+
+    // Renders the ball's depth as seen from light, unless neither the
+    // light, the ball nor the room changed since the last pass. Leaves
+    // the window framebuffer bound.
+    void update(BallShape shape, const mat4 &objectModelView, const vec4 &light, int numVertices)
+    {
+        Key key;
+        key.objectModelView = objectModelView;
+        key.light = light;
+        key.room = vec4(leftWallBoundary, rightWallBoundary, bottomWallBoundary, topWallBoundary);
+        key.shape = shape;
+
+        vec4 centre = objectModelView * vec4(0.0, 0.0, 0.0, 1.0);
+        GLfloat radius = SCALE_FACTOR * ((shape == SPHERE) ? 1.0 : bunnyContext::boundingRadius);
+
+        mat4 lightMatrix = lightViewProjection(light, vec3(centre.x, centre.y, centre.z), radius);
+
+        // Light clip coordinates to texture coordinates and depth in [0, 1]
+        mat4 shadowMatrix = Translate(0.5, 0.5, 0.5) * Scale(0.5, 0.5, 0.5) * lightMatrix;
+
+        GLStateCache &cache = GLStateCache::get();
+        cache.uniformMatrix4fv(shadowMatrixLoc, shadowMatrix);
+
+        if (isValid && std::memcmp(&key, &lastKey, sizeof(Key)) == 0)
+        {
+            numSkipped++;
+            return;
+        }
+
+        PROFILE_FUNCTION();
+        GPUTimerScope scope(gpuTimer, "shadow");
+
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        glViewport(0, 0, MapSize, MapSize);
+        glClear(GL_DEPTH_BUFFER_BIT);
+
+        // Back faces only, so the lit side of the ball does not shadow
+        // itself, pushed back by their slope for the unlit side
+        glCullFace(GL_FRONT);
+        glEnable(GL_POLYGON_OFFSET_FILL);
+        glPolygonOffset(OffsetFactor, OffsetUnits);
+
+        cache.uniformMatrix4fv(Projection, lightMatrix);
+        cache.uniformMatrix4fv(ModelView, objectModelView);
+        cache.uniform1i(shadingModeLoc, NONE);
+        cache.uniform1i(shadowsOnLoc, 0);
+        cache.uniform1f(instanceScaleLoc, 0.0);
+        cache.uniform1i(sphereImpostorLoc, 0);
+
+        cache.bindVertexArray(vao[shape]);
+        glDrawArrays(GL_TRIANGLES, 0, numVertices);
+
+        glDisable(GL_POLYGON_OFFSET_FILL);
+        glCullFace(GL_BACK);
+        glBindFramebuffer(GL_FRAMEBUFFER, windowFramebuffer());
+        glViewport(0, 0, curWidth, curHeight);
+        setProjectionMatrix();
+
+        lastKey = key;
+        isValid = true;
+        numRendered++;
     }
 }
 
 void loadModel(std::string path, std::vector<point4> &points, std::vector<vec3> &normals)
 {
+    PROFILE_FUNCTION();
+
     std::string line;
     std::ifstream modelFile(path);
 
@@ -598,6 +1209,8 @@ void loadModel(std::string path, std::vector<point4> &points, std::vector<vec3>
 
 void loadPPM(std::string path, std::vector<GLubyte> &image, int &texHeight, int &texWidth)
 {
+    PROFILE_FUNCTION();
+
     std::string line;
     std::ifstream ppmFile(path);
 
@@ -639,14 +1252,15 @@ void loadPPM(std::string path, std::vector<GLubyte> &image, int &texHeight, int
     }
 }
 
-void menu(int num)
+void applyMenu(int num)
 {
-    if (num == 0)
+    // Menu entries only change how the scene is drawn
+    if (!hasGLContext)
     {
-        glutDestroyWindow(window);
-        exit(0);
+        return;
     }
-    else if (num == 1)
+
+    if (num == 1)
     {
         curShadeMode = GOURAUD;
     }
@@ -689,13 +1303,13 @@ void menu(int num)
     {
         curDisplayMode = WIREFRAME;
 
-        glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+        GLStateCache::get().polygonMode(GL_LINE);
     }
     else if (num == 9)
     {
         if (curDisplayMode == WIREFRAME)
         {
-            glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+            GLStateCache::get().polygonMode(GL_FILL);
         }
 
         curDisplayMode = SHADING;
@@ -706,43 +1320,45 @@ void menu(int num)
     {
         if (curDisplayMode == WIREFRAME)
         {
-            glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+            GLStateCache::get().polygonMode(GL_FILL);
         }
 
         curDisplayMode = TEXTURE;
         curShadeMode = TEXTURE_2D;
-
-        glUniform1i(shadingModeLoc, static_cast<int>(curShadeMode));
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, sphereContext::sphereTextures[0]);
+        sphereContext::curTexture2D = 0;
     }
     else if (num == 11)
     {
         if (curDisplayMode == WIREFRAME)
         {
-            glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+            GLStateCache::get().polygonMode(GL_FILL);
         }
 
         curDisplayMode = TEXTURE;
         curShadeMode = TEXTURE_2D;
-
-        glUniform1i(shadingModeLoc, static_cast<int>(curShadeMode));
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, sphereContext::sphereTextures[1]);
+        sphereContext::curTexture2D = 1;
     }
     else if (num == 12)
     {
         if (curDisplayMode == WIREFRAME)
         {
-            glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+            GLStateCache::get().polygonMode(GL_FILL);
         }
 
         curDisplayMode = TEXTURE;
         curShadeMode = TEXTURE_1D;
+    }
+    else if (num >= 18 && num <= 20)
+    {
+        if (curDisplayMode == WIREFRAME)
+        {
+            GLStateCache::get().polygonMode(GL_FILL);
+        }
 
-        glUniform1i(shadingModeLoc, static_cast<int>(curShadeMode));
-        glActiveTexture(GL_TEXTURE1);
-        glBindTexture(GL_TEXTURE_1D, sphereContext::sphereTextures[2]);
+        // Procedural textures follow the two images
+        curDisplayMode = TEXTURE;
+        curShadeMode = TEXTURE_2D;
+        sphereContext::curTexture2D = num - 16;
     }
 
     else if (num == 13)
@@ -776,8 +1392,23 @@ void menu(int num)
         LightInfo::light_direction = model_view * LightInfo::light_direction;
         LightInfo::updateLightingComponents();
     }
+}
+
+void menu(int num)
+{
+    PROFILE_FUNCTION();
+
+    if (num == 0)
+    {
+        glutDestroyWindow(window);
+        exit(0);
+    }
+
+    eventLog.record(physics.stepCount(), MENU_EVENT, num);
+
+    applyMenu(num);
 
-    glutPostRedisplay();
+    postRedisplay();
 }
 
 void createMenu(void)
@@ -799,6 +1430,9 @@ void createMenu(void)
     glutAddMenuEntry("Texture (Basketball)", 10);
     glutAddMenuEntry("Texture (Earth)", 11);
     glutAddMenuEntry("Texture (1D)", 12);
+    glutAddMenuEntry("Texture (Checkers)", 18);
+    glutAddMenuEntry("Texture (Noise)", 19);
+    glutAddMenuEntry("Texture (Gradient)", 20);
 
     int light_components_submenu = glutCreateMenu(menu);
     glutAddMenuEntry("Toggle Ambient", 13);
@@ -822,13 +1456,81 @@ void createMenu(void)
     glutAttachMenu(GLUT_RIGHT_BUTTON);
 }
 
-// For setting the projection matrix when toggling between 2D and 3D
-void setProjectionMatrix()
+BallState initialBallState()
 {
-    mat4 projection;
+    BallState state;
+    state.position = TOP_LEFT_FRONT_CORNER;
+    state.velocity = vec3(INITIAL_HORIZONTAL_SPEED, INITIAL_VERTICAL_SPEED, is3D ? INITIAL_Z_SPEED : 0.0) * REFERENCE_FRAME_RATE;
+    return state;
+}
 
-    // Calculating the aspect ratio
-    GLfloat aspect = (GLfloat)curWidth / (GLfloat)curHeight;
+PhysicsParams currentPhysicsParams()
+{
+    PhysicsParams params;
+    params.timeStep = PHYSICS_TIME_STEP;
+    params.gravity = isGravityOn ? GRAVITY : vec3(0.0);
+    params.restitution = isGravityOn ? RESTITUTION : 1.0;
+    params.radius = BALL_RADIUS;
+    params.minBounds = vec3(leftWallBoundary, bottomWallBoundary, backWallBoundary);
+    params.maxBounds = vec3(rightWallBoundary, topWallBoundary, frontWallBoundary);
+    params.bounceZ = is3D;
+    return params;
+}
+
+PhysicsParams particlePhysicsParams()
+{
+    PhysicsParams params = currentPhysicsParams();
+    params.radius = ParticleSystem::radiusFor(particlesContext::NumBalls, params.minBounds, params.maxBounds);
+    return params;
+}
+
+void spawnParticles()
+{
+    PhysicsParams params = particlePhysicsParams();
+    GLfloat speed = length(initialBallState().velocity);
+
+    particlesContext::particles.spawn(particlesContext::NumBalls, params, speed);
+    particlesContext::lastUpdate = BallPhysics::Clock::now();
+}
+
+// Step the particle system at full speed and report steps per second
+void runParticleBenchmark()
+{
+    const size_t BALL_COUNTS[] = {10000, 100000, 1000000};
+    const double SECONDS_PER_COUNT = 2.0;
+
+    std::cout << PRINT_DELIMITER << std::endl;
+    std::cout << "Particle benchmark (" << ThreadPool::global().size() << " threads)" << std::endl;
+
+    for (size_t numBalls : BALL_COUNTS)
+    {
+        particlesContext::NumBalls = numBalls;
+        spawnParticles();
+
+        BallPhysics::Clock::time_point start = BallPhysics::Clock::now();
+        double elapsed = 0.0;
+        int numSteps = 0;
+
+        while (elapsed < SECONDS_PER_COUNT || numSteps < 3)
+        {
+            particlesContext::particles.step();
+            numSteps++;
+            elapsed = std::chrono::duration<double>(BallPhysics::Clock::now() - start).count();
+        }
+
+        std::cout << numBalls << " balls: " << numSteps / elapsed << " steps/sec" << std::endl;
+    }
+
+    std::cout << PRINT_DELIMITER << std::endl;
+}
+
+// For setting the projection matrix when toggling between 2D and 3D
+mat4 projectionMatrix()
+{
+    mat4 projection;
+
+    // Calculating the aspect ratio
+    GLfloat aspect = (GLfloat)curWidth / (GLfloat)curHeight;
 
     // Use perspective projection if 3D
     // Orthographic if 2D
@@ -843,7 +1545,12 @@ void setProjectionMatrix()
                                            : Ortho(-1.0 * aspect, 1.0 * aspect, -1.0, 1.0, zNear, zFar);
     }
 
-    glUniformMatrix4fv(Projection, 1, GL_TRUE, projection);
+    return projection;
+}
+
+void setProjectionMatrix()
+{
+    GLStateCache::get().uniformMatrix4fv(Projection, projectionMatrix());
 }
 
 void toggleColor(point4 colors[], int numVertices)
@@ -864,10 +1571,288 @@ void toggleColor(point4 colors[], int numVertices)
     }
 }
 
+// Model-view matrix of a ball shape at position
+mat4 ballModelView(BallShape shape, const vec3 &position)
+{
+    mat4 result = Translate(position) * Scale(SCALE_FACTOR, SCALE_FACTOR, SCALE_FACTOR);
+
+    // Bunny is rotated so it faces the camera
+    return (shape == BUNNY) ? result * RotateX(BUNNY_X_ROTATION_ANGLE) : result;
+}
+
+// Pixels the earth texture spans across at the current projection: the
+// sphere's circumference, pi times its diameter on screen
+GLfloat earthScreenWidth(const mat4 &modelView)
+{
+    GLfloat depth = -(modelView * vec4(0.0, 0.0, 0.0, 1.0)).z;
+    GLfloat diameter = 2.0 * SCALE_FACTOR * projectionMatrix()[1][1] * 0.5 * curHeight;
+
+    if (is3D)
+    {
+        diameter /= std::max(depth, zNear);
+    }
+
+    return M_PI * diameter;
+}
+
+// Whether part of the tile of the sphere's texture from uvMin to uvMax faces
+// the eye, in direction toEye from the center; the texture coordinates are
+// those sphereContext::triangle() gives
+bool isEarthTileVisible(const vec3 &toEye, const vec2 &uvMin, const vec2 &uvMax)
+{
+    GLfloat eyeLongitude = atan2(toEye.z, toEye.x);
+    GLfloat eyeLatitude = asin(std::min(std::max(toEye.y, -1.0f), 1.0f));
+
+    // Cosine of the longitude in the tile closest to the eye's
+    GLfloat minLongitude = 2.0 * M_PI * (uvMin.x - 0.5);
+    GLfloat maxLongitude = 2.0 * M_PI * (uvMax.x - 0.5);
+    GLfloat offset = remainder(eyeLongitude - minLongitude, 2.0 * M_PI);
+
+    if (offset < 0.0)
+    {
+        offset += 2.0 * M_PI;
+    }
+
+    GLfloat closest = (offset <= maxLongitude - minLongitude)
+                          ? 1.0
+                          : std::max(cos(eyeLongitude - minLongitude), cos(eyeLongitude - maxLongitude));
+
+    // The dot product with toEye over the tile's latitudes peaks at
+    // latitude peak
+    GLfloat peak = atan2(sin(eyeLatitude), cos(eyeLatitude) * closest);
+    GLfloat latitude = std::min(std::max(peak, GLfloat(M_PI * (0.5 - uvMax.y))), GLfloat(M_PI * (0.5 - uvMin.y)));
+
+    // A little past the silhouette, so tiles are there before they turn
+    // into view
+    return cos(latitude) * cos(eyeLatitude) * closest + sin(latitude) * sin(eyeLatitude) > -0.1;
+}
+
+// While the light is fixed, Gouraud lighting comes baked into the vertex
+// colors of the ball; re-bakes them for shape if they are out of date
+void updateLightBake(BallShape shape)
+{
+    LightingModel model;
+    model.ambientProduct = LightInfo::ambientProduct();
+    model.diffuseProduct = LightInfo::diffuseProduct();
+    model.specularProduct = LightInfo::specularProduct();
+    model.shininess = MaterialInfo::material_shininess;
+
+    lightBakeContext::update(shape, model, LightInfo::light_direction);
+}
+
+// Each frame is recorded into a render queue of draw packets, built on a
+// worker thread one frame ahead of its submission in display()
+// (--no-render-thread builds it in display() instead)
+namespace renderQueueContext
+{
+    bool isThreaded = true;
+
+    // Objects outside the view are left out of the queue, unless --no-culling
+    bool isFrustumCullingOn = true;
+
+    // Everything the draws of a frame depend on, captured on the GL thread
+    struct Scene
+    {
+        bool isWallsVisible;
+        ShadingMode wallsShadeMode;
+
+        bool isBallVisible;
+        BallShape ballShape;
+        vec3 ballPosition;
+        ShadingMode ballShadeMode;
+        MaterialID ballMaterial;
+
+        // Ball colors come from the light bake, which the GL thread keeps current
+        bool isLightBaked;
+
+        // Spheres, single or instanced, are drawn as impostors
+        bool isSphereImpostor;
+
+        bool isParticles;
+        ShadingMode particlesShadeMode;
+        GLfloat particleRadius;
+
+        // Room coordinates of the instanced balls in view
+        std::vector<vec3> particleOffsets;
+    };
+
+    // Scene of the frame being captured
+    Scene current;
+
+    RenderMesh meshes[NUM_MESHES];
+
+    // Each material is followed, NUM_MATERIALS on, by its twin drawing
+    // with IMPOSTOR_PROGRAM
+    RenderMaterial materials[2 * NUM_MATERIALS];
+
+    // Keeps IMPOSTOR_PROGRAM on the uniforms everything else sets on PROGRAM
+    UniformMirror impostorUniforms;
+
+    RenderPipeline<Scene> pipeline;
+
+    void capture(Scene &scene)
+    {
+        // Room coordinates are eye coordinates
+        ViewFrustum frustum(projectionMatrix());
+
+        // The walls span z in [-1, 1] before they are moved back by 2
+        vec3 roomMin(leftWallBoundary, bottomWallBoundary, -3.0);
+        vec3 roomMax(rightWallBoundary, topWallBoundary, -1.0);
+
+        scene.isWallsVisible = !isFrustumCullingOn || frustum.isBoxVisible(roomMin, roomMax);
+        scene.wallsShadeMode = wallsContext::shadeMode;
+
+        cullingStats.addObjects(1);
+        cullingStats.addFrustumCulled(!scene.isWallsVisible);
+        cullingStats.addDrawn(scene.isWallsVisible);
+
+        scene.ballShape = curBallShape;
+        scene.ballPosition = displacement;
+        scene.isSphereImpostor = isSphereImpostorOn;
+
+        // Impostors have no vertices to bake the light into, they light
+        // every fragment instead
+        scene.isLightBaked = lightBakeContext::isActive() && !(scene.isSphereImpostor && scene.ballShape == SPHERE);
+        scene.ballShadeMode = scene.isLightBaked ? NONE : curShadeMode;
+
+        if (scene.ballShadeMode == TEXTURE_2D)
+        {
+            scene.ballMaterial = MaterialID(BASKETBALL_MATERIAL + sphereContext::curTexture2D);
+
+            if (scene.ballMaterial == EARTH_MATERIAL)
+            {
+                scene.ballShadeMode = STREAMED_TEXTURE;
+            }
+        }
+        else
+        {
+            scene.ballMaterial = (scene.ballShadeMode == TEXTURE_1D) ? STRIPES_MATERIAL : PLAIN_MATERIAL;
+        }
+
+        scene.isParticles = particlesContext::isActive;
+
+        if (scene.isParticles)
+        {
+            // Instanced mesh only carries normals, so texture modes fall back to Gouraud
+            scene.particlesShadeMode = (curShadeMode == PHONG) ? PHONG : GOURAUD;
+            scene.particleRadius = particlesContext::particles.params().radius;
+
+            size_t numCulled = particlesContext::packOffsets(scene.particleOffsets, isFrustumCullingOn ? &frustum : NULL);
+
+            cullingStats.addObjects(particlesContext::particles.size());
+            cullingStats.addFrustumCulled(numCulled);
+            cullingStats.addDrawn(scene.particleOffsets.size());
+        }
+        else
+        {
+            scene.particleOffsets.clear();
+
+            // Also holds the bunny, whichever way it is rotated
+            GLfloat radius = SCALE_FACTOR * ((scene.ballShape == SPHERE) ? 1.0 : bunnyContext::boundingRadius);
+
+            scene.isBallVisible = !isFrustumCullingOn || frustum.isSphereVisible(scene.ballPosition, radius);
+
+            cullingStats.addObjects(1);
+            cullingStats.addFrustumCulled(!scene.isBallVisible);
+            cullingStats.addDrawn(scene.isBallVisible);
+        }
+    }
+
+    // Runs on the worker thread, so only reads scene
+    void build(const Scene &scene, RenderQueue &queue)
+    {
+        PROFILE_FUNCTION();
+
+        // Render the walls first, then the objects
+        // Translate back a bit so that scene is visible
+        // Scaling should only apply to objects (so (1.0, 1.0, 1.0) is used for the scale matrix)
+        if (scene.isWallsVisible)
+        {
+            queue.record(WALLS_MESH, PLAIN_MATERIAL, Translate(vec3(0.0, 0.0, -2.0)) * Scale(1.0, 1.0, 1.0),
+                         scene.wallsShadeMode);
+        }
+
+        if (scene.isParticles)
+        {
+            // Instance offsets are already in room coordinates
+            DrawPacket &packet = queue.record(scene.isSphereImpostor ? PARTICLES_IMPOSTOR_MESH : PARTICLES_MESH,
+                                              PLAIN_MATERIAL + (scene.isSphereImpostor ? NUM_MATERIALS : 0), mat4(),
+                                              scene.particlesShadeMode);
+            packet.numInstances = scene.particleOffsets.size();
+            packet.instanceScale = scene.particleRadius;
+            packet.isSphereImpostor = scene.isSphereImpostor;
+        }
+        else if (scene.isBallVisible)
+        {
+            bool isImpostor = scene.isSphereImpostor && scene.ballShape == SPHERE;
+
+            DrawPacket &packet = queue.record(isImpostor ? SPHERE_IMPOSTOR_MESH : MeshID(scene.ballShape),
+                                              scene.ballMaterial + (isImpostor ? NUM_MATERIALS : 0),
+                                              ballModelView(scene.ballShape, scene.ballPosition), scene.ballShadeMode);
+            packet.isSphereImpostor = isImpostor;
+        }
+    }
+
+    // Needs the vertex arrays, textures and uniform locations set up
+    void init()
+    {
+        meshes[SPHERE_MESH] = {vao[SPHERE], GL_TRIANGLES, 0, sphereContext::NumVertices};
+        meshes[BUNNY_MESH] = {vao[BUNNY], GL_TRIANGLES, 0, bunnyContext::NumVertices};
+        meshes[WALLS_MESH] = {vao[NUM_SHAPES], GL_TRIANGLES, 0, wallsContext::NumVertices};
+        meshes[PARTICLES_MESH] = {particlesContext::vao, GL_TRIANGLES, 0, particlesContext::NumVertices};
+
+        // The vertex shader places the corners itself, the vertex arrays
+        // only lend their instance offsets
+        meshes[SPHERE_IMPOSTOR_MESH] = {vao[SPHERE], GL_TRIANGLE_STRIP, 0, 4};
+        meshes[PARTICLES_IMPOSTOR_MESH] = {particlesContext::vao, GL_TRIANGLE_STRIP, 0, 4};
+
+        materials[PLAIN_MATERIAL] = {PROGRAM, 0, 0, 0, GLint(ModelView), GLint(shadingModeLoc), GLint(instanceScaleLoc),
+                                     GLint(sphereImpostorLoc), GLint(textureLayerLoc), 0};
+
+        // All textured materials sample the same array texture on unit 0,
+        // each from a layer of its own
+        RenderMaterial textured = materials[PLAIN_MATERIAL];
+        textured.textureTarget = GL_TEXTURE_2D_ARRAY;
+        textured.texture = sphereContext::textures.texture();
+
+        for (int i = 0; i < sphereContext::NumTextures2D; i++)
+        {
+            materials[BASKETBALL_MATERIAL + i] = textured;
+            materials[BASKETBALL_MATERIAL + i].textureLayer = sphereContext::textureLayers2D[i];
+        }
+
+        materials[STRIPES_MATERIAL] = textured;
+        materials[STRIPES_MATERIAL].textureLayer = sphereContext::stripeLayer;
+
+        // The streamed earth keeps its tiles bound on units of their own
+        materials[EARTH_MATERIAL] = materials[PLAIN_MATERIAL];
+
+        for (int i = 0; i < NUM_MATERIALS; i++)
+        {
+            RenderMaterial &impostor = materials[NUM_MATERIALS + i];
+
+            impostor = materials[i];
+            impostor.program = IMPOSTOR_PROGRAM;
+            impostor.modelViewLoc = glGetUniformLocation(IMPOSTOR_PROGRAM, "ModelView");
+            impostor.shadeModeLoc = glGetUniformLocation(IMPOSTOR_PROGRAM, "ShadeMode");
+            impostor.instanceScaleLoc = glGetUniformLocation(IMPOSTOR_PROGRAM, "InstanceScale");
+            impostor.sphereImpostorLoc = glGetUniformLocation(IMPOSTOR_PROGRAM, "SphereImpostor");
+            impostor.textureLayerLoc = glGetUniformLocation(IMPOSTOR_PROGRAM, "TextureLayer");
+        }
+
+        impostorUniforms.init(PROGRAM, IMPOSTOR_PROGRAM);
+
+        pipeline.start(build, isThreaded);
+    }
+}
+
 // OpenGL initialization
 void init()
 {
+    PROFILE_FUNCTION();
+
     // Load shaders and use the resulting shader program
+    IMPOSTOR_PROGRAM = InitShader("vshader.glsl", "fshader.glsl", "#define SPHERE_IMPOSTOR\n");
     PROGRAM = InitShader("vshader.glsl", "fshader.glsl");
 
     sphereContext::initSphere();
@@ -883,8 +1868,8 @@ void init()
     // Retrieve transformation uniform variable locations
     ModelView = glGetUniformLocation(PROGRAM, "ModelView");
     Projection = glGetUniformLocation(PROGRAM, "Projection");
-    texMap2DLoc = glGetUniformLocation(PROGRAM, "texMap2D");
-    texMap1DLoc = glGetUniformLocation(PROGRAM, "texMap1D");
+    textureLayersLoc = glGetUniformLocation(PROGRAM, "TextureLayers");
+    textureLayerLoc = glGetUniformLocation(PROGRAM, "TextureLayer");
 
     sphereContext::initTextures();
 
@@ -906,16 +1891,30 @@ void init()
 
     glGenBuffers(1, &sphereContext::buffer);
     glBindBuffer(GL_ARRAY_BUFFER, sphereContext::buffer);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(sphereContext::points) + sizeof(sphereContext::normals) + sizeof(sphereContext::texCoords) + sizeof(sphereContext::texCoords1D), NULL, GL_STATIC_DRAW);
-    glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(sphereContext::points), sphereContext::points);
-    glBufferSubData(GL_ARRAY_BUFFER, sizeof(sphereContext::points), sizeof(sphereContext::normals), sphereContext::normals);
-    glBufferSubData(GL_ARRAY_BUFFER, sizeof(sphereContext::points) + sizeof(sphereContext::normals), sizeof(sphereContext::texCoords), sphereContext::texCoords);
-    glBufferSubData(GL_ARRAY_BUFFER, sizeof(sphereContext::points) + sizeof(sphereContext::normals) + sizeof(sphereContext::texCoords), sizeof(sphereContext::texCoords1D), sphereContext::texCoords1D);
 
-    glVertexAttribPointer(vPosition, 4, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0));
-    glVertexAttribPointer(vNormal, 3, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(sizeof(sphereContext::points)));
-    glVertexAttribPointer(vTexCoord2D, 2, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(sizeof(sphereContext::points) + sizeof(sphereContext::normals)));
-    glVertexAttribPointer(vTexCoord1D, 1, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(sizeof(sphereContext::points) + sizeof(sphereContext::normals) + sizeof(sphereContext::texCoords)));
+    if (isVertexPackingOn)
+    {
+        std::vector<PackedTexturedVertex> packed = packTexturedVertices(sphereContext::NumVertices, sphereContext::points, sphereContext::normals,
+                                                                        sphereContext::texCoords, sphereContext::texCoords1D);
+        glBufferData(GL_ARRAY_BUFFER, packed.size() * sizeof(PackedTexturedVertex), &packed[0], GL_STATIC_DRAW);
+
+        setPackedTexturedVertexAttributes(vPosition, vNormal, vTexCoord2D, vTexCoord1D);
+        printPackingSavings("Sphere", sphereContext::NumVertices, sizeof(point4) + sizeof(vec3) + sizeof(vec2) + sizeof(float),
+                            sizeof(PackedTexturedVertex));
+    }
+    else
+    {
+        glBufferData(GL_ARRAY_BUFFER, sizeof(sphereContext::points) + sizeof(sphereContext::normals) + sizeof(sphereContext::texCoords) + sizeof(sphereContext::texCoords1D), NULL, GL_STATIC_DRAW);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(sphereContext::points), sphereContext::points);
+        glBufferSubData(GL_ARRAY_BUFFER, sizeof(sphereContext::points), sizeof(sphereContext::normals), sphereContext::normals);
+        glBufferSubData(GL_ARRAY_BUFFER, sizeof(sphereContext::points) + sizeof(sphereContext::normals), sizeof(sphereContext::texCoords), sphereContext::texCoords);
+        glBufferSubData(GL_ARRAY_BUFFER, sizeof(sphereContext::points) + sizeof(sphereContext::normals) + sizeof(sphereContext::texCoords), sizeof(sphereContext::texCoords1D), sphereContext::texCoords1D);
+
+        glVertexAttribPointer(vPosition, 4, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0));
+        glVertexAttribPointer(vNormal, 3, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(sizeof(sphereContext::points)));
+        glVertexAttribPointer(vTexCoord2D, 2, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(sizeof(sphereContext::points) + sizeof(sphereContext::normals)));
+        glVertexAttribPointer(vTexCoord1D, 1, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(sizeof(sphereContext::points) + sizeof(sphereContext::normals) + sizeof(sphereContext::texCoords)));
+    }
 
     // Initialization for BUNNY
     glBindVertexArray(vao[1]);
@@ -926,16 +1925,40 @@ void init()
 
     glGenBuffers(1, &bunnyContext::buffer);
     glBindBuffer(GL_ARRAY_BUFFER, bunnyContext::buffer);
-    glBufferData(GL_ARRAY_BUFFER, bunnyContext::points.size() * sizeof(point4) + bunnyContext::normals.size() * sizeof(vec3), NULL, GL_STATIC_DRAW);
-    glBufferSubData(GL_ARRAY_BUFFER, 0, bunnyContext::points.size() * sizeof(point4), &bunnyContext::points[0]);
-    glBufferSubData(GL_ARRAY_BUFFER, bunnyContext::points.size() * sizeof(point4), bunnyContext::normals.size() * sizeof(vec3), &bunnyContext::normals[0]);
-    // glBufferData(GL_ARRAY_BUFFER, bunnyContext::points.size() * sizeof(point4) + bunnyContext::colors.size() * sizeof(point4), NULL, GL_STATIC_DRAW);
-    // glBufferSubData(GL_ARRAY_BUFFER, 0, bunnyContext::points.size() * sizeof(point4), &bunnyContext::points[0]);
-    // glBufferSubData(GL_ARRAY_BUFFER, bunnyContext::points.size() * sizeof(point4), bunnyContext::colors.size() * sizeof(point4), &bunnyContext::colors[0]);
 
-    glVertexAttribPointer(vPosition, 4, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0));
-    glVertexAttribPointer(vNormal, 3, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(bunnyContext::points.size() * sizeof(point4)));
-    // glVertexAttribPointer(vColor, 4, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(bunnyContext::points.size() * sizeof(point4)));
+    if (isVertexPackingOn)
+    {
+        std::vector<PackedVertex> packed = packVertices(bunnyContext::points.size(), &bunnyContext::points[0], &bunnyContext::normals[0]);
+        glBufferData(GL_ARRAY_BUFFER, packed.size() * sizeof(PackedVertex), &packed[0], GL_STATIC_DRAW);
+
+        setPackedVertexAttributes(vPosition, vNormal);
+        printPackingSavings("Bunny", bunnyContext::points.size(), sizeof(point4) + sizeof(vec3), sizeof(PackedVertex));
+    }
+    else
+    {
+        glBufferData(GL_ARRAY_BUFFER, bunnyContext::points.size() * sizeof(point4) + bunnyContext::normals.size() * sizeof(vec3), NULL, GL_STATIC_DRAW);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, bunnyContext::points.size() * sizeof(point4), &bunnyContext::points[0]);
+        glBufferSubData(GL_ARRAY_BUFFER, bunnyContext::points.size() * sizeof(point4), bunnyContext::normals.size() * sizeof(vec3), &bunnyContext::normals[0]);
+        // glBufferData(GL_ARRAY_BUFFER, bunnyContext::points.size() * sizeof(point4) + bunnyContext::colors.size() * sizeof(point4), NULL, GL_STATIC_DRAW);
+        // glBufferSubData(GL_ARRAY_BUFFER, 0, bunnyContext::points.size() * sizeof(point4), &bunnyContext::points[0]);
+        // glBufferSubData(GL_ARRAY_BUFFER, bunnyContext::points.size() * sizeof(point4), bunnyContext::colors.size() * sizeof(point4), &bunnyContext::colors[0]);
+
+        glVertexAttribPointer(vPosition, 4, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0));
+        glVertexAttribPointer(vNormal, 3, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(bunnyContext::points.size() * sizeof(point4)));
+        // glVertexAttribPointer(vColor, 4, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(bunnyContext::points.size() * sizeof(point4)));
+    }
+
+    // Baked Gouraud colors of both ball shapes, in buffers of their own
+    int ballNumVertices[NUM_SHAPES] = {sphereContext::NumVertices, bunnyContext::NumVertices};
+    lightBakeContext::allocate(ballNumVertices);
+
+    for (int shape = 0; shape < NUM_SHAPES; shape++)
+    {
+        glBindVertexArray(vao[shape]);
+        glEnableVertexAttribArray(vColor);
+        glBindBuffer(GL_ARRAY_BUFFER, lightBakeContext::buffers[shape]);
+        glVertexAttribPointer(vColor, 4, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0));
+    }
 
     // Initialization for WALLS / ROOM
     glBindVertexArray(vao[2]);
@@ -945,12 +1968,60 @@ void init()
 
     glGenBuffers(1, &wallsContext::buffer);
     glBindBuffer(GL_ARRAY_BUFFER, wallsContext::buffer);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(wallsContext::points) + sizeof(wallsContext::colors), NULL, GL_STATIC_DRAW);
-    glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(wallsContext::points), wallsContext::points);
-    glBufferSubData(GL_ARRAY_BUFFER, sizeof(wallsContext::points), sizeof(wallsContext::colors), wallsContext::colors);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(wallsContext::colors), wallsContext::colors, GL_STATIC_DRAW);
+
+    glVertexAttribPointer(vColor, 4, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0));
+
+    wallsContext::dynamicPoints.init(vao[2], vPosition, 4, GL_FLOAT, sizeof(wallsContext::points));
+    wallsContext::dynamicPoints.update(wallsContext::points, sizeof(wallsContext::points));
+
+    // Initialization for instanced PARTICLES
+    particlesContext::initMesh();
 
-    glVertexAttribPointer(vPosition, 4, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0));
-    glVertexAttribPointer(vColor, 4, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(sizeof(wallsContext::points)));
+    GLuint vInstanceOffset = glGetAttribLocation(PROGRAM, "vInstanceOffset");
+
+    glGenVertexArrays(1, &particlesContext::vao);
+    glBindVertexArray(particlesContext::vao);
+
+    glEnableVertexAttribArray(vPosition);
+    glEnableVertexAttribArray(vNormal);
+    glEnableVertexAttribArray(vInstanceOffset);
+
+    glGenBuffers(1, &particlesContext::meshBuffer);
+    glBindBuffer(GL_ARRAY_BUFFER, particlesContext::meshBuffer);
+
+    if (isVertexPackingOn)
+    {
+        std::vector<PackedVertex> packed = packVertices(particlesContext::points.size(), &particlesContext::points[0], &particlesContext::normals[0]);
+        glBufferData(GL_ARRAY_BUFFER, packed.size() * sizeof(PackedVertex), &packed[0], GL_STATIC_DRAW);
+
+        setPackedVertexAttributes(vPosition, vNormal);
+        printPackingSavings("Particle ball", particlesContext::points.size(), sizeof(point4) + sizeof(vec3), sizeof(PackedVertex));
+    }
+    else
+    {
+        glBufferData(GL_ARRAY_BUFFER, particlesContext::points.size() * sizeof(point4) + particlesContext::normals.size() * sizeof(vec3), NULL, GL_STATIC_DRAW);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, particlesContext::points.size() * sizeof(point4), &particlesContext::points[0]);
+        glBufferSubData(GL_ARRAY_BUFFER, particlesContext::points.size() * sizeof(point4), particlesContext::normals.size() * sizeof(vec3), &particlesContext::normals[0]);
+
+        glVertexAttribPointer(vPosition, 4, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0));
+        glVertexAttribPointer(vNormal, 3, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(particlesContext::points.size() * sizeof(point4)));
+    }
+
+    // One ball centre per instance, filled in every frame
+    particlesContext::instanceOffsets.init(particlesContext::vao, vInstanceOffset, 3, GL_FLOAT,
+                                           particlesContext::NumBalls * sizeof(vec3));
+    glVertexAttribPointer(vInstanceOffset, 3, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0));
+    glVertexAttribDivisor(vInstanceOffset, 1);
+
+    instanceScaleLoc = glGetUniformLocation(PROGRAM, "InstanceScale");
+    sphereImpostorLoc = glGetUniformLocation(PROGRAM, "SphereImpostor");
+
+    // The light samplers need texture units of their own even without lights
+    pointLightsContext::init();
+    pointLightsContext::update();
+
+    shadowContext::init();
 
     MaterialInfo::updateMaterial();
     LightInfo::updateLightingComponents();
@@ -958,6 +2029,11 @@ void init()
     // Set current program object
     glUseProgram(PROGRAM);
 
+    // Everything above bound objects directly
+    GLStateCache::get().invalidate();
+
+    renderQueueContext::init();
+
     // Enable hiddden surface removal
     glEnable(GL_DEPTH_TEST);
     glEnable(GL_CULL_FACE);
@@ -970,50 +2046,74 @@ void init()
 
 void display(void)
 {
+    PROFILE_FUNCTION();
+
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-    // Render the walls first, then the objects
-    // Translate back a bit so that scene is visible
-    // Scaling should only apply to objects (so (1.0, 1.0, 1.0) is used for the scale matrix)
-    model_view = Translate(vec3(0.0, 0.0, -2.0)) * Scale(1.0, 1.0, 1.0);
+    renderQueueContext::capture(renderQueueContext::current);
 
-    // Draw room
-    glBindVertexArray(vao[2]);
-    glBindBuffer(GL_ARRAY_BUFFER, wallsContext::buffer);
-    glUniformMatrix4fv(ModelView, 1, GL_TRUE, model_view);
-    glUniform1i(shadingModeLoc, static_cast<int>(wallsContext::shadeMode));
-    glDrawArrays(GL_TRIANGLES, 0, wallsContext::NumVertices);
+    // Built from the scene of the previous frame when the render thread is on
+    RenderPipeline<renderQueueContext::Scene>::Frame &frame = renderQueueContext::pipeline.next(renderQueueContext::current);
+    const renderQueueContext::Scene &scene = frame.scene;
+
+    // The light follows the ball as drawn
+    model_view = scene.isParticles ? mat4() : ballModelView(scene.ballShape, scene.ballPosition);
+
+    if (scene.isLightBaked)
+    {
+        updateLightBake(scene.ballShape);
+    }
+
+    // The instanced balls cast no shadows
+    bool isShadowOn = shadowContext::isEnabled && !scene.isParticles;
+
+    if (isShadowOn)
+    {
+        int numVertices = (scene.ballShape == SPHERE) ? sphereContext::NumVertices : bunnyContext::NumVertices;
+        vec4 light = shadowContext::ballLight(scene.ballShadeMode, scene.isLightBaked, scene.ballShape, model_view);
+        shadowContext::update(scene.ballShape, model_view, light, numVertices);
+    }
 
-    // Use different matrices for objects other than the room
-    model_view = (Translate(displacement) * Scale(SCALE_FACTOR, SCALE_FACTOR, SCALE_FACTOR));
+    GLStateCache::get().uniform1i(shadowContext::shadowsOnLoc, isShadowOn);
 
-    glUniformMatrix4fv(ModelView, 1, GL_TRUE, model_view);
+    if (pointLightsContext::lights.size() > 0)
+    {
+        pointLightsContext::update();
+    }
 
-    switch (curBallShape)
+    if (scene.isParticles)
+    {
+        particlesContext::uploadOffsets(scene.particleOffsets);
+    }
+    else if (scene.isBallVisible && scene.ballShadeMode == STREAMED_TEXTURE)
     {
-    case SPHERE:
-        glBindVertexArray(vao[0]);
-        glBindBuffer(GL_ARRAY_BUFFER, sphereContext::buffer);
-        glUniform1i(shadingModeLoc, static_cast<int>(curShadeMode));
-        glDrawArrays(GL_TRIANGLES, 0, sphereContext::NumVertices);
-        break;
-    case BUNNY:
-        glBindVertexArray(vao[1]);
-        glBindBuffer(GL_ARRAY_BUFFER, bunnyContext::buffer);
+        // The ball is only ever translated, so the view direction is also
+        // the direction in its own coordinates
+        vec4 center = model_view * vec4(0.0, 0.0, 0.0, 1.0);
+        vec3 toEye = is3D ? normalize(-vec3(center.x, center.y, center.z)) : vec3(0.0, 0.0, 1.0);
+
+        sphereContext::earthStream.update(earthScreenWidth(model_view), [&](const vec2 &uvMin, const vec2 &uvMax)
+                                          { return isEarthTileVisible(toEye, uvMin, uvMax); });
+    }
 
-        // Modify and send new ModelView matrix for Bunny
-        // Rotate in X-direction
-        // Need to do this so BUnny faces camera
-        model_view = model_view * RotateX(BUNNY_X_ROTATION_ANGLE);
-        glUniformMatrix4fv(ModelView, 1, GL_TRUE, model_view);
+    {
+        GPUTimerScope scope(gpuTimer, "scene");
 
-        glUniform1i(shadingModeLoc, static_cast<int>(curShadeMode));
-        glDrawArrays(GL_TRIANGLES, 0, bunnyContext::NumVertices);
-        break;
+        if (scene.isSphereImpostor)
+        {
+            renderQueueContext::impostorUniforms.copy();
+        }
+
+        frame.queue.submit(renderQueueContext::meshes, renderQueueContext::materials);
+
+        // Everything else sets its uniforms on PROGRAM directly
+        GLStateCache::get().useProgram(PROGRAM);
     }
 
     glFlush();
-    glutSwapBuffers();
+    swapBuffers();
+    gpuTimer.endFrame();
+    cullingStats.endFrame();
 }
 
 //---------------------------------------------------------------------
@@ -1021,9 +2121,12 @@ void display(void)
 // reshape
 //
 
-void reshape(int w, int h)
+void applyReshape(int w, int h)
 {
-    glViewport(0, 0, w, h);
+    if (hasGLContext)
+    {
+        glViewport(0, 0, w, h);
+    }
 
     curWidth = w;
     curHeight = h;
@@ -1052,84 +2155,159 @@ void reshape(int w, int h)
     // Need to update wall vertices on reshape since room will be scaled
     wallsContext::colorcube();
 
-    // Bind wall buffer send updated vertex data
-    glBindVertexArray(vao[3]);
-    glBindBuffer(GL_ARRAY_BUFFER, wallsContext::buffer);
-    glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(wallsContext::points), wallsContext::points);
+    // Ball bounces off the new walls from the next step on
+    physics.setParams(currentPhysicsParams());
+    particlesContext::particles.setParams(particlePhysicsParams());
+
+    if (hasGLContext)
+    {
+        // Send the updated vertex data to the next wall buffer region
+        wallsContext::dynamicPoints.update(wallsContext::points, sizeof(wallsContext::points));
+
+        // Projection matrix may need to be updated
+        setProjectionMatrix();
+    }
+}
 
-    // Projection matrix may need to be updated
-    setProjectionMatrix();
+void reshape(int w, int h)
+{
+    PROFILE_FUNCTION();
+
+    eventLog.record(physics.stepCount(), RESHAPE_EVENT, w, h);
+
+    applyReshape(w, h);
 }
 
 //----------------------------------------------------------------------------
 
-void idle(void)
+unsigned simulationChecksum()
 {
-    // Ball should bounce off boundaries
-    if (displacement.x + curHorizontalSpeed <= leftWallBoundary + BALL_RADIUS)
-    {
-        displacement.x = leftWallBoundary + BALL_RADIUS;
-        curHorizontalSpeed = -curHorizontalSpeed;
-    }
-    else if (displacement.x + curHorizontalSpeed >= rightWallBoundary - BALL_RADIUS)
+    unsigned hash = hashBytes(&physics.state(), sizeof(BallState));
+
+    if (particlesContext::isActive)
     {
+        ParticleSystem &particles = particlesContext::particles;
 
-        displacement.x = rightWallBoundary - BALL_RADIUS;
-        curHorizontalSpeed = -curHorizontalSpeed;
+        hash = hashBytes(&particles.px[0], particles.size() * sizeof(GLfloat), hash);
+        hash = hashBytes(&particles.py[0], particles.size() * sizeof(GLfloat), hash);
+        hash = hashBytes(&particles.pz[0], particles.size() * sizeof(GLfloat), hash);
     }
 
-    if (displacement.y + curVerticalSpeed <= bottomWallBoundary + BALL_RADIUS)
-    {
-        displacement.y = bottomWallBoundary + BALL_RADIUS;
-        curVerticalSpeed = -curVerticalSpeed;
-    }
-    else if (displacement.y + curVerticalSpeed >= topWallBoundary - BALL_RADIUS)
+    return hash;
+}
+
+// One fixed step of everything that is simulated
+void stepSimulation()
+{
+    physics.step();
+
+    if (particlesContext::isActive)
     {
-        displacement.y = topWallBoundary - BALL_RADIUS;
-        curVerticalSpeed = -curVerticalSpeed;
+        particlesContext::particles.step();
     }
+}
 
-    // Make ball bounce off front / back walls only if 3D is toggled
-    if (is3D)
+void idle(void)
+{
+    PROFILE_FUNCTION();
+
+    if (eventLog.isRecording())
     {
-        if (displacement.z + curZSpeed <= backWallBoundary + BALL_RADIUS)
+        // Keep the particles in lockstep with the ball so a replay can
+        // reproduce them
+        BallPhysics::Clock::time_point now = BallPhysics::Clock::now();
+        int numSteps = physics.advance(std::chrono::duration<double>(now - lastUpdate).count());
+        lastUpdate = now;
+
+        for (int i = 0; i < numSteps && particlesContext::isActive; i++)
         {
-            displacement.z = backWallBoundary + BALL_RADIUS;
-            curZSpeed = -curZSpeed;
+            particlesContext::particles.step();
         }
-        else if (displacement.z + curZSpeed >= frontWallBoundary - BALL_RADIUS)
+
+        eventLog.markStep(physics.stepCount());
+
+        if (physics.stepCount() >= nextCheckpoint)
         {
-            displacement.z = frontWallBoundary - BALL_RADIUS;
-            curZSpeed = -curZSpeed;
+            eventLog.record(physics.stepCount(), CHECKPOINT_EVENT, simulationChecksum());
+            nextCheckpoint = physics.stepCount() + CHECKPOINT_INTERVAL;
         }
     }
+    else if (particlesContext::isActive)
+    {
+        BallPhysics::Clock::time_point now = BallPhysics::Clock::now();
+        particlesContext::particles.advance(std::chrono::duration<double>(now - particlesContext::lastUpdate).count());
+        particlesContext::lastUpdate = now;
+    }
 
-    displacement += vec3(curHorizontalSpeed, curVerticalSpeed, curZSpeed);
+    // The ball is simulated on its own thread; just pick up where it is
+    displacement = physics.renderPosition();
 
-    glutPostRedisplay();
+    postRedisplay();
 }
 
 //----------------------------------------------------------------------------
 
-void keyboard(unsigned char key, int x, int y)
+void applyKey(unsigned char key)
 {
     // Reset ball to initial position
     // Reset ball speed
     if (key == 'I' | key == 'i')
     {
-        displacement = TOP_LEFT_FRONT_CORNER;
-        curHorizontalSpeed = INITIAL_HORIZONTAL_SPEED;
-        curVerticalSpeed = INITIAL_VERTICAL_SPEED;
-        curZSpeed = INITIAL_Z_SPEED;
+        physics.setState(initialBallState());
+
+        if (particlesContext::isActive)
+        {
+            spawnParticles();
+        }
     }
 
     // Toggle between 2D and 3D
     if (key == 'V' | key == 'v')
     {
         is3D = !is3D;
-        curZSpeed = is3D ? INITIAL_Z_SPEED : 0;
 
-        setProjectionMatrix();
+        BallState state = physics.snapshot().current;
+        state.velocity.z = is3D ? INITIAL_Z_SPEED * REFERENCE_FRAME_RATE : 0.0;
+
+        physics.setParams(currentPhysicsParams());
+        physics.setState(state);
+
+        particlesContext::particles.setParams(particlePhysicsParams());
+
+        if (!is3D)
+        {
+            std::fill(particlesContext::particles.vz.begin(), particlesContext::particles.vz.end(), 0.0f);
+        }
+
+        if (hasGLContext)
+        {
+            setProjectionMatrix();
+        }
+    }
+
+    // Toggle gravity
+    if (key == 'G' || key == 'g')
+    {
+        isGravityOn = !isGravityOn;
+        physics.setParams(currentPhysicsParams());
+        particlesContext::particles.setParams(particlePhysicsParams());
+    }
+
+    // Toggle between one ball and many colliding balls
+    if (key == 'M' || key == 'm')
+    {
+        particlesContext::isActive = !particlesContext::isActive;
+
+        if (particlesContext::isActive)
+        {
+            spawnParticles();
+        }
+    }
+
+    // Toggle between sphere meshes and ray traced impostors
+    if (key == 'R' || key == 'r')
+    {
+        isSphereImpostorOn = !isSphereImpostorOn;
     }
 
     // Print input command overview
@@ -1141,21 +2319,33 @@ void keyboard(unsigned char key, int x, int y)
         std::cout << "Press C => Toggle between colors" << std::endl;
         std::cout << "Press I => Reset ball to initial position" << std::endl;
         std::cout << "Press V => Toggle between 2D and 3D" << std::endl;
+        std::cout << "Press G => Toggle gravity" << std::endl;
+        std::cout << "Press M => Toggle between one ball and many colliding balls" << std::endl;
+        std::cout << "Press R => Toggle between sphere meshes and ray traced impostors" << std::endl;
         std::cout << "Press Q => Quit the program" << std::endl;
         std::cout << "Left-mouse click => Toggle between ball shapes" << std::endl;
         std::cout << PRINT_DELIMITER << std::endl;
     }
+}
+
+void keyboard(unsigned char key, int x, int y)
+{
+    PROFILE_FUNCTION();
 
     // Quit the program
     if (key == 'Q' | key == 'q')
     {
         exit(0);
     }
+
+    eventLog.record(physics.stepCount(), KEY_EVENT, key);
+
+    applyKey(key);
 }
 
 //----------------------------------------------------------------------------
 
-void mouse(int button, int state, int x, int y)
+void applyMouse(int button, int state)
 {
     // Toggle betwene shapes on left-mouse click
     if (state == GLUT_DOWN)
@@ -1163,46 +2353,519 @@ void mouse(int button, int state, int x, int y)
         switch (button)
         {
         case GLUT_LEFT_BUTTON:
+            // display() binds whatever the new shape needs
             curBallShape = BallShape((curBallShape + 1) % NUM_SHAPES);
+            break;
+        }
+    }
+}
+
+void mouse(int button, int state, int x, int y)
+{
+    PROFILE_FUNCTION();
+
+    eventLog.record(physics.stepCount(), MOUSE_EVENT, button, state);
+
+    applyMouse(button, state);
+}
+
+//----------------------------------------------------------------------------
+
+// Feed a recorded run back through the same handlers, without a window and
+// as fast as possible, and check the simulation matches the recording
+int replay(const std::string &path)
+{
+    if (!eventLog.load(path, "bouncing_ball_3"))
+    {
+        std::cerr << "Could not read event log " << path << std::endl;
+        return 1;
+    }
+
+    hasGLContext = false;
 
-            if (curBallShape == SPHERE)
+    physics.init(currentPhysicsParams(), initialBallState());
+
+    int numCheckpoints = 0;
+    int numMismatches = 0;
+
+    BallPhysics::Clock::time_point start = BallPhysics::Clock::now();
+
+    for (;;)
+    {
+        LogEvent event;
+
+        while (eventLog.next(physics.stepCount(), event))
+        {
+            switch (event.type)
             {
-                glBindVertexArray(vao[0]);
-                glBindBuffer(GL_ARRAY_BUFFER, sphereContext::buffer);
+            case KEY_EVENT:
+                applyKey(event.args[0]);
+                break;
+            case MOUSE_EVENT:
+                applyMouse(event.args[0], event.args[1]);
+                break;
+            case RESHAPE_EVENT:
+                applyReshape(event.args[0], event.args[1]);
+                break;
+            case MENU_EVENT:
+                applyMenu(event.args[0]);
+                break;
+            case BALL_COUNT_EVENT:
+                particlesContext::NumBalls = event.args[0];
+                break;
+            case CHECKPOINT_EVENT:
+                numCheckpoints++;
+
+                if (simulationChecksum() != static_cast<unsigned>(event.args[0]))
+                {
+                    if (numMismatches == 0)
+                    {
+                        std::cout << "Replay diverged from the recording at step " << event.step << std::endl;
+                    }
+
+                    numMismatches++;
+                }
+                break;
             }
-            else if (curBallShape == BUNNY)
+        }
+
+        if (physics.stepCount() >= eventLog.endStep())
+        {
+            break;
+        }
+
+        stepSimulation();
+    }
+
+    double seconds = std::chrono::duration<double>(BallPhysics::Clock::now() - start).count();
+
+    std::cout << PRINT_DELIMITER << std::endl;
+    std::cout << "Replayed " << physics.stepCount() << " steps and " << eventLog.numEvents() << " events in "
+              << seconds << " s (" << physics.stepCount() / seconds << " steps/sec)" << std::endl;
+    std::cout << numCheckpoints - numMismatches << " of " << numCheckpoints << " checkpoints matched" << std::endl;
+    std::cout << PRINT_DELIMITER << std::endl;
+
+    return numMismatches == 0 ? 0 : 1;
+}
+
+//----------------------------------------------------------------------------
+
+// The same scene drawn on the CPU, for hosts without a GPU (--software N)
+namespace softwareContext
+{
+    SoftwareRasterizer rasterizer;
+
+    SoftwareTexture basketballTexture;
+
+    // Decoded whole, the software path does not stream
+    int earthTexHeight, earthTexWidth;
+    std::vector<GLubyte> earthTexImg;
+    SoftwareTexture earthTexture;
+    SoftwareTexture stripeTexture;
+
+    // Geometry and textures as init() makes them, without any GL calls
+    void init()
+    {
+        sphereContext::initSphere();
+        bunnyContext::initBunny();
+        wallsContext::colorcube();
+        sphereContext::loadTextureImages();
+        loadPPM(sphereContext::earthTexPath, earthTexImg, earthTexHeight, earthTexWidth);
+
+        // Same sizes as handed to glTexImage2D() / glTexImage1D()
+        basketballTexture.load(sphereContext::basketballTexImg.empty() ? NULL : &sphereContext::basketballTexImg[0],
+                               sphereContext::basketballTexWidth, sphereContext::basketballTexHeight);
+        earthTexture.load(earthTexImg.empty() ? NULL : &earthTexImg[0], earthTexWidth, earthTexHeight);
+        stripeTexture.load(sphereContext::stripeImage, sphereContext::stripeImageWidth, 1, false);
+
+        MaterialInfo::updateMaterial();
+
+        SoftwareRasterizer::State &state = rasterizer.state;
+
+        state.isCullFaceOn = true;
+        state.texture2D = &basketballTexture;
+        state.texture1D = &stripeTexture;
+
+        // Value of the vColor attribute when it is not enabled
+        state.color = color4(0.0, 0.0, 0.0, 1.0);
+    }
+
+    void display(SoftwareRasterizer::ShadeMode ballShadeMode)
+    {
+        PROFILE_FUNCTION();
+
+        SoftwareRasterizer::State &state = rasterizer.state;
+
+        if (rasterizer.width() != curWidth || rasterizer.height() != curHeight)
+        {
+            rasterizer.resize(curWidth, curHeight);
+        }
+
+        rasterizer.clear(color4(1.0, 1.0, 1.0, 1.0));
+
+        state.projection = projectionMatrix();
+        state.ambientProduct = LightInfo::ambientProduct();
+        state.diffuseProduct = LightInfo::diffuseProduct();
+        state.specularProduct = LightInfo::specularProduct();
+        state.lightPosition = LightInfo::light_direction;
+        state.shininess = MaterialInfo::material_shininess;
+
+        // Draw room
+        SoftwareVertexArrays walls(wallsContext::points);
+        walls.colors = wallsContext::colors;
+
+        state.modelView = Translate(vec3(0.0, 0.0, -2.0));
+        state.shadeMode = static_cast<SoftwareRasterizer::ShadeMode>(wallsContext::shadeMode);
+        rasterizer.drawArrays(GL_TRIANGLES, walls, 0, wallsContext::NumVertices);
+
+        state.modelView = Translate(displacement) * Scale(SCALE_FACTOR, SCALE_FACTOR, SCALE_FACTOR);
+        state.shadeMode = ballShadeMode;
+
+        switch (curBallShape)
+        {
+        case SPHERE:
+        {
+            SoftwareVertexArrays sphere(sphereContext::points);
+            sphere.normals = sphereContext::normals;
+            sphere.texCoords2D = sphereContext::texCoords;
+            sphere.texCoords1D = sphereContext::texCoords1D;
+
+            rasterizer.drawArrays(GL_TRIANGLES, sphere, 0, sphereContext::NumVertices);
+            break;
+        }
+        case BUNNY:
+        {
+            SoftwareVertexArrays bunny(&bunnyContext::points[0]);
+            bunny.normals = &bunnyContext::normals[0];
+
+            state.modelView = state.modelView * RotateX(BUNNY_X_ROTATION_ANGLE);
+            rasterizer.drawArrays(GL_TRIANGLES, bunny, 0, bunnyContext::NumVertices);
+            break;
+        }
+        }
+    }
+}
+
+// Draw each ball shape in each shading mode on the CPU for numFrames frames.
+// The ball is stepped a fixed amount per frame, so every run renders the
+// same images; the last frame of each scene goes to <outputPrefix>_<scene>.ppm.
+int runSoftwareRenderer(int numFrames, const char *outputPrefix)
+{
+    const BallShape SHAPES[] = {SPHERE, BUNNY};
+    const char *SHAPE_NAMES[] = {"sphere", "bunny"};
+
+    const SoftwareRasterizer::ShadeMode SHADE_MODES[] = {
+        SoftwareRasterizer::COLOR, SoftwareRasterizer::FLAT, SoftwareRasterizer::GOURAUD,
+        SoftwareRasterizer::PHONG, SoftwareRasterizer::TEXTURE_2D, SoftwareRasterizer::TEXTURE_1D};
+    const char *SHADE_MODE_NAMES[] = {"none", "flat", "gouraud", "phong", "texture_2d", "texture_1d"};
+
+    // Physics steps per frame at the reference frame rate
+    const int STEPS_PER_FRAME = int(1.0 / (REFERENCE_FRAME_RATE * PHYSICS_TIME_STEP) + 0.5);
+
+    hasGLContext = false;
+
+    softwareContext::init();
+
+    physics.init(currentPhysicsParams(), initialBallState());
+    applyReshape(1024, 1024);
+
+    std::cout << PRINT_DELIMITER << std::endl;
+
+    for (int shape = 0; shape < NUM_SHAPES; shape++)
+    {
+        curBallShape = SHAPES[shape];
+
+        for (int mode = 0; mode < 6; mode++)
+        {
+            std::string scene = std::string(SHAPE_NAMES[shape]) + "_" + SHADE_MODE_NAMES[mode];
+
+            physics.init(currentPhysicsParams(), initialBallState());
+
+            std::vector<double> times;
+
+            for (int frame = 0; frame < numFrames; frame++)
             {
-                glBindVertexArray(vao[1]);
-                glBindBuffer(GL_ARRAY_BUFFER, bunnyContext::buffer);
+                for (int step = 0; step < STEPS_PER_FRAME; step++)
+                {
+                    physics.step();
+                }
+
+                displacement = physics.state().position;
+
+                BallPhysics::Clock::time_point start = BallPhysics::Clock::now();
+                softwareContext::display(SHADE_MODES[mode]);
+                times.push_back(std::chrono::duration<double>(BallPhysics::Clock::now() - start).count());
             }
 
-            break;
+            FrameTimes frameTimes(times);
+
+            std::printf("%-24s p50 %8.3f p99 %8.3f max %8.3f ms (%.1f fps)\n",
+                        scene.c_str(), frameTimes.p50, frameTimes.p99, frameTimes.max, 1000.0 / frameTimes.mean);
+
+            std::string path = std::string(outputPrefix ? outputPrefix : "") + "_" + scene + ".ppm";
+
+            if (outputPrefix && !softwareContext::rasterizer.savePPM(path.c_str()))
+            {
+                std::cerr << "Could not write " << path << std::endl;
+                return 1;
+            }
         }
     }
+
+    std::cout << PRINT_DELIMITER << std::endl;
+
+    return 0;
 }
 
 //----------------------------------------------------------------------------
 
+// Draw each ball shape in each shading mode offscreen for numFrames frames
+// and write the frame-time statistics to outputPath
+int runFrameBenchmark(int numFrames, const std::string &outputPath, const char *baselinePath)
+{
+    const BallShape SHAPES[] = {SPHERE, BUNNY};
+    const char *SHAPE_NAMES[] = {"sphere", "bunny"};
+
+    // Menu entry that switches to each shading mode; NONE has no entry
+    // and is set on top of Gouraud
+    const ShadingMode SHADE_MODES[] = {NONE, GOURAUD, PHONG, TEXTURE_2D, TEXTURE_1D};
+    const char *SHADE_MODE_NAMES[] = {"none", "gouraud", "phong", "texture_2d", "texture_1d"};
+    const int SHADE_MODE_MENU_ENTRIES[] = {9, 9, 2, 10, 12};
+
+    FrameBenchmark benchmark("bouncing_ball_3", numFrames);
+
+    std::cout << PRINT_DELIMITER << std::endl;
+
+    for (int shape = 0; shape < NUM_SHAPES; shape++)
+    {
+        curBallShape = SHAPES[shape];
+
+        for (int mode = 0; mode < 5; mode++)
+        {
+            applyMenu(SHADE_MODE_MENU_ENTRIES[mode]);
+            curShadeMode = SHADE_MODES[mode];
+
+            benchmark.runScene(std::string(SHAPE_NAMES[shape]) + "_" + SHADE_MODE_NAMES[mode], "triangles", display, idle);
+        }
+    }
+
+    std::cout << PRINT_DELIMITER << std::endl;
+
+    if (baselinePath && !benchmark.compare(baselinePath))
+    {
+        std::cerr << "Could not read baseline " << baselinePath << std::endl;
+    }
+
+    if (!benchmark.writeJSON(outputPath, curWidth, curHeight))
+    {
+        std::cerr << "Could not write " << outputPath << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
-    glutInit(&argc, argv);
-    glutInitDisplayMode(GLUT_RGBA | GLUT_DOUBLE | GLUT_DEPTH);
-    glutInitWindowSize(1024, 1024);
-    glutInitWindowPosition(50, 50);
-    glutCreateWindow("Bouncing Ball");
+    // CPU zones are only recorded when built with -DANGEL_PROFILE
+    PROFILE_TRACE_AT_EXIT("bouncing_ball_3_trace.json");
+
+    std::string recordPath;
+
+    // Render this many frames offscreen and exit, instead of opening a window
+    int headlessFrames = 0;
+    const char *headlessOutput = NULL;
+
+    // Time a fixed set of scenes offscreen instead (--benchmark N)
+    int benchmarkFrames = 0;
+    std::string benchmarkOutput = "bouncing_ball_3_benchmark.json";
+    const char *benchmarkBaseline = NULL;
+
+    bool isGPUTimerOn = false;
+    const char *gpuTimerCSV = NULL;
+
+    // Render on the CPU without any GL context (--software N)
+    int softwareFrames = 0;
+    const char *softwareOutput = NULL;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--balls") == 0 && i + 1 < argc)
+        {
+            particlesContext::NumBalls = std::max(1, atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--particle-bench") == 0)
+        {
+            runParticleBenchmark();
+            return 0;
+        }
+        else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc)
+        {
+            recordPath = argv[++i];
+        }
+        else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc)
+        {
+            return replay(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--headless") == 0 && i + 1 < argc)
+        {
+            headlessFrames = std::max(1, atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--headless-output") == 0 && i + 1 < argc)
+        {
+            headlessOutput = argv[++i];
+        }
+        else if (strcmp(argv[i], "--benchmark") == 0 && i + 1 < argc)
+        {
+            benchmarkFrames = std::max(1, atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--benchmark-output") == 0 && i + 1 < argc)
+        {
+            benchmarkOutput = argv[++i];
+        }
+        else if (strcmp(argv[i], "--benchmark-baseline") == 0 && i + 1 < argc)
+        {
+            benchmarkBaseline = argv[++i];
+        }
+        else if (strcmp(argv[i], "--gpu-timers") == 0)
+        {
+            isGPUTimerOn = true;
+        }
+        else if (strcmp(argv[i], "--gpu-timers-csv") == 0 && i + 1 < argc)
+        {
+            isGPUTimerOn = true;
+            gpuTimerCSV = argv[++i];
+        }
+        else if (strcmp(argv[i], "--software") == 0 && i + 1 < argc)
+        {
+            softwareFrames = std::max(1, atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--software-output") == 0 && i + 1 < argc)
+        {
+            softwareOutput = argv[++i];
+        }
+        else if (strcmp(argv[i], "--lights") == 0 && i + 1 < argc)
+        {
+            pointLightsContext::NumLights = std::max(0, atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--no-shadows") == 0)
+        {
+            shadowContext::isEnabled = false;
+        }
+        else if (strcmp(argv[i], "--no-culling") == 0)
+        {
+            renderQueueContext::isFrustumCullingOn = false;
+        }
+        else if (strcmp(argv[i], "--culling-stats") == 0)
+        {
+            cullingStats.enable(CULLING_STATS_PRINT_INTERVAL);
+        }
+        else if (strcmp(argv[i], "--no-render-thread") == 0)
+        {
+            renderQueueContext::isThreaded = false;
+        }
+        else if (strcmp(argv[i], "--no-light-bake") == 0)
+        {
+            lightBakeContext::isEnabled = false;
+        }
+        else if (strcmp(argv[i], "--packed-vertices") == 0)
+        {
+            isVertexPackingOn = true;
+        }
+        else if (strcmp(argv[i], "--earth-texture") == 0 && i + 1 < argc)
+        {
+            sphereContext::earthTexPath = argv[++i];
+        }
+        else if (strcmp(argv[i], "--texture-budget") == 0 && i + 1 < argc)
+        {
+            sphereContext::earthTextureBudget = size_t(std::max(1, atoi(argv[++i]))) * 1024 * 1024;
+        }
+        else if (strcmp(argv[i], "--sphere-impostors") == 0)
+        {
+            isSphereImpostorOn = true;
+        }
+        else if (strcmp(argv[i], "--stream-stats") == 0)
+        {
+            sphereContext::earthStream.enableStats(STREAM_STATS_PRINT_INTERVAL);
+        }
+    }
+
+    if (softwareFrames > 0)
+    {
+        return runSoftwareRenderer(softwareFrames, softwareOutput);
+    }
+
+    if (headlessFrames > 0 || benchmarkFrames > 0)
+    {
+        if (!HeadlessRenderer::get().init(1024, 1024))
+        {
+            return 1;
+        }
+
+        init();
+    }
+    else
+    {
+        glutInit(&argc, argv);
+        glutInitDisplayMode(GLUT_RGBA | GLUT_DOUBLE | GLUT_DEPTH);
+        glutInitWindowSize(1024, 1024);
+        glutInitWindowPosition(50, 50);
+        glutCreateWindow("Bouncing Ball");
 
-    glewExperimental = GL_TRUE;
-    glewInit();
+        glewExperimental = GL_TRUE;
+        glewInit();
 
-    init();
+        init();
 
-    createMenu();
+        createMenu();
+
+        glutDisplayFunc(display);
+        glutReshapeFunc(reshape);
+        glutIdleFunc(idle);
+        glutMouseFunc(mouse);
+        glutKeyboardFunc(keyboard);
+    }
 
-    glutDisplayFunc(display);
-    glutReshapeFunc(reshape);
-    glutIdleFunc(idle);
-    glutMouseFunc(mouse);
-    glutKeyboardFunc(keyboard);
+    if (isGPUTimerOn && !gpuTimer.enable(GPU_TIMER_PRINT_INTERVAL, gpuTimerCSV))
+    {
+        std::cerr << "Could not write " << gpuTimerCSV << std::endl;
+    }
+
+    physics.init(currentPhysicsParams(), initialBallState());
+
+    if (recordPath.empty())
+    {
+        physics.start();
+    }
+    else if (eventLog.startRecording(recordPath, "bouncing_ball_3"))
+    {
+        eventLog.record(0, BALL_COUNT_EVENT, particlesContext::NumBalls);
+        lastUpdate = BallPhysics::Clock::now();
+    }
+    else
+    {
+        std::cerr << "Could not write event log " << recordPath << std::endl;
+        physics.start();
+    }
+
+    if (benchmarkFrames > 0)
+    {
+        reshape(1024, 1024);
+        return runFrameBenchmark(benchmarkFrames, benchmarkOutput, benchmarkBaseline);
+    }
+
+    if (headlessFrames > 0)
+    {
+        reshape(1024, 1024);
+        HeadlessRenderer::get().run(headlessFrames, display, idle);
+
+        if (headlessOutput && !HeadlessRenderer::get().savePPM(headlessOutput))
+        {
+            std::cerr << "Could not write " << headlessOutput << std::endl;
+        }
+
+        return 0;
+    }
 
     glutMainLoop();
     return 0;
@@ -6,12 +6,20 @@ in vec4 vColor;
 in vec2 vTexCoord2D;
 in float vTexCoord1D;
 
+// Per-instance ball centre, used when InstanceScale > 0
+in vec3 vInstanceOffset;
+
 out vec4 color;
 out vec3 fN;
 out vec3 fV;
 out vec3 fL;
 out vec2 texCoord2D;
 out float texCoord1D;
+out vec4 shadowCoord;
+
+// Eye coordinates of the impostor quad, and centre and radius of its sphere
+out vec3 impostorPosition;
+flat out vec4 impostorSphere;
 
 uniform mat4 ModelView;
 uniform mat4 Projection;
@@ -25,12 +33,67 @@ uniform float Shininess;
 
 uniform int ShadeMode;
 
+// Eye coordinates to shadow map coordinates
+uniform mat4 ShadowMatrix;
+
+// Radius of instanced balls, 0 when drawing a single object
+uniform float InstanceScale;
+
+// Draw the unit sphere the mesh approximates as a quad of four vertices,
+// numbered by gl_VertexID, which the fragment shader ray traces
+uniform int SphereImpostor;
+
+// The quad faces the eye, through the sphere's centre, and covers the cone
+// of rays touching the sphere
+void impostor()
+{
+    vec3 offset = (InstanceScale > 0.0) ? vInstanceOffset : vec3(0.0);
+    vec3 center = (ModelView * vec4(offset, 1.0)).xyz;
+    float radius = ((InstanceScale > 0.0) ? InstanceScale : 1.0) * length(ModelView[0].xyz);
+
+    // Orthographic projections keep w = 1
+    bool isOrthographic = Projection[3][3] != 0.0;
+    vec3 toEye = isOrthographic ? vec3(0.0, 0.0, 1.0) : normalize(-center);
+    float halfSize = radius;
+
+    if (!isOrthographic) {
+        float distance = length(center);
+        halfSize *= inversesqrt(max(1.0 - radius * radius / (distance * distance), 1e-4));
+    }
+
+    vec3 up = (abs(toEye.y) > 0.99) ? vec3(1.0, 0.0, 0.0) : vec3(0.0, 1.0, 0.0);
+    vec3 right = normalize(cross(up, toEye));
+    up = cross(toEye, right);
+
+    // Triangle strip corners (-1, -1), (1, -1), (-1, 1), (1, 1)
+    vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1) * 2.0 - 1.0;
+
+    impostorPosition = center + halfSize * (corner.x * right + corner.y * up);
+    impostorSphere = vec4(center, radius);
+
+    // Lighting and texture coordinates are found per fragment
+    color = vColor;
+
+    gl_Position = Projection * vec4(impostorPosition, 1.0);
+}
+
 void main()
 {
+    if (SphereImpostor != 0) {
+        impostor();
+        return;
+    }
+
+    vec4 position = vPosition;
+
+    if (InstanceScale > 0.0) {
+        position = vec4(vPosition.xyz * InstanceScale + vInstanceOffset, 1.0);
+    }
+
     // Gouraud
     if (ShadeMode == 1) {
         // Transform vertex  position into eye coordinates
-        vec3 pos = (ModelView * vPosition).xyz;
+        vec3 pos = (ModelView * position).xyz;
 
         vec3 L = normalize((ModelView * LightPosition).xyz - pos);
         vec3 E = normalize(-pos);
@@ -60,7 +123,7 @@ void main()
     else if (ShadeMode == 2)
     {
         // Transform vertex position into camera coord.
-        vec3 pos = (ModelView * vPosition).xyz;
+        vec3 pos = (ModelView * position).xyz;
 
         // normal direction in camera coordinates
         fN = (ModelView * vec4(vNormal, 0.0)).xyz;
@@ -79,11 +142,13 @@ void main()
     // No shading
     else if (ShadeMode == 0) {
         color = vColor;
-    } else if (ShadeMode == 3) {
+    } else if (ShadeMode == 3 || ShadeMode == 5) {
         texCoord2D = vTexCoord2D;
     } else if (ShadeMode == 4) {
         texCoord1D = vTexCoord1D;
     }
 
-    gl_Position = Projection * ModelView * vPosition;
+    shadowCoord = ShadowMatrix * (ModelView * position);
+
+    gl_Position = Projection * ModelView * position;
 }
\ No newline at end of file
@@ -51,9 +51,12 @@
 namespace Angel
 {
 
-	//  Helper function to load vertex and fragment shader files
+	//  Helper function to load vertex and fragment shader files;
+	//    fragmentDefines (e.g. "#define NAME\n") go right after the
+	//    fragment shader's #version line
 	GLuint InitShader(const char *vertexShaderFile,
-					  const char *fragmentShaderFile);
+					  const char *fragmentShaderFile,
+					  const char *fragmentDefines = NULL);
 
 	//  Defined constant for when numbers are too small to be used in the
 	//    denominator of a division operation.  This is only used if the
@@ -67,6 +70,8 @@ namespace Angel
 
 #include "vec.h"
 #include "mat.h"
+#include "quat.h"
+#include "profiler.h"
 //#include "CheckError.h"
 
 // #define Print(x)  do { std::cerr << #x " = " << (x) << std::endl; } while(0)
@@ -0,0 +1,169 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- chaosgame.h ---
+//
+//   Parallel chaos-game point generator (Sierpinski gasket and other
+//   "move halfway towards a random vertex" fractals)
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __ANGEL_CHAOSGAME_H__
+#define __ANGEL_CHAOSGAME_H__
+
+#include <mutex>
+#include <vector>
+
+#include "vec.h"
+#include "parallel.h"
+#include "xoshiro.h"
+
+namespace Angel
+{
+
+    class ChaosGame
+    {
+    public:
+        // Points per block; each block has its own random stream, so the
+        // result depends only on the seed, not on the number of threads
+        static const size_t BlockSize = 1 << 16;
+
+        // Steps thrown away at the start of a block. Every step halves the
+        // distance to the attractor, so after 32 the start point is lost
+        // below float precision.
+        static const int BurnIn = 32;
+
+        // Blocks between cached streams; a block's stream is at most this
+        // many jumps away from one
+        static const size_t CheckpointInterval = 16;
+
+    private:
+        std::vector<vec2> _vertices;
+        uint64_t _seed;
+
+        // Streams of blocks 0, CheckpointInterval, 2 * CheckpointInterval,
+        // ..., added as later blocks are asked for
+        std::mutex _streamMutex;
+        std::vector<Xoshiro256> _checkpoints;
+
+        template <typename Visit>
+        void iterate(Xoshiro256 rng, size_t count, Visit visit) const
+        {
+            const vec2 *vertices = &_vertices[0];
+            uint32_t numVertices = _vertices.size();
+
+            // Start at a vertex, which is already on the attractor
+            vec2 p = vertices[rng.below(numVertices)];
+
+            for (int i = 0; i < BurnIn; i++)
+            {
+                p = (p + vertices[rng.below(numVertices)]) * GLfloat(0.5);
+            }
+
+            for (size_t i = 0; i < count; i++)
+            {
+                p = (p + vertices[rng.below(numVertices)]) * GLfloat(0.5);
+                visit(p);
+            }
+        }
+
+        void fill(Xoshiro256 rng, vec2 *points, size_t count) const
+        {
+            iterate(rng, count, [&](const vec2 &p)
+                    { *points++ = p; });
+        }
+
+    public:
+        ChaosGame(const std::vector<vec2> &vertices, uint64_t seed = 1)
+            : _vertices(vertices), _seed(seed), _checkpoints(1, Xoshiro256(seed)) {}
+
+        uint64_t seed() const { return _seed; }
+
+        size_t numBlocks(size_t count) const
+        {
+            return (count + BlockSize - 1) / BlockSize;
+        }
+
+        // Random stream of a block, thread-safe. Blocks may be asked for in
+        // any order: each one jumps on from the nearest checkpoint below it,
+        // outside the lock, and every checkpoint is jumped to only once.
+        Xoshiro256 stream(size_t block)
+        {
+            size_t checkpoint = block / CheckpointInterval;
+            Xoshiro256 rng;
+
+            {
+                std::lock_guard<std::mutex> lock(_streamMutex);
+
+                while (_checkpoints.size() <= checkpoint)
+                {
+                    Xoshiro256 next = _checkpoints.back();
+
+                    for (size_t i = 0; i < CheckpointInterval; i++)
+                    {
+                        next.jump();
+                    }
+
+                    _checkpoints.push_back(next);
+                }
+
+                rng = _checkpoints[checkpoint];
+            }
+
+            for (size_t i = checkpoint * CheckpointInterval; i < block; i++)
+            {
+                rng.jump();
+            }
+
+            return rng;
+        }
+
+        // Write the points of one block (count may be less than BlockSize
+        // for the last block); blocks can be generated concurrently
+        void generateBlock(size_t block, vec2 *points, size_t count)
+        {
+            fill(stream(block), points, count);
+        }
+
+        // Call visit(p) for every point of one block instead of storing them
+        template <typename Visit>
+        void visitBlock(size_t block, size_t count, Visit visit)
+        {
+            iterate(stream(block), count, visit);
+        }
+
+        // Same for the block whose stream is rng; a run of blocks needs
+        // only the stream of its first, each next one is a jump further
+        template <typename Visit>
+        void visitStream(Xoshiro256 rng, size_t count, Visit visit) const
+        {
+            iterate(rng, count, visit);
+        }
+
+        // Fill points[0, count) using every thread of the pool
+        void generate(vec2 *points, size_t count)
+        {
+            size_t blocks = numBlocks(count);
+
+            // Jumping ahead is serial, do it before fanning out
+            std::vector<Xoshiro256> streams;
+
+            for (size_t block = 0; block < blocks; block++)
+            {
+                streams.push_back(stream(block));
+            }
+
+            parallelFor(blocks, 1, [&](size_t begin, size_t end)
+                        {
+                for (size_t block = begin; block < end; block++)
+                {
+                    size_t first = block * BlockSize;
+                    size_t blockCount = std::min(size_t(BlockSize), count - first);
+
+                    fill(streams[block], points + first, blockCount);
+                } });
+        }
+    };
+
+} // namespace Angel
+
+#endif // __ANGEL_CHAOSGAME_H__
@@ -0,0 +1,144 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- chunkqueue.h ---
+//
+//   Fixed pool of data chunks passed from producer threads to a consumer
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __ANGEL_CHUNKQUEUE_H__
+#define __ANGEL_CHUNKQUEUE_H__
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+namespace Angel
+{
+
+    //----------------------------------------------------------------------------
+    //
+    //  ChunkQueue - producers take an empty chunk, fill it and push it; the
+    //    consumer pops full chunks and recycles them. Memory use is fixed
+    //    by the number of chunks: producers block while all are in flight.
+    //
+
+    template <typename T>
+    class ChunkQueue
+    {
+    public:
+        struct Chunk
+        {
+            // Index of the chunk in the whole stream, set by the producer
+            size_t index;
+
+            size_t count;
+            std::vector<T> data;
+        };
+
+    private:
+        std::vector<Chunk> _chunks;
+
+        std::mutex _mutex;
+        std::condition_variable _hasEmpty;
+
+        std::vector<Chunk *> _empty;
+        std::deque<Chunk *> _full;
+
+        bool _isClosed;
+
+    public:
+        ChunkQueue() : _isClosed(false) {}
+
+        // Not safe while producers are running
+        void init(size_t numChunks, size_t chunkSize)
+        {
+            _chunks.resize(numChunks);
+            _empty.clear();
+            _full.clear();
+
+            for (Chunk &chunk : _chunks)
+            {
+                chunk.index = 0;
+                chunk.count = 0;
+                chunk.data.resize(chunkSize);
+                _empty.push_back(&chunk);
+            }
+
+            _isClosed = false;
+        }
+
+        size_t chunkSize() const { return _chunks.empty() ? 0 : _chunks[0].data.size(); }
+
+        //
+        //  --- Producer side ---
+        //
+
+        // Blocks until a chunk is free; NULL once the queue is closed
+        Chunk *acquire()
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _hasEmpty.wait(lock, [&]
+                           { return _isClosed || !_empty.empty(); });
+
+            if (_isClosed)
+            {
+                return NULL;
+            }
+
+            Chunk *chunk = _empty.back();
+            _empty.pop_back();
+            return chunk;
+        }
+
+        void push(Chunk *chunk)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _full.push_back(chunk);
+        }
+
+        //
+        //  --- Consumer side ---
+        //
+
+        // Never blocks; NULL if nothing is ready yet
+        Chunk *pop()
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+
+            if (_full.empty())
+            {
+                return NULL;
+            }
+
+            Chunk *chunk = _full.front();
+            _full.pop_front();
+            return chunk;
+        }
+
+        void recycle(Chunk *chunk)
+        {
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _empty.push_back(chunk);
+            }
+
+            _hasEmpty.notify_one();
+        }
+
+        // Wake up and turn away all producers
+        void close()
+        {
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _isClosed = true;
+            }
+
+            _hasEmpty.notify_all();
+        }
+    };
+
+} // namespace Angel
+
+#endif // __ANGEL_CHUNKQUEUE_H__
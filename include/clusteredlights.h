@@ -0,0 +1,325 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- clusteredlights.h ---
+//
+//   Many point lights for forward shading: lights are binned on the CPU
+//   into a grid of view-space froxels (screen tiles split into depth
+//   slices), and the fragment shader only loops over the lights of its
+//   own cluster. The grid and light lists reach the shader as buffer
+//   textures.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __ANGEL_CLUSTEREDLIGHTS_H__
+#define __ANGEL_CLUSTEREDLIGHTS_H__
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "Angel.h"
+#include "parallel.h"
+
+namespace Angel
+{
+
+    //----------------------------------------------------------------------------
+    //
+    //  ClusteredLights - add() lights, move them through the public arrays,
+    //    then build() and upload() once per frame before drawing.
+    //
+    //    The shader finds the cluster of a fragment from gl_FragCoord and
+    //    its view-space depth d:
+    //      x = gl_FragCoord.x * ClusterParams.x, y = gl_FragCoord.y * ClusterParams.y
+    //      z = log(d) * ClusterParams.z + ClusterParams.w
+    //    and reads (first index, light count) of cluster
+    //    (z * GridY + y) * GridX + x from ClusterTexture, the light indices
+    //    from LightIndexTexture, and two texels per light from
+    //    PointLightTexture: view-space position and radius, then color.
+    //
+
+    class ClusteredLights
+    {
+    public:
+        static const int GridX = 16;
+        static const int GridY = 16;
+        static const int GridZ = 24;
+        static const int NumClusters = GridX * GridY * GridZ;
+
+    private:
+        // Lights handled per parallelFor chunk
+        static const size_t Grain = 256;
+
+        // Depth slices are exponential between the near and far plane
+        GLfloat _near;
+        GLfloat _far;
+        GLfloat _depthScale;
+        GLfloat _depthBias;
+
+        int _width;
+        int _height;
+
+        // Clusters touched by each light: x0, x1, y0, y1, z0, z1, empty
+        // when z0 > z1
+        std::vector<int> _ranges;
+
+        // Per cluster (first index, count), then the light indices
+        std::vector<uint32_t> _clusters;
+        std::vector<uint32_t> _indices;
+
+        // Per light: view-space position and radius, color and 0
+        std::vector<GLfloat> _lightData;
+
+        // Buffer objects and their buffer textures: clusters, indices, lights
+        GLuint _buffers[3];
+        GLuint _textures[3];
+        bool _hasGLObjects;
+
+        int slice(GLfloat depth) const
+        {
+            int z = int(std::floor(std::log(depth) * _depthScale + _depthBias));
+            return std::min(std::max(z, 0), GridZ - 1);
+        }
+
+        static int tile(GLfloat ndc, int gridSize)
+        {
+            int i = int(std::floor((ndc + 1.0f) * 0.5f * gridSize));
+            return std::min(std::max(i, 0), gridSize - 1);
+        }
+
+        // Conservative cluster range of light i from its view-space bounding
+        // sphere: the depth slices it spans and the screen rectangle of its
+        // bounding box
+        void bound(size_t i, const mat4 &view, const mat4 &projection)
+        {
+            int *range = &_ranges[6 * i];
+
+            vec4 centre = view * vec4(px[i], py[i], pz[i], 1.0);
+            GLfloat r = radius[i];
+
+            GLfloat *data = &_lightData[8 * i];
+            data[0] = centre.x, data[1] = centre.y, data[2] = centre.z, data[3] = r;
+            data[4] = red[i], data[5] = green[i], data[6] = blue[i], data[7] = 0.0;
+
+            // Empty unless it survives the checks below
+            range[4] = 1, range[5] = 0;
+
+            GLfloat minDepth = -centre.z - r;
+            GLfloat maxDepth = -centre.z + r;
+
+            if (maxDepth < _near || minDepth > _far)
+            {
+                return;
+            }
+
+            GLfloat minX = 1.0, maxX = -1.0, minY = 1.0, maxY = -1.0;
+            bool isBehindEye = false;
+
+            for (int corner = 0; corner < 8 && !isBehindEye; corner++)
+            {
+                vec4 p = projection * vec4(centre.x + ((corner & 1) ? r : -r),
+                                           centre.y + ((corner & 2) ? r : -r),
+                                           centre.z + ((corner & 4) ? r : -r), 1.0);
+
+                // A box reaching behind the eye can cover any part of the screen
+                if (p.w <= 1e-6)
+                {
+                    isBehindEye = true;
+                    break;
+                }
+
+                minX = std::min(minX, p.x / p.w), maxX = std::max(maxX, p.x / p.w);
+                minY = std::min(minY, p.y / p.w), maxY = std::max(maxY, p.y / p.w);
+            }
+
+            if (isBehindEye)
+            {
+                minX = minY = -1.0;
+                maxX = maxY = 1.0;
+            }
+            else if (maxX < -1.0 || minX > 1.0 || maxY < -1.0 || minY > 1.0)
+            {
+                return;
+            }
+
+            range[0] = tile(minX, GridX), range[1] = tile(maxX, GridX);
+            range[2] = tile(minY, GridY), range[3] = tile(maxY, GridY);
+            range[4] = slice(std::max(minDepth, _near));
+            range[5] = slice(std::min(maxDepth, _far));
+        }
+
+        // Calls fn(cluster, light) for each light touching a cluster of
+        // depth slice z, in light order
+        template <typename Function>
+        void forEachInSlice(int z, Function fn) const
+        {
+            for (size_t i = 0; i < size(); i++)
+            {
+                const int *range = &_ranges[6 * i];
+
+                if (z < range[4] || z > range[5])
+                {
+                    continue;
+                }
+
+                for (int y = range[2]; y <= range[3]; y++)
+                {
+                    for (int x = range[0]; x <= range[1]; x++)
+                    {
+                        fn((z * GridY + y) * GridX + x, i);
+                    }
+                }
+            }
+        }
+
+    public:
+        // Structure-of-arrays light store: position (in the space view
+        // maps to eye coordinates), radius of influence and color
+        std::vector<GLfloat> px, py, pz;
+        std::vector<GLfloat> radius;
+        std::vector<GLfloat> red, green, blue;
+
+        ClusteredLights() : _width(1), _height(1), _hasGLObjects(false)
+        {
+            setDepthRange(0.1, 100.0);
+        }
+
+        ~ClusteredLights()
+        {
+            if (_hasGLObjects)
+            {
+                glDeleteTextures(3, _textures);
+                glDeleteBuffers(3, _buffers);
+            }
+        }
+
+        size_t size() const { return px.size(); }
+
+        // Light indices over all clusters after the last build()
+        size_t numIndices() const { return _indices.size(); }
+
+        void add(const vec3 &position, GLfloat lightRadius, const vec3 &color)
+        {
+            px.push_back(position.x), py.push_back(position.y), pz.push_back(position.z);
+            radius.push_back(lightRadius);
+            red.push_back(color.x), green.push_back(color.y), blue.push_back(color.z);
+        }
+
+        void clear()
+        {
+            px.clear(), py.clear(), pz.clear();
+            radius.clear();
+            red.clear(), green.clear(), blue.clear();
+        }
+
+        // View-space depths the slices cover, usually zNear and zFar
+        void setDepthRange(GLfloat zNear, GLfloat zFar)
+        {
+            _near = zNear;
+            _far = zFar;
+            _depthScale = GridZ / std::log(zFar / zNear);
+            _depthBias = -std::log(zNear) * _depthScale;
+        }
+
+        // Bins the lights into clusters for a width x height viewport
+        void build(const mat4 &view, const mat4 &projection, int width, int height)
+        {
+            size_t n = size();
+
+            _width = std::max(width, 1);
+            _height = std::max(height, 1);
+
+            _ranges.resize(6 * n);
+            _lightData.resize(8 * n);
+            _clusters.assign(2 * NumClusters, 0);
+
+            parallelFor(n, Grain, [&](size_t begin, size_t end)
+                        {
+                for (size_t i = begin; i < end; i++)
+                {
+                    bound(i, view, projection);
+                } });
+
+            // Count per cluster, one depth slice per task so no two tasks
+            // touch the same cluster
+            parallelFor(GridZ, 1, [&](size_t begin, size_t end)
+                        {
+                for (size_t z = begin; z < end; z++)
+                {
+                    forEachInSlice(z, [&](int cluster, size_t)
+                                   { _clusters[2 * cluster + 1]++; });
+                } });
+
+            uint32_t offset = 0;
+
+            for (int c = 0; c < NumClusters; c++)
+            {
+                _clusters[2 * c] = offset;
+                offset += _clusters[2 * c + 1];
+            }
+
+            _indices.resize(offset);
+
+            parallelFor(GridZ, 1, [&](size_t begin, size_t end)
+                        {
+                std::vector<uint32_t> cursor(GridX * GridY);
+
+                for (size_t z = begin; z < end; z++)
+                {
+                    const uint32_t *slice = &_clusters[2 * z * GridX * GridY];
+
+                    for (int c = 0; c < GridX * GridY; c++)
+                    {
+                        cursor[c] = slice[2 * c];
+                    }
+
+                    forEachInSlice(z, [&](int cluster, size_t light)
+                                   { _indices[cursor[cluster - z * GridX * GridY]++] = light; });
+                } });
+        }
+
+        // Needs a current GL context and program in use; binds the buffer
+        // textures to units firstUnit to firstUnit + 2
+        void upload(GLuint program, int firstUnit)
+        {
+            if (!_hasGLObjects)
+            {
+                glGenBuffers(3, _buffers);
+                glGenTextures(3, _textures);
+                _hasGLObjects = true;
+            }
+
+            const GLenum formats[3] = {GL_RG32UI, GL_R32UI, GL_RGBA32F};
+            const char *samplers[3] = {"ClusterTexture", "LightIndexTexture", "PointLightTexture"};
+
+            const void *data[3] = {&_clusters[0], _indices.empty() ? NULL : &_indices[0],
+                                   _lightData.empty() ? NULL : &_lightData[0]};
+            size_t sizes[3] = {_clusters.size() * sizeof(uint32_t), _indices.size() * sizeof(uint32_t),
+                               _lightData.size() * sizeof(GLfloat)};
+
+            for (int i = 0; i < 3; i++)
+            {
+                glBindBuffer(GL_TEXTURE_BUFFER, _buffers[i]);
+                glBufferData(GL_TEXTURE_BUFFER, sizes[i], data[i], GL_STREAM_DRAW);
+
+                glActiveTexture(GL_TEXTURE0 + firstUnit + i);
+                glBindTexture(GL_TEXTURE_BUFFER, _textures[i]);
+                glTexBuffer(GL_TEXTURE_BUFFER, formats[i], _buffers[i]);
+
+                glUniform1i(glGetUniformLocation(program, samplers[i]), firstUnit + i);
+            }
+
+            glBindBuffer(GL_TEXTURE_BUFFER, 0);
+            glActiveTexture(GL_TEXTURE0);
+
+            glUniform1i(glGetUniformLocation(program, "NumPointLights"), size());
+            glUniform3i(glGetUniformLocation(program, "ClusterGrid"), GridX, GridY, GridZ);
+            glUniform4f(glGetUniformLocation(program, "ClusterParams"), GLfloat(GridX) / _width,
+                        GLfloat(GridY) / _height, _depthScale, _depthBias);
+        }
+    };
+
+} // namespace Angel
+
+#endif // __ANGEL_CLUSTEREDLIGHTS_H__
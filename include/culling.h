@@ -0,0 +1,250 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- culling.h ---
+//
+//   Visibility tests that keep hidden objects from being drawn: bounding
+//   spheres and boxes against the view frustum (four spheres at a time
+//   with SSE), and per-frame counters of what was culled and drawn.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __ANGEL_CULLING_H__
+#define __ANGEL_CULLING_H__
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define ANGEL_CULLING_SSE
+#endif
+
+#include "Angel.h"
+
+namespace Angel
+{
+
+    //----------------------------------------------------------------------------
+    //
+    //  ViewFrustum - the six planes of a projection (times a view, to test in
+    //    world coordinates), normalized and pointing inwards: a point p is
+    //    inside when a * p.x + b * p.y + c * p.z + d >= 0 for every plane.
+    //    Works for both Perspective() and Ortho().
+    //
+
+    class ViewFrustum
+    {
+    public:
+        static const int NumPlanes = 6;
+
+        // Plane coefficients as structure-of-arrays
+        GLfloat a[NumPlanes], b[NumPlanes], c[NumPlanes], d[NumPlanes];
+
+    private:
+        // Spheres with one radius each, or all with radii[0] when isUniform
+        template <bool isUniform>
+        size_t cull(const GLfloat *x, const GLfloat *y, const GLfloat *z, const GLfloat *radii,
+                    size_t count, uint8_t *visible) const
+        {
+            size_t numVisible = 0;
+            size_t i = 0;
+
+#ifdef ANGEL_CULLING_SSE
+            __m128 uniformRadius = _mm_set1_ps(-radii[0]);
+
+            for (; i + 4 <= count; i += 4)
+            {
+                __m128 px = _mm_loadu_ps(x + i);
+                __m128 py = _mm_loadu_ps(y + i);
+                __m128 pz = _mm_loadu_ps(z + i);
+                __m128 minDistance = isUniform ? uniformRadius : _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(radii + i));
+
+                // All ones while a sphere reaches inside every plane so far
+                __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+
+                for (int p = 0; p < NumPlanes; p++)
+                {
+                    __m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(a[p]), px),
+                                                            _mm_mul_ps(_mm_set1_ps(b[p]), py)),
+                                                 _mm_add_ps(_mm_mul_ps(_mm_set1_ps(c[p]), pz), _mm_set1_ps(d[p])));
+
+                    inside = _mm_and_ps(inside, _mm_cmpge_ps(distance, minDistance));
+                }
+
+                int mask = _mm_movemask_ps(inside);
+
+                for (int k = 0; k < 4; k++)
+                {
+                    visible[i + k] = (mask >> k) & 1;
+                }
+
+                numVisible += ((mask & 1) + ((mask >> 1) & 1)) + (((mask >> 2) & 1) + ((mask >> 3) & 1));
+            }
+#endif
+
+            for (; i < count; i++)
+            {
+                visible[i] = isSphereVisible(vec3(x[i], y[i], z[i]), isUniform ? radii[0] : radii[i]);
+                numVisible += visible[i];
+            }
+
+            return numVisible;
+        }
+
+    public:
+        ViewFrustum() { set(mat4()); }
+
+        explicit ViewFrustum(const mat4 &clip) { set(clip); }
+
+        // Planes of clip = projection * view, in the coordinates view maps from
+        void set(const mat4 &clip)
+        {
+            // Row 3 plus or minus rows 0 (left, right), 1 (bottom, top)
+            // and 2 (near, far)
+            for (int p = 0; p < NumPlanes; p++)
+            {
+                GLfloat sign = (p & 1) ? -1.0 : 1.0;
+                const vec4 &row = clip[p / 2];
+
+                vec4 plane = clip[3] + sign * row;
+                GLfloat length = std::sqrt(plane.x * plane.x + plane.y * plane.y + plane.z * plane.z);
+
+                a[p] = plane.x / length;
+                b[p] = plane.y / length;
+                c[p] = plane.z / length;
+                d[p] = plane.w / length;
+            }
+        }
+
+        bool isSphereVisible(const vec3 &centre, GLfloat radius) const
+        {
+            for (int p = 0; p < NumPlanes; p++)
+            {
+                if (a[p] * centre.x + b[p] * centre.y + c[p] * centre.z + d[p] < -radius)
+                {
+                    return false;
+                }
+            }
+
+            return true;
+        }
+
+        // Axis-aligned box: only its corner furthest along each plane
+        // normal needs testing
+        bool isBoxVisible(const vec3 &minCorner, const vec3 &maxCorner) const
+        {
+            for (int p = 0; p < NumPlanes; p++)
+            {
+                GLfloat x = (a[p] >= 0.0) ? maxCorner.x : minCorner.x;
+                GLfloat y = (b[p] >= 0.0) ? maxCorner.y : minCorner.y;
+                GLfloat z = (c[p] >= 0.0) ? maxCorner.z : minCorner.z;
+
+                if (a[p] * x + b[p] * y + c[p] * z + d[p] < 0.0)
+                {
+                    return false;
+                }
+            }
+
+            return true;
+        }
+
+        // Sets visible[i] to 1 for each sphere (x[i], y[i], z[i]) of radii[i]
+        // that touches the frustum, 0 otherwise; returns how many do
+        size_t cullSpheres(const GLfloat *x, const GLfloat *y, const GLfloat *z, const GLfloat *radii,
+                           size_t count, uint8_t *visible) const
+        {
+            return cull<false>(x, y, z, radii, count, visible);
+        }
+
+        // Same, with one radius for all spheres
+        size_t cullSpheres(const GLfloat *x, const GLfloat *y, const GLfloat *z, GLfloat radius,
+                           size_t count, uint8_t *visible) const
+        {
+            return cull<true>(x, y, z, &radius, count, visible);
+        }
+    };
+
+    //----------------------------------------------------------------------------
+    //
+    //  CullingStats - count objects per frame as they are tested, then
+    //    call endFrame(). Averages over the last printInterval frames are
+    //    printed every printInterval frames once enabled.
+    //
+
+    class CullingStats
+    {
+    public:
+        struct Counts
+        {
+            unsigned long long numObjects;
+            unsigned long long numFrustumCulled;
+            unsigned long long numOccluded;
+            unsigned long long numDrawn;
+        };
+
+    private:
+        Counts _frame;
+        Counts _window;
+        unsigned long long _numFrames;
+
+        int _printInterval;
+
+        static void clear(Counts &counts)
+        {
+            counts.numObjects = counts.numFrustumCulled = counts.numOccluded = counts.numDrawn = 0;
+        }
+
+    public:
+        CullingStats() : _numFrames(0), _printInterval(0)
+        {
+            clear(_frame);
+            clear(_window);
+        }
+
+        void enable(int printInterval) { _printInterval = printInterval; }
+
+        bool isEnabled() const { return _printInterval > 0; }
+
+        // Objects of the current frame, drawn or not
+        void addObjects(unsigned long long count) { _frame.numObjects += count; }
+        void addFrustumCulled(unsigned long long count) { _frame.numFrustumCulled += count; }
+
+        // Objects known to be hidden behind others, and so not drawn
+        void addOccluded(unsigned long long count) { _frame.numOccluded += count; }
+
+        void addDrawn(unsigned long long count) { _frame.numDrawn += count; }
+
+        // Counts of the frame being recorded
+        const Counts &frame() const { return _frame; }
+
+        void endFrame()
+        {
+            _window.numObjects += _frame.numObjects;
+            _window.numFrustumCulled += _frame.numFrustumCulled;
+            _window.numOccluded += _frame.numOccluded;
+            _window.numDrawn += _frame.numDrawn;
+            _numFrames++;
+
+            clear(_frame);
+
+            if (_printInterval > 0 && _numFrames % _printInterval == 0)
+            {
+                print();
+                clear(_window);
+            }
+        }
+
+        void print() const
+        {
+            double frames = _printInterval;
+
+            std::printf("Objects per frame (last %d frames): tested %.1f  frustum culled %.1f  occluded %.1f  drawn %.1f\n",
+                        _printInterval, _window.numObjects / frames, _window.numFrustumCulled / frames,
+                        _window.numOccluded / frames, _window.numDrawn / frames);
+        }
+    };
+
+} // namespace Angel
+
+#endif // __ANGEL_CULLING_H__
@@ -0,0 +1,145 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- density.h ---
+//
+//   Point density image: points are counted per pixel in one histogram
+//   per worker, then merged and tone-mapped to an RGBA image
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __ANGEL_DENSITY_H__
+#define __ANGEL_DENSITY_H__
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "Angel.h"
+#include "parallel.h"
+
+namespace Angel
+{
+
+    class DensityImage
+    {
+        int _width;
+        int _height;
+
+        // One histogram per slice of work, so slices never share counters;
+        // integer counts make the merged result independent of the order
+        std::vector<std::vector<uint32_t>> _histograms;
+
+        std::vector<uint32_t> _density;
+        std::vector<GLubyte> _pixels;
+
+        unsigned long long _numPoints;
+
+    public:
+        DensityImage() : _width(0), _height(0), _numPoints(0) {}
+
+        // Covers [-1, 1] x [-1, 1], like clip coordinates
+        void resize(int width, int height, int numSlices)
+        {
+            _width = width;
+            _height = height;
+
+            _histograms.resize(numSlices);
+            _density.resize(size_t(width) * height);
+            _pixels.resize(4 * _density.size());
+
+            clear();
+        }
+
+        void clear()
+        {
+            for (std::vector<uint32_t> &histogram : _histograms)
+            {
+                histogram.assign(_density.size(), 0);
+            }
+
+            _numPoints = 0;
+        }
+
+        int width() const { return _width; }
+        int height() const { return _height; }
+        int numSlices() const { return _histograms.size(); }
+
+        // Only one thread may splat into a given slice at a time
+        void splat(int slice, const vec2 &p)
+        {
+            int x = int((p.x + 1.0f) * 0.5f * _width);
+            int y = int((p.y + 1.0f) * 0.5f * _height);
+
+            // Points exactly on the right / top edge land in the last pixel
+            x = x < _width ? x : _width - 1;
+            y = y < _height ? y : _height - 1;
+
+            if (x >= 0 && y >= 0)
+            {
+                _histograms[slice][size_t(y) * _width + x]++;
+            }
+        }
+
+        void addPointCount(unsigned long long numPoints) { _numPoints += numPoints; }
+        unsigned long long numPoints() const { return _numPoints; }
+
+        // Sum the histograms row by row in parallel and map density to
+        // color on a log scale, from background (empty) to ink (densest)
+        const std::vector<GLubyte> &resolve(const vec4 &background, const vec4 &ink)
+        {
+            int numSlices = _histograms.size();
+            std::vector<uint32_t> rowMax(_height, 0);
+
+            parallelFor(_height, 16, [&](size_t begin, size_t end)
+                        {
+                for (size_t row = begin; row < end; row++)
+                {
+                    uint32_t *density = &_density[row * _width];
+                    uint32_t maxCount = 0;
+
+                    for (int x = 0; x < _width; x++)
+                    {
+                        uint32_t count = 0;
+
+                        for (int slice = 0; slice < numSlices; slice++)
+                        {
+                            count += _histograms[slice][row * _width + x];
+                        }
+
+                        density[x] = count;
+                        maxCount = count > maxCount ? count : maxCount;
+                    }
+
+                    rowMax[row] = maxCount;
+                } });
+
+            uint32_t maxCount = 0;
+
+            for (uint32_t count : rowMax)
+            {
+                maxCount = count > maxCount ? count : maxCount;
+            }
+
+            GLfloat scale = maxCount > 0 ? 1.0f / std::log(1.0f + maxCount) : 0.0f;
+
+            parallelFor(_density.size(), 16384, [&](size_t begin, size_t end)
+                        {
+                for (size_t i = begin; i < end; i++)
+                {
+                    // Any point at all should show, so start a little above background
+                    GLfloat t = _density[i] ? 0.25f + 0.75f * std::log(1.0f + _density[i]) * scale : 0.0f;
+                    vec4 color = background + t * (ink - background);
+
+                    _pixels[4 * i + 0] = GLubyte(255.0f * color.x + 0.5f);
+                    _pixels[4 * i + 1] = GLubyte(255.0f * color.y + 0.5f);
+                    _pixels[4 * i + 2] = GLubyte(255.0f * color.z + 0.5f);
+                    _pixels[4 * i + 3] = GLubyte(255.0f * color.w + 0.5f);
+                } });
+
+            return _pixels;
+        }
+    };
+
+} // namespace Angel
+
+#endif // __ANGEL_DENSITY_H__
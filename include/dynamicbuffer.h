@@ -0,0 +1,132 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- dynamicbuffer.h ---
+//
+//   Vertex attributes whose data the CPU replaces while the GPU may still
+//   be drawing the previous version: each update is written straight into
+//   the next region of a mapped ring buffer and the attribute re-pointed
+//   at it, so nothing is copied through the driver or waits on the GPU.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __ANGEL_DYNAMICBUFFER_H__
+#define __ANGEL_DYNAMICBUFFER_H__
+
+#include <algorithm>
+
+#include "Angel.h"
+#include "glstate.h"
+#include "ringbuffer.h"
+
+namespace Angel
+{
+
+    //----------------------------------------------------------------------------
+    //
+    //  DynamicAttribute - one non-normalized, tightly packed vertex attribute
+    //    of a vertex array, kept in a MappedRingBuffer of numVersions regions
+    //    (three by default: one being drawn, one queued, one being written).
+    //
+    //      void *data = attribute.beginUpdate(bytes);   // next region
+    //      ... fill data ...
+    //      attribute.endUpdate();                      // draws now use it
+    //
+    //    Updating retires the region of the previous update with a fence, so
+    //    the draws that read it must already have been issued; a region is
+    //    only waited for when it comes round again. Works for per-frame data
+    //    as well as data changed now and then. Binds go through the
+    //    GLStateCache, the attribute must already be enabled.
+    //
+
+    class DynamicAttribute
+    {
+    public:
+        static const int DefaultNumVersions = 3;
+
+    private:
+        MappedRingBuffer _ring;
+
+        GLuint _vertexArray;
+        GLuint _index;
+        GLint _size;
+        GLenum _type;
+        int _numVersions;
+
+        // Region of the last update, if any
+        GLintptr _offset;
+        bool _hasData;
+
+        void allocate(GLsizeiptr regionSize)
+        {
+            _ring.init(GL_ARRAY_BUFFER, regionSize, _numVersions);
+            _hasData = false;
+
+            // init() bound the new buffer behind the cache's back
+            GLStateCache::get().bindBuffer(GL_ARRAY_BUFFER, _ring.buffer());
+        }
+
+    public:
+        DynamicAttribute()
+            : _vertexArray(0), _index(0), _size(4), _type(GL_FLOAT), _numVersions(DefaultNumVersions),
+              _offset(0), _hasData(false) {}
+
+        // Needs a current GL context; capacity is the expected size of an
+        // update in bytes, larger updates grow the buffer
+        void init(GLuint vertexArray, GLuint index, GLint size, GLenum type, GLsizeiptr capacity,
+                  int numVersions = DefaultNumVersions)
+        {
+            _vertexArray = vertexArray;
+            _index = index;
+            _size = size;
+            _type = type;
+            _numVersions = numVersions;
+
+            allocate(std::max(capacity, GLsizeiptr(1)));
+        }
+
+        GLuint buffer() const { return _ring.buffer(); }
+        GLsizeiptr capacity() const { return _ring.slotSize(); }
+        bool isPersistent() const { return _ring.isPersistent(); }
+
+        // Where to write the next version of at most bytes
+        void *beginUpdate(GLsizeiptr bytes)
+        {
+            if (bytes > _ring.slotSize())
+            {
+                // Deleting the old buffer is safe, GL keeps it alive until
+                // the draws reading it are done
+                allocate(std::max(bytes, 2 * _ring.slotSize()));
+            }
+            else if (_hasData)
+            {
+                _ring.fence();
+            }
+
+            GLStateCache::get().bindBuffer(GL_ARRAY_BUFFER, _ring.buffer());
+            return _ring.beginWrite(_offset);
+        }
+
+        void endUpdate()
+        {
+            GLStateCache &cache = GLStateCache::get();
+
+            cache.bindBuffer(GL_ARRAY_BUFFER, _ring.buffer());
+            _ring.endWrite();
+
+            cache.bindVertexArray(_vertexArray);
+            glVertexAttribPointer(_index, _size, _type, GL_FALSE, 0, BUFFER_OFFSET(_offset));
+
+            _hasData = true;
+        }
+
+        // Copies bytes of data in as the next version
+        void update(const void *data, GLsizeiptr bytes)
+        {
+            std::copy_n(static_cast<const GLubyte *>(data), bytes, static_cast<GLubyte *>(beginUpdate(bytes)));
+            endUpdate();
+        }
+    };
+
+} // namespace Angel
+
+#endif // __ANGEL_DYNAMICBUFFER_H__
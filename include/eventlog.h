@@ -0,0 +1,374 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- eventlog.h ---
+//
+//   Record input and simulation events to a compact binary file and feed
+//   them back in the same order, keyed to simulation steps
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __ANGEL_EVENTLOG_H__
+#define __ANGEL_EVENTLOG_H__
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace Angel
+{
+
+    //----------------------------------------------------------------------------
+    //
+    //  LogEvent - one recorded event
+    //
+    //    type is chosen by the program (0 is reserved for the end of a log),
+    //    args hold whatever the program needs to re-apply the event. Events
+    //    recorded at step S were applied after S steps had been taken, so a
+    //    replay applies them right before taking step S + 1.
+    //
+
+    struct LogEvent
+    {
+        static const int MaxArgs = 4;
+
+        unsigned long long step;
+        unsigned type;
+        int numArgs;
+        int args[MaxArgs];
+
+        LogEvent() : step(0), type(0), numArgs(0)
+        {
+            std::memset(args, 0, sizeof(args));
+        }
+    };
+
+    //----------------------------------------------------------------------------
+    //
+    //  EventLog
+    //
+    //    File layout: "ALOG", a version byte, the program name (length byte
+    //    followed by the characters), then one record per event:
+    //
+    //      varint  steps since the previous record
+    //      byte    type
+    //      byte    number of args
+    //      varint  each arg, zig-zag encoded
+    //
+    //    A record of type EndOfLog carries the step the recording stopped at.
+    //    Most records fit in 4-6 bytes.
+    //
+
+    class EventLog
+    {
+    public:
+        static const unsigned EndOfLog = 0;
+
+    private:
+        static const unsigned char Version = 1;
+
+        // The name's length is stored in one byte
+        static const size_t MaxProgramName = 255;
+        static const size_t FlushSize = 64 * 1024;
+
+        enum Mode
+        {
+            IDLE,
+            RECORDING,
+            REPLAYING
+        };
+
+        Mode _mode;
+
+        // Recording
+        std::FILE *_file;
+        std::vector<unsigned char> _buffer;
+        unsigned long long _lastRecordedStep;
+
+        // Replaying
+        std::vector<LogEvent> _events;
+        size_t _nextEvent;
+
+        // Step the recording stopped at (or the latest step seen so far)
+        unsigned long long _endStep;
+
+        void putVarint(unsigned long long value)
+        {
+            while (value >= 0x80)
+            {
+                _buffer.push_back(static_cast<unsigned char>(value | 0x80));
+                value >>= 7;
+            }
+
+            _buffer.push_back(static_cast<unsigned char>(value));
+        }
+
+        static bool getVarint(const unsigned char *&pos, const unsigned char *end, unsigned long long &value)
+        {
+            value = 0;
+
+            for (int shift = 0; pos < end && shift < 64; shift += 7)
+            {
+                unsigned char byte = *pos++;
+                value |= static_cast<unsigned long long>(byte & 0x7f) << shift;
+
+                if (!(byte & 0x80))
+                {
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
+        void putRecord(unsigned long long step, unsigned type, int numArgs, const int *args)
+        {
+            putVarint(step - _lastRecordedStep);
+            _buffer.push_back(static_cast<unsigned char>(type));
+            _buffer.push_back(static_cast<unsigned char>(numArgs));
+
+            for (int i = 0; i < numArgs; i++)
+            {
+                // Zig-zag so small negative values stay small
+                unsigned value = (static_cast<unsigned>(args[i]) << 1) ^ static_cast<unsigned>(args[i] >> 31);
+                putVarint(value);
+            }
+
+            _lastRecordedStep = step;
+
+            if (_buffer.size() >= FlushSize)
+            {
+                flush();
+            }
+        }
+
+        void flush()
+        {
+            if (_file && !_buffer.empty())
+            {
+                std::fwrite(&_buffer[0], 1, _buffer.size(), _file);
+                _buffer.clear();
+            }
+        }
+
+    public:
+        EventLog() : _mode(IDLE), _file(NULL), _lastRecordedStep(0), _nextEvent(0), _endStep(0) {}
+
+        ~EventLog() { finish(); }
+
+        bool isRecording() const { return _mode == RECORDING; }
+        bool isReplaying() const { return _mode == REPLAYING; }
+
+        //
+        //  --- Recording ---
+        //
+
+        // Fails for a program name longer than MaxProgramName characters
+        bool startRecording(const std::string &path, const std::string &program)
+        {
+            finish();
+
+            if (program.size() > MaxProgramName)
+            {
+                return false;
+            }
+
+            _file = std::fopen(path.c_str(), "wb");
+
+            if (!_file)
+            {
+                return false;
+            }
+
+            _buffer.clear();
+            _buffer.push_back('A');
+            _buffer.push_back('L');
+            _buffer.push_back('O');
+            _buffer.push_back('G');
+            _buffer.push_back(static_cast<unsigned char>(Version));
+            _buffer.push_back(static_cast<unsigned char>(program.size()));
+            _buffer.insert(_buffer.end(), program.begin(), program.end());
+
+            _lastRecordedStep = 0;
+            _endStep = 0;
+            _mode = RECORDING;
+            return true;
+        }
+
+        // Steps must never decrease between calls
+        void record(unsigned long long step, unsigned type, int a = 0, int b = 0, int c = 0, int d = 0)
+        {
+            if (_mode != RECORDING)
+            {
+                return;
+            }
+
+            int args[LogEvent::MaxArgs] = {a, b, c, d};
+            int numArgs = LogEvent::MaxArgs;
+
+            // Trailing zero args are implied
+            while (numArgs > 0 && args[numArgs - 1] == 0)
+            {
+                numArgs--;
+            }
+
+            putRecord(step, type, numArgs, args);
+            markStep(step);
+        }
+
+        // Let the log know how far the simulation got, so a replay runs
+        // just as long as the recording even if the last events were early
+        void markStep(unsigned long long step)
+        {
+            if (step > _endStep)
+            {
+                _endStep = step;
+            }
+        }
+
+        // Write the end record and close the file; also called on destruction
+        void finish()
+        {
+            if (_mode == RECORDING)
+            {
+                putRecord(_endStep, EndOfLog, 0, NULL);
+                flush();
+                std::fclose(_file);
+                _file = NULL;
+            }
+
+            _mode = IDLE;
+        }
+
+        //
+        //  --- Replaying ---
+        //
+
+        // Read a whole log written by the given program
+        bool load(const std::string &path, const std::string &program)
+        {
+            finish();
+
+            std::FILE *file = std::fopen(path.c_str(), "rb");
+
+            if (!file)
+            {
+                return false;
+            }
+
+            std::vector<unsigned char> data;
+            unsigned char chunk[4096];
+            size_t numRead;
+
+            while ((numRead = std::fread(chunk, 1, sizeof(chunk), file)) > 0)
+            {
+                data.insert(data.end(), chunk, chunk + numRead);
+            }
+
+            std::fclose(file);
+
+            size_t headerSize = 6 + program.size();
+
+            if (data.size() < headerSize || std::memcmp(&data[0], "ALOG", 4) != 0 || data[4] != Version ||
+                data[5] != program.size() || program.compare(0, program.size(), reinterpret_cast<const char *>(&data[6]), program.size()) != 0)
+            {
+                return false;
+            }
+
+            const unsigned char *pos = &data[0] + headerSize;
+            const unsigned char *end = &data[0] + data.size();
+
+            _events.clear();
+            _nextEvent = 0;
+            _endStep = 0;
+
+            unsigned long long step = 0;
+
+            // A log cut short (e.g. by a crash) is replayed up to its last event
+            while (pos < end)
+            {
+                unsigned long long delta;
+
+                if (!getVarint(pos, end, delta) || end - pos < 2)
+                {
+                    break;
+                }
+
+                LogEvent event;
+                event.step = step += delta;
+                event.type = *pos++;
+                event.numArgs = *pos++;
+
+                if (event.numArgs > LogEvent::MaxArgs)
+                {
+                    break;
+                }
+
+                bool isComplete = true;
+
+                for (int i = 0; i < event.numArgs && isComplete; i++)
+                {
+                    unsigned long long value;
+                    isComplete = getVarint(pos, end, value);
+
+                    unsigned zigzag = static_cast<unsigned>(value);
+                    event.args[i] = static_cast<int>((zigzag >> 1) ^ (0u - (zigzag & 1)));
+                }
+
+                if (!isComplete)
+                {
+                    break;
+                }
+
+                _endStep = step;
+
+                if (event.type == EndOfLog)
+                {
+                    break;
+                }
+
+                _events.push_back(event);
+            }
+
+            _mode = REPLAYING;
+            return true;
+        }
+
+        // Pop the next event that was applied at or before step
+        bool next(unsigned long long step, LogEvent &event)
+        {
+            if (_nextEvent >= _events.size() || _events[_nextEvent].step > step)
+            {
+                return false;
+            }
+
+            event = _events[_nextEvent++];
+            return true;
+        }
+
+        size_t numEvents() const { return _events.size(); }
+
+        unsigned long long endStep() const { return _endStep; }
+    };
+
+    //----------------------------------------------------------------------------
+    //
+    //  Helpers for checkpoint events
+    //
+
+    // FNV-1a hash, chain calls by passing the previous result
+    inline unsigned hashBytes(const void *data, size_t size, unsigned hash = 2166136261u)
+    {
+        const unsigned char *bytes = static_cast<const unsigned char *>(data);
+
+        for (size_t i = 0; i < size; i++)
+        {
+            hash = (hash ^ bytes[i]) * 16777619u;
+        }
+
+        return hash;
+    }
+
+} // namespace Angel
+
+#endif // __ANGEL_EVENTLOG_H__
@@ -0,0 +1,357 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- framebench.h ---
+//
+//   Frame-time benchmark: drives a scene for a fixed number of frames,
+//   times each frame on the CPU and on the GPU (GL_TIME_ELAPSED), and
+//   reports percentiles and primitive throughput as JSON
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __ANGEL_FRAMEBENCH_H__
+#define __ANGEL_FRAMEBENCH_H__
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "Angel.h"
+
+namespace Angel
+{
+
+    //----------------------------------------------------------------------------
+    //
+    //  FrameTimes - summary of one series of frame times, in milliseconds
+    //
+
+    struct FrameTimes
+    {
+        double mean;
+        double p50;
+        double p95;
+        double p99;
+        double max;
+
+        FrameTimes() : mean(0.0), p50(0.0), p95(0.0), p99(0.0), max(0.0) {}
+
+        // times in seconds; percentiles use the nearest-rank method
+        FrameTimes(std::vector<double> times) : FrameTimes()
+        {
+            if (times.empty())
+            {
+                return;
+            }
+
+            std::sort(times.begin(), times.end());
+
+            double sum = 0.0;
+
+            for (double time : times)
+            {
+                sum += time;
+            }
+
+            mean = 1000.0 * sum / times.size();
+            p50 = 1000.0 * percentile(times, 50.0);
+            p95 = 1000.0 * percentile(times, 95.0);
+            p99 = 1000.0 * percentile(times, 99.0);
+            max = 1000.0 * times.back();
+        }
+
+        static double percentile(const std::vector<double> &sorted, double p)
+        {
+            size_t rank = size_t(std::ceil(p / 100.0 * sorted.size()));
+            return sorted[std::max<size_t>(rank, 1) - 1];
+        }
+    };
+
+    //----------------------------------------------------------------------------
+    //
+    //  FrameBenchmark - set up a scene, then call runScene(); repeat for
+    //    every scene and write the results with writeJSON()
+    //
+
+    class FrameBenchmark
+    {
+        struct Scene
+        {
+            std::string name;
+
+            // What GL_PRIMITIVES_GENERATED counts for this scene
+            std::string primitive;
+
+            FrameTimes cpu;
+            FrameTimes gpu;
+
+            double seconds;
+            unsigned long long numPrimitives;
+        };
+
+        std::string _program;
+
+        int _numFrames;
+        int _numWarmupFrames;
+
+        // Time-elapsed and primitives-generated queries around every frame
+        GLuint _queries[2];
+        bool _hasTimer;
+
+        std::vector<Scene> _scenes;
+
+        static void writeTimes(std::ostream &out, const char *name, const FrameTimes &times)
+        {
+            out << "      \"" << name << "\": {\"mean\": " << times.mean
+                << ", \"p50\": " << times.p50 << ", \"p95\": " << times.p95
+                << ", \"p99\": " << times.p99 << ", \"max\": " << times.max << "}";
+        }
+
+        // Value of "key": in the first "times" object after the named scene;
+        // only has to read files written by writeJSON()
+        static bool findValue(const std::string &json, const std::string &scene,
+                              const std::string &times, const std::string &key, double &value)
+        {
+            size_t pos = json.find("\"name\": \"" + scene + "\"");
+
+            if (pos == std::string::npos)
+            {
+                return false;
+            }
+
+            // Stay within this scene's object
+            size_t end = json.find("\"name\": ", pos + 1);
+
+            pos = json.find("\"" + times + "\": {", pos);
+
+            if (pos == std::string::npos || pos > end)
+            {
+                return false;
+            }
+
+            pos = json.find("\"" + key + "\": ", pos);
+
+            if (pos == std::string::npos || pos > end)
+            {
+                return false;
+            }
+
+            value = std::strtod(json.c_str() + pos + key.size() + 4, NULL);
+            return true;
+        }
+
+    public:
+        // Warm-up frames (shader compilation, first uploads) are not timed
+        FrameBenchmark(const std::string &program, int numFrames, int numWarmupFrames = 10)
+            : _program(program), _numFrames(std::max(1, numFrames)), _numWarmupFrames(numWarmupFrames)
+        {
+            glGenQueries(2, _queries);
+
+            GLint counterBits = 0;
+            glGetQueryiv(GL_TIME_ELAPSED, GL_QUERY_COUNTER_BITS, &counterBits);
+            _hasTimer = counterBits > 0;
+        }
+
+        ~FrameBenchmark()
+        {
+            glDeleteQueries(2, _queries);
+        }
+
+        bool hasGPUTimer() const { return _hasTimer; }
+
+        // Call idle() and display() for the warm-up frames plus the timed
+        // frames. CPU time is the whole frame until glFinish() returns.
+        void runScene(const std::string &name, const std::string &primitive,
+                      void (*display)(void), void (*idle)(void) = NULL)
+        {
+            typedef std::chrono::steady_clock Clock;
+
+            std::vector<double> cpuTimes, gpuTimes;
+            cpuTimes.reserve(_numFrames);
+            gpuTimes.reserve(_numFrames);
+
+            Scene scene;
+            scene.name = name;
+            scene.primitive = primitive;
+            scene.numPrimitives = 0;
+
+            for (int frame = -_numWarmupFrames; frame < _numFrames; frame++)
+            {
+                Clock::time_point frameStart = Clock::now();
+
+                if (_hasTimer)
+                {
+                    glBeginQuery(GL_TIME_ELAPSED, _queries[0]);
+                }
+
+                glBeginQuery(GL_PRIMITIVES_GENERATED, _queries[1]);
+
+                if (idle)
+                {
+                    idle();
+                }
+
+                display();
+
+                glEndQuery(GL_PRIMITIVES_GENERATED);
+
+                if (_hasTimer)
+                {
+                    glEndQuery(GL_TIME_ELAPSED);
+                }
+
+                glFinish();
+
+                double cpuTime = std::chrono::duration<double>(Clock::now() - frameStart).count();
+
+                if (frame < 0)
+                {
+                    continue;
+                }
+
+                cpuTimes.push_back(cpuTime);
+
+                // The GPU is idle after glFinish(), so the results are ready
+                GLuint64 numPrimitives = 0;
+                glGetQueryObjectui64v(_queries[1], GL_QUERY_RESULT, &numPrimitives);
+                scene.numPrimitives += numPrimitives;
+
+                if (_hasTimer)
+                {
+                    GLuint64 nanoseconds = 0;
+                    glGetQueryObjectui64v(_queries[0], GL_QUERY_RESULT, &nanoseconds);
+                    gpuTimes.push_back(1e-9 * nanoseconds);
+                }
+            }
+
+            scene.seconds = 0.0;
+
+            for (double time : cpuTimes)
+            {
+                scene.seconds += time;
+            }
+
+            scene.cpu = FrameTimes(cpuTimes);
+            scene.gpu = FrameTimes(gpuTimes);
+
+            _scenes.push_back(scene);
+
+            std::printf("%-24s cpu p50 %8.3f p95 %8.3f p99 %8.3f max %8.3f ms",
+                        name.c_str(), scene.cpu.p50, scene.cpu.p95, scene.cpu.p99, scene.cpu.max);
+
+            if (_hasTimer)
+            {
+                std::printf(" | gpu p50 %8.3f p99 %8.3f ms", scene.gpu.p50, scene.gpu.p99);
+            }
+
+            std::printf(" | %.3g %s/s\n", scene.numPrimitives / scene.seconds, primitive.c_str());
+        }
+
+        void writeJSON(std::ostream &out, int width, int height) const
+        {
+            out << "{\n"
+                << "  \"program\": \"" << _program << "\",\n"
+                << "  \"renderer\": \"" << glGetString(GL_RENDERER) << "\",\n"
+                << "  \"width\": " << width << ",\n"
+                << "  \"height\": " << height << ",\n"
+                << "  \"frames\": " << _numFrames << ",\n"
+                << "  \"warmup_frames\": " << _numWarmupFrames << ",\n"
+                << "  \"scenes\": [\n";
+
+            for (size_t i = 0; i < _scenes.size(); i++)
+            {
+                const Scene &scene = _scenes[i];
+
+                out << "    {\n"
+                    << "      \"name\": \"" << scene.name << "\",\n"
+                    << "      \"primitive\": \"" << scene.primitive << "\",\n"
+                    << "      \"primitives_per_frame\": " << scene.numPrimitives / _numFrames << ",\n"
+                    << "      \"primitives_per_second\": " << scene.numPrimitives / scene.seconds << ",\n";
+
+                writeTimes(out, "cpu_ms", scene.cpu);
+
+                if (_hasTimer)
+                {
+                    out << ",\n";
+                    writeTimes(out, "gpu_ms", scene.gpu);
+                }
+
+                out << "\n    }" << (i + 1 < _scenes.size() ? "," : "") << "\n";
+            }
+
+            out << "  ]\n"
+                << "}\n";
+        }
+
+        bool writeJSON(const std::string &path, int width, int height) const
+        {
+            std::ofstream out(path.c_str());
+
+            if (!out)
+            {
+                return false;
+            }
+
+            writeJSON(out, width, height);
+            return bool(out);
+        }
+
+        // Print the change of the p50 / p99 times against an earlier run
+        bool compare(const std::string &baselinePath) const
+        {
+            std::ifstream in(baselinePath.c_str());
+
+            if (!in)
+            {
+                return false;
+            }
+
+            std::stringstream buffer;
+            buffer << in.rdbuf();
+            std::string json = buffer.str();
+
+            std::printf("Change against %s:\n", baselinePath.c_str());
+
+            for (const Scene &scene : _scenes)
+            {
+                const char *keys[2] = {"p50", "p99"};
+                const double cpuValues[2] = {scene.cpu.p50, scene.cpu.p99};
+                const double gpuValues[2] = {scene.gpu.p50, scene.gpu.p99};
+
+                std::printf("%-24s", scene.name.c_str());
+
+                for (int k = 0; k < 2; k++)
+                {
+                    double baseline;
+
+                    if (findValue(json, scene.name, "cpu_ms", keys[k], baseline) && baseline > 0.0)
+                    {
+                        std::printf(" cpu %s %+7.1f%%", keys[k], 100.0 * (cpuValues[k] / baseline - 1.0));
+                    }
+                }
+
+                for (int k = 0; k < 2 && _hasTimer; k++)
+                {
+                    double baseline;
+
+                    if (findValue(json, scene.name, "gpu_ms", keys[k], baseline) && baseline > 0.0)
+                    {
+                        std::printf(" gpu %s %+7.1f%%", keys[k], 100.0 * (gpuValues[k] / baseline - 1.0));
+                    }
+                }
+
+                std::printf("\n");
+            }
+
+            return true;
+        }
+    };
+
+} // namespace Angel
+
+#endif // __ANGEL_FRAMEBENCH_H__
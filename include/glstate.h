@@ -0,0 +1,558 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- glstate.h ---
+//
+//   A cache of the GL state the homeworks change per draw (program, vertex
+//   array, array buffer, textures, polygon mode and uniforms) that drops
+//   calls setting what is already set, a draw list that sorts draws by
+//   program, texture and vertex array before issuing them, and a mirror
+//   that keeps a variant of a program on the uniform values of the
+//   original.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __ANGEL_GLSTATE_H__
+#define __ANGEL_GLSTATE_H__
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Angel.h"
+
+namespace Angel
+{
+
+    //----------------------------------------------------------------------------
+    //
+    //  GLStateCache - one per program, see get(). Everything starts out
+    //    unknown, so the first call of each kind always reaches GL. Code
+    //    that changes cached state behind the cache's back must call
+    //    invalidate() afterwards. Texture unit 0 is taken to be active
+    //    between calls, and the cache leaves it active too.
+    //
+
+    class GLStateCache
+    {
+    public:
+        static const int MaxTextureUnits = 16;
+
+    private:
+        static const GLuint Unknown = ~0u;
+
+        struct Uniform
+        {
+            GLfloat values[16];
+            int size;
+        };
+
+        GLuint _program;
+        GLuint _vertexArray;
+        GLuint _arrayBuffer;
+        GLuint _polygonMode;
+
+        // Texture bound per unit, and to which target
+        GLuint _textures[MaxTextureUnits];
+        GLenum _textureTargets[MaxTextureUnits];
+
+        // Last value of each uniform, by program and location
+        std::unordered_map<uint64_t, Uniform> _uniforms;
+
+        unsigned long long _numCalls;
+        unsigned long long _numSkipped;
+
+        GLStateCache() : _numCalls(0), _numSkipped(0)
+        {
+            invalidate();
+        }
+
+        // Counts the call; true if it changes nothing
+        bool isRedundant(bool isSame)
+        {
+            _numCalls++;
+            _numSkipped += isSame;
+            return isSame;
+        }
+
+        // Stores size floats as the value of location in the current
+        // program; true if they were already its value
+        bool cacheUniform(GLint location, const GLfloat *values, int size)
+        {
+            if (_program == Unknown || location < 0)
+            {
+                return isRedundant(false);
+            }
+
+            Uniform &uniform = _uniforms[(uint64_t(_program) << 32) | uint32_t(location)];
+
+            if (uniform.size == size && std::memcmp(uniform.values, values, size * sizeof(GLfloat)) == 0)
+            {
+                return isRedundant(true);
+            }
+
+            std::memcpy(uniform.values, values, size * sizeof(GLfloat));
+            uniform.size = size;
+
+            return isRedundant(false);
+        }
+
+    public:
+        static GLStateCache &get()
+        {
+            static GLStateCache cache;
+            return cache;
+        }
+
+        // Forget all cached state
+        void invalidate()
+        {
+            _program = _vertexArray = _arrayBuffer = _polygonMode = Unknown;
+
+            std::fill(_textures, _textures + MaxTextureUnits, GLuint(Unknown));
+            std::fill(_textureTargets, _textureTargets + MaxTextureUnits, GLenum(0));
+
+            _uniforms.clear();
+        }
+
+        // Forget the uniforms cached for program, after they were set
+        // behind the cache's back
+        void invalidateUniforms(GLuint program)
+        {
+            for (auto it = _uniforms.begin(); it != _uniforms.end();)
+            {
+                if ((it->first >> 32) == program)
+                {
+                    it = _uniforms.erase(it);
+                }
+                else
+                {
+                    ++it;
+                }
+            }
+        }
+
+        // Calls made through the cache, and how many of them were dropped
+        unsigned long long numCalls() const { return _numCalls; }
+        unsigned long long numSkipped() const { return _numSkipped; }
+
+        void useProgram(GLuint program)
+        {
+            if (!isRedundant(program == _program))
+            {
+                glUseProgram(program);
+                _program = program;
+            }
+        }
+
+        void bindVertexArray(GLuint vertexArray)
+        {
+            if (!isRedundant(vertexArray == _vertexArray))
+            {
+                glBindVertexArray(vertexArray);
+                _vertexArray = vertexArray;
+            }
+        }
+
+        // Only GL_ARRAY_BUFFER is cached; other targets are passed on
+        void bindBuffer(GLenum target, GLuint buffer)
+        {
+            if (target != GL_ARRAY_BUFFER)
+            {
+                isRedundant(false);
+                glBindBuffer(target, buffer);
+            }
+            else if (!isRedundant(buffer == _arrayBuffer))
+            {
+                glBindBuffer(GL_ARRAY_BUFFER, buffer);
+                _arrayBuffer = buffer;
+            }
+        }
+
+        void bindTexture(GLuint unit, GLenum target, GLuint texture)
+        {
+            bool isCached = unit < MaxTextureUnits;
+
+            if (isRedundant(isCached && texture == _textures[unit] && target == _textureTargets[unit]))
+            {
+                return;
+            }
+
+            if (unit != 0)
+            {
+                glActiveTexture(GL_TEXTURE0 + unit);
+            }
+
+            glBindTexture(target, texture);
+
+            if (unit != 0)
+            {
+                glActiveTexture(GL_TEXTURE0);
+            }
+
+            if (isCached)
+            {
+                _textures[unit] = texture;
+                _textureTargets[unit] = target;
+            }
+        }
+
+        // For GL_FRONT_AND_BACK, the only face core profiles accept
+        void polygonMode(GLenum mode)
+        {
+            if (!isRedundant(mode == _polygonMode))
+            {
+                glPolygonMode(GL_FRONT_AND_BACK, mode);
+                _polygonMode = mode;
+            }
+        }
+
+        //  --- uniforms of the current program ---
+
+        void uniform1i(GLint location, GLint value)
+        {
+            // Stored bit for bit, so it compares like an int
+            GLfloat bits;
+            std::memcpy(&bits, &value, sizeof(bits));
+
+            if (!cacheUniform(location, &bits, 1))
+            {
+                glUniform1i(location, value);
+            }
+        }
+
+        void uniform1f(GLint location, GLfloat value)
+        {
+            if (!cacheUniform(location, &value, 1))
+            {
+                glUniform1f(location, value);
+            }
+        }
+
+        void uniform4fv(GLint location, const vec4 &value)
+        {
+            if (!cacheUniform(location, static_cast<const GLfloat *>(value), 4))
+            {
+                glUniform4fv(location, 1, value);
+            }
+        }
+
+        // Row-major, uploaded transposed like everywhere else
+        void uniformMatrix4fv(GLint location, const mat4 &value)
+        {
+            if (!cacheUniform(location, static_cast<const GLfloat *>(value), 16))
+            {
+                glUniformMatrix4fv(location, 1, GL_TRUE, value);
+            }
+        }
+    };
+
+    //----------------------------------------------------------------------------
+    //
+    //  UniformMirror - for a program built from the same shaders as
+    //    another, with different defines say. init() pairs up their
+    //    uniforms by name; copy() sets each one in the variant to its value
+    //    in the original, so code that only sets uniforms of the original
+    //    can draw with either. Handles float, int and sampler uniforms up
+    //    to vec4 and mat4, and arrays of them.
+    //
+
+    class UniformMirror
+    {
+        struct Entry
+        {
+            GLint from;
+            GLint to;
+            GLenum type;
+        };
+
+        GLuint _from;
+        GLuint _to;
+        std::vector<Entry> _entries;
+
+    public:
+        UniformMirror() : _from(0), _to(0) {}
+
+        // Needs a current GL context
+        void init(GLuint from, GLuint to)
+        {
+            _from = from;
+            _to = to;
+            _entries.clear();
+
+            GLint numUniforms = 0, maxLength = 0;
+            glGetProgramiv(to, GL_ACTIVE_UNIFORMS, &numUniforms);
+            glGetProgramiv(to, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+
+            std::vector<GLchar> name(maxLength + 1);
+
+            for (GLint i = 0; i < numUniforms; i++)
+            {
+                GLint size = 0;
+                GLenum type = 0;
+                glGetActiveUniform(to, i, name.size(), NULL, &size, &type, &name[0]);
+
+                // Arrays are reported as "name[0]"; each element has a
+                // location of its own
+                std::string base(&name[0]);
+
+                if (size > 1 && base.size() > 3 && base.compare(base.size() - 3, 3, "[0]") == 0)
+                {
+                    base.resize(base.size() - 3);
+                }
+
+                for (GLint k = 0; k < size; k++)
+                {
+                    std::string element = (size > 1) ? base + "[" + std::to_string(k) + "]" : base;
+
+                    Entry entry;
+                    entry.from = glGetUniformLocation(from, element.c_str());
+                    entry.to = glGetUniformLocation(to, element.c_str());
+                    entry.type = type;
+
+                    // Built-ins have no location, and the original may not
+                    // use everything the variant does
+                    if (entry.from >= 0 && entry.to >= 0)
+                    {
+                        _entries.push_back(entry);
+                    }
+                }
+            }
+        }
+
+        // Reads the values back from GL, which keeps them on the CPU
+        void copy(GLStateCache &cache = GLStateCache::get())
+        {
+            GLfloat floats[16];
+            GLint ints[4];
+
+            for (const Entry &entry : _entries)
+            {
+                switch (entry.type)
+                {
+                case GL_FLOAT:
+                case GL_FLOAT_VEC2:
+                case GL_FLOAT_VEC3:
+                case GL_FLOAT_VEC4:
+                    glGetUniformfv(_from, entry.from, floats);
+
+                    if (entry.type == GL_FLOAT) glProgramUniform1fv(_to, entry.to, 1, floats);
+                    if (entry.type == GL_FLOAT_VEC2) glProgramUniform2fv(_to, entry.to, 1, floats);
+                    if (entry.type == GL_FLOAT_VEC3) glProgramUniform3fv(_to, entry.to, 1, floats);
+                    if (entry.type == GL_FLOAT_VEC4) glProgramUniform4fv(_to, entry.to, 1, floats);
+                    break;
+
+                case GL_FLOAT_MAT4:
+                    // Read back column-major, as GL keeps it
+                    glGetUniformfv(_from, entry.from, floats);
+                    glProgramUniformMatrix4fv(_to, entry.to, 1, GL_FALSE, floats);
+                    break;
+
+                case GL_INT_VEC2:
+                    glGetUniformiv(_from, entry.from, ints);
+                    glProgramUniform2iv(_to, entry.to, 1, ints);
+                    break;
+
+                case GL_INT_VEC3:
+                    glGetUniformiv(_from, entry.from, ints);
+                    glProgramUniform3iv(_to, entry.to, 1, ints);
+                    break;
+
+                case GL_INT_VEC4:
+                    glGetUniformiv(_from, entry.from, ints);
+                    glProgramUniform4iv(_to, entry.to, 1, ints);
+                    break;
+
+                default:
+                    // int, bool and samplers
+                    glGetUniformiv(_from, entry.from, ints);
+                    glProgramUniform1iv(_to, entry.to, 1, ints);
+                    break;
+                }
+            }
+
+            cache.invalidateUniforms(_to);
+        }
+    };
+
+    //----------------------------------------------------------------------------
+    //
+    //  DrawList - add() draws with the state they need, then execute() them
+    //    through the cache in order of program, texture and vertex array.
+    //    Draws with the same sort key keep the order they were added in.
+    //    Uniforms set after add() belong to that draw.
+    //
+
+    class DrawList
+    {
+        struct UniformSetting
+        {
+            GLint location;
+            GLfloat values[16];
+            int size;
+            bool isInt;
+        };
+
+        struct Draw
+        {
+            uint64_t key;
+
+            GLuint program;
+            GLuint vertexArray;
+            GLuint textureUnit;
+            GLenum textureTarget;
+            GLuint texture;
+
+            GLenum mode;
+            GLint first;
+            GLsizei count;
+
+            // Instance count, -1 for a plain glDrawArrays()
+            GLsizei numInstances;
+
+            // Range of this draw's settings in _uniforms
+            size_t firstUniform;
+            size_t numUniforms;
+        };
+
+        std::vector<Draw> _draws;
+        std::vector<UniformSetting> _uniforms;
+        std::vector<size_t> _order;
+
+        UniformSetting &addUniform(GLint location, int size, bool isInt)
+        {
+            _uniforms.push_back(UniformSetting());
+            _draws.back().numUniforms++;
+
+            UniformSetting &setting = _uniforms.back();
+            setting.location = location;
+            setting.size = size;
+            setting.isInt = isInt;
+            return setting;
+        }
+
+    public:
+        size_t size() const { return _draws.size(); }
+
+        void clear()
+        {
+            _draws.clear();
+            _uniforms.clear();
+        }
+
+        void add(GLuint program, GLuint vertexArray, GLenum mode, GLint first, GLsizei count)
+        {
+            addInstanced(program, vertexArray, mode, first, count, -1);
+        }
+
+        void addInstanced(GLuint program, GLuint vertexArray, GLenum mode, GLint first, GLsizei count,
+                          GLsizei numInstances)
+        {
+            Draw draw;
+            draw.program = program;
+            draw.vertexArray = vertexArray;
+            draw.textureUnit = 0;
+            draw.textureTarget = 0;
+            draw.texture = 0;
+            draw.mode = mode;
+            draw.first = first;
+            draw.count = count;
+            draw.numInstances = numInstances;
+            draw.firstUniform = _uniforms.size();
+            draw.numUniforms = 0;
+
+            // 16 bits of program, 24 of texture and vertex array each; the
+            // texture is filled in by setTexture()
+            draw.key = (uint64_t(program & 0xffff) << 48) | (vertexArray & 0xffffff);
+
+            _draws.push_back(draw);
+        }
+
+        // Texture the last draw needs; one per draw
+        void setTexture(GLuint unit, GLenum target, GLuint texture)
+        {
+            Draw &draw = _draws.back();
+            draw.textureUnit = unit;
+            draw.textureTarget = target;
+            draw.texture = texture;
+            draw.key = (draw.key & ~(uint64_t(0xffffff) << 24)) | (uint64_t(texture & 0xffffff) << 24);
+        }
+
+        void uniform1i(GLint location, GLint value)
+        {
+            std::memcpy(addUniform(location, 1, true).values, &value, sizeof(value));
+        }
+
+        void uniform1f(GLint location, GLfloat value)
+        {
+            addUniform(location, 1, false).values[0] = value;
+        }
+
+        void uniformMatrix4fv(GLint location, const mat4 &value)
+        {
+            std::memcpy(addUniform(location, 16, false).values, static_cast<const GLfloat *>(value), 16 * sizeof(GLfloat));
+        }
+
+        void execute(GLStateCache &cache = GLStateCache::get())
+        {
+            _order.resize(_draws.size());
+
+            for (size_t i = 0; i < _order.size(); i++)
+            {
+                _order[i] = i;
+            }
+
+            std::stable_sort(_order.begin(), _order.end(), [this](size_t a, size_t b)
+                             { return _draws[a].key < _draws[b].key; });
+
+            for (size_t i : _order)
+            {
+                const Draw &draw = _draws[i];
+
+                cache.useProgram(draw.program);
+                cache.bindVertexArray(draw.vertexArray);
+
+                if (draw.textureTarget)
+                {
+                    cache.bindTexture(draw.textureUnit, draw.textureTarget, draw.texture);
+                }
+
+                for (size_t u = draw.firstUniform; u < draw.firstUniform + draw.numUniforms; u++)
+                {
+                    const UniformSetting &setting = _uniforms[u];
+
+                    if (setting.isInt)
+                    {
+                        GLint value;
+                        std::memcpy(&value, setting.values, sizeof(value));
+                        cache.uniform1i(setting.location, value);
+                    }
+                    else if (setting.size == 1)
+                    {
+                        cache.uniform1f(setting.location, setting.values[0]);
+                    }
+                    else
+                    {
+                        mat4 value;
+                        std::memcpy(static_cast<GLfloat *>(value), setting.values, 16 * sizeof(GLfloat));
+                        cache.uniformMatrix4fv(setting.location, value);
+                    }
+                }
+
+                if (draw.numInstances >= 0)
+                {
+                    glDrawArraysInstanced(draw.mode, draw.first, draw.count, draw.numInstances);
+                }
+                else
+                {
+                    glDrawArrays(draw.mode, draw.first, draw.count);
+                }
+            }
+        }
+    };
+
+} // namespace Angel
+
+#endif // __ANGEL_GLSTATE_H__
@@ -0,0 +1,356 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- gputimer.h ---
+//
+//   GPU time of named render passes, measured with timestamp queries and
+//   read back once the GPU has them, so the CPU never waits for the GPU
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __ANGEL_GPUTIMER_H__
+#define __ANGEL_GPUTIMER_H__
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "Angel.h"
+
+namespace Angel
+{
+
+    //----------------------------------------------------------------------------
+    //
+    //  GPUTimer - wrap passes in GPUTimerScope (or begin() / end()) and call
+    //    endFrame() once per frame, after the buffers are swapped. Does
+    //    nothing, not even query calls, until enable() is called.
+    //
+
+    class GPUTimer
+    {
+    public:
+        // Query sets in flight: the one being written and up to three
+        // frames the GPU may still be working on
+        static const int NumFrameSets = 4;
+
+        // Frames the rolling averages are taken over
+        static const int WindowSize = 60;
+
+    private:
+        struct Pass
+        {
+            std::string name;
+
+            // Last WindowSize frame times (ms) of frames that had this pass
+            double samples[WindowSize];
+            int numSamples;
+            int nextSample;
+            double sum;
+
+            // Time of this pass in the frame being read back
+            double frameTime;
+            bool isInFrame;
+        };
+
+        struct Interval
+        {
+            int pass;
+            GLuint queries[2];
+        };
+
+        // Timestamp queries of one frame; queries are reused, never deleted
+        struct FrameSet
+        {
+            std::vector<Interval> intervals;
+            size_t numUsed;
+            unsigned long long frame;
+
+            // Ended but not read back yet
+            bool isPending;
+        };
+
+        std::vector<Pass> _passes;
+
+        FrameSet _sets[NumFrameSets];
+        int _current;
+        unsigned long long _frame;
+
+        // Frames whose set was needed again before the GPU finished them
+        unsigned long long _numDropped;
+
+        bool _isEnabled;
+        int _printInterval;
+        std::FILE *_csv;
+
+        int findPass(const char *name)
+        {
+            for (size_t i = 0; i < _passes.size(); i++)
+            {
+                if (_passes[i].name == name)
+                {
+                    return i;
+                }
+            }
+
+            Pass pass;
+            pass.name = name;
+            pass.numSamples = 0;
+            pass.nextSample = 0;
+            pass.sum = 0.0;
+            pass.frameTime = 0.0;
+            pass.isInFrame = false;
+
+            _passes.push_back(pass);
+            return _passes.size() - 1;
+        }
+
+        // Whether the GPU has written every query of the set, without
+        // waiting for it
+        bool isAvailable(const FrameSet &set) const
+        {
+            for (size_t i = 0; i < set.numUsed; i++)
+            {
+                for (GLuint query : set.intervals[i].queries)
+                {
+                    GLuint available = GL_FALSE;
+                    glGetQueryObjectuiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+
+                    if (!available)
+                    {
+                        return false;
+                    }
+                }
+            }
+
+            return true;
+        }
+
+        // Sum the intervals of a finished frame per pass and add them to
+        // the rolling averages and the CSV file
+        void collect(FrameSet &set)
+        {
+            for (size_t i = 0; i < set.numUsed; i++)
+            {
+                const Interval &interval = set.intervals[i];
+
+                GLuint64 start = 0, end = 0;
+                glGetQueryObjectui64v(interval.queries[0], GL_QUERY_RESULT, &start);
+                glGetQueryObjectui64v(interval.queries[1], GL_QUERY_RESULT, &end);
+
+                Pass &pass = _passes[interval.pass];
+                pass.frameTime += 1e-6 * (end - start);
+                pass.isInFrame = true;
+            }
+
+            for (Pass &pass : _passes)
+            {
+                if (!pass.isInFrame)
+                {
+                    continue;
+                }
+
+                if (pass.numSamples == WindowSize)
+                {
+                    pass.sum -= pass.samples[pass.nextSample];
+                }
+                else
+                {
+                    pass.numSamples++;
+                }
+
+                pass.samples[pass.nextSample] = pass.frameTime;
+                pass.sum += pass.frameTime;
+                pass.nextSample = (pass.nextSample + 1) % WindowSize;
+
+                if (_csv)
+                {
+                    std::fprintf(_csv, "%llu,%s,%.6f\n", set.frame, pass.name.c_str(), pass.frameTime);
+                }
+
+                pass.frameTime = 0.0;
+                pass.isInFrame = false;
+            }
+
+            set.numUsed = 0;
+            set.isPending = false;
+        }
+
+    public:
+        GPUTimer() : _current(0), _frame(0), _numDropped(0), _isEnabled(false), _printInterval(0), _csv(NULL)
+        {
+            for (FrameSet &set : _sets)
+            {
+                set.numUsed = 0;
+                set.frame = 0;
+                set.isPending = false;
+            }
+        }
+
+        ~GPUTimer()
+        {
+            if (_csv)
+            {
+                std::fclose(_csv);
+            }
+        }
+
+        // Needs a current GL context. Prints the averages every
+        // printInterval frames (0 = never) and writes one line per pass
+        // and frame to csvPath (NULL = no file).
+        bool enable(int printInterval, const char *csvPath = NULL)
+        {
+            _isEnabled = true;
+            _printInterval = printInterval;
+
+            if (csvPath)
+            {
+                _csv = std::fopen(csvPath, "w");
+
+                if (!_csv)
+                {
+                    return false;
+                }
+
+                std::fprintf(_csv, "frame,pass,gpu_ms\n");
+            }
+
+            return true;
+        }
+
+        bool isEnabled() const { return _isEnabled; }
+
+        // Returns a handle for end(), -1 when disabled
+        int begin(const char *name)
+        {
+            if (!_isEnabled)
+            {
+                return -1;
+            }
+
+            FrameSet &set = _sets[_current];
+
+            if (set.numUsed == set.intervals.size())
+            {
+                Interval interval;
+                glGenQueries(2, interval.queries);
+                set.intervals.push_back(interval);
+            }
+
+            Interval &interval = set.intervals[set.numUsed];
+            interval.pass = findPass(name);
+
+            glQueryCounter(interval.queries[0], GL_TIMESTAMP);
+
+            return set.numUsed++;
+        }
+
+        void end(int handle)
+        {
+            if (handle >= 0)
+            {
+                glQueryCounter(_sets[_current].intervals[handle].queries[1], GL_TIMESTAMP);
+            }
+        }
+
+        // Read back the finished frames, oldest first, stopping at the
+        // first one the GPU still works on, and move on to the next query
+        // set. If that set is still pending the GPU is NumFrameSets - 1
+        // frames behind, and its frame is dropped rather than waited for.
+        void endFrame()
+        {
+            if (!_isEnabled)
+            {
+                return;
+            }
+
+            _sets[_current].frame = _frame++;
+            _sets[_current].isPending = true;
+            _current = (_current + 1) % NumFrameSets;
+
+            for (int i = 0; i < NumFrameSets; i++)
+            {
+                FrameSet &set = _sets[(_current + i) % NumFrameSets];
+
+                if (!set.isPending)
+                {
+                    continue;
+                }
+
+                if (!isAvailable(set))
+                {
+                    break;
+                }
+
+                collect(set);
+            }
+
+            FrameSet &next = _sets[_current];
+
+            if (next.isPending)
+            {
+                next.numUsed = 0;
+                next.isPending = false;
+                _numDropped++;
+            }
+
+            if (_printInterval > 0 && _frame % _printInterval == 0)
+            {
+                print();
+            }
+        }
+
+        unsigned long long numDropped() const { return _numDropped; }
+
+        // Rolling average in milliseconds, 0 for an unknown pass
+        double average(const char *name) const
+        {
+            for (const Pass &pass : _passes)
+            {
+                if (pass.name == name && pass.numSamples > 0)
+                {
+                    return pass.sum / pass.numSamples;
+                }
+            }
+
+            return 0.0;
+        }
+
+        void print() const
+        {
+            std::printf("GPU ms (last %d frames):", WindowSize);
+
+            for (const Pass &pass : _passes)
+            {
+                if (pass.numSamples > 0)
+                {
+                    std::printf("  %s %.3f", pass.name.c_str(), pass.sum / pass.numSamples);
+                }
+            }
+
+            if (_numDropped > 0)
+            {
+                std::printf("  (%llu frames dropped)", _numDropped);
+            }
+
+            std::printf("\n");
+        }
+    };
+
+    //----------------------------------------------------------------------------
+    //
+    //  GPUTimerScope - times the rest of the enclosing block as one pass
+    //
+
+    class GPUTimerScope
+    {
+        GPUTimer &_timer;
+        int _handle;
+
+    public:
+        GPUTimerScope(GPUTimer &timer, const char *name) : _timer(timer), _handle(timer.begin(name)) {}
+        ~GPUTimerScope() { _timer.end(_handle); }
+    };
+
+} // namespace Angel
+
+#endif // __ANGEL_GPUTIMER_H__
@@ -0,0 +1,303 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- headless.h ---
+//
+//   Offscreen rendering without a window: an EGL context (surfaceless or
+//   pbuffer, e.g. Mesa's software rasterizer) drawing into a framebuffer
+//   object, plus stand-ins for the GLUT calls that need a window
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __ANGEL_HEADLESS_H__
+#define __ANGEL_HEADLESS_H__
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+#include "Angel.h"
+
+#ifndef __APPLE__
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+namespace Angel
+{
+
+    //----------------------------------------------------------------------------
+    //
+    //  HeadlessRenderer - one per program, see get()
+    //
+    //    init() replaces glutInit() / glutCreateWindow(); afterwards the
+    //    program's own init(), reshape(), idle() and display() run as usual
+    //    and run() calls them for a fixed number of frames.
+    //
+
+    class HeadlessRenderer
+    {
+        bool _isActive;
+
+        int _width;
+        int _height;
+
+        GLuint _framebuffer;
+        GLuint _colorbuffer;
+        GLuint _depthbuffer;
+
+#ifndef __APPLE__
+        EGLDisplay _display;
+        EGLSurface _surface;
+        EGLContext _context;
+
+        bool createContext()
+        {
+            PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+                (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+
+            // Mesa's surfaceless platform needs neither X nor a GPU
+            _display = EGL_NO_DISPLAY;
+
+#ifdef EGL_PLATFORM_SURFACELESS_MESA
+            if (getPlatformDisplay)
+            {
+                _display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+            }
+#endif
+
+            EGLint major, minor;
+
+            if (_display == EGL_NO_DISPLAY || !eglInitialize(_display, &major, &minor))
+            {
+                _display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+                if (_display == EGL_NO_DISPLAY || !eglInitialize(_display, &major, &minor))
+                {
+                    return false;
+                }
+            }
+
+            if (!eglBindAPI(EGL_OPENGL_API))
+            {
+                return false;
+            }
+
+            const EGLint configAttribs[] = {
+                EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+                EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+                EGL_NONE};
+
+            EGLConfig config = NULL;
+            EGLint numConfigs = 0;
+
+            eglChooseConfig(_display, configAttribs, &config, 1, &numConfigs);
+
+            // The shaders use the compatibility profile (attribute / varying)
+            const EGLint contextAttribs[] = {
+                EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_COMPATIBILITY_PROFILE_BIT,
+                EGL_NONE};
+
+            _context = eglCreateContext(_display, numConfigs > 0 ? config : (EGLConfig)0, EGL_NO_CONTEXT, contextAttribs);
+
+            if (_context == EGL_NO_CONTEXT)
+            {
+                return false;
+            }
+
+            // Everything is drawn into our framebuffer object, so no surface
+            // is needed if the driver allows it; otherwise use a tiny pbuffer
+            _surface = EGL_NO_SURFACE;
+
+            if (eglMakeCurrent(_display, EGL_NO_SURFACE, EGL_NO_SURFACE, _context))
+            {
+                return true;
+            }
+
+            if (numConfigs == 0)
+            {
+                return false;
+            }
+
+            const EGLint pbufferAttribs[] = {EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE};
+            _surface = eglCreatePbufferSurface(_display, config, pbufferAttribs);
+
+            return _surface != EGL_NO_SURFACE && eglMakeCurrent(_display, _surface, _surface, _context);
+        }
+#endif // __APPLE__
+
+    public:
+        HeadlessRenderer()
+            : _isActive(false), _width(0), _height(0), _framebuffer(0), _colorbuffer(0), _depthbuffer(0)
+#ifndef __APPLE__
+              ,
+              _display(EGL_NO_DISPLAY), _surface(EGL_NO_SURFACE), _context(EGL_NO_CONTEXT)
+#endif
+        {
+        }
+
+        static HeadlessRenderer &get()
+        {
+            static HeadlessRenderer renderer;
+            return renderer;
+        }
+
+        // Create a context and a width x height framebuffer to draw into
+        bool init(int width, int height)
+        {
+#ifdef __APPLE__
+            std::cerr << "Headless rendering needs EGL, which is not available here" << std::endl;
+            return false;
+#else
+            if (!createContext())
+            {
+                std::cerr << "Could not create an EGL context for headless rendering" << std::endl;
+                return false;
+            }
+
+            // With an EGL context glewInit() may report that there is no GLX
+            // display, but the GL entry points are loaded before that check
+            glewExperimental = GL_TRUE;
+            glewInit();
+
+            _width = width;
+            _height = height;
+
+            glGenRenderbuffers(1, &_colorbuffer);
+            glBindRenderbuffer(GL_RENDERBUFFER, _colorbuffer);
+            glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+
+            glGenRenderbuffers(1, &_depthbuffer);
+            glBindRenderbuffer(GL_RENDERBUFFER, _depthbuffer);
+            glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
+
+            glGenFramebuffers(1, &_framebuffer);
+            glBindFramebuffer(GL_FRAMEBUFFER, _framebuffer);
+            glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, _colorbuffer);
+            glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, _depthbuffer);
+
+            if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            {
+                std::cerr << "Headless framebuffer is incomplete" << std::endl;
+                return false;
+            }
+
+            glViewport(0, 0, width, height);
+
+            std::cout << "Headless rendering with " << glGetString(GL_RENDERER)
+                      << " (OpenGL " << glGetString(GL_VERSION) << ")" << std::endl;
+
+            _isActive = true;
+            return true;
+#endif // __APPLE__
+        }
+
+        bool isActive() const { return _isActive; }
+
+        int width() const { return _width; }
+        int height() const { return _height; }
+
+        // Framebuffer standing in for the window
+        GLuint framebuffer() const { return _framebuffer; }
+
+        // Call idle() and display() numFrames times, waiting for the GPU
+        // after every frame, and print how long the frames took
+        void run(int numFrames, void (*display)(void), void (*idle)(void) = NULL)
+        {
+            std::vector<double> frameTimes;
+            frameTimes.reserve(numFrames);
+
+            typedef std::chrono::steady_clock Clock;
+            Clock::time_point start = Clock::now();
+
+            for (int frame = 0; frame < numFrames; frame++)
+            {
+                Clock::time_point frameStart = Clock::now();
+
+                if (idle)
+                {
+                    idle();
+                }
+
+                display();
+                glFinish();
+
+                frameTimes.push_back(std::chrono::duration<double>(Clock::now() - frameStart).count());
+            }
+
+            double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+            if (frameTimes.empty())
+            {
+                return;
+            }
+
+            double minTime = *std::min_element(frameTimes.begin(), frameTimes.end());
+            double maxTime = *std::max_element(frameTimes.begin(), frameTimes.end());
+
+            std::cout << "Rendered " << numFrames << " frames at " << _width << "x" << _height
+                      << " in " << seconds << " s (" << numFrames / seconds << " fps)" << std::endl;
+            std::cout << "Frame time (ms): min " << 1000.0 * minTime
+                      << ", mean " << 1000.0 * seconds / numFrames
+                      << ", max " << 1000.0 * maxTime << std::endl;
+        }
+
+        // Write the current contents of the framebuffer as a binary PPM
+        bool savePPM(const char *path) const
+        {
+            std::vector<GLubyte> pixels(3 * _width * _height);
+
+            glBindFramebuffer(GL_READ_FRAMEBUFFER, _framebuffer);
+            glPixelStorei(GL_PACK_ALIGNMENT, 1);
+            glReadPixels(0, 0, _width, _height, GL_RGB, GL_UNSIGNED_BYTE, &pixels[0]);
+
+            std::FILE *file = std::fopen(path, "wb");
+
+            if (!file)
+            {
+                return false;
+            }
+
+            std::fprintf(file, "P6\n%d %d\n255\n", _width, _height);
+
+            // GL rows go bottom-up, PPM rows top-down
+            for (int row = _height - 1; row >= 0; row--)
+            {
+                std::fwrite(&pixels[3 * _width * row], 1, 3 * _width, file);
+            }
+
+            std::fclose(file);
+            return true;
+        }
+    };
+
+    //----------------------------------------------------------------------------
+    //
+    //  Window helpers that also work headless
+    //
+
+    inline void swapBuffers()
+    {
+        if (!HeadlessRenderer::get().isActive())
+        {
+            glutSwapBuffers();
+        }
+    }
+
+    inline void postRedisplay()
+    {
+        if (!HeadlessRenderer::get().isActive())
+        {
+            glutPostRedisplay();
+        }
+    }
+
+    // Framebuffer to bind when drawing "to the window"
+    inline GLuint windowFramebuffer()
+    {
+        return HeadlessRenderer::get().framebuffer();
+    }
+
+} // namespace Angel
+
+#endif // __ANGEL_HEADLESS_H__
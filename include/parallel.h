@@ -0,0 +1,180 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- parallel.h ---
+//
+//   Small persistent thread pool with a blocking parallelFor()
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __ANGEL_PARALLEL_H__
+#define __ANGEL_PARALLEL_H__
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Angel
+{
+
+    class ThreadPool
+    {
+        typedef std::function<void(size_t, size_t)> Job;
+
+        std::vector<std::thread> _workers;
+
+        std::mutex _mutex;
+        std::condition_variable _wake;
+        std::condition_variable _done;
+
+        // Current job, published under _mutex and bumped with _generation
+        const Job *_job;
+        size_t _count;
+        size_t _grain;
+        std::atomic<size_t> _next;
+        unsigned _busyWorkers;
+        unsigned long long _generation;
+        bool _quit;
+
+        static bool &insideJob()
+        {
+            static thread_local bool inside = false;
+            return inside;
+        }
+
+        // Grab chunks of the current job until none are left
+        void runChunks()
+        {
+            size_t begin;
+
+            while ((begin = _next.fetch_add(_grain)) < _count)
+            {
+                (*_job)(begin, std::min(begin + _grain, _count));
+            }
+        }
+
+        void workerLoop()
+        {
+            unsigned long long seenGeneration = 0;
+
+            insideJob() = true;
+
+            for (;;)
+            {
+                {
+                    std::unique_lock<std::mutex> lock(_mutex);
+                    _wake.wait(lock, [&]
+                               { return _quit || _generation != seenGeneration; });
+
+                    if (_quit)
+                    {
+                        return;
+                    }
+
+                    seenGeneration = _generation;
+                }
+
+                runChunks();
+
+                std::lock_guard<std::mutex> lock(_mutex);
+
+                if (--_busyWorkers == 0)
+                {
+                    _done.notify_one();
+                }
+            }
+        }
+
+    public:
+        // numThreads counts the calling thread, 0 means one per hardware thread
+        explicit ThreadPool(unsigned numThreads = 0)
+            : _job(NULL), _count(0), _grain(1), _next(0), _busyWorkers(0), _generation(0), _quit(false)
+        {
+            if (numThreads == 0)
+            {
+                numThreads = std::max(1u, std::thread::hardware_concurrency());
+            }
+
+            for (unsigned i = 1; i < numThreads; i++)
+            {
+                _workers.emplace_back(&ThreadPool::workerLoop, this);
+            }
+        }
+
+        ~ThreadPool()
+        {
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _quit = true;
+            }
+
+            _wake.notify_all();
+
+            for (std::thread &worker : _workers)
+            {
+                worker.join();
+            }
+        }
+
+        // Number of threads that work on a job, including the caller
+        unsigned size() const { return _workers.size() + 1; }
+
+        // Call fn(begin, end) over [0, count) in chunks of grain items and
+        // return once every chunk is done. Calls from inside a job run serially.
+        void parallelFor(size_t count, size_t grain, const Job &fn)
+        {
+            if (count == 0)
+            {
+                return;
+            }
+
+            grain = std::max<size_t>(grain, 1);
+
+            if (_workers.empty() || count <= grain || insideJob())
+            {
+                fn(0, count);
+                return;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _job = &fn;
+                _count = count;
+                _grain = grain;
+                _next = 0;
+                _busyWorkers = _workers.size();
+                _generation++;
+            }
+
+            _wake.notify_all();
+
+            insideJob() = true;
+            runChunks();
+            insideJob() = false;
+
+            std::unique_lock<std::mutex> lock(_mutex);
+            _done.wait(lock, [&]
+                       { return _busyWorkers == 0; });
+            _job = NULL;
+        }
+
+        // Pool shared by everything in the program
+        static ThreadPool &global()
+        {
+            static ThreadPool pool;
+            return pool;
+        }
+    };
+
+    inline void parallelFor(size_t count, size_t grain, const std::function<void(size_t, size_t)> &fn)
+    {
+        ThreadPool::global().parallelFor(count, grain, fn);
+    }
+
+} // namespace Angel
+
+#endif // __ANGEL_PARALLEL_H__
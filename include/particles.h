@@ -0,0 +1,411 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- particles.h ---
+//
+//   Many equal-sized balls bouncing off each other and the room walls.
+//   Positions and velocities are kept as structure-of-arrays, collisions use
+//   a uniform grid broad phase and a sphere-sphere narrow phase.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __ANGEL_PARTICLES_H__
+#define __ANGEL_PARTICLES_H__
+
+#include <cstdint>
+#include <random>
+#include <vector>
+
+#include "physics.h"
+#include "parallel.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define ANGEL_PARTICLES_SSE
+#endif
+
+namespace Angel
+{
+
+    class ParticleSystem
+    {
+        // Particles handled per parallelFor chunk
+        static const size_t Grain = 4096;
+
+        PhysicsParams _params;
+        double _accumulator;
+        unsigned long long _step;
+
+        // Uniform grid, cell edge equal to one ball diameter so only the
+        // 27 surrounding cells can hold a colliding ball
+        GLfloat _cellSize;
+        int _gridDims[3];
+        std::vector<uint32_t> _cellOf;     // cell of each particle
+        std::vector<uint32_t> _cellStart;  // first sorted slot of each cell (+1 sentinel)
+        std::vector<uint32_t> _cellCursor; // scratch for the counting sort
+        std::vector<uint32_t> _sorted;     // particle indices sorted by cell
+        std::vector<float> _scratch;       // gather buffer for reordering
+
+        // Per-particle corrections computed by the narrow phase
+        std::vector<float> _dpx, _dpy, _dpz;
+        std::vector<float> _dvx, _dvy, _dvz;
+
+    public:
+        // Structure-of-arrays particle store
+        std::vector<float> px, py, pz;
+        std::vector<float> vx, vy, vz;
+
+        ParticleSystem() : _accumulator(0.0), _step(0), _cellSize(1.0)
+        {
+            _gridDims[0] = _gridDims[1] = _gridDims[2] = 1;
+        }
+
+        size_t size() const { return px.size(); }
+        unsigned long long stepCount() const { return _step; }
+        const PhysicsParams &params() const { return _params; }
+
+        // Radius that fills about fillFraction of the room with count balls
+        static GLfloat radiusFor(size_t count, const vec3 &minBounds, const vec3 &maxBounds,
+                                 GLfloat fillFraction = 0.1)
+        {
+            vec3 extent = maxBounds - minBounds;
+            GLfloat volume = extent.x * extent.y * extent.z;
+            return std::cbrt(fillFraction * volume * 3.0 / (4.0 * M_PI * std::max<size_t>(count, 1)));
+        }
+
+        // Scatter count balls through the room with random velocities of
+        // the given speed; the same seed always gives the same set
+        void spawn(size_t count, const PhysicsParams &params, GLfloat speed, unsigned seed = 1)
+        {
+            _params = params;
+            _accumulator = 0.0;
+            _step = 0;
+
+            px.resize(count);
+            py.resize(count);
+            pz.resize(count);
+            vx.resize(count);
+            vy.resize(count);
+            vz.resize(count);
+
+            std::mt19937 generator(seed);
+            std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+            vec3 low = params.minBounds + vec3(params.radius);
+            vec3 high = params.maxBounds - vec3(params.radius);
+
+            for (size_t i = 0; i < count; i++)
+            {
+                px[i] = low.x + unit(generator) * (high.x - low.x);
+                py[i] = low.y + unit(generator) * (high.y - low.y);
+                pz[i] = low.z + unit(generator) * (high.z - low.z);
+
+                vec3 direction = normalize(vec3(unit(generator) - 0.5f, unit(generator) - 0.5f,
+                                                params.bounceZ ? unit(generator) - 0.5f : 0.0f));
+                vx[i] = direction.x * speed;
+                vy[i] = direction.y * speed;
+                vz[i] = direction.z * speed;
+            }
+
+            resizeGrid();
+        }
+
+        void setParams(const PhysicsParams &params)
+        {
+            _params = params;
+            resizeGrid();
+        }
+
+        // Fixed-timestep accumulator, same scheme as BallPhysics::advance()
+        int advance(double elapsed, int maxSteps = 2)
+        {
+            _accumulator += elapsed;
+
+            int numSteps = 0;
+
+            while (_accumulator >= _params.timeStep && numSteps < maxSteps)
+            {
+                step();
+                _accumulator -= _params.timeStep;
+                numSteps++;
+            }
+
+            if (numSteps == maxSteps && _accumulator >= _params.timeStep)
+            {
+                _accumulator = 0.0;
+            }
+
+            return numSteps;
+        }
+
+        void step()
+        {
+            integrate();
+            buildGrid();
+            collide();
+            _step++;
+        }
+
+    private:
+        void resizeGrid()
+        {
+            _cellSize = std::max<GLfloat>(2.0 * _params.radius, 1e-4);
+
+            for (int axis = 0; axis < 3; axis++)
+            {
+                GLfloat extent = _params.maxBounds[axis] - _params.minBounds[axis];
+                _gridDims[axis] = std::max(1, int(std::ceil(extent / _cellSize)));
+            }
+
+            size_t numCells = size_t(_gridDims[0]) * _gridDims[1] * _gridDims[2];
+            _cellStart.assign(numCells + 1, 0);
+            _cellCursor.assign(numCells, 0);
+        }
+
+        int cellCoord(float p, int axis) const
+        {
+            int c = int((p - _params.minBounds[axis]) / _cellSize);
+            return std::min(std::max(c, 0), _gridDims[axis] - 1);
+        }
+
+        uint32_t cellIndex(int cx, int cy, int cz) const
+        {
+            return uint32_t((cz * _gridDims[1] + cy) * _gridDims[0] + cx);
+        }
+
+        // Integrate and bounce off the walls along one axis, four particles at a time
+        static void integrateAxis(float *p, float *v, size_t begin, size_t end,
+                                  float g, float dt, float low, float high, float restitution)
+        {
+            size_t i = begin;
+
+#ifdef ANGEL_PARTICLES_SSE
+            const __m128 gdt = _mm_set1_ps(g * dt);
+            const __m128 vdt = _mm_set1_ps(dt);
+            const __m128 lo = _mm_set1_ps(low);
+            const __m128 hi = _mm_set1_ps(high);
+            const __m128 bounce = _mm_set1_ps(-restitution);
+            const __m128 zero = _mm_setzero_ps();
+
+            for (; i + 4 <= end; i += 4)
+            {
+                __m128 vel = _mm_add_ps(_mm_loadu_ps(v + i), gdt);
+                __m128 pos = _mm_add_ps(_mm_loadu_ps(p + i), _mm_mul_ps(vel, vdt));
+
+                // Moving into a wall it has reached => reflect
+                __m128 hitLow = _mm_and_ps(_mm_cmple_ps(pos, lo), _mm_cmplt_ps(vel, zero));
+                __m128 hitHigh = _mm_and_ps(_mm_cmpge_ps(pos, hi), _mm_cmpgt_ps(vel, zero));
+                __m128 hit = _mm_or_ps(hitLow, hitHigh);
+
+                vel = _mm_or_ps(_mm_andnot_ps(hit, vel), _mm_and_ps(hit, _mm_mul_ps(vel, bounce)));
+                pos = _mm_min_ps(_mm_max_ps(pos, lo), hi);
+
+                _mm_storeu_ps(v + i, vel);
+                _mm_storeu_ps(p + i, pos);
+            }
+#endif // ANGEL_PARTICLES_SSE
+
+            for (; i < end; i++)
+            {
+                v[i] += g * dt;
+                p[i] += v[i] * dt;
+
+                if ((p[i] <= low && v[i] < 0.0f) || (p[i] >= high && v[i] > 0.0f))
+                {
+                    v[i] = -v[i] * restitution;
+                }
+
+                p[i] = std::min(std::max(p[i], low), high);
+            }
+        }
+
+        void integrate()
+        {
+            const PhysicsParams &params = _params;
+            float dt = params.timeStep;
+            float r = params.radius;
+
+            parallelFor(size(), Grain, [&](size_t begin, size_t end)
+                        {
+                integrateAxis(&px[0], &vx[0], begin, end, params.gravity.x, dt,
+                              params.minBounds.x + r, params.maxBounds.x - r, params.restitution);
+                integrateAxis(&py[0], &vy[0], begin, end, params.gravity.y, dt,
+                              params.minBounds.y + r, params.maxBounds.y - r, params.restitution);
+
+                if (params.bounceZ)
+                {
+                    integrateAxis(&pz[0], &vz[0], begin, end, params.gravity.z, dt,
+                                  params.minBounds.z + r, params.maxBounds.z - r, params.restitution);
+                }
+                else
+                {
+                    for (size_t i = begin; i < end; i++)
+                    {
+                        pz[i] += vz[i] * dt;
+                    }
+                } });
+        }
+
+        // Put one array into _sorted order
+        void reorder(std::vector<float> &values)
+        {
+            _scratch.resize(values.size());
+
+            parallelFor(values.size(), Grain, [&](size_t begin, size_t end)
+                        {
+                for (size_t s = begin; s < end; s++)
+                {
+                    _scratch[s] = values[_sorted[s]];
+                } });
+
+            values.swap(_scratch);
+        }
+
+        // Counting sort of the particles by grid cell. The particle arrays
+        // themselves are reordered, so balls sharing a cell are neighbours
+        // in memory and the narrow phase reads them sequentially.
+        void buildGrid()
+        {
+            size_t n = size();
+            _cellOf.resize(n);
+            _sorted.resize(n);
+
+            parallelFor(n, Grain, [&](size_t begin, size_t end)
+                        {
+                for (size_t i = begin; i < end; i++)
+                {
+                    _cellOf[i] = cellIndex(cellCoord(px[i], 0), cellCoord(py[i], 1), cellCoord(pz[i], 2));
+                } });
+
+            std::fill(_cellCursor.begin(), _cellCursor.end(), 0);
+
+            for (size_t i = 0; i < n; i++)
+            {
+                _cellCursor[_cellOf[i]]++;
+            }
+
+            uint32_t offset = 0;
+
+            for (size_t c = 0; c < _cellCursor.size(); c++)
+            {
+                _cellStart[c] = offset;
+                offset += _cellCursor[c];
+                _cellCursor[c] = _cellStart[c];
+            }
+
+            _cellStart[_cellCursor.size()] = offset;
+
+            for (size_t i = 0; i < n; i++)
+            {
+                _sorted[_cellCursor[_cellOf[i]]++] = uint32_t(i);
+            }
+
+            reorder(px);
+            reorder(py);
+            reorder(pz);
+            reorder(vx);
+            reorder(vy);
+            reorder(vz);
+        }
+
+        // Each particle sums the push and impulse it gets from every ball it
+        // overlaps and only writes its own correction, so threads never
+        // touch the same particle and the result does not depend on the
+        // thread count
+        void collide()
+        {
+            size_t n = size();
+            _dpx.resize(n);
+            _dpy.resize(n);
+            _dpz.resize(n);
+            _dvx.resize(n);
+            _dvy.resize(n);
+            _dvz.resize(n);
+
+            const float diameter = 2.0f * _params.radius;
+            const float diameter2 = diameter * diameter;
+            const float impulseScale = 0.5f * (1.0f + _params.restitution);
+
+            parallelFor(n, Grain, [&](size_t begin, size_t end)
+                        {
+                for (size_t i = begin; i < end; i++)
+                {
+                    int cx = cellCoord(px[i], 0);
+                    int cy = cellCoord(py[i], 1);
+                    int cz = cellCoord(pz[i], 2);
+
+                    float dpx = 0.0f, dpy = 0.0f, dpz = 0.0f;
+                    float dvx = 0.0f, dvy = 0.0f, dvz = 0.0f;
+
+                    for (int z = std::max(cz - 1, 0); z <= std::min(cz + 1, _gridDims[2] - 1); z++)
+                    {
+                        for (int y = std::max(cy - 1, 0); y <= std::min(cy + 1, _gridDims[1] - 1); y++)
+                        {
+                            uint32_t rowStart = cellIndex(std::max(cx - 1, 0), y, z);
+                            uint32_t rowEnd = cellIndex(std::min(cx + 1, _gridDims[0] - 1), y, z);
+
+                            // Cells adjacent in x are contiguous in the sorted array
+                            for (uint32_t j = _cellStart[rowStart]; j < _cellStart[rowEnd + 1]; j++)
+                            {
+                                if (j == i)
+                                {
+                                    continue;
+                                }
+
+                                float dx = px[i] - px[j];
+                                float dy = py[i] - py[j];
+                                float dz = pz[i] - pz[j];
+                                float dist2 = dx * dx + dy * dy + dz * dz;
+
+                                if (dist2 >= diameter2 || dist2 <= 1e-12f)
+                                {
+                                    continue;
+                                }
+
+                                float dist = std::sqrt(dist2);
+                                float nx = dx / dist, ny = dy / dist, nz = dz / dist;
+
+                                // Push apart by half the overlap each
+                                float push = 0.5f * (diameter - dist);
+                                dpx += nx * push;
+                                dpy += ny * push;
+                                dpz += nz * push;
+
+                                // Equal masses: each takes half of the exchanged impulse
+                                float approach = (vx[i] - vx[j]) * nx + (vy[i] - vy[j]) * ny + (vz[i] - vz[j]) * nz;
+
+                                if (approach < 0.0f)
+                                {
+                                    float impulse = -impulseScale * approach;
+                                    dvx += nx * impulse;
+                                    dvy += ny * impulse;
+                                    dvz += nz * impulse;
+                                }
+                            }
+                        }
+                    }
+
+                    _dpx[i] = dpx;
+                    _dpy[i] = dpy;
+                    _dpz[i] = dpz;
+                    _dvx[i] = dvx;
+                    _dvy[i] = dvy;
+                    _dvz[i] = dvz;
+                } });
+
+            parallelFor(n, Grain, [&](size_t begin, size_t end)
+                        {
+                for (size_t i = begin; i < end; i++)
+                {
+                    px[i] += _dpx[i];
+                    py[i] += _dpy[i];
+                    pz[i] += _dpz[i];
+                    vx[i] += _dvx[i];
+                    vy[i] += _dvy[i];
+                    vz[i] += _dvz[i];
+                } });
+        }
+    };
+
+} // namespace Angel
+
+#endif // __ANGEL_PARTICLES_H__
@@ -0,0 +1,399 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- physics.h ---
+//
+//   Fixed-timestep bouncing ball simulation that can run on its own thread
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __ANGEL_PHYSICS_H__
+#define __ANGEL_PHYSICS_H__
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+
+#include "vec.h"
+
+namespace Angel
+{
+
+    //----------------------------------------------------------------------------
+    //
+    //  SnapshotBuffer - lock-free hand-off of the latest value from one
+    //    writer thread to one reader thread
+    //
+    //    Three slots are used so that the writer always has a free slot to
+    //    fill and the reader always keeps the slot it is looking at; neither
+    //    side ever blocks.
+    //
+
+    template <typename T>
+    class SnapshotBuffer
+    {
+        static const unsigned IndexMask = 0x3;
+        static const unsigned FreshBit = 0x4;
+
+        T _slots[3];
+
+        // Slot holding the most recently published value, plus FreshBit if
+        // the reader has not picked it up yet
+        std::atomic<unsigned> _middle;
+
+        unsigned _back;  // owned by the writer
+        unsigned _front; // owned by the reader
+
+    public:
+        SnapshotBuffer() : _middle(1), _back(0), _front(2) {}
+
+        // Writer: fill back() then publish() it
+        T &back() { return _slots[_back]; }
+
+        void publish()
+        {
+            unsigned previous = _middle.exchange(_back | FreshBit, std::memory_order_acq_rel);
+            _back = previous & IndexMask;
+        }
+
+        // Reader: latest published value (or the last one read if nothing new)
+        const T &read()
+        {
+            if (_middle.load(std::memory_order_acquire) & FreshBit)
+            {
+                unsigned previous = _middle.exchange(_front, std::memory_order_acq_rel);
+                _front = previous & IndexMask;
+            }
+
+            return _slots[_front];
+        }
+    };
+
+    //----------------------------------------------------------------------------
+    //
+    //  Ball state and simulation parameters
+    //
+
+    struct BallState
+    {
+        vec3 position;
+        vec3 velocity;
+    };
+
+    struct PhysicsParams
+    {
+        // Seconds of simulated time per step
+        GLfloat timeStep;
+
+        vec3 gravity;
+
+        // Fraction of the normal velocity kept after hitting a wall
+        GLfloat restitution;
+
+        GLfloat radius;
+
+        // Room boundaries
+        vec3 minBounds;
+        vec3 maxBounds;
+
+        // Bounce off the front / back walls (only in 3D)
+        bool bounceZ;
+
+        PhysicsParams()
+            : timeStep(1.0 / 120.0), gravity(0.0), restitution(1.0), radius(1.0),
+              minBounds(-1.0), maxBounds(1.0), bounceZ(true) {}
+    };
+
+    // Advance state by one fixed step (semi-implicit Euler) and resolve
+    // collisions with the walls
+    inline void stepBall(BallState &state, const PhysicsParams &params)
+    {
+        GLfloat dt = params.timeStep;
+
+        state.velocity += params.gravity * dt;
+        state.position += state.velocity * dt;
+
+        int numAxes = params.bounceZ ? 3 : 2;
+
+        for (int axis = 0; axis < numAxes; axis++)
+        {
+            GLfloat low = params.minBounds[axis] + params.radius;
+            GLfloat high = params.maxBounds[axis] - params.radius;
+
+            if (state.position[axis] <= low)
+            {
+                state.position[axis] = low;
+
+                if (state.velocity[axis] < 0.0)
+                {
+                    state.velocity[axis] = -state.velocity[axis] * params.restitution;
+                }
+            }
+            else if (state.position[axis] >= high)
+            {
+                state.position[axis] = high;
+
+                if (state.velocity[axis] > 0.0)
+                {
+                    state.velocity[axis] = -state.velocity[axis] * params.restitution;
+                }
+            }
+        }
+    }
+
+    //----------------------------------------------------------------------------
+    //
+    //  BallPhysics - fixed-timestep accumulator around stepBall()
+    //
+    //    Either call advance() from the render loop, or start() a dedicated
+    //    thread and read interpolated positions with renderPosition().
+    //    Changes requested from the render thread (reset, bounds, parameters)
+    //    are applied at the next step boundary so the simulation stays
+    //    deterministic for a given sequence of inputs.
+    //
+
+    class BallPhysics
+    {
+    public:
+        typedef std::chrono::steady_clock Clock;
+
+        struct Snapshot
+        {
+            BallState previous;
+            BallState current;
+
+            // Number of steps taken so far
+            unsigned long long step;
+
+            // Simulated time not yet consumed by a step when published,
+            // and the wall-clock time of publishing
+            double leftover;
+            Clock::time_point publishTime;
+
+            double timeStep;
+
+            Snapshot() : step(0), leftover(0.0), timeStep(1.0) {}
+        };
+
+    private:
+        // Never run more steps than this per update, so a long stall
+        // does not turn into a spiral of ever longer catch-ups
+        static const int MaxStepsPerUpdate = 8;
+
+        PhysicsParams _params;
+        BallState _state;
+        BallState _previousState;
+        unsigned long long _step;
+        double _accumulator;
+
+        // Requests from other threads, guarded by _requestMutex
+        std::mutex _requestMutex;
+        bool _hasNewParams;
+        bool _hasNewState;
+        PhysicsParams _requestedParams;
+        BallState _requestedState;
+
+        SnapshotBuffer<Snapshot> _snapshots;
+
+        std::thread _thread;
+        std::atomic<bool> _running;
+
+        void applyRequests()
+        {
+            std::lock_guard<std::mutex> lock(_requestMutex);
+
+            if (_hasNewParams)
+            {
+                _params = _requestedParams;
+                _hasNewParams = false;
+            }
+
+            if (_hasNewState)
+            {
+                _state = _previousState = _requestedState;
+                _hasNewState = false;
+            }
+        }
+
+        void publish(Clock::time_point now)
+        {
+            Snapshot &snapshot = _snapshots.back();
+            snapshot.previous = _previousState;
+            snapshot.current = _state;
+            snapshot.step = _step;
+            snapshot.leftover = _accumulator;
+            snapshot.publishTime = now;
+            snapshot.timeStep = _params.timeStep;
+            _snapshots.publish();
+        }
+
+        // Same as a published snapshot, for use when no thread is running
+        Snapshot _syncSnapshot;
+
+        const Snapshot &latestSnapshot()
+        {
+            _syncSnapshot.previous = _previousState;
+            _syncSnapshot.current = _state;
+            _syncSnapshot.step = _step;
+            _syncSnapshot.leftover = _accumulator;
+            _syncSnapshot.publishTime = Clock::now();
+            _syncSnapshot.timeStep = _params.timeStep;
+            return _syncSnapshot;
+        }
+
+        void run()
+        {
+            Clock::time_point last = Clock::now();
+
+            while (_running.load(std::memory_order_relaxed))
+            {
+                Clock::time_point now = Clock::now();
+                advance(std::chrono::duration<double>(now - last).count());
+                publish(now);
+                last = now;
+
+                // Sleep until the next step is due
+                double untilNextStep = _params.timeStep - _accumulator;
+                std::this_thread::sleep_for(std::chrono::duration<double>(untilNextStep));
+            }
+        }
+
+    public:
+        BallPhysics()
+            : _step(0), _accumulator(0.0), _hasNewParams(false), _hasNewState(false), _running(false) {}
+
+        ~BallPhysics() { stop(); }
+
+        // Set up parameters and state before the thread is started
+        void init(const PhysicsParams &params, const BallState &state)
+        {
+            _params = _requestedParams = params;
+            _state = _previousState = _requestedState = state;
+            _step = 0;
+            _accumulator = 0.0;
+            publish(Clock::now());
+        }
+
+        // Take as many fixed steps as fit into elapsed seconds
+        int advance(double elapsed)
+        {
+            applyRequests();
+
+            _accumulator += elapsed;
+
+            int numSteps = 0;
+
+            while (_accumulator >= _params.timeStep && numSteps < MaxStepsPerUpdate)
+            {
+                _previousState = _state;
+                stepBall(_state, _params);
+                _accumulator -= _params.timeStep;
+                _step++;
+                numSteps++;
+            }
+
+            // Drop time we could not catch up on
+            if (numSteps == MaxStepsPerUpdate && _accumulator >= _params.timeStep)
+            {
+                _accumulator = 0.0;
+            }
+
+            return numSteps;
+        }
+
+        // Take exactly one step, independent of wall-clock time
+        void step()
+        {
+            applyRequests();
+
+            _previousState = _state;
+            stepBall(_state, _params);
+            _step++;
+        }
+
+        void start()
+        {
+            if (_running.exchange(true))
+            {
+                return;
+            }
+
+            _thread = std::thread(&BallPhysics::run, this);
+        }
+
+        void stop()
+        {
+            if (!_running.exchange(false))
+            {
+                return;
+            }
+
+            if (_thread.joinable())
+            {
+                _thread.join();
+            }
+        }
+
+        bool isRunning() const { return _running.load(std::memory_order_relaxed); }
+
+        //
+        //  --- Requests (applied at the next step boundary) ---
+        //
+
+        void setParams(const PhysicsParams &params)
+        {
+            std::lock_guard<std::mutex> lock(_requestMutex);
+            _requestedParams = params;
+            _hasNewParams = true;
+        }
+
+        void setState(const BallState &state)
+        {
+            std::lock_guard<std::mutex> lock(_requestMutex);
+            _requestedState = state;
+            _hasNewState = true;
+        }
+
+        // Parameters as last requested (not necessarily applied yet)
+        PhysicsParams params()
+        {
+            std::lock_guard<std::mutex> lock(_requestMutex);
+            return _requestedParams;
+        }
+
+        //
+        //  --- Render-side access ---
+        //
+
+        // State owned by the simulation; only safe when no thread is running
+        const BallState &state() const { return _state; }
+        unsigned long long stepCount() const { return _step; }
+
+        // Latest published steps; call from the render thread only
+        const Snapshot &snapshot()
+        {
+            return isRunning() ? _snapshots.read() : latestSnapshot();
+        }
+
+        // Blend the last two steps by how far wall-clock time has moved past
+        // the newer one, so motion stays smooth at any render rate
+        vec3 renderPosition()
+        {
+            const Snapshot &snapshot = this->snapshot();
+
+            double sincePublish = std::chrono::duration<double>(Clock::now() - snapshot.publishTime).count();
+            double alpha = (snapshot.leftover + sincePublish) / snapshot.timeStep;
+
+            if (alpha > 1.0)
+            {
+                alpha = 1.0;
+            }
+
+            return snapshot.previous.position +
+                   GLfloat(alpha) * (snapshot.current.position - snapshot.previous.position);
+        }
+    };
+
+} // namespace Angel
+
+#endif // __ANGEL_PHYSICS_H__
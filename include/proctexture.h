@@ -0,0 +1,363 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- proctexture.h ---
+//
+//   Procedural RGB textures (stripes, checkers, noise and gradients)
+//   generated on the CPU in parallel tiles, and a 2D texture array that
+//   packs them together with loaded images, one layer per material, so
+//   switching textures is a uniform change instead of a bind.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __ANGEL_PROCTEXTURE_H__
+#define __ANGEL_PROCTEXTURE_H__
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "Angel.h"
+#include "parallel.h"
+
+namespace Angel
+{
+
+    // Calls fn(x0, y0, x1, y1) for each TextureTileSize square tile of a
+    // width x height image, spread over the thread pool
+    const int TextureTileSize = 64;
+
+    template <typename Function>
+    inline void forEachTextureTile(int width, int height, Function fn)
+    {
+        int tilesX = (width + TextureTileSize - 1) / TextureTileSize;
+        int tilesY = (height + TextureTileSize - 1) / TextureTileSize;
+
+        parallelFor(tilesX * tilesY, 1, [&](size_t begin, size_t end)
+                    {
+            for (size_t tile = begin; tile < end; tile++)
+            {
+                int x0 = (tile % tilesX) * TextureTileSize;
+                int y0 = (tile / tilesX) * TextureTileSize;
+
+                fn(x0, y0, std::min(x0 + TextureTileSize, width), std::min(y0 + TextureTileSize, height));
+            } });
+    }
+
+    //----------------------------------------------------------------------------
+    //
+    //  TexturePattern - a repeating pattern between two colors over texture
+    //    coordinates (u, v) in [0, 1), so it tiles seamlessly with
+    //    GL_REPEAT and looks the same at any resolution. Make one with the
+    //    named constructors.
+    //
+
+    struct TexturePattern
+    {
+        enum Kind
+        {
+            STRIPES,
+            CHECKERS,
+            NOISE,
+            GRADIENT
+        };
+
+        Kind kind;
+
+        // RGB in [0, 1]
+        vec3 color0;
+        vec3 color1;
+
+        // Pattern periods across u and v; for noise, lattice cells of the
+        // coarsest octave
+        int repeatsU;
+        int repeatsV;
+
+        // Stripes: part of each period in color0
+        GLfloat fraction;
+
+        // Noise: lattice values and number of octaves
+        uint32_t seed;
+        int numOctaves;
+
+        // Stripes across u, constant along v
+        static TexturePattern stripes(const vec3 &color0, const vec3 &color1, int repeats, GLfloat fraction)
+        {
+            TexturePattern pattern = make(STRIPES, color0, color1, repeats, 1);
+            pattern.fraction = fraction;
+            return pattern;
+        }
+
+        static TexturePattern checkers(const vec3 &color0, const vec3 &color1, int repeatsU, int repeatsV)
+        {
+            return make(CHECKERS, color0, color1, repeatsU, repeatsV);
+        }
+
+        // Fractal value noise blending color0 into color1
+        static TexturePattern noise(const vec3 &color0, const vec3 &color1, int repeatsU, int repeatsV,
+                                    uint32_t seed, int numOctaves = 4)
+        {
+            TexturePattern pattern = make(NOISE, color0, color1, repeatsU, repeatsV);
+            pattern.seed = seed;
+            pattern.numOctaves = numOctaves;
+            return pattern;
+        }
+
+        // color0 at v = 0 to color1 at v = 1
+        static TexturePattern gradient(const vec3 &color0, const vec3 &color1)
+        {
+            return make(GRADIENT, color0, color1, 1, 1);
+        }
+
+        vec3 color(GLfloat u, GLfloat v) const
+        {
+            GLfloat t = 0.0;
+
+            switch (kind)
+            {
+            case STRIPES:
+                t = (fractional(u * repeatsU) < fraction) ? 0.0 : 1.0;
+                break;
+
+            case CHECKERS:
+                t = ((int(std::floor(u * repeatsU)) + int(std::floor(v * repeatsV))) & 1) ? 1.0 : 0.0;
+                break;
+
+            case NOISE:
+                t = fractalNoise(u, v);
+                break;
+
+            case GRADIENT:
+                t = v;
+                break;
+            }
+
+            return color0 + t * (color1 - color0);
+        }
+
+    private:
+        static TexturePattern make(Kind kind, const vec3 &color0, const vec3 &color1, int repeatsU, int repeatsV)
+        {
+            TexturePattern pattern;
+            pattern.kind = kind;
+            pattern.color0 = color0;
+            pattern.color1 = color1;
+            pattern.repeatsU = std::max(repeatsU, 1);
+            pattern.repeatsV = std::max(repeatsV, 1);
+            pattern.fraction = 0.5;
+            pattern.seed = 0;
+            pattern.numOctaves = 1;
+            return pattern;
+        }
+
+        static GLfloat fractional(GLfloat x) { return x - std::floor(x); }
+
+        // Value in [0, 1] at lattice point (x, y) of a periodX x periodY
+        // lattice that wraps around
+        GLfloat latticeValue(int x, int y, int periodX, int periodY, int octave) const
+        {
+            x = ((x % periodX) + periodX) % periodX;
+            y = ((y % periodY) + periodY) % periodY;
+
+            uint32_t h = seed ^ (uint32_t(octave) * 0x9e3779b9u);
+            h ^= uint32_t(x) * 0x85ebca6bu;
+            h = (h ^ (h >> 13)) * 0xc2b2ae35u;
+            h ^= uint32_t(y) * 0x27d4eb2fu;
+            h = (h ^ (h >> 16)) * 0x85ebca6bu;
+            h ^= h >> 13;
+
+            return (h & 0xffffff) / GLfloat(0xffffff);
+        }
+
+        GLfloat valueNoise(GLfloat u, GLfloat v, int periodX, int periodY, int octave) const
+        {
+            GLfloat x = fractional(u) * periodX;
+            GLfloat y = fractional(v) * periodY;
+
+            int x0 = int(std::floor(x));
+            int y0 = int(std::floor(y));
+
+            // Smoothstep between the four surrounding lattice values
+            GLfloat sx = x - x0, sy = y - y0;
+            sx = sx * sx * (3.0f - 2.0f * sx);
+            sy = sy * sy * (3.0f - 2.0f * sy);
+
+            GLfloat bottom = latticeValue(x0, y0, periodX, periodY, octave) +
+                             sx * (latticeValue(x0 + 1, y0, periodX, periodY, octave) - latticeValue(x0, y0, periodX, periodY, octave));
+            GLfloat top = latticeValue(x0, y0 + 1, periodX, periodY, octave) +
+                          sx * (latticeValue(x0 + 1, y0 + 1, periodX, periodY, octave) - latticeValue(x0, y0 + 1, periodX, periodY, octave));
+
+            return bottom + sy * (top - bottom);
+        }
+
+        // Octaves double in frequency and halve in amplitude
+        GLfloat fractalNoise(GLfloat u, GLfloat v) const
+        {
+            GLfloat sum = 0.0, amplitude = 1.0, total = 0.0;
+
+            for (int octave = 0; octave < numOctaves; octave++)
+            {
+                sum += amplitude * valueNoise(u, v, repeatsU << octave, repeatsV << octave, octave);
+                total += amplitude;
+                amplitude *= 0.5;
+            }
+
+            return sum / total;
+        }
+    };
+
+    // Fills width x height RGB texels with a pattern, sampled at texel
+    // centres; a 1D texture is a height of 1
+    inline void generateTexture(const TexturePattern &pattern, int width, int height, GLubyte *rgb)
+    {
+        forEachTextureTile(width, height, [&](int x0, int y0, int x1, int y1)
+                           {
+            for (int y = y0; y < y1; y++)
+            {
+                GLubyte *row = rgb + 3 * size_t(y) * width;
+                GLfloat v = (y + 0.5f) / height;
+
+                for (int x = x0; x < x1; x++)
+                {
+                    vec3 color = pattern.color((x + 0.5f) / width, v);
+
+                    for (int c = 0; c < 3; c++)
+                    {
+                        row[3 * x + c] = GLubyte(std::lround(std::min(std::max(color[c], 0.0f), 1.0f) * 255.0f));
+                    }
+                }
+            } });
+    }
+
+    //----------------------------------------------------------------------------
+    //
+    //  TextureArray - RGB layers of one size for a GL_TEXTURE_2D_ARRAY.
+    //    Add patterns and images on the CPU, each returning its layer, then
+    //    upload() once with a GL context. Shaders sample layer L at (s, t)
+    //    with texture(sampler, vec3(s, t, L)); 1D lookups use t = 0.5 in
+    //    a pattern constant along v.
+    //
+
+    class TextureArray
+    {
+        int _width;
+        int _height;
+
+        // RGB texels of all layers, one after the other
+        std::vector<GLubyte> _texels;
+
+        GLuint _texture;
+
+        GLubyte *newLayer()
+        {
+            size_t layerSize = 3 * size_t(_width) * _height;
+
+            _texels.resize(_texels.size() + layerSize);
+            return &_texels[_texels.size() - layerSize];
+        }
+
+    public:
+        TextureArray(int width, int height) : _width(width), _height(height), _texture(0) {}
+
+        ~TextureArray()
+        {
+            if (_texture)
+            {
+                glDeleteTextures(1, &_texture);
+            }
+        }
+
+        int width() const { return _width; }
+        int height() const { return _height; }
+        int numLayers() const { return _texels.size() / (3 * size_t(_width) * _height); }
+
+        GLuint texture() const { return _texture; }
+
+        int addPattern(const TexturePattern &pattern)
+        {
+            generateTexture(pattern, _width, _height, newLayer());
+            return numLayers() - 1;
+        }
+
+        // An imageWidth x imageHeight RGB image, bilinearly resampled to
+        // the layer size with wrap-around; black if rgb is NULL
+        int addImage(const GLubyte *rgb, int imageWidth, int imageHeight)
+        {
+            GLubyte *layer = newLayer();
+
+            if (!rgb || imageWidth <= 0 || imageHeight <= 0)
+            {
+                std::fill(layer, layer + 3 * size_t(_width) * _height, GLubyte(0));
+                return numLayers() - 1;
+            }
+
+            forEachTextureTile(_width, _height, [&](int x0, int y0, int x1, int y1)
+                               {
+                for (int y = y0; y < y1; y++)
+                {
+                    GLfloat sy = (y + 0.5f) * imageHeight / _height - 0.5f;
+                    int iy = int(std::floor(sy));
+                    GLfloat fy = sy - iy;
+
+                    int row0 = ((iy % imageHeight) + imageHeight) % imageHeight;
+                    int row1 = (row0 + 1) % imageHeight;
+
+                    for (int x = x0; x < x1; x++)
+                    {
+                        GLfloat sx = (x + 0.5f) * imageWidth / _width - 0.5f;
+                        int ix = int(std::floor(sx));
+                        GLfloat fx = sx - ix;
+
+                        int column0 = ((ix % imageWidth) + imageWidth) % imageWidth;
+                        int column1 = (column0 + 1) % imageWidth;
+
+                        const GLubyte *p00 = rgb + 3 * (size_t(row0) * imageWidth + column0);
+                        const GLubyte *p10 = rgb + 3 * (size_t(row0) * imageWidth + column1);
+                        const GLubyte *p01 = rgb + 3 * (size_t(row1) * imageWidth + column0);
+                        const GLubyte *p11 = rgb + 3 * (size_t(row1) * imageWidth + column1);
+
+                        for (int c = 0; c < 3; c++)
+                        {
+                            GLfloat bottom = p00[c] + fx * (p10[c] - p00[c]);
+                            GLfloat top = p01[c] + fx * (p11[c] - p01[c]);
+
+                            layer[3 * (size_t(y) * _width + x) + c] = GLubyte(std::lround(bottom + fy * (top - bottom)));
+                        }
+                    }
+                } });
+
+            return numLayers() - 1;
+        }
+
+        // Creates the texture with mipmaps, repeating in s and t, and
+        // leaves it bound to unit; the CPU copy is kept
+        void upload(GLuint unit)
+        {
+            if (!_texture)
+            {
+                glGenTextures(1, &_texture);
+            }
+
+            glActiveTexture(GL_TEXTURE0 + unit);
+            glBindTexture(GL_TEXTURE_2D_ARRAY, _texture);
+
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_NEAREST);
+
+            // Rows of odd widths are not 4-byte aligned
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+            glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGB8, _width, _height, numLayers(), 0,
+                         GL_RGB, GL_UNSIGNED_BYTE, _texels.empty() ? NULL : &_texels[0]);
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+            glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+
+            glActiveTexture(GL_TEXTURE0);
+        }
+    };
+
+} // namespace Angel
+
+#endif // __ANGEL_PROCTEXTURE_H__
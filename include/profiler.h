@@ -0,0 +1,286 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- profiler.h ---
+//
+//   CPU zone profiler: PROFILE_ZONE / PROFILE_FUNCTION record how long a
+//   block took into a ring buffer owned by the calling thread, and the
+//   events are written as a Chrome trace (chrome://tracing, Perfetto).
+//
+//   Only active when compiled with -DANGEL_PROFILE; otherwise the macros
+//   expand to nothing.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __ANGEL_PROFILER_H__
+#define __ANGEL_PROFILER_H__
+
+#ifdef ANGEL_PROFILE
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define ANGEL_PROFILE_RDTSC
+#endif
+
+namespace Angel
+{
+
+    // Zone names must be string literals (or otherwise live forever)
+    struct ProfileEvent
+    {
+        const char *name;
+        uint64_t start;
+        uint64_t end;
+    };
+
+    //----------------------------------------------------------------------------
+    //
+    //  ProfileBuffer - events of one thread. Only the owning thread writes;
+    //    once full, the oldest events are overwritten.
+    //
+
+    class ProfileBuffer
+    {
+    public:
+        static const size_t Capacity = 1 << 16;
+
+    private:
+        ProfileEvent _events[Capacity];
+
+        // Number of events ever written; published after the event
+        std::atomic<uint64_t> _head;
+
+    public:
+        ProfileBuffer() : _head(0) {}
+
+        void push(const char *name, uint64_t start, uint64_t end)
+        {
+            uint64_t head = _head.load(std::memory_order_relaxed);
+
+            ProfileEvent &event = _events[head & (Capacity - 1)];
+            event.name = name;
+            event.start = start;
+            event.end = end;
+
+            _head.store(head + 1, std::memory_order_release);
+        }
+
+        // Copy out the events still in the buffer, oldest first. The owner
+        // may keep writing; events it overwrote during the copy are dropped.
+        void read(std::vector<ProfileEvent> &events) const
+        {
+            uint64_t head = _head.load(std::memory_order_acquire);
+            uint64_t first = head > Capacity ? head - Capacity : 0;
+
+            size_t begin = events.size();
+
+            for (uint64_t i = first; i < head; i++)
+            {
+                events.push_back(_events[i & (Capacity - 1)]);
+            }
+
+            uint64_t newHead = _head.load(std::memory_order_acquire);
+
+            if (newHead > first + Capacity)
+            {
+                size_t numOverwritten = std::min<uint64_t>(newHead - first - Capacity, head - first);
+                events.erase(events.begin() + begin, events.begin() + begin + numOverwritten);
+            }
+        }
+    };
+
+    //----------------------------------------------------------------------------
+    //
+    //  Profiler - owns the buffers of all threads that recorded a zone,
+    //    so events of threads that have finished are kept
+    //
+
+    class Profiler
+    {
+        typedef std::chrono::steady_clock Clock;
+
+        std::mutex _mutex;
+        std::vector<std::unique_ptr<ProfileBuffer>> _buffers;
+
+        // Pairs the tick counter with the clock to convert ticks to time
+        uint64_t _startTicks;
+        Clock::time_point _startTime;
+
+        std::string _tracePath;
+
+        Profiler() : _startTicks(now()), _startTime(Clock::now()) {}
+
+        ProfileBuffer *addThread()
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+
+            _buffers.emplace_back(new ProfileBuffer());
+            return _buffers.back().get();
+        }
+
+        static void flushAtExit()
+        {
+            Profiler &profiler = get();
+            profiler.writeChromeTrace(profiler._tracePath.c_str());
+        }
+
+    public:
+        static Profiler &get()
+        {
+            static Profiler profiler;
+            return profiler;
+        }
+
+        // Time stamp in ticks: the time stamp counter where available
+        static uint64_t now()
+        {
+#ifdef ANGEL_PROFILE_RDTSC
+            return __rdtsc();
+#else
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+#endif
+        }
+
+        // Buffer of the calling thread, created on its first zone
+        static ProfileBuffer *threadBuffer()
+        {
+            static thread_local ProfileBuffer *buffer = get().addThread();
+            return buffer;
+        }
+
+        // Nanoseconds per tick, measured over the life of the program
+        double tickPeriod()
+        {
+#ifdef ANGEL_PROFILE_RDTSC
+            // Too short a baseline makes the conversion noisy
+            while (Clock::now() - _startTime < std::chrono::milliseconds(10))
+            {
+            }
+
+            double nanoseconds = std::chrono::duration<double, std::nano>(Clock::now() - _startTime).count();
+            return nanoseconds / (now() - _startTicks);
+#else
+            return 1.0;
+#endif
+        }
+
+        bool writeChromeTrace(const char *path)
+        {
+            std::FILE *file = std::fopen(path, "w");
+
+            if (!file)
+            {
+                std::fprintf(stderr, "Could not write %s\n", path);
+                return false;
+            }
+
+            double period = tickPeriod();
+
+            std::vector<ProfileEvent> events;
+            std::vector<size_t> threadEnds;
+            uint64_t origin = UINT64_MAX;
+
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+
+                for (const std::unique_ptr<ProfileBuffer> &buffer : _buffers)
+                {
+                    buffer->read(events);
+                    threadEnds.push_back(events.size());
+                }
+            }
+
+            for (const ProfileEvent &event : events)
+            {
+                origin = std::min(origin, event.start);
+            }
+
+            std::fprintf(file, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+
+            size_t thread = 0;
+
+            for (size_t i = 0; i < events.size(); i++)
+            {
+                while (i >= threadEnds[thread])
+                {
+                    thread++;
+                }
+
+                const ProfileEvent &event = events[i];
+
+                // Complete events, times in microseconds
+                std::fprintf(file, "{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %zu, \"ts\": %.3f, \"dur\": %.3f},\n",
+                             event.name, thread,
+                             1e-3 * period * (event.start - origin),
+                             1e-3 * period * (event.end - event.start));
+            }
+
+            for (thread = 0; thread < threadEnds.size(); thread++)
+            {
+                std::fprintf(file, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %zu, \"args\": {\"name\": \"%s %zu\"}}%s\n",
+                             thread, thread == 0 ? "main" : "thread", thread,
+                             thread + 1 < threadEnds.size() ? "," : "");
+            }
+
+            std::fprintf(file, "]}\n");
+            std::fclose(file);
+
+            std::printf("Wrote %zu profiler events of %zu threads to %s\n", events.size(), threadEnds.size(), path);
+            return true;
+        }
+
+        // Write the trace when the program exits, also through exit()
+        void writeTraceAtExit(const char *path)
+        {
+            _tracePath = path;
+            std::atexit(flushAtExit);
+        }
+    };
+
+    //----------------------------------------------------------------------------
+    //
+    //  ProfileZone - records the lifetime of the enclosing block
+    //
+
+    class ProfileZone
+    {
+        const char *_name;
+        uint64_t _start;
+
+    public:
+        ProfileZone(const char *name) : _name(name), _start(Profiler::now()) {}
+
+        ~ProfileZone()
+        {
+            Profiler::threadBuffer()->push(_name, _start, Profiler::now());
+        }
+    };
+
+} // namespace Angel
+
+#define ANGEL_PROFILE_CONCAT_(a, b) a##b
+#define ANGEL_PROFILE_CONCAT(a, b) ANGEL_PROFILE_CONCAT_(a, b)
+
+#define PROFILE_ZONE(name) Angel::ProfileZone ANGEL_PROFILE_CONCAT(profileZone, __LINE__)(name)
+#define PROFILE_FUNCTION() PROFILE_ZONE(__func__)
+#define PROFILE_TRACE_AT_EXIT(path) Angel::Profiler::get().writeTraceAtExit(path)
+
+#else // ANGEL_PROFILE
+
+#define PROFILE_ZONE(name)
+#define PROFILE_FUNCTION()
+#define PROFILE_TRACE_AT_EXIT(path)
+
+#endif // ANGEL_PROFILE
+
+#endif // __ANGEL_PROFILER_H__
@@ -0,0 +1,338 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- quat.h ---
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __ANGEL_QUAT_H__
+#define __ANGEL_QUAT_H__
+
+#include "mat.h"
+
+#if defined(__SSE__) || defined(_M_X64)
+#include <xmmintrin.h>
+#define ANGEL_QUAT_SSE
+#endif
+
+namespace Angel
+{
+
+    //////////////////////////////////////////////////////////////////////////////
+    //
+    //  quat - unit quaternion for orientations
+    //
+    //    Stored as (x, y, z, w) where (x, y, z) is the vector part and w the
+    //    scalar part, so a quat has the same memory layout as a vec4.
+    //
+
+    struct quat
+    {
+
+        GLfloat x;
+        GLfloat y;
+        GLfloat z;
+        GLfloat w;
+
+        //
+        //  --- Constructors and Destructors ---
+        //
+
+        quat() : x(0.0), y(0.0), z(0.0), w(1.0) {} // identity rotation
+
+        quat(GLfloat x, GLfloat y, GLfloat z, GLfloat w) : x(x), y(y), z(z), w(w) {}
+
+        quat(const vec3 &v, const GLfloat s) : x(v.x), y(v.y), z(v.z), w(s) {}
+
+        quat(const quat &q) : x(q.x), y(q.y), z(q.z), w(q.w) {}
+
+        quat &operator=(const quat &q)
+        {
+            x = q.x;
+            y = q.y;
+            z = q.z;
+            w = q.w;
+            return *this;
+        }
+
+        //
+        //  --- (non-modifying) Arithematic Operators ---
+        //
+
+        quat operator-() const
+        {
+            return quat(-x, -y, -z, -w);
+        }
+
+        quat operator+(const quat &q) const
+        {
+            return quat(x + q.x, y + q.y, z + q.z, w + q.w);
+        }
+
+        quat operator-(const quat &q) const
+        {
+            return quat(x - q.x, y - q.y, z - q.z, w - q.w);
+        }
+
+        quat operator*(const GLfloat s) const
+        {
+            return quat(s * x, s * y, s * z, s * w);
+        }
+
+        friend quat operator*(const GLfloat s, const quat &q)
+        {
+            return q * s;
+        }
+
+        // Hamilton product: (*this * q) applies q first, then *this
+        quat operator*(const quat &q) const
+        {
+#ifdef ANGEL_QUAT_SSE
+            __m128 a = _mm_loadu_ps(&x);
+            __m128 b = _mm_loadu_ps(&q.x);
+
+            __m128 aw = _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 3, 3, 3));
+            __m128 ax = _mm_shuffle_ps(a, a, _MM_SHUFFLE(0, 0, 0, 0));
+            __m128 ay = _mm_shuffle_ps(a, a, _MM_SHUFFLE(1, 1, 1, 1));
+            __m128 az = _mm_shuffle_ps(a, a, _MM_SHUFFLE(2, 2, 2, 2));
+
+            __m128 bwzyx = _mm_shuffle_ps(b, b, _MM_SHUFFLE(0, 1, 2, 3));
+            __m128 bzwxy = _mm_shuffle_ps(b, b, _MM_SHUFFLE(1, 0, 3, 2));
+            __m128 byxwz = _mm_shuffle_ps(b, b, _MM_SHUFFLE(2, 3, 0, 1));
+
+            __m128 r = _mm_mul_ps(aw, b);
+            r = _mm_add_ps(r, _mm_mul_ps(_mm_mul_ps(ax, bwzyx), _mm_setr_ps(1.0f, -1.0f, 1.0f, -1.0f)));
+            r = _mm_add_ps(r, _mm_mul_ps(_mm_mul_ps(ay, bzwxy), _mm_setr_ps(1.0f, 1.0f, -1.0f, -1.0f)));
+            r = _mm_add_ps(r, _mm_mul_ps(_mm_mul_ps(az, byxwz), _mm_setr_ps(-1.0f, 1.0f, 1.0f, -1.0f)));
+
+            quat c;
+            _mm_storeu_ps(&c.x, r);
+            return c;
+#else
+            return quat(w * q.x + x * q.w + y * q.z - z * q.y,
+                        w * q.y - x * q.z + y * q.w + z * q.x,
+                        w * q.z + x * q.y - y * q.x + z * q.w,
+                        w * q.w - x * q.x - y * q.y - z * q.z);
+#endif // ANGEL_QUAT_SSE
+        }
+
+        //
+        //  --- (modifying) Arithematic Operators ---
+        //
+
+        quat &operator*=(const quat &q)
+        {
+            return *this = *this * q;
+        }
+
+        quat &operator*=(const GLfloat s)
+        {
+            x *= s;
+            y *= s;
+            z *= s;
+            w *= s;
+            return *this;
+        }
+
+        //
+        //  --- Insertion and Extraction Operators ---
+        //
+
+        friend std::ostream &operator<<(std::ostream &os, const quat &q)
+        {
+            return os << "( " << q.x << ", " << q.y
+                      << ", " << q.z << ", " << q.w << " )";
+        }
+
+        //
+        //  --- Conversion Operators ---
+        //
+
+        operator const GLfloat *() const
+        {
+            return static_cast<const GLfloat *>(&x);
+        }
+
+        operator GLfloat *()
+        {
+            return static_cast<GLfloat *>(&x);
+        }
+    };
+
+    //----------------------------------------------------------------------------
+    //
+    //  Non-class quat Methods
+    //
+
+    inline GLfloat dot(const quat &p, const quat &q)
+    {
+        return p.x * q.x + p.y * q.y + p.z * q.z + p.w * q.w;
+    }
+
+    inline GLfloat length(const quat &q)
+    {
+        return std::sqrt(dot(q, q));
+    }
+
+    // Re-normalizing after every composition keeps accumulated
+    // orientations from drifting away from a pure rotation
+    inline quat normalize(const quat &q)
+    {
+        GLfloat len = length(q);
+
+        if (len < DivideByZeroTolerance)
+        {
+            return quat();
+        }
+
+        return q * (GLfloat(1.0) / len);
+    }
+
+    inline quat conjugate(const quat &q)
+    {
+        return quat(-q.x, -q.y, -q.z, q.w);
+    }
+
+    inline quat inverse(const quat &q)
+    {
+        return conjugate(q) * (GLfloat(1.0) / dot(q, q));
+    }
+
+    // Rotate a vector by a unit quaternion
+    inline vec3 rotate(const quat &q, const vec3 &v)
+    {
+        // v' = v + 2 * cross(q.xyz, cross(q.xyz, v) + q.w * v)
+        vec3 u(q.x, q.y, q.z);
+        vec3 t = cross(u, v) + q.w * v;
+        return v + GLfloat(2.0) * cross(u, t);
+    }
+
+    inline vec4 rotate(const quat &q, const vec4 &v)
+    {
+        vec3 r = rotate(q, vec3(v.x, v.y, v.z));
+        return vec4(r.x, r.y, r.z, v.w);
+    }
+
+    //----------------------------------------------------------------------------
+    //
+    //  Interpolation
+    //
+
+    // Normalized linear interpolation, cheap and good enough for small steps
+    inline quat nlerp(const quat &p, const quat &q, const GLfloat t)
+    {
+        // Take the shorter arc
+        quat r = dot(p, q) < 0.0 ? -q : q;
+        return normalize(p * (GLfloat(1.0) - t) + r * t);
+    }
+
+    // Spherical linear interpolation, constant angular velocity in t
+    inline quat slerp(const quat &p, const quat &q, const GLfloat t)
+    {
+        GLfloat cosTheta = dot(p, q);
+        quat r = q;
+
+        // Take the shorter arc
+        if (cosTheta < 0.0)
+        {
+            cosTheta = -cosTheta;
+            r = -q;
+        }
+
+        // Nearly parallel, fall back to nlerp to avoid dividing by sin(0)
+        if (cosTheta > 0.9995)
+        {
+            return nlerp(p, r, t);
+        }
+
+        GLfloat theta = std::acos(cosTheta);
+        GLfloat sinTheta = std::sin(theta);
+
+        GLfloat a = std::sin((GLfloat(1.0) - t) * theta) / sinTheta;
+        GLfloat b = std::sin(t * theta) / sinTheta;
+
+        return p * a + r * b;
+    }
+
+    //----------------------------------------------------------------------------
+    //
+    //  Quaternion generators and conversions
+    //
+
+    // Rotation of theta degrees about axis (same convention as RotateX/Y/Z)
+    inline quat AxisAngle(const GLfloat theta, const vec3 &axis)
+    {
+        GLfloat halfAngle = DegreesToRadians * theta * 0.5;
+        vec3 n = normalize(axis);
+
+        return quat(n * std::sin(halfAngle), std::cos(halfAngle));
+    }
+
+    // Rotation matrix equivalent of a unit quaternion
+    inline mat4 Rotate(const quat &q)
+    {
+        GLfloat xx = q.x * q.x, yy = q.y * q.y, zz = q.z * q.z;
+        GLfloat xy = q.x * q.y, xz = q.x * q.z, yz = q.y * q.z;
+        GLfloat wx = q.w * q.x, wy = q.w * q.y, wz = q.w * q.z;
+
+        mat4 c;
+        c[0][0] = 1.0 - 2.0 * (yy + zz);
+        c[0][1] = 2.0 * (xy - wz);
+        c[0][2] = 2.0 * (xz + wy);
+
+        c[1][0] = 2.0 * (xy + wz);
+        c[1][1] = 1.0 - 2.0 * (xx + zz);
+        c[1][2] = 2.0 * (yz - wx);
+
+        c[2][0] = 2.0 * (xz - wy);
+        c[2][1] = 2.0 * (yz + wx);
+        c[2][2] = 1.0 - 2.0 * (xx + yy);
+        return c;
+    }
+
+    // Extract the rotation of the upper 3x3 block of m (assumed orthonormal)
+    inline quat toQuat(const mat4 &m)
+    {
+        GLfloat trace = m[0][0] + m[1][1] + m[2][2];
+        quat q;
+
+        if (trace > 0.0)
+        {
+            GLfloat s = std::sqrt(trace + 1.0) * 2.0;
+            q.w = 0.25 * s;
+            q.x = (m[2][1] - m[1][2]) / s;
+            q.y = (m[0][2] - m[2][0]) / s;
+            q.z = (m[1][0] - m[0][1]) / s;
+        }
+        else if (m[0][0] > m[1][1] && m[0][0] > m[2][2])
+        {
+            GLfloat s = std::sqrt(1.0 + m[0][0] - m[1][1] - m[2][2]) * 2.0;
+            q.w = (m[2][1] - m[1][2]) / s;
+            q.x = 0.25 * s;
+            q.y = (m[0][1] + m[1][0]) / s;
+            q.z = (m[0][2] + m[2][0]) / s;
+        }
+        else if (m[1][1] > m[2][2])
+        {
+            GLfloat s = std::sqrt(1.0 + m[1][1] - m[0][0] - m[2][2]) * 2.0;
+            q.w = (m[0][2] - m[2][0]) / s;
+            q.x = (m[0][1] + m[1][0]) / s;
+            q.y = 0.25 * s;
+            q.z = (m[1][2] + m[2][1]) / s;
+        }
+        else
+        {
+            GLfloat s = std::sqrt(1.0 + m[2][2] - m[0][0] - m[1][1]) * 2.0;
+            q.w = (m[1][0] - m[0][1]) / s;
+            q.x = (m[0][2] + m[2][0]) / s;
+            q.y = (m[1][2] + m[2][1]) / s;
+            q.z = 0.25 * s;
+        }
+
+        return normalize(q);
+    }
+
+    //----------------------------------------------------------------------------
+
+} // namespace Angel
+
+#endif // __ANGEL_QUAT_H__
@@ -0,0 +1,1054 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- rasterizer.h ---
+//
+//   Tile-based software rasterizer for hosts without a GPU. Covers what
+//   the homeworks draw: indexed and non-indexed triangles and points, depth
+//   test, back-face culling, and the shading modes of the homework shaders,
+//   into an in-memory framebuffer. Output does not depend on the number of
+//   threads.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __ANGEL_RASTERIZER_H__
+#define __ANGEL_RASTERIZER_H__
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#include "Angel.h"
+#include "lighting.h"
+#include "parallel.h"
+
+namespace Angel
+{
+
+    //----------------------------------------------------------------------------
+    //
+    //  SoftwareTexture - RGB8 image with a box-filtered mip chain, sampled
+    //    like GL_REPEAT + GL_LINEAR_MIPMAP_NEAREST. A 1D texture is an image
+    //    one texel high.
+    //
+
+    class SoftwareTexture
+    {
+        struct Level
+        {
+            int width;
+            int height;
+            std::vector<vec4> texels;
+        };
+
+        std::vector<Level> _levels;
+
+        vec4 texel(const Level &level, int x, int y) const
+        {
+            x %= level.width;
+            y %= level.height;
+
+            x += x < 0 ? level.width : 0;
+            y += y < 0 ? level.height : 0;
+
+            return level.texels[y * level.width + x];
+        }
+
+    public:
+        SoftwareTexture() {}
+
+        SoftwareTexture(const GLubyte *rgb, int width, int height, bool hasMipmaps = true)
+        {
+            load(rgb, width, height, hasMipmaps);
+        }
+
+        // Rows go from t = 0 up, as glTexImage2D() reads them
+        void load(const GLubyte *rgb, int width, int height, bool hasMipmaps = true)
+        {
+            _levels.clear();
+
+            if (!rgb || width <= 0 || height <= 0)
+            {
+                return;
+            }
+
+            Level base;
+            base.width = width;
+            base.height = height;
+            base.texels.resize(width * height);
+
+            for (int i = 0; i < width * height; i++)
+            {
+                base.texels[i] = vec4(rgb[3 * i] / 255.0, rgb[3 * i + 1] / 255.0, rgb[3 * i + 2] / 255.0, 1.0);
+            }
+
+            _levels.push_back(base);
+
+            while (hasMipmaps && (_levels.back().width > 1 || _levels.back().height > 1))
+            {
+                const Level &prev = _levels.back();
+
+                Level next;
+                next.width = std::max(1, prev.width / 2);
+                next.height = std::max(1, prev.height / 2);
+                next.texels.resize(next.width * next.height);
+
+                // Average the 2x2 texels under each new one; a side of one
+                // texel averages with itself
+                for (int y = 0; y < next.height; y++)
+                {
+                    int y0 = std::min(2 * y, prev.height - 1);
+                    int y1 = std::min(2 * y + 1, prev.height - 1);
+
+                    for (int x = 0; x < next.width; x++)
+                    {
+                        int x0 = std::min(2 * x, prev.width - 1);
+                        int x1 = std::min(2 * x + 1, prev.width - 1);
+
+                        next.texels[y * next.width + x] = 0.25 * (prev.texels[y0 * prev.width + x0] + prev.texels[y0 * prev.width + x1] +
+                                                                  prev.texels[y1 * prev.width + x0] + prev.texels[y1 * prev.width + x1]);
+                    }
+                }
+
+                _levels.push_back(next);
+            }
+        }
+
+        bool empty() const { return _levels.empty(); }
+        int numLevels() const { return _levels.size(); }
+        int width() const { return empty() ? 0 : _levels[0].width; }
+        int height() const { return empty() ? 0 : _levels[0].height; }
+
+        // Nearest mip level for a footprint of texelsPerPixel base texels
+        int level(float texelsPerPixel) const
+        {
+            if (!(texelsPerPixel > 1.0))
+            {
+                return 0;
+            }
+
+            int level = int(std::floor(std::log2(texelsPerPixel) + 0.5));
+            return std::min(level, numLevels() - 1);
+        }
+
+        // Bilinear sample of one level; (0, 0, 0, 1) without an image,
+        // like an incomplete GL texture
+        vec4 sample(float s, float t, int level = 0) const
+        {
+            if (empty())
+            {
+                return vec4(0.0, 0.0, 0.0, 1.0);
+            }
+
+            const Level &mip = _levels[level];
+
+            float u = s * mip.width - 0.5;
+            float v = t * mip.height - 0.5;
+
+            float x0 = std::floor(u);
+            float y0 = std::floor(v);
+
+            float fx = u - x0;
+            float fy = v - y0;
+
+            // Keep the texel indices in range of int for far-out coordinates
+            int x = int(std::fmod(x0, float(mip.width)));
+            int y = int(std::fmod(y0, float(mip.height)));
+
+            vec4 bottom = (1.0 - fx) * texel(mip, x, y) + fx * texel(mip, x + 1, y);
+            vec4 top = (1.0 - fx) * texel(mip, x, y + 1) + fx * texel(mip, x + 1, y + 1);
+
+            return (1.0 - fy) * bottom + fy * top;
+        }
+    };
+
+    //----------------------------------------------------------------------------
+    //
+    //  SoftwareVertexArrays - attributes of a draw, indexed by vertex.
+    //    Attributes without an array read as zero, like disabled GL
+    //    attributes; colors come from State::color then.
+    //
+
+    struct SoftwareVertexArrays
+    {
+        const vec4 *positions;
+        const vec4 *colors;
+        const vec3 *normals;
+        const vec2 *texCoords2D;
+        const float *texCoords1D;
+
+        SoftwareVertexArrays(const vec4 *positions = NULL)
+            : positions(positions), colors(NULL), normals(NULL), texCoords2D(NULL), texCoords1D(NULL) {}
+    };
+
+    //----------------------------------------------------------------------------
+    //
+    //  SoftwareRasterizer - set the state, then clear() and draw like GL.
+    //    Each draw runs the vertex and setup stages over chunks of
+    //    primitives and bins them into screen tiles, then fills the tiles in
+    //    parallel, each in primitive order.
+    //
+
+    class SoftwareRasterizer
+    {
+    public:
+        // Numbered like the ShadeMode uniform of the homework shaders, and
+        // lit the same way; FLAT takes the Gouraud color of the last vertex
+        enum ShadeMode
+        {
+            COLOR,
+            GOURAUD,
+            PHONG,
+            TEXTURE_2D,
+            TEXTURE_1D,
+            FLAT
+        };
+
+        struct State
+        {
+            mat4 modelView;
+            mat4 projection;
+
+            vec4 ambientProduct;
+            vec4 diffuseProduct;
+            vec4 specularProduct;
+            vec4 lightPosition;
+            float shininess;
+
+            ShadeMode shadeMode;
+
+            // Color of COLOR mode without a color array
+            vec4 color;
+
+            const SoftwareTexture *texture2D;
+            const SoftwareTexture *texture1D;
+
+            bool isDepthTestOn;
+
+            // Counter-clockwise triangles face front
+            bool isCullFaceOn;
+
+            float pointSize;
+
+            State()
+                : shininess(1.0), shadeMode(COLOR), color(1.0), texture2D(NULL), texture1D(NULL),
+                  isDepthTestOn(true), isCullFaceOn(false), pointSize(1.0) {}
+        };
+
+        static const int TileSize = 64;
+
+        // Primitives per chunk of the vertex and setup stages
+        static const int ChunkSize = 1024;
+
+        State state;
+
+    private:
+        static const int MaxVaryings = 9;
+
+        // Window coordinates are snapped to 1/256 pixel
+        static const int SubpixelBits = 8;
+        static const int SubpixelScale = 1 << SubpixelBits;
+
+        // Triangles are clipped to this many viewports around the viewport,
+        // so edge functions stay exact in 64 bits
+        static constexpr float GuardBand = 8.0;
+
+        struct ClipVertex
+        {
+            vec4 position;
+            float varyings[MaxVaryings];
+        };
+
+        struct Triangle
+        {
+            // Pixel bounds, inclusive
+            int minX, minY, maxX, maxY;
+
+            // Edge function i is a[i] * x + b[i] * y + c[i] at pixel (x, y),
+            // biased so pixels on edges that are not top or left fail
+            int64_t a[3], b[3], c[3];
+
+            float inverseArea;
+
+            float depth[3];
+            float inverseW[3];
+
+            // Divided by w for perspective-correct interpolation
+            float varyings[3][MaxVaryings];
+
+            int textureLevel;
+        };
+
+        struct Point
+        {
+            int minX, minY, maxX, maxY;
+            float depth;
+            uint32_t color;
+        };
+
+        // Output of one chunk of primitives, binned per tile
+        struct Chunk
+        {
+            std::vector<Triangle> triangles;
+            std::vector<Point> points;
+            std::vector<std::vector<uint32_t>> bins;
+        };
+
+        int _width;
+        int _height;
+        int _tilesX;
+        int _tilesY;
+
+        // RGBA8, rows bottom-up like glReadPixels()
+        std::vector<uint32_t> _color;
+        std::vector<float> _depth;
+
+        std::vector<ClipVertex> _vertices;
+        std::vector<Chunk> _chunks;
+
+        // Lighting uniforms of the current draw
+        LightingModel _lightingModel;
+
+        int _numVaryings;
+
+        //  --- vertex stage ---
+
+        static vec3 xyz(const vec4 &v) { return vec3(v.x, v.y, v.z); }
+
+        static int numVaryings(ShadeMode mode)
+        {
+            switch (mode)
+            {
+            case PHONG:
+                return 9;
+            case TEXTURE_2D:
+                return 2;
+            case TEXTURE_1D:
+                return 1;
+            default:
+                return 4;
+            }
+        }
+
+        void shadeVertex(const SoftwareVertexArrays &arrays, size_t index, ClipVertex &out) const
+        {
+            const vec4 &position = arrays.positions[index];
+            vec3 normal = arrays.normals ? arrays.normals[index] : vec3(0.0);
+
+            vec4 eye = state.modelView * position;
+            vec3 pos = xyz(eye);
+
+            out.position = state.projection * eye;
+
+            float *varyings = out.varyings;
+
+            switch (state.shadeMode)
+            {
+            case COLOR:
+            {
+                vec4 color = arrays.colors ? arrays.colors[index] : state.color;
+                std::copy(&color.x, &color.x + 4, varyings);
+                break;
+            }
+            case GOURAUD:
+            case FLAT:
+                // Lit in batches by lightVertices()
+                break;
+            case PHONG:
+            {
+                vec3 N = xyz(state.modelView * vec4(normal, 0.0));
+                vec3 V = -pos;
+                vec3 L = xyz(state.lightPosition);
+
+                // Point light source
+                if (state.lightPosition.w != 0.0)
+                {
+                    L = L - pos;
+                }
+
+                std::copy(&N.x, &N.x + 3, varyings);
+                std::copy(&V.x, &V.x + 3, varyings + 3);
+                std::copy(&L.x, &L.x + 3, varyings + 6);
+                break;
+            }
+            case TEXTURE_2D:
+                varyings[0] = arrays.texCoords2D ? arrays.texCoords2D[index].x : 0.0;
+                varyings[1] = arrays.texCoords2D ? arrays.texCoords2D[index].y : 0.0;
+                break;
+            case TEXTURE_1D:
+                varyings[0] = arrays.texCoords1D ? arrays.texCoords1D[index] : 0.0;
+                break;
+            }
+        }
+
+        // Gouraud colors of _vertices[begin, end)
+        void lightChunk(const SoftwareVertexArrays &arrays, size_t firstVertex, size_t begin, size_t end)
+        {
+            const size_t BlockSize = 256;
+
+            vec4 colors[BlockSize];
+
+            for (size_t block = begin; block < end; block += BlockSize)
+            {
+                size_t size = std::min(BlockSize, end - block);
+                size_t first = firstVertex + block;
+
+                lightVertices(arrays.positions + first, arrays.normals ? arrays.normals + first : NULL, size,
+                              state.modelView, state.lightPosition, _lightingModel, colors);
+
+                for (size_t i = 0; i < size; i++)
+                {
+                    std::copy(&colors[i].x, &colors[i].x + 4, _vertices[block + i].varyings);
+                }
+            }
+        }
+
+        //  --- fragment stage ---
+
+        vec4 shadeFragment(ShadeMode mode, const float *varyings, int textureLevel) const
+        {
+            switch (mode)
+            {
+            case PHONG:
+            {
+                vec3 N(varyings[0], varyings[1], varyings[2]);
+                vec3 V(varyings[3], varyings[4], varyings[5]);
+                vec3 L(varyings[6], varyings[7], varyings[8]);
+
+                return blinnPhong(N, L, V, _lightingModel);
+            }
+            case TEXTURE_2D:
+                return state.texture2D ? state.texture2D->sample(varyings[0], varyings[1], textureLevel) : vec4(0.0, 0.0, 0.0, 1.0);
+            case TEXTURE_1D:
+                return state.texture1D ? state.texture1D->sample(varyings[0], 0.5, textureLevel) : vec4(0.0, 0.0, 0.0, 1.0);
+            default:
+                return vec4(varyings[0], varyings[1], varyings[2], varyings[3]);
+            }
+        }
+
+        static uint32_t packColor(const vec4 &color)
+        {
+            uint32_t packed = 0;
+
+            for (int i = 0; i < 4; i++)
+            {
+                // NaN (from normalizing a zero vector) goes to 0
+                float channel = (&color.x)[i];
+                channel = channel > 0.0f ? std::min(channel, 1.0f) : 0.0f;
+
+                packed |= uint32_t(channel * 255.0 + 0.5) << (8 * i);
+            }
+
+            return packed;
+        }
+
+        //  --- setup stage ---
+
+        // Screen-space footprint of the texture, as GL picks a mip level
+        int textureLevel(const float x[3], const float y[3], const ClipVertex *v[3], float area) const
+        {
+            const SoftwareTexture *texture = state.shadeMode == TEXTURE_2D ? state.texture2D : state.texture1D;
+
+            if (!texture || texture->numLevels() <= 1 || area == 0.0)
+            {
+                return 0;
+            }
+
+            float scale[2] = {float(texture->width()), float(texture->height())};
+            int numCoords = state.shadeMode == TEXTURE_2D ? 2 : 1;
+
+            float lengthX = 0.0, lengthY = 0.0;
+
+            for (int i = 0; i < numCoords; i++)
+            {
+                float a0 = scale[i] * v[0]->varyings[i];
+                float a1 = scale[i] * v[1]->varyings[i];
+                float a2 = scale[i] * v[2]->varyings[i];
+
+                float dx = ((a1 - a0) * (y[2] - y[0]) - (a2 - a0) * (y[1] - y[0])) / area;
+                float dy = ((a2 - a0) * (x[1] - x[0]) - (a1 - a0) * (x[2] - x[0])) / area;
+
+                lengthX += dx * dx;
+                lengthY += dy * dy;
+            }
+
+            return texture->level(std::sqrt(std::max(lengthX, lengthY)));
+        }
+
+        void setupTriangle(const ClipVertex *v[3], Chunk &chunk)
+        {
+            float x[3], y[3];
+            int64_t X[3], Y[3];
+
+            Triangle triangle;
+
+            for (int i = 0; i < 3; i++)
+            {
+                float inverseW = 1.0 / v[i]->position.w;
+
+                x[i] = (v[i]->position.x * inverseW * 0.5 + 0.5) * _width;
+                y[i] = (v[i]->position.y * inverseW * 0.5 + 0.5) * _height;
+
+                X[i] = int64_t(std::floor(x[i] * SubpixelScale + 0.5));
+                Y[i] = int64_t(std::floor(y[i] * SubpixelScale + 0.5));
+
+                triangle.depth[i] = v[i]->position.z * inverseW * 0.5 + 0.5;
+                triangle.inverseW[i] = inverseW;
+            }
+
+            int64_t area = (X[1] - X[0]) * (Y[2] - Y[0]) - (X[2] - X[0]) * (Y[1] - Y[0]);
+
+            if (area == 0 || (area < 0 && state.isCullFaceOn))
+            {
+                return;
+            }
+
+            // Rasterize back faces with the winding of front faces
+            if (area < 0)
+            {
+                std::swap(v[1], v[2]);
+                std::swap(x[1], x[2]);
+                std::swap(y[1], y[2]);
+                std::swap(X[1], X[2]);
+                std::swap(Y[1], Y[2]);
+                std::swap(triangle.depth[1], triangle.depth[2]);
+                std::swap(triangle.inverseW[1], triangle.inverseW[2]);
+                area = -area;
+            }
+
+            triangle.minX = std::max(0, int(std::min(X[0], std::min(X[1], X[2])) >> SubpixelBits));
+            triangle.minY = std::max(0, int(std::min(Y[0], std::min(Y[1], Y[2])) >> SubpixelBits));
+            triangle.maxX = std::min(_width - 1, int(std::max(X[0], std::max(X[1], X[2])) >> SubpixelBits));
+            triangle.maxY = std::min(_height - 1, int(std::max(Y[0], std::max(Y[1], Y[2])) >> SubpixelBits));
+
+            if (triangle.minX > triangle.maxX || triangle.minY > triangle.maxY)
+            {
+                return;
+            }
+
+            for (int i = 0; i < 3; i++)
+            {
+                int j = (i + 1) % 3;
+                int k = (i + 2) % 3;
+
+                int64_t dx = X[k] - X[j];
+                int64_t dy = Y[k] - Y[j];
+
+                // Edge opposite vertex i, positive inside; evaluated at
+                // pixel centres
+                triangle.a[i] = -dy * SubpixelScale;
+                triangle.b[i] = dx * SubpixelScale;
+                triangle.c[i] = dx * (SubpixelScale / 2 - Y[j]) - dy * (SubpixelScale / 2 - X[j]);
+
+                bool isTopLeft = dy < 0 || (dy == 0 && dx < 0);
+
+                if (!isTopLeft)
+                {
+                    triangle.c[i] -= 1;
+                }
+
+                for (int n = 0; n < _numVaryings; n++)
+                {
+                    triangle.varyings[i][n] = v[i]->varyings[n] * triangle.inverseW[i];
+                }
+            }
+
+            triangle.inverseArea = 1.0 / double(area);
+
+            triangle.textureLevel = 0;
+
+            if (state.shadeMode == TEXTURE_2D || state.shadeMode == TEXTURE_1D)
+            {
+                triangle.textureLevel = textureLevel(x, y, v, float(area) / (SubpixelScale * SubpixelScale));
+            }
+
+            uint32_t index = chunk.triangles.size();
+            chunk.triangles.push_back(triangle);
+
+            binRect(chunk, triangle.minX, triangle.minY, triangle.maxX, triangle.maxY, index);
+        }
+
+        void binRect(Chunk &chunk, int minX, int minY, int maxX, int maxY, uint32_t index)
+        {
+            for (int tileY = minY / TileSize; tileY <= maxY / TileSize; tileY++)
+            {
+                for (int tileX = minX / TileSize; tileX <= maxX / TileSize; tileX++)
+                {
+                    chunk.bins[tileY * _tilesX + tileX].push_back(index);
+                }
+            }
+        }
+
+        static ClipVertex lerp(const ClipVertex &a, const ClipVertex &b, float t, int count)
+        {
+            ClipVertex v;
+            v.position = a.position + t * (b.position - a.position);
+
+            for (int n = 0; n < count; n++)
+            {
+                v.varyings[n] = a.varyings[n] + t * (b.varyings[n] - a.varyings[n]);
+            }
+
+            return v;
+        }
+
+        // Clip against the near plane and the guard band, then set up the
+        // pieces as a fan
+        void clipTriangle(const ClipVertex *triangle[3], Chunk &chunk)
+        {
+            const vec4 planes[5] = {
+                vec4(0.0, 0.0, 1.0, 1.0),
+                vec4(-1.0, 0.0, 0.0, GuardBand),
+                vec4(1.0, 0.0, 0.0, GuardBand),
+                vec4(0.0, -1.0, 0.0, GuardBand),
+                vec4(0.0, 1.0, 0.0, GuardBand)};
+
+            // Every plane adds at most one vertex
+            ClipVertex buffers[2][8];
+
+            int numVertices = 3;
+            ClipVertex *in = buffers[0];
+            ClipVertex *out = buffers[1];
+
+            for (int i = 0; i < 3; i++)
+            {
+                in[i] = *triangle[i];
+            }
+
+            for (const vec4 &plane : planes)
+            {
+                int numOut = 0;
+
+                for (int i = 0; i < numVertices; i++)
+                {
+                    const ClipVertex &a = in[i];
+                    const ClipVertex &b = in[(i + 1) % numVertices];
+
+                    float da = dot(plane, a.position);
+                    float db = dot(plane, b.position);
+
+                    if (da >= 0.0)
+                    {
+                        out[numOut++] = a;
+                    }
+
+                    if ((da >= 0.0) != (db >= 0.0))
+                    {
+                        out[numOut++] = lerp(a, b, da / (da - db), _numVaryings);
+                    }
+                }
+
+                std::swap(in, out);
+                numVertices = numOut;
+
+                if (numVertices < 3)
+                {
+                    return;
+                }
+            }
+
+            for (int i = 1; i + 1 < numVertices; i++)
+            {
+                const ClipVertex *piece[3] = {&in[0], &in[i], &in[i + 1]};
+                setupTriangle(piece, chunk);
+            }
+        }
+
+        void assembleTriangle(const ClipVertex *v[3], Chunk &chunk)
+        {
+            bool needsClipping = false;
+
+            // Outside one frustum plane entirely, or crossing the near plane
+            // or the guard band
+            for (int axis = 0; axis < 3; axis++)
+            {
+                int numBelow = 0, numAbove = 0;
+
+                for (int i = 0; i < 3; i++)
+                {
+                    float coord = (&v[i]->position.x)[axis];
+                    float w = v[i]->position.w;
+
+                    numBelow += coord < -w;
+                    numAbove += coord > w;
+
+                    if (axis == 2 ? coord < -w : std::fabs(coord) > GuardBand * w)
+                    {
+                        needsClipping = true;
+                    }
+                }
+
+                if (numBelow == 3 || numAbove == 3)
+                {
+                    return;
+                }
+            }
+
+            if (needsClipping)
+            {
+                clipTriangle(v, chunk);
+            }
+            else
+            {
+                setupTriangle(v, chunk);
+            }
+        }
+
+        void assemblePoint(const ClipVertex &v, Chunk &chunk)
+        {
+            const vec4 &p = v.position;
+
+            // Points are clipped by their centre
+            if (!(p.w > 0.0) || std::fabs(p.x) > p.w || std::fabs(p.y) > p.w || std::fabs(p.z) > p.w)
+            {
+                return;
+            }
+
+            float x = (p.x / p.w * 0.5 + 0.5) * _width;
+            float y = (p.y / p.w * 0.5 + 0.5) * _height;
+
+            // Pixel centres within the point's square
+            float halfSize = 0.5 * std::max(state.pointSize, 1.0f);
+
+            Point point;
+            point.minX = std::max(0, int(std::ceil(x - halfSize - 0.5)));
+            point.minY = std::max(0, int(std::ceil(y - halfSize - 0.5)));
+            point.maxX = std::min(_width - 1, int(std::ceil(x + halfSize - 0.5)) - 1);
+            point.maxY = std::min(_height - 1, int(std::ceil(y + halfSize - 0.5)) - 1);
+
+            if (point.minX > point.maxX || point.minY > point.maxY)
+            {
+                return;
+            }
+
+            point.depth = p.z / p.w * 0.5 + 0.5;
+            point.color = packColor(shadeFragment(state.shadeMode, v.varyings, 0));
+
+            uint32_t index = chunk.points.size();
+            chunk.points.push_back(point);
+
+            binRect(chunk, point.minX, point.minY, point.maxX, point.maxY, index);
+        }
+
+        //  --- raster stage ---
+
+        // Compiled per shading mode, so the fragment loop has no branches
+        // on the mode
+        template <ShadeMode Mode>
+        void rasterizeTriangle(const Triangle &triangle, int tileX, int tileY)
+        {
+            const int count = numVaryings(Mode);
+
+            int minX = std::max(triangle.minX, tileX * TileSize);
+            int minY = std::max(triangle.minY, tileY * TileSize);
+            int maxX = std::min(triangle.maxX, tileX * TileSize + TileSize - 1);
+            int maxY = std::min(triangle.maxY, tileY * TileSize + TileSize - 1);
+
+            float varyings[MaxVaryings];
+
+            for (int y = minY; y <= maxY; y++)
+            {
+                int64_t e[3];
+
+                for (int i = 0; i < 3; i++)
+                {
+                    e[i] = triangle.a[i] * minX + triangle.b[i] * y + triangle.c[i];
+                }
+
+                for (int x = minX; x <= maxX; x++, e[0] += triangle.a[0], e[1] += triangle.a[1], e[2] += triangle.a[2])
+                {
+                    if ((e[0] | e[1] | e[2]) < 0)
+                    {
+                        continue;
+                    }
+
+                    float b0 = e[0] * triangle.inverseArea;
+                    float b1 = e[1] * triangle.inverseArea;
+                    float b2 = e[2] * triangle.inverseArea;
+
+                    float depth = b0 * triangle.depth[0] + b1 * triangle.depth[1] + b2 * triangle.depth[2];
+
+                    size_t pixel = size_t(y) * _width + x;
+
+                    if (depth < 0.0 || depth > 1.0 || (state.isDepthTestOn && !(depth < _depth[pixel])))
+                    {
+                        continue;
+                    }
+
+                    float w = 1.0 / (b0 * triangle.inverseW[0] + b1 * triangle.inverseW[1] + b2 * triangle.inverseW[2]);
+
+                    for (int n = 0; n < count; n++)
+                    {
+                        varyings[n] = w * (b0 * triangle.varyings[0][n] + b1 * triangle.varyings[1][n] + b2 * triangle.varyings[2][n]);
+                    }
+
+                    _color[pixel] = packColor(shadeFragment(Mode, varyings, triangle.textureLevel));
+
+                    if (state.isDepthTestOn)
+                    {
+                        _depth[pixel] = depth;
+                    }
+                }
+            }
+        }
+
+        void rasterizePoint(const Point &point, int tileX, int tileY)
+        {
+            int minX = std::max(point.minX, tileX * TileSize);
+            int minY = std::max(point.minY, tileY * TileSize);
+            int maxX = std::min(point.maxX, tileX * TileSize + TileSize - 1);
+            int maxY = std::min(point.maxY, tileY * TileSize + TileSize - 1);
+
+            for (int y = minY; y <= maxY; y++)
+            {
+                for (int x = minX; x <= maxX; x++)
+                {
+                    size_t pixel = size_t(y) * _width + x;
+
+                    if (state.isDepthTestOn)
+                    {
+                        if (!(point.depth < _depth[pixel]))
+                        {
+                            continue;
+                        }
+
+                        _depth[pixel] = point.depth;
+                    }
+
+                    _color[pixel] = point.color;
+                }
+            }
+        }
+
+        typedef void (SoftwareRasterizer::*RasterizeTriangle)(const Triangle &, int, int);
+
+        static RasterizeTriangle rasterizerFor(ShadeMode mode)
+        {
+            switch (mode)
+            {
+            case GOURAUD:
+                return &SoftwareRasterizer::rasterizeTriangle<GOURAUD>;
+            case PHONG:
+                return &SoftwareRasterizer::rasterizeTriangle<PHONG>;
+            case TEXTURE_2D:
+                return &SoftwareRasterizer::rasterizeTriangle<TEXTURE_2D>;
+            case TEXTURE_1D:
+                return &SoftwareRasterizer::rasterizeTriangle<TEXTURE_1D>;
+            case FLAT:
+                return &SoftwareRasterizer::rasterizeTriangle<FLAT>;
+            default:
+                return &SoftwareRasterizer::rasterizeTriangle<COLOR>;
+            }
+        }
+
+        // Shared by the draw calls; index(i) is the vertex of element i
+        template <typename Index>
+        void draw(GLenum mode, const SoftwareVertexArrays &arrays, size_t numElements,
+                  size_t firstVertex, size_t numVertices, Index index)
+        {
+            PROFILE_FUNCTION();
+
+            if (_width == 0 || numElements == 0 || (mode != GL_TRIANGLES && mode != GL_POINTS))
+            {
+                return;
+            }
+
+            _lightingModel.ambientProduct = state.ambientProduct;
+            _lightingModel.diffuseProduct = state.diffuseProduct;
+            _lightingModel.specularProduct = state.specularProduct;
+            _lightingModel.shininess = state.shininess;
+            _numVaryings = numVaryings(state.shadeMode);
+
+            RasterizeTriangle rasterizeTriangle = rasterizerFor(state.shadeMode);
+
+            // Vertex stage over every vertex the elements may use
+            _vertices.resize(numVertices);
+
+            parallelFor(numVertices, ChunkSize, [&](size_t begin, size_t end)
+                        {
+                for (size_t i = begin; i < end; i++)
+                {
+                    shadeVertex(arrays, firstVertex + i, _vertices[i]);
+                }
+
+                if (state.shadeMode == GOURAUD || state.shadeMode == FLAT)
+                {
+                    lightChunk(arrays, firstVertex, begin, end);
+                } });
+
+            size_t verticesPerPrimitive = mode == GL_TRIANGLES ? 3 : 1;
+            size_t numPrimitives = numElements / verticesPerPrimitive;
+            size_t numChunks = (numPrimitives + ChunkSize - 1) / ChunkSize;
+
+            if (_chunks.size() < numChunks)
+            {
+                _chunks.resize(numChunks);
+            }
+
+            // Setup stage; chunk boundaries only depend on the draw, which
+            // keeps the output independent of the threads
+            parallelFor(numChunks, 1, [&](size_t begin, size_t end)
+                        {
+                for (size_t c = begin; c < end; c++)
+                {
+                    Chunk &chunk = _chunks[c];
+                    chunk.triangles.clear();
+                    chunk.points.clear();
+                    chunk.bins.resize(_tilesX * _tilesY);
+
+                    for (std::vector<uint32_t> &bin : chunk.bins)
+                    {
+                        bin.clear();
+                    }
+
+                    size_t last = std::min(numPrimitives, (c + 1) * ChunkSize);
+
+                    for (size_t p = c * ChunkSize; p < last; p++)
+                    {
+                        if (mode == GL_POINTS)
+                        {
+                            assemblePoint(_vertices[index(p) - firstVertex], chunk);
+                            continue;
+                        }
+
+                        const ClipVertex *v[3] = {&_vertices[index(3 * p) - firstVertex],
+                                                  &_vertices[index(3 * p + 1) - firstVertex],
+                                                  &_vertices[index(3 * p + 2) - firstVertex]};
+
+                        if (state.shadeMode != FLAT)
+                        {
+                            assembleTriangle(v, chunk);
+                            continue;
+                        }
+
+                        // The last vertex colors the whole triangle
+                        ClipVertex flat[3] = {*v[0], *v[1], *v[2]};
+                        std::copy(v[2]->varyings, v[2]->varyings + 4, flat[0].varyings);
+                        std::copy(v[2]->varyings, v[2]->varyings + 4, flat[1].varyings);
+
+                        const ClipVertex *f[3] = {&flat[0], &flat[1], &flat[2]};
+                        assembleTriangle(f, chunk);
+                    }
+                } });
+
+            // Raster stage, one tile per job
+            parallelFor(_tilesX * _tilesY, 1, [&](size_t begin, size_t end)
+                        {
+                for (size_t tile = begin; tile < end; tile++)
+                {
+                    int tileX = tile % _tilesX;
+                    int tileY = tile / _tilesX;
+
+                    for (size_t c = 0; c < numChunks; c++)
+                    {
+                        const Chunk &chunk = _chunks[c];
+
+                        for (uint32_t i : chunk.bins[tile])
+                        {
+                            if (mode == GL_POINTS)
+                            {
+                                rasterizePoint(chunk.points[i], tileX, tileY);
+                            }
+                            else
+                            {
+                                (this->*rasterizeTriangle)(chunk.triangles[i], tileX, tileY);
+                            }
+                        }
+                    }
+                } });
+        }
+
+    public:
+        SoftwareRasterizer(int width = 0, int height = 0) : _width(0), _height(0), _tilesX(0), _tilesY(0)
+        {
+            resize(width, height);
+        }
+
+        // Contents are undefined until the next clear()
+        void resize(int width, int height)
+        {
+            _width = std::max(0, width);
+            _height = std::max(0, height);
+
+            _tilesX = (_width + TileSize - 1) / TileSize;
+            _tilesY = (_height + TileSize - 1) / TileSize;
+
+            _color.resize(size_t(_width) * _height);
+            _depth.resize(size_t(_width) * _height);
+
+            _chunks.clear();
+        }
+
+        int width() const { return _width; }
+        int height() const { return _height; }
+
+        const uint32_t *pixels() const { return _width ? &_color[0] : NULL; }
+        const float *depth() const { return _width ? &_depth[0] : NULL; }
+
+        void clear(const vec4 &color, float depth = 1.0)
+        {
+            std::fill(_color.begin(), _color.end(), packColor(color));
+            std::fill(_depth.begin(), _depth.end(), depth);
+        }
+
+        // GL_TRIANGLES or GL_POINTS, like glDrawArrays()
+        void drawArrays(GLenum mode, const SoftwareVertexArrays &arrays, int first, int count)
+        {
+            draw(mode, arrays, count, first, count, [first](size_t i)
+                 { return first + i; });
+        }
+
+        // GL_TRIANGLES or GL_POINTS, like glDrawElements() with GL_UNSIGNED_INT
+        void drawElements(GLenum mode, const SoftwareVertexArrays &arrays, const GLuint *indices, int count)
+        {
+            if (count <= 0)
+            {
+                return;
+            }
+
+            // Only the range of vertices the indices use goes through the
+            // vertex stage
+            GLuint minIndex = *std::min_element(indices, indices + count);
+            GLuint maxIndex = *std::max_element(indices, indices + count);
+
+            draw(mode, arrays, count, minIndex, maxIndex - minIndex + 1, [indices](size_t i)
+                 { return indices[i]; });
+        }
+
+        bool savePPM(const char *path) const
+        {
+            std::FILE *file = std::fopen(path, "wb");
+
+            if (!file)
+            {
+                return false;
+            }
+
+            std::fprintf(file, "P6\n%d %d\n255\n", _width, _height);
+
+            std::vector<GLubyte> row(3 * _width);
+
+            // Framebuffer rows go bottom-up, PPM rows top-down
+            for (int y = _height - 1; y >= 0; y--)
+            {
+                for (int x = 0; x < _width; x++)
+                {
+                    uint32_t color = _color[size_t(y) * _width + x];
+
+                    row[3 * x] = color & 0xff;
+                    row[3 * x + 1] = (color >> 8) & 0xff;
+                    row[3 * x + 2] = (color >> 16) & 0xff;
+                }
+
+                std::fwrite(&row[0], 1, row.size(), file);
+            }
+
+            std::fclose(file);
+            return true;
+        }
+    };
+
+} // namespace Angel
+
+#endif // __ANGEL_RASTERIZER_H__
@@ -0,0 +1,429 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- renderqueue.h ---
+//
+//   Command-buffer style rendering: scene code records compact draw
+//   packets into a per-frame arena, the GL thread sorts and replays them.
+//   A pipeline builds the queue of the next frame on a worker thread
+//   while the current one is submitted.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __ANGEL_RENDERQUEUE_H__
+#define __ANGEL_RENDERQUEUE_H__
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+
+#include "Angel.h"
+#include "glstate.h"
+
+namespace Angel
+{
+
+    //----------------------------------------------------------------------------
+    //
+    //  FrameArena - linear allocator for data that lives for one frame.
+    //    Allocations are a pointer bump; reset() frees them all at once.
+    //    When a frame outgrows the first block, further blocks are chained
+    //    and merged into one block at the next reset(), so a steady scene
+    //    allocates nothing after its first frames. Destructors are never
+    //    run, so only store trivially destructible types.
+    //
+
+    class FrameArena
+    {
+        static const size_t MinBlockSize = 16 * 1024;
+
+        struct Block
+        {
+            std::unique_ptr<unsigned char[]> data;
+            size_t size;
+        };
+
+        std::vector<Block> _blocks;
+        size_t _current;
+        size_t _used;
+
+        void addBlock(size_t size)
+        {
+            Block block;
+            block.data.reset(new unsigned char[size]);
+            block.size = size;
+            _blocks.push_back(std::move(block));
+        }
+
+    public:
+        FrameArena() : _current(0), _used(0) {}
+
+        void *allocate(size_t size, size_t alignment)
+        {
+            for (;;)
+            {
+                if (_current < _blocks.size())
+                {
+                    Block &block = _blocks[_current];
+                    size_t offset = (_used + alignment - 1) & ~(alignment - 1);
+
+                    if (offset + size <= block.size)
+                    {
+                        _used = offset + size;
+                        return block.data.get() + offset;
+                    }
+
+                    _current++;
+                    _used = 0;
+                }
+                else
+                {
+                    addBlock(std::max(size_t(MinBlockSize), 2 * (size + alignment)));
+                }
+            }
+        }
+
+        // Constructs a T in the arena
+        template <typename T>
+        T *create()
+        {
+            return new (allocate(sizeof(T), alignof(T))) T();
+        }
+
+        void reset()
+        {
+            if (_blocks.size() > 1)
+            {
+                size_t total = 0;
+
+                for (const Block &block : _blocks)
+                {
+                    total += block.size;
+                }
+
+                _blocks.clear();
+                addBlock(total);
+            }
+
+            _current = 0;
+            _used = 0;
+        }
+
+        // Bytes reserved by the arena
+        size_t capacity() const
+        {
+            size_t total = 0;
+
+            for (const Block &block : _blocks)
+            {
+                total += block.size;
+            }
+
+            return total;
+        }
+    };
+
+    //----------------------------------------------------------------------------
+    //
+    //  Meshes and materials are referred to by small IDs and looked up in
+    //    tables at submission time, so packets stay small and recording
+    //    needs no GL.
+    //
+
+    struct RenderMesh
+    {
+        GLuint vertexArray;
+        GLenum mode;
+        GLint first;
+        GLsizei count;
+    };
+
+    // A program with the textures it samples and where it takes the
+    // packet values from; locations may be -1 if unused
+    struct RenderMaterial
+    {
+        GLuint program;
+
+        // No texture when textureTarget is 0
+        GLuint textureUnit;
+        GLenum textureTarget;
+        GLuint texture;
+
+        GLint modelViewLoc;
+        GLint shadeModeLoc;
+        GLint instanceScaleLoc;
+        GLint sphereImpostorLoc;
+
+        // Materials sharing an array texture differ only in this uniform
+        GLint textureLayerLoc;
+        GLint textureLayer;
+    };
+
+    struct DrawPacket
+    {
+        uint16_t mesh;
+        uint16_t material;
+        int16_t shadeMode;
+
+        // Instance count, -1 for a plain glDrawArrays()
+        GLsizei numInstances;
+        GLfloat instanceScale;
+
+        // Ray traced on a quad instead of rasterized, for spheres
+        bool isSphereImpostor;
+
+        mat4 modelView;
+    };
+
+    //----------------------------------------------------------------------------
+    //
+    //  RenderQueue - record() packets for a frame, then submit() them. Draws
+    //    are issued by material, then mesh, then in recording order.
+    //    Recording needs no GL context, submission does.
+    //
+
+    class RenderQueue
+    {
+        struct SortEntry
+        {
+            uint64_t key;
+            const DrawPacket *packet;
+
+            bool operator<(const SortEntry &other) const { return key < other.key; }
+        };
+
+        FrameArena _arena;
+        std::vector<SortEntry> _entries;
+
+    public:
+        size_t size() const { return _entries.size(); }
+
+        // Arena bytes reserved, for statistics
+        size_t capacity() const { return _arena.capacity(); }
+
+        void clear()
+        {
+            _arena.reset();
+            _entries.clear();
+        }
+
+        // Returns the packet so instancing can be filled in
+        DrawPacket &record(uint16_t mesh, uint16_t material, const mat4 &modelView, int shadeMode)
+        {
+            DrawPacket *packet = _arena.create<DrawPacket>();
+            packet->mesh = mesh;
+            packet->material = material;
+            packet->shadeMode = shadeMode;
+            packet->numInstances = -1;
+            packet->instanceScale = 0.0;
+            packet->isSphereImpostor = false;
+            packet->modelView = modelView;
+
+            // The recording index keeps equal draws in order
+            SortEntry entry;
+            entry.key = (uint64_t(material) << 48) | (uint64_t(mesh) << 32) | uint32_t(_entries.size());
+            entry.packet = packet;
+            _entries.push_back(entry);
+
+            return *packet;
+        }
+
+        void sort()
+        {
+            std::sort(_entries.begin(), _entries.end());
+        }
+
+        // Replays the packets in sorted order; meshes and materials are
+        // indexed by the packet IDs
+        void submit(const RenderMesh *meshes, const RenderMaterial *materials,
+                    GLStateCache &cache = GLStateCache::get()) const
+        {
+            for (const SortEntry &entry : _entries)
+            {
+                const DrawPacket &packet = *entry.packet;
+                const RenderMesh &mesh = meshes[packet.mesh];
+                const RenderMaterial &material = materials[packet.material];
+
+                cache.useProgram(material.program);
+                cache.bindVertexArray(mesh.vertexArray);
+
+                if (material.textureTarget)
+                {
+                    cache.bindTexture(material.textureUnit, material.textureTarget, material.texture);
+                    cache.uniform1i(material.textureLayerLoc, material.textureLayer);
+                }
+
+                cache.uniformMatrix4fv(material.modelViewLoc, packet.modelView);
+                cache.uniform1i(material.shadeModeLoc, packet.shadeMode);
+                cache.uniform1f(material.instanceScaleLoc, packet.instanceScale);
+                cache.uniform1i(material.sphereImpostorLoc, packet.isSphereImpostor);
+
+                if (packet.numInstances >= 0)
+                {
+                    glDrawArraysInstanced(mesh.mode, mesh.first, mesh.count, packet.numInstances);
+                }
+                else
+                {
+                    glDrawArrays(mesh.mode, mesh.first, mesh.count);
+                }
+            }
+        }
+    };
+
+    //----------------------------------------------------------------------------
+    //
+    //  RenderPipeline - double-buffered frames of a Scene snapshot and the
+    //    queue built from it. next(scene) hands back the frame built from
+    //    the scene of the previous call and starts building this one on
+    //    the worker thread, so submission of frame N overlaps the build of
+    //    frame N + 1 at the cost of one frame of latency. The build must
+    //    only read its scene: the GL thread keeps changing everything else.
+    //    It must not call parallelFor() either, which the GL thread may be
+    //    using at the same time.
+    //
+    //    Without a thread, next() builds the scene it is given right away.
+    //
+
+    template <typename Scene>
+    class RenderPipeline
+    {
+    public:
+        typedef std::function<void(const Scene &, RenderQueue &)> BuildFunction;
+
+        struct Frame
+        {
+            Scene scene;
+            RenderQueue queue;
+        };
+
+    private:
+        Frame _frames[2];
+
+        // Frame the next build goes into
+        int _back;
+
+        BuildFunction _build;
+
+        std::thread _thread;
+        std::mutex _mutex;
+        std::condition_variable _wake;
+        std::condition_variable _done;
+
+        // A build of _frames[_back] was started and not yet collected
+        bool _isPending;
+        bool _isBuilding;
+        bool _quit;
+
+        void build(Frame &frame)
+        {
+            frame.queue.clear();
+            _build(frame.scene, frame.queue);
+            frame.queue.sort();
+        }
+
+        void workerLoop()
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+
+            for (;;)
+            {
+                _wake.wait(lock, [&]
+                           { return _quit || _isBuilding; });
+
+                if (_quit)
+                {
+                    return;
+                }
+
+                Frame &frame = _frames[_back];
+
+                lock.unlock();
+                build(frame);
+                lock.lock();
+
+                _isBuilding = false;
+                _done.notify_one();
+            }
+        }
+
+    public:
+        RenderPipeline() : _back(0), _isPending(false), _isBuilding(false), _quit(false) {}
+
+        ~RenderPipeline() { stop(); }
+
+        void start(const BuildFunction &buildFunction, bool isThreaded)
+        {
+            stop();
+
+            _build = buildFunction;
+            _isPending = false;
+            _quit = false;
+
+            if (isThreaded)
+            {
+                _thread = std::thread(&RenderPipeline::workerLoop, this);
+            }
+        }
+
+        void stop()
+        {
+            if (!_thread.joinable())
+            {
+                return;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _quit = true;
+            }
+
+            _wake.notify_one();
+            _thread.join();
+        }
+
+        bool isThreaded() const { return _thread.joinable(); }
+
+        Frame &next(const Scene &scene)
+        {
+            if (!isThreaded() || !_isPending)
+            {
+                // Nothing built ahead yet, so this frame is built in place
+                _frames[_back].scene = scene;
+                build(_frames[_back]);
+            }
+            else
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _done.wait(lock, [&]
+                           { return !_isBuilding; });
+            }
+
+            Frame &ready = _frames[_back];
+
+            if (isThreaded())
+            {
+                _back ^= 1;
+                _frames[_back].scene = scene;
+
+                {
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    _isBuilding = true;
+                    _isPending = true;
+                }
+
+                _wake.notify_one();
+            }
+
+            return ready;
+        }
+    };
+
+} // namespace Angel
+
+#endif // __ANGEL_RENDERQUEUE_H__
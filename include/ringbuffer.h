@@ -0,0 +1,177 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- ringbuffer.h ---
+//
+//   Buffer object split into fixed-size slots that the CPU fills while
+//   the GPU may still be reading earlier ones, guarded by fence syncs
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __ANGEL_RINGBUFFER_H__
+#define __ANGEL_RINGBUFFER_H__
+
+#include <vector>
+
+#include "Angel.h"
+
+namespace Angel
+{
+
+    //----------------------------------------------------------------------------
+    //
+    //  MappedRingBuffer
+    //
+    //    Write one slot at a time:
+    //
+    //      GLintptr offset;
+    //      void *data = ring.beginWrite(offset);   // waits for the slot
+    //      ... fill data ...
+    //      ring.endWrite();
+    //      ... draw from offset ...
+    //      ring.fence();                          // slot is in use until here
+    //
+    //    With GL 4.4 / ARB_buffer_storage the buffer is mapped once,
+    //    persistently and coherently. Otherwise each slot is mapped
+    //    unsynchronized for the write, which the fences make safe.
+    //
+
+    class MappedRingBuffer
+    {
+        GLenum _target;
+        GLuint _buffer;
+        GLsizeiptr _slotSize;
+
+        std::vector<GLsync> _fences;
+        int _current;
+
+        bool _isPersistent;
+        GLubyte *_mapped;
+
+        void waitForSlot(int slot)
+        {
+            GLsync &fence = _fences[slot];
+
+            if (!fence)
+            {
+                return;
+            }
+
+            // Flush on the first wait so the fence is guaranteed to signal
+            GLbitfield flags = GL_SYNC_FLUSH_COMMANDS_BIT;
+
+            while (glClientWaitSync(fence, flags, 1000000000) == GL_TIMEOUT_EXPIRED)
+            {
+                flags = 0;
+            }
+
+            glDeleteSync(fence);
+            fence = 0;
+        }
+
+    public:
+        MappedRingBuffer()
+            : _target(GL_ARRAY_BUFFER), _buffer(0), _slotSize(0), _current(0),
+              _isPersistent(false), _mapped(NULL) {}
+
+        ~MappedRingBuffer() { release(); }
+
+        // Create the buffer and leave it bound to target
+        void init(GLenum target, GLsizeiptr slotSize, int numSlots)
+        {
+            release();
+
+            _target = target;
+            _slotSize = slotSize;
+            _fences.assign(numSlots, GLsync(0));
+            _current = 0;
+
+            glGenBuffers(1, &_buffer);
+            glBindBuffer(_target, _buffer);
+
+            GLsizeiptr size = slotSize * numSlots;
+
+#ifdef GL_MAP_PERSISTENT_BIT
+            _isPersistent = GLEW_ARB_buffer_storage;
+#endif
+
+            if (_isPersistent)
+            {
+                GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+                glBufferStorage(_target, size, NULL, flags);
+                _mapped = static_cast<GLubyte *>(glMapBufferRange(_target, 0, size, flags));
+            }
+            else
+            {
+                glBufferData(_target, size, NULL, GL_STREAM_DRAW);
+            }
+        }
+
+        void release()
+        {
+            for (GLsync &fence : _fences)
+            {
+                if (fence)
+                {
+                    glDeleteSync(fence);
+                    fence = 0;
+                }
+            }
+
+            if (_buffer)
+            {
+                if (_mapped)
+                {
+                    glBindBuffer(_target, _buffer);
+                    glUnmapBuffer(_target);
+                    _mapped = NULL;
+                }
+
+                glDeleteBuffers(1, &_buffer);
+                _buffer = 0;
+            }
+        }
+
+        GLuint buffer() const { return _buffer; }
+        GLsizeiptr slotSize() const { return _slotSize; }
+        int numSlots() const { return _fences.size(); }
+        bool isPersistent() const { return _isPersistent; }
+
+        // Wait until the current slot is no longer read by the GPU and
+        // return where to write it; offset is its byte offset in buffer()
+        void *beginWrite(GLintptr &offset)
+        {
+            waitForSlot(_current);
+
+            offset = _current * _slotSize;
+
+            if (_isPersistent)
+            {
+                return _mapped + offset;
+            }
+
+            glBindBuffer(_target, _buffer);
+            return glMapBufferRange(_target, offset, _slotSize,
+                                    GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_INVALIDATE_RANGE_BIT);
+        }
+
+        void endWrite()
+        {
+            if (!_isPersistent)
+            {
+                glBindBuffer(_target, _buffer);
+                glUnmapBuffer(_target);
+            }
+        }
+
+        // Call after the commands that read the current slot, then move on
+        void fence()
+        {
+            _fences[_current] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+            _current = (_current + 1) % _fences.size();
+        }
+    };
+
+} // namespace Angel
+
+#endif // __ANGEL_RINGBUFFER_H__
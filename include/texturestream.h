@@ -0,0 +1,871 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- texturestream.h ---
+//
+//   Streaming of textures too large to keep resident: the image is split
+//   into tiles per mip level, a background thread reads the tiles a frame
+//   asks for straight from the file, and the GPU keeps them in a pool of
+//   fixed size with least-recently-used eviction. A page table tells the
+//   shader which pool layer holds each tile.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __ANGEL_TEXTURESTREAM_H__
+#define __ANGEL_TEXTURESTREAM_H__
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "Angel.h"
+
+namespace Angel
+{
+
+    //----------------------------------------------------------------------------
+    //
+    //  TextureStreamer - open() a PPM image, initGL() with the program in
+    //    use, then update() once per frame before drawing with the width in
+    //    pixels the whole texture would cover on screen. Only the mip level
+    //    that width needs and the coarser ones are requested, and of those
+    //    only the tiles in view; the level is made coarser still while
+    //    they would not fit the budget. Tiles left out of view go first
+    //    when the pool is full.
+    //
+    //    Binary (P6) files are read tile by tile and never held in memory
+    //    whole; plain (P3) files have to be parsed whole first, on the
+    //    loader thread. Levels at most MaxCoarseSize texels across are
+    //    built in memory in one pass over the file, before any tile is
+    //    served, so the coarsest tiles arrive first.
+    //
+    //    The shader finds level L of texture coordinates (u, v), u
+    //    repeating and v clamped, at texel p = (u, v) * max(StreamBaseSize
+    //    >> L, 1), in tile t = p / StreamTileSize, whose pool layer is
+    //    entry StreamLevelOffsets[L] + t.y * tilesX + t.x of
+    //    StreamPageTable, or -1 if not resident. Pool layers hold a tile
+    //    with a Border texel wide frame of its neighbours, so bilinear
+    //    filtering within a layer is seamless.
+    //
+
+    class TextureStreamer
+    {
+    public:
+        static const int MaxLevels = 16;
+        static const int Border = 1;
+
+        // Levels no wider or taller than this are kept in memory
+        static const int MaxCoarseSize = 2048;
+
+        // Tiles copied into the pool per update()
+        static const int MaxUploadsPerFrame = 8;
+
+        // Whether the tile covering texture coordinates uvMin to uvMax is
+        // in view
+        typedef std::function<bool(const vec2 &uvMin, const vec2 &uvMax)> TileFilter;
+
+        struct Stats
+        {
+            int level;
+            size_t numResident;
+            size_t numSlots;
+            size_t numMissing;
+            unsigned long long numLoaded;
+            unsigned long long numEvicted;
+        };
+
+    private:
+        static const uint64_t NoTile = ~uint64_t(0);
+
+        struct LoadedTile
+        {
+            uint64_t key;
+            std::vector<GLubyte> texels;
+        };
+
+        struct Slot
+        {
+            uint64_t key;
+            unsigned long long lastUsed;
+        };
+
+        //  --- image, read by the loader thread once open() returns ---
+
+        std::string _path;
+        int _width;
+        int _height;
+        bool _isBinary;
+        std::streamoff _dataOffset;
+
+        // Whole image of a P3 file
+        std::vector<GLubyte> _image;
+
+        // Levels _coarseLevel to _numLevels - 1
+        std::vector<std::vector<GLubyte>> _coarse;
+
+        int _tileSize;
+        int _numLevels;
+        int _coarseLevel;
+
+        //  --- shared with the loader thread ---
+
+        std::thread _thread;
+        std::mutex _mutex;
+        std::condition_variable _wake;
+        std::atomic<bool> _quit;
+
+        // Wanted tiles, taken from the back
+        std::vector<uint64_t> _requests;
+        uint64_t _loadingKey;
+        std::vector<LoadedTile> _loaded;
+
+        //  --- GL thread ---
+
+        GLuint _pool;
+        GLuint _pageBuffer;
+        GLuint _pageTexture;
+        GLuint _poolUnit;
+
+        std::vector<Slot> _slots;
+        std::unordered_map<uint64_t, int> _resident;
+
+        std::vector<GLint> _pageTable;
+        GLint _levelOffsets[MaxLevels];
+        bool _isPageTableDirty;
+
+        unsigned long long _frame;
+        Stats _stats;
+        int _printInterval;
+
+        static uint64_t tileKey(int level, int x, int y)
+        {
+            return (uint64_t(level) << 48) | (uint64_t(y) << 24) | uint64_t(x);
+        }
+
+        static int keyLevel(uint64_t key) { return int(key >> 48); }
+        static int keyY(uint64_t key) { return int((key >> 24) & 0xffffff); }
+        static int keyX(uint64_t key) { return int(key & 0xffffff); }
+
+        int storedSize() const { return _tileSize + 2 * Border; }
+
+        int levelWidth(int level) const { return std::max(_width >> level, 1); }
+        int levelHeight(int level) const { return std::max(_height >> level, 1); }
+
+        int tilesX(int level) const { return (levelWidth(level) + _tileSize - 1) / _tileSize; }
+        int tilesY(int level) const { return (levelHeight(level) + _tileSize - 1) / _tileSize; }
+
+        // Texels [begin, end) of a source of size size that texel i of a
+        // level of size levelSize averages, each level halving the last
+        static void block(int i, int shift, int levelSize, int size, int &begin, int &end)
+        {
+            begin = i << shift;
+            end = (i == levelSize - 1) ? size : std::min((i + 1) << shift, size);
+        }
+
+        static bool readHeaderToken(std::istream &in, std::string &token)
+        {
+            token.clear();
+
+            for (int c = in.get(); c != EOF; c = in.get())
+            {
+                if (c == '#')
+                {
+                    while (c != EOF && c != '\n')
+                    {
+                        c = in.get();
+                    }
+                }
+                else if (std::isspace(c))
+                {
+                    if (!token.empty())
+                    {
+                        return true;
+                    }
+                }
+                else
+                {
+                    token += char(c);
+                }
+            }
+
+            return !token.empty();
+        }
+
+        //  --- loader thread ---
+
+        // Source texels [x0, x1) of row y
+        void readSpan(std::ifstream &file, int y, int x0, int x1, GLubyte *rgb)
+        {
+            size_t offset = 3 * (size_t(y) * _width + x0);
+
+            if (_isBinary)
+            {
+                file.seekg(_dataOffset + std::streamoff(offset));
+                file.read(reinterpret_cast<char *>(rgb), 3 * (x1 - x0));
+            }
+            else
+            {
+                std::copy(&_image[offset], &_image[offset] + 3 * (x1 - x0), rgb);
+            }
+        }
+
+        bool loadPlainImage(std::ifstream &file)
+        {
+            _image.resize(3 * size_t(_width) * _height);
+
+            for (size_t i = 0; i < _image.size(); i++)
+            {
+                int value;
+
+                if (!(file >> value))
+                {
+                    return false;
+                }
+
+                _image[i] = value;
+
+                if (i % 65536 == 0 && _quit)
+                {
+                    return false;
+                }
+            }
+
+            return true;
+        }
+
+        // One pass over the image for _coarseLevel, then 2 x 2 averages
+        // for the coarser levels
+        bool buildCoarseLevels(std::ifstream &file)
+        {
+            int shift = _coarseLevel;
+            int width = levelWidth(shift), height = levelHeight(shift);
+
+            _coarse.assign(1, std::vector<GLubyte>(3 * size_t(width) * height));
+
+            std::vector<GLubyte> row(3 * size_t(_width));
+            std::vector<uint32_t> sums(3 * size_t(width));
+
+            for (int y = 0; y < height; y++)
+            {
+                int y0, y1;
+                block(y, shift, height, _height, y0, y1);
+
+                std::fill(sums.begin(), sums.end(), 0);
+
+                for (int sy = y0; sy < y1; sy++)
+                {
+                    readSpan(file, sy, 0, _width, &row[0]);
+
+                    for (int sx = 0; sx < _width; sx++)
+                    {
+                        int x = std::min(sx >> shift, width - 1);
+
+                        for (int c = 0; c < 3; c++)
+                        {
+                            sums[3 * x + c] += row[3 * sx + c];
+                        }
+                    }
+                }
+
+                for (int x = 0; x < width; x++)
+                {
+                    int x0, x1;
+                    block(x, shift, width, _width, x0, x1);
+
+                    uint32_t count = uint32_t(x1 - x0) * (y1 - y0);
+
+                    for (int c = 0; c < 3; c++)
+                    {
+                        _coarse[0][3 * (size_t(y) * width + x) + c] = (sums[3 * x + c] + count / 2) / count;
+                    }
+                }
+
+                if (_quit)
+                {
+                    return false;
+                }
+            }
+
+            for (int level = _coarseLevel + 1; level < _numLevels; level++)
+            {
+                const std::vector<GLubyte> &finer = _coarse.back();
+                int finerWidth = levelWidth(level - 1), finerHeight = levelHeight(level - 1);
+
+                width = levelWidth(level), height = levelHeight(level);
+                std::vector<GLubyte> texels(3 * size_t(width) * height);
+
+                for (int y = 0; y < height; y++)
+                {
+                    int y0, y1;
+                    block(y, 1, height, finerHeight, y0, y1);
+
+                    for (int x = 0; x < width; x++)
+                    {
+                        int x0, x1;
+                        block(x, 1, width, finerWidth, x0, x1);
+
+                        uint32_t count = uint32_t(x1 - x0) * (y1 - y0);
+
+                        for (int c = 0; c < 3; c++)
+                        {
+                            uint32_t sum = 0;
+
+                            for (int fy = y0; fy < y1; fy++)
+                            {
+                                for (int fx = x0; fx < x1; fx++)
+                                {
+                                    sum += finer[3 * (size_t(fy) * finerWidth + fx) + c];
+                                }
+                            }
+
+                            texels[3 * (size_t(y) * width + x) + c] = (sum + count / 2) / count;
+                        }
+                    }
+                }
+
+                _coarse.push_back(texels);
+            }
+
+            return true;
+        }
+
+        // The stored texels of a tile, frame included: columns wrap around,
+        // rows are clamped
+        std::vector<GLubyte> loadTile(std::ifstream &file, uint64_t key)
+        {
+            int level = keyLevel(key);
+            int size = storedSize();
+            int width = levelWidth(level), height = levelHeight(level);
+            int originX = keyX(key) * _tileSize - Border, originY = keyY(key) * _tileSize - Border;
+
+            std::vector<GLubyte> texels(3 * size_t(size) * size);
+            std::vector<int> columns(size);
+
+            for (int sx = 0; sx < size; sx++)
+            {
+                columns[sx] = ((originX + sx) % width + width) % width;
+            }
+
+            if (level >= _coarseLevel)
+            {
+                const std::vector<GLubyte> &source = _coarse[level - _coarseLevel];
+
+                for (int sy = 0; sy < size; sy++)
+                {
+                    int y = std::min(std::max(originY + sy, 0), height - 1);
+
+                    for (int sx = 0; sx < size; sx++)
+                    {
+                        std::copy_n(&source[3 * (size_t(y) * width + columns[sx])], 3, &texels[3 * (size_t(sy) * size + sx)]);
+                    }
+                }
+
+                return texels;
+            }
+
+            std::vector<uint32_t> sums(3 * size_t(size));
+            std::vector<GLubyte> span;
+
+            for (int sy = 0; sy < size; sy++)
+            {
+                int y = std::min(std::max(originY + sy, 0), height - 1);
+                int y0, y1;
+                block(y, level, height, _height, y0, y1);
+
+                std::fill(sums.begin(), sums.end(), 0);
+
+                for (int row = y0; row < y1; row++)
+                {
+                    // Columns are read in runs of consecutive texels, split
+                    // where they wrap around
+                    for (int first = 0; first < size;)
+                    {
+                        int last = first;
+
+                        while (last + 1 < size && columns[last + 1] == columns[last] + 1)
+                        {
+                            last++;
+                        }
+
+                        int spanBegin, spanEnd, unused;
+                        block(columns[first], level, width, _width, spanBegin, unused);
+                        block(columns[last], level, width, _width, unused, spanEnd);
+
+                        span.resize(3 * size_t(spanEnd - spanBegin));
+                        readSpan(file, row, spanBegin, spanEnd, &span[0]);
+
+                        for (int sx = first; sx <= last; sx++)
+                        {
+                            int x0, x1;
+                            block(columns[sx], level, width, _width, x0, x1);
+
+                            for (int x = x0; x < x1; x++)
+                            {
+                                for (int c = 0; c < 3; c++)
+                                {
+                                    sums[3 * sx + c] += span[3 * (x - spanBegin) + c];
+                                }
+                            }
+                        }
+
+                        first = last + 1;
+                    }
+                }
+
+                for (int sx = 0; sx < size; sx++)
+                {
+                    int x0, x1;
+                    block(columns[sx], level, width, _width, x0, x1);
+
+                    uint32_t count = uint32_t(x1 - x0) * (y1 - y0);
+
+                    for (int c = 0; c < 3; c++)
+                    {
+                        texels[3 * (size_t(sy) * size + sx) + c] = (sums[3 * sx + c] + count / 2) / count;
+                    }
+                }
+            }
+
+            return texels;
+        }
+
+        void loaderLoop()
+        {
+            std::ifstream file(_path, std::ios::binary);
+            file.seekg(_dataOffset);
+
+            if (!_isBinary && !loadPlainImage(file))
+            {
+                return;
+            }
+
+            if (!buildCoarseLevels(file))
+            {
+                return;
+            }
+
+            std::unique_lock<std::mutex> lock(_mutex);
+
+            for (;;)
+            {
+                _wake.wait(lock, [&]
+                           { return _quit || !_requests.empty(); });
+
+                if (_quit)
+                {
+                    return;
+                }
+
+                _loadingKey = _requests.back();
+                _requests.pop_back();
+
+                lock.unlock();
+
+                LoadedTile tile;
+                tile.key = _loadingKey;
+                tile.texels = loadTile(file, tile.key);
+
+                lock.lock();
+
+                _loaded.push_back(std::move(tile));
+                _loadingKey = NoTile;
+            }
+        }
+
+        //  --- GL thread ---
+
+        // Pool layer for a new tile: a free one, else the least recently
+        // used one not used this frame; -1 if there is none
+        int allocateSlot()
+        {
+            int best = -1;
+
+            for (size_t i = 0; i < _slots.size(); i++)
+            {
+                const Slot &slot = _slots[i];
+
+                if (slot.key == NoTile)
+                {
+                    return i;
+                }
+
+                if (slot.lastUsed < _frame && (best < 0 || slot.lastUsed < _slots[best].lastUsed))
+                {
+                    best = i;
+                }
+            }
+
+            if (best >= 0)
+            {
+                uint64_t evicted = _slots[best].key;
+
+                _resident.erase(evicted);
+                _pageTable[pageIndex(evicted)] = -1;
+                _slots[best].key = NoTile;
+                _stats.numEvicted++;
+            }
+
+            return best;
+        }
+
+        size_t pageIndex(uint64_t key) const
+        {
+            int level = keyLevel(key);
+            return _levelOffsets[level] + size_t(keyY(key)) * tilesX(level) + keyX(key);
+        }
+
+        // Takes at most MaxUploadsPerFrame of the missing tiles that have
+        // arrived, drops arrivals no longer wanted and leaves the loader the
+        // rest of missing, coarsest first
+        void exchangeTiles(const std::vector<uint64_t> &missing, std::vector<LoadedTile> &loaded)
+        {
+            std::unordered_set<uint64_t> isMissing(missing.begin(), missing.end());
+            std::vector<LoadedTile> waiting;
+
+            std::lock_guard<std::mutex> lock(_mutex);
+
+            for (LoadedTile &tile : _loaded)
+            {
+                if (isMissing.erase(tile.key))
+                {
+                    if (loaded.size() < size_t(MaxUploadsPerFrame))
+                    {
+                        loaded.push_back(std::move(tile));
+                    }
+                    else
+                    {
+                        waiting.push_back(std::move(tile));
+                    }
+                }
+            }
+
+            _loaded.swap(waiting);
+
+            // The loader takes from the back
+            _requests.clear();
+
+            for (std::vector<uint64_t>::const_reverse_iterator it = missing.rbegin(); it != missing.rend(); ++it)
+            {
+                if (*it != _loadingKey && isMissing.count(*it))
+                {
+                    _requests.push_back(*it);
+                }
+            }
+        }
+
+        void uploadTiles(const std::vector<LoadedTile> &loaded)
+        {
+            if (loaded.empty())
+            {
+                return;
+            }
+
+            glActiveTexture(GL_TEXTURE0 + _poolUnit);
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+            for (const LoadedTile &tile : loaded)
+            {
+                if (_resident.count(tile.key))
+                {
+                    continue;
+                }
+
+                // The pool is full of tiles this frame needs, so the tile
+                // is asked for again later
+                int slot = allocateSlot();
+
+                if (slot < 0)
+                {
+                    continue;
+                }
+
+                glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, slot, storedSize(), storedSize(), 1,
+                                GL_RGB, GL_UNSIGNED_BYTE, &tile.texels[0]);
+
+                _slots[slot].key = tile.key;
+                _slots[slot].lastUsed = _frame;
+                _resident[tile.key] = slot;
+                _pageTable[pageIndex(tile.key)] = slot;
+                _isPageTableDirty = true;
+                _stats.numLoaded++;
+            }
+
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+            glActiveTexture(GL_TEXTURE0);
+        }
+
+    public:
+        TextureStreamer()
+            : _width(0), _height(0), _isBinary(false), _dataOffset(0), _tileSize(128), _numLevels(0),
+              _coarseLevel(0), _quit(false), _loadingKey(NoTile), _pool(0), _pageBuffer(0), _pageTexture(0),
+              _poolUnit(0), _isPageTableDirty(false), _frame(0), _printInterval(0)
+        {
+            _stats = Stats();
+            std::fill(_levelOffsets, _levelOffsets + MaxLevels, 0);
+        }
+
+        ~TextureStreamer()
+        {
+            close();
+
+            if (_pool)
+            {
+                glDeleteTextures(1, &_pool);
+                glDeleteTextures(1, &_pageTexture);
+                glDeleteBuffers(1, &_pageBuffer);
+            }
+        }
+
+        // Reads the header and starts loading in the background; false if
+        // path is not an 8-bit PPM file
+        bool open(const std::string &path, int tileSize)
+        {
+            close();
+
+            std::ifstream file(path, std::ios::binary);
+            std::string magic, width, height, maxValue;
+
+            if (!file.is_open() || !readHeaderToken(file, magic) || !readHeaderToken(file, width) ||
+                !readHeaderToken(file, height) || !readHeaderToken(file, maxValue) ||
+                (magic != "P6" && magic != "P3") || std::atoi(maxValue.c_str()) != 255)
+            {
+                return false;
+            }
+
+            _path = path;
+            _isBinary = (magic == "P6");
+            _width = std::atoi(width.c_str());
+            _height = std::atoi(height.c_str());
+            _dataOffset = file.tellg();
+            _tileSize = tileSize;
+
+            if (_width <= 0 || _height <= 0)
+            {
+                return false;
+            }
+
+            // Down to the level that fits in one tile
+            _numLevels = 1;
+
+            while (_numLevels < MaxLevels && (levelWidth(_numLevels - 1) > _tileSize || levelHeight(_numLevels - 1) > _tileSize))
+            {
+                _numLevels++;
+            }
+
+            _coarseLevel = 0;
+
+            while (_coarseLevel < _numLevels - 1 &&
+                   (levelWidth(_coarseLevel) > MaxCoarseSize || levelHeight(_coarseLevel) > MaxCoarseSize))
+            {
+                _coarseLevel++;
+            }
+
+            _quit = false;
+            _thread = std::thread(&TextureStreamer::loaderLoop, this);
+
+            return true;
+        }
+
+        void close()
+        {
+            if (!_thread.joinable())
+            {
+                return;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _quit = true;
+            }
+
+            _wake.notify_one();
+            _thread.join();
+        }
+
+        bool isOpen() const { return _numLevels > 0; }
+
+        int width() const { return _width; }
+        int height() const { return _height; }
+        int numLevels() const { return _numLevels; }
+
+        // Prints Stats every printInterval updates
+        void enableStats(int printInterval) { _printInterval = printInterval; }
+
+        const Stats &stats() const { return _stats; }
+
+        // Needs a current GL context with program in use. Creates a pool of
+        // as many tiles as fit in budgetBytes on poolUnit and the page
+        // table on pageTableUnit, and leaves them bound there. Without an
+        // open image the shader finds no tiles.
+        void initGL(GLuint program, GLuint poolUnit, GLuint pageTableUnit, size_t budgetBytes)
+        {
+            int size = storedSize();
+            size_t slotBytes = 3 * size_t(size) * size;
+
+            GLint maxLayers = 256;
+            glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &maxLayers);
+
+            size_t numSlots = std::min(std::max(budgetBytes / slotBytes, size_t(1)), size_t(maxLayers));
+            _slots.assign(numSlots, Slot{NoTile, 0});
+            _resident.clear();
+            _poolUnit = poolUnit;
+
+            size_t numEntries = 0;
+
+            for (int level = 0; level < _numLevels; level++)
+            {
+                _levelOffsets[level] = numEntries;
+                numEntries += size_t(tilesX(level)) * tilesY(level);
+            }
+
+            _pageTable.assign(std::max(numEntries, size_t(1)), -1);
+
+            glGenTextures(1, &_pool);
+            glActiveTexture(GL_TEXTURE0 + poolUnit);
+            glBindTexture(GL_TEXTURE_2D_ARRAY, _pool);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, 0);
+            glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGB8, size, size, numSlots, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+
+            glGenBuffers(1, &_pageBuffer);
+            glBindBuffer(GL_TEXTURE_BUFFER, _pageBuffer);
+            glBufferData(GL_TEXTURE_BUFFER, _pageTable.size() * sizeof(GLint), &_pageTable[0], GL_DYNAMIC_DRAW);
+            glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+            glGenTextures(1, &_pageTexture);
+            glActiveTexture(GL_TEXTURE0 + pageTableUnit);
+            glBindTexture(GL_TEXTURE_BUFFER, _pageTexture);
+            glTexBuffer(GL_TEXTURE_BUFFER, GL_R32I, _pageBuffer);
+
+            glActiveTexture(GL_TEXTURE0);
+
+            glUniform1i(glGetUniformLocation(program, "StreamPool"), poolUnit);
+            glUniform1i(glGetUniformLocation(program, "StreamPageTable"), pageTableUnit);
+            glUniform2i(glGetUniformLocation(program, "StreamBaseSize"), _width, _height);
+            glUniform1i(glGetUniformLocation(program, "StreamTileSize"), _tileSize);
+            glUniform1i(glGetUniformLocation(program, "StreamNumLevels"), _numLevels);
+            glUniform1iv(glGetUniformLocation(program, "StreamLevelOffsets"), MaxLevels, _levelOffsets);
+
+            _stats.numSlots = numSlots;
+        }
+
+        // Picks the level for a texture covering screenWidth pixels across,
+        // uploads tiles that arrived and asks for the ones still missing.
+        // Only tiles isVisible accepts are wanted, and the coarsest level
+        // always.
+        void update(GLfloat screenWidth, const TileFilter &isVisible = TileFilter())
+        {
+            if (!isOpen() || _slots.empty())
+            {
+                return;
+            }
+
+            _frame++;
+
+            int level = 0;
+
+            if (screenWidth > 0.0 && screenWidth < _width)
+            {
+                level = int(std::floor(std::log2(_width / screenWidth)));
+            }
+
+            level = std::min(std::max(level, 0), _numLevels - 1);
+
+            // Coarsest first, so the loader is asked for those first
+            std::vector<std::vector<uint64_t>> wanted(_numLevels);
+            size_t numWanted = 0;
+
+            for (int l = _numLevels - 1; l >= level; l--)
+            {
+                vec2 scale(1.0 / levelWidth(l), 1.0 / levelHeight(l));
+
+                for (int y = 0; y < tilesY(l); y++)
+                {
+                    for (int x = 0; x < tilesX(l); x++)
+                    {
+                        vec2 uvMin(x * _tileSize * scale.x, y * _tileSize * scale.y);
+                        vec2 uvMax(std::min((x + 1) * _tileSize * scale.x, 1.0f),
+                                   std::min((y + 1) * _tileSize * scale.y, 1.0f));
+
+                        if (l == _numLevels - 1 || !isVisible || isVisible(uvMin, uvMax))
+                        {
+                            wanted[l].push_back(tileKey(l, x, y));
+                        }
+                    }
+                }
+
+                numWanted += wanted[l].size();
+            }
+
+            while (level < _numLevels - 1 && numWanted > _slots.size())
+            {
+                numWanted -= wanted[level].size();
+                level++;
+            }
+
+            // Tiles in use are touched before new ones may evict anything
+            std::vector<uint64_t> missing;
+
+            for (int l = _numLevels - 1; l >= level; l--)
+            {
+                for (uint64_t key : wanted[l])
+                {
+                    std::unordered_map<uint64_t, int>::iterator it = _resident.find(key);
+
+                    if (it != _resident.end())
+                    {
+                        _slots[it->second].lastUsed = _frame;
+                    }
+                    else
+                    {
+                        missing.push_back(key);
+                    }
+                }
+            }
+
+            std::vector<LoadedTile> loaded;
+            exchangeTiles(missing, loaded);
+            _wake.notify_one();
+
+            uploadTiles(loaded);
+
+            if (_isPageTableDirty)
+            {
+                glBindBuffer(GL_TEXTURE_BUFFER, _pageBuffer);
+                glBufferSubData(GL_TEXTURE_BUFFER, 0, _pageTable.size() * sizeof(GLint), &_pageTable[0]);
+                glBindBuffer(GL_TEXTURE_BUFFER, 0);
+                _isPageTableDirty = false;
+            }
+
+            _stats.level = level;
+            _stats.numResident = _resident.size();
+            _stats.numMissing = missing.size();
+
+            if (_printInterval > 0 && _frame % _printInterval == 0)
+            {
+                std::printf("Streamed texture: level %d of %d, %zu of %zu tiles resident (%.1f MB), %zu missing, %llu loaded, %llu evicted\n",
+                            _stats.level, _numLevels, _stats.numResident, _stats.numSlots,
+                            _stats.numResident * 3.0 * storedSize() * storedSize() / (1024.0 * 1024.0),
+                            _stats.numMissing, _stats.numLoaded, _stats.numEvicted);
+            }
+        }
+    };
+
+} // namespace Angel
+
+#endif // __ANGEL_TEXTURESTREAM_H__
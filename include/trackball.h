@@ -0,0 +1,117 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- trackball.h ---
+//
+//   Virtual trackball that accumulates its rotation in a unit quaternion
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __ANGEL_TRACKBALL_H__
+#define __ANGEL_TRACKBALL_H__
+
+#include "quat.h"
+
+namespace Angel
+{
+
+    class Trackball
+    {
+
+        int _width;
+        int _height;
+
+        vec3 _lastPos;
+
+        // Incremental rotation derived from the last mouse motion
+        quat _spin;
+
+        // Accumulated orientation, re-normalized after every update
+        quat _orientation;
+
+        bool _active;
+
+    public:
+        Trackball() : _width(1), _height(1), _active(false) {}
+
+        // Project window coordinates onto the unit hemisphere
+        vec3 project(int x, int y) const
+        {
+            vec3 v;
+
+            v.x = (2.0 * x - _width) / _width;
+            v.y = (_height - 2.0 * y) / _height;
+
+            GLfloat d = std::sqrt(v.x * v.x + v.y * v.y);
+
+            v.z = std::cos((M_PI / 2.0) * ((d < 1.0) ? d : 1.0));
+
+            return normalize(v);
+        }
+
+        void resize(int width, int height)
+        {
+            _width = width > 0 ? width : 1;
+            _height = height > 0 ? height : 1;
+        }
+
+        void start(int x, int y)
+        {
+            _lastPos = project(x, y);
+            _spin = quat();
+            _active = true;
+        }
+
+        void stop()
+        {
+            _spin = quat();
+            _active = false;
+        }
+
+        // Turn the drag from the last position into an incremental rotation
+        void motion(int x, int y)
+        {
+            if (!_active)
+            {
+                return;
+            }
+
+            vec3 curPos = project(x, y);
+            vec3 d = curPos - _lastPos;
+
+            if (d.x || d.y || d.z)
+            {
+                vec3 axis = cross(_lastPos, curPos);
+                GLfloat angle = 90.0 * length(d);
+
+                if (length(axis) > DivideByZeroTolerance)
+                {
+                    _spin = AxisAngle(angle, axis);
+                }
+
+                _lastPos = curPos;
+            }
+        }
+
+        // Apply the current spin once; keeps rotating while the button is held
+        bool update()
+        {
+            if (!_active)
+            {
+                return false;
+            }
+
+            _orientation = normalize(_spin * _orientation);
+            return true;
+        }
+
+        bool isActive() const { return _active; }
+
+        const quat &spin() const { return _spin; }
+        const quat &orientation() const { return _orientation; }
+
+        void setOrientation(const quat &q) { _orientation = normalize(q); }
+    };
+
+} // namespace Angel
+
+#endif // __ANGEL_TRACKBALL_H__
@@ -419,7 +419,7 @@ namespace Angel
             w = v.w;
         }
 
-        vec4(const vec3 &v, const float s = 1.0) : w(w)
+        vec4(const vec3 &v, const float s = 1.0) : w(s)
         {
             x = v.x;
             y = v.y;
@@ -465,7 +465,7 @@ namespace Angel
 
         vec4 operator*(const vec4 &v) const
         {
-            return vec4(x * v.x, y * v.y, z * v.z, w * v.z);
+            return vec4(x * v.x, y * v.y, z * v.z, w * v.w);
         }
 
         friend vec4 operator*(const GLfloat s, const vec4 &v)
@@ -578,7 +578,7 @@ namespace Angel
 
     inline GLfloat dot(const vec4 &u, const vec4 &v)
     {
-        return u.x * v.x + u.y * v.y + u.z * v.z + u.w + v.w;
+        return u.x * v.x + u.y * v.y + u.z * v.z + u.w * v.w;
     }
 
     inline GLfloat length(const vec4 &v)
@@ -0,0 +1,211 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- vertexformat.h ---
+//
+//   Compact vertex formats: half-float positions and texture coordinates
+//   and 10-bit signed normalized normals, interleaved into 12 bytes per
+//   vertex, or 20 with texture coordinates. GL expands them back to
+//   floats on fetch, so shaders written for float attributes read them
+//   unchanged.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __ANGEL_VERTEXFORMAT_H__
+#define __ANGEL_VERTEXFORMAT_H__
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "Angel.h"
+
+namespace Angel
+{
+
+    // IEEE 754 half of value, rounded to nearest even
+    inline GLushort toHalf(GLfloat value)
+    {
+        uint32_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+
+        uint32_t sign = (bits >> 16) & 0x8000;
+        uint32_t floatExponent = (bits >> 23) & 0xff;
+        uint32_t mantissa = bits & 0x7fffff;
+
+        // Infinity stays infinity, NaN stays NaN
+        if (floatExponent == 0xff)
+        {
+            return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+        }
+
+        int exponent = int(floatExponent) - 127 + 15;
+
+        if (exponent >= 31)
+        {
+            return sign | 0x7c00;
+        }
+
+        uint32_t half, rest, halfway;
+
+        if (exponent <= 0)
+        {
+            // Subnormal half, or zero when even that is too small
+            if (exponent < -10)
+            {
+                return sign;
+            }
+
+            mantissa |= 0x800000;
+            int shift = 14 - exponent;
+
+            half = mantissa >> shift;
+            rest = mantissa & ((1u << shift) - 1);
+            halfway = 1u << (shift - 1);
+        }
+        else
+        {
+            half = (uint32_t(exponent) << 10) | (mantissa >> 13);
+            rest = mantissa & 0x1fff;
+            halfway = 0x1000;
+        }
+
+        // A carry out of the mantissa correctly bumps the exponent
+        if (rest > halfway || (rest == halfway && (half & 1)))
+        {
+            half++;
+        }
+
+        return sign | half;
+    }
+
+    // Unit vector as GL_INT_2_10_10_10_REV: x, y, z in the low 30 bits as
+    // 10-bit signed normalized values, w = 0
+    inline GLuint packNormal(const vec3 &normal)
+    {
+        GLfloat length = std::sqrt(dot(normal, normal));
+        vec3 n = length > 0.0 ? normal / length : vec3(0.0, 0.0, 1.0);
+
+        GLuint packed = 0;
+
+        for (int i = 0; i < 3; i++)
+        {
+            int value = int(std::lround(std::fmin(std::fmax(n[i], -1.0f), 1.0f) * 511.0f));
+            packed |= (GLuint(value) & 0x3ff) << (10 * i);
+        }
+
+        return packed;
+    }
+
+    //----------------------------------------------------------------------------
+    //
+    //  PackedVertex - position and normal in 12 bytes, against 28 for a
+    //    float vec4 position and vec3 normal. PackedTexturedVertex adds
+    //    the 2D and 1D texture coordinates in 20 bytes, against 40.
+    //
+
+    struct PackedVertex
+    {
+        // x, y, z, w = 1 as halves
+        GLushort position[4];
+        GLuint normal;
+    };
+
+    struct PackedTexturedVertex
+    {
+        GLushort position[4];
+        GLuint normal;
+        GLushort texCoord2D[2];
+        GLushort texCoord1D;
+
+        // Keeps the stride a multiple of four bytes
+        GLushort padding;
+    };
+
+    template <typename Vertex>
+    inline void packPositionAndNormal(Vertex &vertex, const vec4 &point, const vec3 &normal)
+    {
+        for (int k = 0; k < 4; k++)
+        {
+            vertex.position[k] = toHalf(point[k]);
+        }
+
+        vertex.normal = packNormal(normal);
+    }
+
+    // Interleaves count vertices
+    inline std::vector<PackedVertex> packVertices(size_t count, const vec4 *points, const vec3 *normals)
+    {
+        std::vector<PackedVertex> vertices(count);
+
+        for (size_t i = 0; i < count; i++)
+        {
+            packPositionAndNormal(vertices[i], points[i], normals[i]);
+        }
+
+        return vertices;
+    }
+
+    inline std::vector<PackedTexturedVertex> packTexturedVertices(size_t count, const vec4 *points, const vec3 *normals,
+                                                                  const vec2 *texCoords2D, const GLfloat *texCoords1D)
+    {
+        std::vector<PackedTexturedVertex> vertices(count);
+
+        for (size_t i = 0; i < count; i++)
+        {
+            PackedTexturedVertex &vertex = vertices[i];
+
+            packPositionAndNormal(vertex, points[i], normals[i]);
+            vertex.texCoord2D[0] = toHalf(texCoords2D[i].x);
+            vertex.texCoord2D[1] = toHalf(texCoords2D[i].y);
+            vertex.texCoord1D = toHalf(texCoords1D[i]);
+            vertex.padding = 0;
+        }
+
+        return vertices;
+    }
+
+    // Point the attributes of the bound vertex array at packed vertices at
+    // the start of the bound array buffer
+
+    template <typename Vertex>
+    inline void setPositionAndNormalAttributes(GLuint position, GLuint normal)
+    {
+        glVertexAttribPointer(position, 4, GL_HALF_FLOAT, GL_FALSE, sizeof(Vertex),
+                              BUFFER_OFFSET(offsetof(Vertex, position)));
+        glVertexAttribPointer(normal, 4, GL_INT_2_10_10_10_REV, GL_TRUE, sizeof(Vertex),
+                              BUFFER_OFFSET(offsetof(Vertex, normal)));
+    }
+
+    inline void setPackedVertexAttributes(GLuint position, GLuint normal)
+    {
+        setPositionAndNormalAttributes<PackedVertex>(position, normal);
+    }
+
+    inline void setPackedTexturedVertexAttributes(GLuint position, GLuint normal, GLuint texCoord2D, GLuint texCoord1D)
+    {
+        GLsizei stride = sizeof(PackedTexturedVertex);
+
+        setPositionAndNormalAttributes<PackedTexturedVertex>(position, normal);
+        glVertexAttribPointer(texCoord2D, 2, GL_HALF_FLOAT, GL_FALSE, stride,
+                              BUFFER_OFFSET(offsetof(PackedTexturedVertex, texCoord2D)));
+        glVertexAttribPointer(texCoord1D, 1, GL_HALF_FLOAT, GL_FALSE, stride,
+                              BUFFER_OFFSET(offsetof(PackedTexturedVertex, texCoord1D)));
+    }
+
+    // Prints the vertex data a mesh saves by packing
+    inline void printPackingSavings(const char *name, size_t numVertices, size_t unpackedStride, size_t packedStride)
+    {
+        double unpacked = double(numVertices) * unpackedStride;
+        double packed = double(numVertices) * packedStride;
+
+        std::printf("%s: %zu vertices, %zu -> %zu bytes per vertex, %.2f MB -> %.2f MB of vertex fetch (%.1fx less)\n",
+                    name, numVertices, unpackedStride, packedStride, unpacked / (1024.0 * 1024.0),
+                    packed / (1024.0 * 1024.0), unpacked / packed);
+    }
+
+} // namespace Angel
+
+#endif // __ANGEL_VERTEXFORMAT_H__
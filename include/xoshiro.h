@@ -0,0 +1,111 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- xoshiro.h ---
+//
+//   xoshiro256** pseudo-random generator with jump-ahead, for splitting
+//   one seed into many independent streams
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __ANGEL_XOSHIRO_H__
+#define __ANGEL_XOSHIRO_H__
+
+#include <cstdint>
+
+namespace Angel
+{
+
+    class Xoshiro256
+    {
+        uint64_t _s[4];
+
+        static uint64_t rotl(uint64_t x, int k)
+        {
+            return (x << k) | (x >> (64 - k));
+        }
+
+    public:
+        typedef uint64_t result_type;
+
+        // Expand a 64-bit seed with splitmix64, so nearby seeds give
+        // unrelated states
+        explicit Xoshiro256(uint64_t seed = 1)
+        {
+            for (int i = 0; i < 4; i++)
+            {
+                uint64_t z = (seed += 0x9e3779b97f4a7c15ull);
+                z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+                z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+                _s[i] = z ^ (z >> 31);
+            }
+        }
+
+        uint64_t next()
+        {
+            uint64_t result = rotl(_s[1] * 5, 7) * 9;
+            uint64_t t = _s[1] << 17;
+
+            _s[2] ^= _s[0];
+            _s[3] ^= _s[1];
+            _s[1] ^= _s[2];
+            _s[0] ^= _s[3];
+
+            _s[2] ^= t;
+            _s[3] = rotl(_s[3], 45);
+
+            return result;
+        }
+
+        uint64_t operator()() { return next(); }
+
+        static uint64_t min() { return 0; }
+        static uint64_t max() { return UINT64_MAX; }
+
+        // Uniform integer in [0, n) from the high bits, without the bias
+        // of a modulo
+        uint32_t below(uint32_t n)
+        {
+            return static_cast<uint32_t>(((next() >> 32) * n) >> 32);
+        }
+
+        // Uniform float in [0, 1)
+        float uniform()
+        {
+            return (next() >> 40) * (1.0f / 16777216.0f);
+        }
+
+        // Advance by 2^128 calls to next(); successive jumps from one seed
+        // give 2^128 non-overlapping streams
+        void jump()
+        {
+            static const uint64_t JUMP[4] = {0x180ec6d33cfd0abaull, 0xd5a61266f0c9392cull,
+                                             0xa9582618e03fc9aaull, 0x39abdc4529b1661cull};
+
+            uint64_t s[4] = {0, 0, 0, 0};
+
+            for (int i = 0; i < 4; i++)
+            {
+                for (int b = 0; b < 64; b++)
+                {
+                    if (JUMP[i] & (uint64_t(1) << b))
+                    {
+                        s[0] ^= _s[0];
+                        s[1] ^= _s[1];
+                        s[2] ^= _s[2];
+                        s[3] ^= _s[3];
+                    }
+
+                    next();
+                }
+            }
+
+            for (int i = 0; i < 4; i++)
+            {
+                _s[i] = s[i];
+            }
+        }
+    };
+
+} // namespace Angel
+
+#endif // __ANGEL_XOSHIRO_H__